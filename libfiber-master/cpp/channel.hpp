@@ -17,12 +17,62 @@
 #ifndef CHANNEL_HPP_
 #define CHANNEL_HPP_
 
+#include <errno.h>
+#include <new>
 #include <stdexcept>
+#include <type_traits>
+#include <utility>
 #include <fiber_channel.h>
+#include <fiber_node_pool.h>
+#include <fiber_semaphore.h>
 #include <signal.hpp>
 
 namespace fiberpp {
 
+//allocates memory for objects of type T from a fiber_node_pool_t, which keeps a free list per fiber manager. it must
+//be created after fiber_manager_init(); before that it falls back on malloc()
+template<typename T>
+class PooledAllocator
+{
+public:
+    PooledAllocator()
+    {
+        if(!fiber_node_pool_init(&pool, sizeof(T) > sizeof(fiber_node_pool_node_t) ? sizeof(T) : sizeof(fiber_node_pool_node_t))) {
+            throw std::bad_alloc();
+        }
+    }
+
+    ~PooledAllocator()
+    {
+        fiber_node_pool_destroy(&pool);
+    }
+
+    void* allocate()
+    {
+        void* const ret = fiber_node_pool_alloc(&pool);
+        if(!ret) {
+            throw std::bad_alloc();
+        }
+        return ret;
+    }
+
+    void deallocate(void* p)
+    {
+        fiber_node_pool_free(&pool, p);
+    }
+
+    fiber_node_pool_t* getPool()
+    {
+        return &pool;
+    }
+
+private:
+    PooledAllocator(const PooledAllocator&);
+    PooledAllocator& operator=(const PooledAllocator&);
+
+    fiber_node_pool_t pool;
+};
+
 template<typename EventDescriptorType, typename EventPayloadType>
 class UnboundedMultiProducerChannel
 {
@@ -69,7 +119,7 @@ public:
 
     UnboundedMultiProducerChannel(fiber_signal_t* signal)
     {
-        if(!fiber_unbounded_channel_init(&channel, signal)) {
+        if(!fiber_unbounded_channel_init_with_pool(&channel, signal, getAllocator().getPool())) {
             throw std::runtime_error("fiberpp::UnboundedMultiProducerEventSource() - error creating channel");
         }
     }
@@ -79,15 +129,20 @@ public:
         fiber_unbounded_channel_destroy(&channel);
     }
 
-    //returns true if a fiber was scheduled as a result of sending the event
+    //returns true if a fiber was scheduled as a result of sending the event. if the channel is closed the caller keeps the
+    //event and errno is set to EPIPE
     bool send(event* e)
     {
-        return fiber_unbounded_channel_send(&channel, e->wrapper);
+        return fiber_unbounded_channel_send(&channel, e->wrapper) > 0;
     }
 
+    //returns NULL once the channel is closed and drained (or if the receiver is canceled)
     event* receive()
     {
         event_wrapper* const wrapper = reinterpret_cast<event_wrapper*>(fiber_unbounded_channel_receive(&channel));
+        if(!wrapper) {
+            return NULL;
+        }
         event* const e = &reinterpret_cast<event_wrapper*>(wrapper->data)->e;
         e->wrapper = wrapper;
         return e;
@@ -104,8 +159,15 @@ public:
         return e;
     }
 
+    bool close()
+    {
+        return fiber_unbounded_channel_close(&channel);
+    }
+
 private:
 
+    //the FIFO hands back the node ahead of the one sent, so an event ends up paired with another event's wrapper.
+    //every wrapper (and the channel's first dummy node) comes from the same pool, which makes that harmless
     struct event_wrapper : public fiber_unbounded_channel_message_t
     {
         event_wrapper(const event_descriptor& type)
@@ -119,28 +181,31 @@ private:
 
     fiber_unbounded_channel_t channel;
 
+    static PooledAllocator<event_wrapper>& getAllocator()
+    {
+        //never destroyed; events can still be in flight while the process exits
+        static PooledAllocator<event_wrapper>* const allocator = new PooledAllocator<event_wrapper>();
+        return *allocator;
+    }
+
 public:
 
     static event* allocEvent(const event_descriptor& type)
     {
-        event_wrapper* const wrapper = reinterpret_cast<event_wrapper*>(malloc(sizeof(*wrapper)));
-        if(!wrapper) {
-            throw std::bad_alloc();
-        }
+        void* const memory = getAllocator().allocate();
         try {
-            new (wrapper) event_wrapper(type);
+            return &(new (memory) event_wrapper(type))->e;
         } catch(...) {
-            free(wrapper);
+            getAllocator().deallocate(memory);
             throw;
         }
-        return &wrapper->e;
     }
 
     static void freeEvent(event* e)
     {
         event_wrapper* const wrapper = e->wrapper;
         e->~event();
-        free(wrapper);
+        getAllocator().deallocate(wrapper);
     }
 };
 
@@ -190,7 +255,7 @@ public:
 
     UnboundedSingleProducerChannel(fiber_signal_t* signal)
     {
-        if(!fiber_unbounded_sp_channel_init(&channel, signal)) {
+        if(!fiber_unbounded_sp_channel_init_with_pool(&channel, signal, getAllocator().getPool())) {
             throw std::runtime_error("fiberpp::UnboundedMultiProducerEventSource() - error creating channel");
         }
     }
@@ -200,15 +265,20 @@ public:
         fiber_unbounded_sp_channel_destroy(&channel);
     }
 
-    //returns true if a fiber was scheduled as a result of sending the event
+    //returns true if a fiber was scheduled as a result of sending the event. if the channel is closed the caller keeps the
+    //event and errno is set to EPIPE
     bool send(event* e)
     {
-        return fiber_unbounded_sp_channel_send(&channel, e->wrapper);
+        return fiber_unbounded_sp_channel_send(&channel, e->wrapper) > 0;
     }
 
+    //returns NULL once the channel is closed and drained (or if the receiver is canceled)
     event* receive()
     {
         event_wrapper* const wrapper = reinterpret_cast<event_wrapper*>(fiber_unbounded_sp_channel_receive(&channel));
+        if(!wrapper) {
+            return NULL;
+        }
         event* const e = &reinterpret_cast<event_wrapper*>(wrapper->data)->e;
         e->wrapper = wrapper;
         return e;
@@ -225,8 +295,15 @@ public:
         return e;
     }
 
+    bool close()
+    {
+        return fiber_unbounded_sp_channel_close(&channel);
+    }
+
 private:
 
+    //the FIFO hands back the node ahead of the one sent, so an event ends up paired with another event's wrapper.
+    //every wrapper (and the channel's first dummy node) comes from the same pool, which makes that harmless
     struct event_wrapper : public fiber_unbounded_sp_channel_message_t
     {
         event_wrapper(const event_descriptor& type)
@@ -240,29 +317,270 @@ private:
 
     fiber_unbounded_sp_channel_t channel;
 
+    static PooledAllocator<event_wrapper>& getAllocator()
+    {
+        //never destroyed; events can still be in flight while the process exits
+        static PooledAllocator<event_wrapper>* const allocator = new PooledAllocator<event_wrapper>();
+        return *allocator;
+    }
+
 public:
 
     static event* allocEvent(const event_descriptor& type)
     {
-        event_wrapper* const wrapper = reinterpret_cast<event_wrapper*>(malloc(sizeof(*wrapper)));
-        if(!wrapper) {
-            throw std::bad_alloc();
-        }
+        void* const memory = getAllocator().allocate();
         try {
-            new (wrapper) event_wrapper(type);
+            return &(new (memory) event_wrapper(type))->e;
         } catch(...) {
-            free(wrapper);
+            getAllocator().deallocate(memory);
             throw;
         }
-        return &wrapper->e;
     }
 
     static void freeEvent(event* e)
     {
         event_wrapper* const wrapper = e->wrapper;
         e->~event();
-        free(wrapper);
+        getAllocator().deallocate(wrapper);
+    }
+};
+
+//a bounded channel which stores T values inline rather than pointers to them. it's the same sequence-numbered ring as
+//fiber_bounded_mpmc_channel_t (see fiber_multi_channel.h) - a pair of semaphores counts the free and filled slots and
+//fibers park in them - but values are moved in and out of the slots, so sending doesn't allocate and receiving
+//doesn't chase a pointer. Capacity must be a power of two
+template<typename T, size_t Capacity>
+class Channel
+{
+    static_assert(Capacity && !(Capacity & (Capacity - 1)), "fiberpp::Channel - Capacity must be a power of two");
+    static_assert(Capacity <= 0x40000000, "fiberpp::Channel - Capacity must fit a semaphore's counter");
+
+public:
+    typedef T value_type;
+
+    Channel()
+    : high(0), low(0)
+    {
+        for(size_t i = 0; i < Capacity; ++i) {
+            slots[i].sequence = i;
+        }
+        if(!fiber_semaphore_init(&freeSlots, Capacity)) {
+            throw std::runtime_error("fiberpp::Channel() - error creating semaphore");
+        }
+        if(!fiber_semaphore_init(&usedSlots, 0)) {
+            fiber_semaphore_destroy(&freeSlots);
+            throw std::runtime_error("fiberpp::Channel() - error creating semaphore");
+        }
+    }
+
+    ~Channel()
+    {
+        const uint64_t end = high & ~CLOSED;
+        for(uint64_t i = low; i < end; ++i) {
+            slotAt(i).value()->~T();
+        }
+        fiber_semaphore_destroy(&freeSlots);
+        fiber_semaphore_destroy(&usedSlots);
+    }
+
+    //blocks while the channel is full. returns false with errno set to ECANCELED if the sender is canceled or EPIPE if
+    //the channel is closed, in which case 'value' is left alone
+    bool send(T&& value)
+    {
+        if(isClosed() || !fiber_semaphore_wait(&freeSlots)) {
+            return false;
+        }
+        return put(&value, 1) == 1;
     }
+
+    //returns false with errno set to EPIPE if the channel is closed or EAGAIN if it's full
+    bool trySend(T&& value)
+    {
+        if(isClosed()) {
+            return false;
+        }
+        if(!fiber_semaphore_trywait(&freeSlots)) {
+            errno = EAGAIN;
+            return false;
+        }
+        return put(&value, 1) == 1;
+    }
+
+    //blocks while the channel is empty. returns false with errno set to ECANCELED if the receiver is canceled or EPIPE
+    //if the channel is closed and drained
+    bool receive(T& out)
+    {
+        if(!fiber_semaphore_wait(&usedSlots)) {
+            return false;
+        }
+        return take(&out, 1) == 1;
+    }
+
+    //returns false with errno set to EPIPE if the channel is closed and drained or EAGAIN if it's empty
+    bool tryReceive(T& out)
+    {
+        if(!fiber_semaphore_trywait(&usedSlots)) {
+            //a closed channel's extra permit may be in another receiver's hands
+            const uint64_t l = low;
+            load_load_barrier();
+            const uint64_t h = high;
+            errno = (h & CLOSED) && l >= (h & ~CLOSED) ? EPIPE : EAGAIN;
+            return false;
+        }
+        return take(&out, 1) == 1;
+    }
+
+    //moves up to 'count' values out of 'values', claiming their slots with a single CAS. blocks only until the first
+    //slot is free; returns the number sent, or 0 with errno set as for send()
+    size_t sendBatch(T* values, size_t count)
+    {
+        if(!count) {
+            return 0;
+        }
+        if(isClosed() || !fiber_semaphore_wait(&freeSlots)) {
+            return 0;
+        }
+        size_t permits = 1;
+        while(permits < count && fiber_semaphore_trywait(&freeSlots)) {
+            ++permits;
+        }
+        return put(values, permits);
+    }
+
+    //moves up to 'count' values into 'out', claiming their slots with a single CAS. blocks only until the first value
+    //is available; returns the number received, or 0 with errno set as for receive()
+    size_t receiveBatch(T* out, size_t count)
+    {
+        if(!count) {
+            return 0;
+        }
+        if(!fiber_semaphore_wait(&usedSlots)) {
+            return 0;
+        }
+        size_t permits = 1;
+        while(permits < count && fiber_semaphore_trywait(&usedSlots)) {
+            ++permits;
+        }
+        return take(out, permits);
+    }
+
+    //sends fail with EPIPE from now on, and receives do too once the values already sent are gone. wakes every
+    //blocked sender and receiver; returns false if the channel was already closed
+    bool close()
+    {
+        if(__sync_fetch_and_or(&high, CLOSED) & CLOSED) {
+            return false;
+        }
+        fiber_semaphore_post_internal(&freeSlots);
+        fiber_semaphore_post_internal(&usedSlots);
+        return true;
+    }
+
+private:
+    Channel(const Channel&);
+    Channel& operator=(const Channel&);
+
+    static const uint64_t CLOSED = (uint64_t)1 << 63;
+
+    struct Slot
+    {
+        volatile uint64_t sequence;
+        typename std::aligned_storage<sizeof(T), std::alignment_of<T>::value>::type storage;
+
+        T* value()
+        {
+            return reinterpret_cast<T*>(&storage);
+        }
+    };
+
+    Slot& slotAt(uint64_t position)
+    {
+        return slots[position & (Capacity - 1)];
+    }
+
+    bool isClosed()
+    {
+        if(high & CLOSED) {
+            errno = EPIPE;
+            return true;
+        }
+        return false;
+    }
+
+    //the caller owns 'permits' free slots. if the channel is closed they're passed on so every blocked sender wakes
+    size_t put(T* values, size_t permits)
+    {
+        uint64_t h;
+        do {
+            h = high;
+            if(h & CLOSED) {
+                for(size_t i = 0; i < permits; ++i) {
+                    fiber_semaphore_post_internal(&freeSlots);
+                }
+                errno = EPIPE;
+                return 0;
+            }
+        } while(!__sync_bool_compare_and_swap(&high, h, h + permits));
+        for(size_t i = 0; i < permits; ++i) {
+            Slot& slot = slotAt(h + i);
+            while(slot.sequence != h + i) {
+                cpu_relax();//the receiver from the previous lap has claimed this slot but not emptied it yet
+            }
+            load_load_barrier();
+            new (slot.value()) T(std::move(values[i]));
+            write_barrier();
+            slot.sequence = h + i + 1;
+            fiber_semaphore_post_internal(&usedSlots);
+        }
+        return permits;
+    }
+
+    //the caller owns 'permits' used slots. while the channel is open they guarantee that many values are available;
+    //after closing the extra permit doesn't, so whatever isn't backed by a value is passed on to the next receiver
+    size_t take(T* out, size_t permits)
+    {
+        uint64_t l;
+        size_t available;
+        do {
+            l = low;
+            load_load_barrier();
+            const uint64_t h = high & ~CLOSED;
+            available = l < h ? h - l : 0;
+            if(available > permits) {
+                available = permits;
+            }
+            if(!available) {
+                for(size_t i = 0; i < permits; ++i) {
+                    fiber_semaphore_post_internal(&usedSlots);
+                }
+                errno = EPIPE;
+                return 0;
+            }
+        } while(!__sync_bool_compare_and_swap(&low, l, l + available));
+        for(size_t i = available; i < permits; ++i) {
+            fiber_semaphore_post_internal(&usedSlots);
+        }
+        for(size_t i = 0; i < available; ++i) {
+            Slot& slot = slotAt(l + i);
+            while(slot.sequence != l + i + 1) {
+                cpu_relax();//the sender which claimed this slot hasn't filled it yet
+            }
+            load_load_barrier();
+            T* const value = slot.value();
+            out[i] = std::move(*value);
+            value->~T();
+            write_barrier();
+            slot.sequence = l + i + Capacity;
+            fiber_semaphore_post_internal(&freeSlots);
+        }
+        return available;
+    }
+
+    alignas(CACHE_SIZE) volatile uint64_t high;
+    alignas(CACHE_SIZE) volatile uint64_t low;
+    alignas(CACHE_SIZE) fiber_semaphore_t freeSlots;//senders wait here while the ring is full
+    fiber_semaphore_t usedSlots;//receivers wait here while the ring is empty
+    alignas(CACHE_SIZE) Slot slots[Capacity];
 };
 
 template<typename ChannelType>
@@ -315,7 +633,7 @@ public:
 
     static event* allocEvent(const event_descriptor& type)
     {
-        return ChannelType::allocEvent();
+        return ChannelType::allocEvent(type);
     }
 
     static void freeEvent(event* e)
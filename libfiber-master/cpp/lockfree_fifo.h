@@ -405,7 +405,7 @@ public:
             PopResult const result = popper.try_pop(ret);
             switch(result) {
             case PopResult::Success:
-                return std::move(ret);
+                return ret;
             case PopResult::Failure:
                 backoff.wait();
                 break;
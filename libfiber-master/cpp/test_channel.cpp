@@ -17,11 +17,14 @@
 #include "channel.hpp"
 #include <fiber_manager.h>
 #include <fiber_barrier.h>
+#include "test_helper.h"
 #include <iostream>
+#include <memory>
 #include <sys/time.h>
 
 #define NUM_THREADS 2
 #define PER_FIBER_COUNT 3000000
+#define BATCH_SIZE 64
 
 using namespace fiberpp;
 
@@ -33,6 +36,7 @@ enum EventType
 
 typedef UnboundedMultiProducerChannel<EventType, int> ChannelType;
 typedef UnboundedSingleProducerChannel<EventType, int> SingleChannelType;
+typedef Channel<int, 1024> TypedChannelType;
 
 fiber_barrier_t barrier;
 
@@ -47,6 +51,7 @@ void* run_function(void* param)
             fiber_yield();
         }
     }
+    return NULL;
 }
 
 void* single_function(void* param)
@@ -60,6 +65,79 @@ void* single_function(void* param)
             fiber_yield();
         }
     }
+    return NULL;
+}
+
+void* typed_function(void* param)
+{
+    fiber_barrier_wait(&barrier);
+    TypedChannelType* const channel = reinterpret_cast<TypedChannelType*>(param);
+    for(int i = 0; i < PER_FIBER_COUNT; ++i) {
+        channel->send(int(i));
+    }
+    return NULL;
+}
+
+void* typed_batch_function(void* param)
+{
+    fiber_barrier_wait(&barrier);
+    TypedChannelType* const channel = reinterpret_cast<TypedChannelType*>(param);
+    int values[BATCH_SIZE];
+    int sent = 0;
+    while(sent < PER_FIBER_COUNT) {
+        int count = PER_FIBER_COUNT - sent < BATCH_SIZE ? PER_FIBER_COUNT - sent : BATCH_SIZE;
+        for(int i = 0; i < count; ++i) {
+            values[i] = sent + i;
+        }
+        int offset = 0;
+        while(offset < count) {
+            offset += channel->sendBatch(values + offset, count - offset);
+        }
+        sent += count;
+    }
+    return NULL;
+}
+
+void test_move_only()
+{
+    Channel<std::unique_ptr<int>, 4> channel;
+    std::unique_ptr<int> value(new int(1));
+    bool ok = channel.send(std::move(value));
+    test_assert(ok);
+    test_assert(!value);
+    ok = channel.trySend(std::unique_ptr<int>(new int(2)));
+    test_assert(ok);
+    std::unique_ptr<int> batch[3] = {std::unique_ptr<int>(new int(3)), std::unique_ptr<int>(new int(4)), std::unique_ptr<int>(new int(5))};
+    //only two slots are left
+    size_t count = channel.sendBatch(batch, 3);
+    test_assert(count == 2);
+    test_assert(!batch[0] && !batch[1] && batch[2]);
+    ok = channel.trySend(std::move(batch[2]));
+    test_assert(!ok && errno == EAGAIN && batch[2]);
+
+    std::unique_ptr<int> out;
+    ok = channel.receive(out);
+    test_assert(ok && *out == 1);
+    std::unique_ptr<int> outs[4];
+    count = channel.receiveBatch(outs, 4);
+    test_assert(count == 3);
+    test_assert(*outs[0] == 2 && *outs[1] == 3 && *outs[2] == 4);
+
+    //values still in the channel when it's closed can be drained; the destructor frees any that aren't
+    ok = channel.send(std::move(batch[2]));
+    test_assert(ok);
+    ok = channel.close();
+    test_assert(ok);
+    ok = channel.close();
+    test_assert(!ok);
+    ok = channel.send(std::unique_ptr<int>(new int(6)));
+    test_assert(!ok && errno == EPIPE);
+    ok = channel.tryReceive(out);
+    test_assert(ok && *out == 5);
+    ok = channel.tryReceive(out);
+    test_assert(!ok && errno == EPIPE);
+    ok = channel.receive(out);
+    test_assert(!ok && errno == EPIPE);
 }
 
 uint64_t getUsecs(const timeval& t)
@@ -126,6 +204,43 @@ int main()
     }
     gettimeofday(&end, NULL);
     std::cout << "single sender, many channel took: " << (getUsecs(end) - getUsecs(begin)) << " usecs" << std::endl;
+
+    //the same traffic as "multi sender, same channel" but the ints are stored in the channel itself
+    TypedChannelType typedChannel;
+    fiber_create(102400, &typed_function, &typedChannel);
+    fiber_create(102400, &typed_function, &typedChannel);
+    fiber_create(102400, &typed_function, &typedChannel);
+    fiber_barrier_wait(&barrier);
+    gettimeofday(&begin, NULL);
+    long long sum = 0;
+    for(int i = 0; i < 3 * PER_FIBER_COUNT; ++i) {
+        int value = 0;
+        typedChannel.receive(value);
+        sum += value;
+    }
+    gettimeofday(&end, NULL);
+    test_assert(sum == 3LL * PER_FIBER_COUNT * (PER_FIBER_COUNT - 1) / 2);
+    std::cout << "multi sender, typed channel took: " << (getUsecs(end) - getUsecs(begin)) << " usecs" << std::endl;
+
+    fiber_create(102400, &typed_batch_function, &typedChannel);
+    fiber_create(102400, &typed_batch_function, &typedChannel);
+    fiber_create(102400, &typed_batch_function, &typedChannel);
+    fiber_barrier_wait(&barrier);
+    gettimeofday(&begin, NULL);
+    sum = 0;
+    int values[BATCH_SIZE];
+    for(int received = 0; received < 3 * PER_FIBER_COUNT;) {
+        const size_t count = typedChannel.receiveBatch(values, BATCH_SIZE);
+        for(size_t i = 0; i < count; ++i) {
+            sum += values[i];
+        }
+        received += count;
+    }
+    gettimeofday(&end, NULL);
+    test_assert(sum == 3LL * PER_FIBER_COUNT * (PER_FIBER_COUNT - 1) / 2);
+    std::cout << "multi sender, typed channel in batches took: " << (getUsecs(end) - getUsecs(begin)) << " usecs" << std::endl;
+
+    test_move_only();
     
     return 0;
 }
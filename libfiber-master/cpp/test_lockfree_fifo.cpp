@@ -91,8 +91,6 @@ int main()
     }*/
 
     std::atomic<int> x(0);
-    int y = x.load(std::memory_order_acquire);
-
-    return 0;
+    return x.load(std::memory_order_acquire);
 }
 
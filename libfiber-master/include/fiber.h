@@ -18,7 +18,10 @@
 #define _FIBER_FIBER_H_
 
 #include <stdint.h>
+#include <time.h>
 #include "fiber_context.h"
+#include "fiber_event.h"
+#include "fiber_spinlock.h"
 #include "mpsc_fifo.h"
 
 typedef int fiber_state_t;
@@ -48,6 +51,10 @@ typedef struct fiber
     int volatile detach_state;
     struct fiber* volatile join_info;
     void* volatile scratch;//to be used by internal fiber mechanisms. be sure mechanisms do not conflict! (ie. only use scratch while a fiber is sleeping/waiting)
+    fiber_spinlock_t cancel_lock;//protects cancel_point and cancel_pending
+    fiber_timeout_t* cancel_point;//fired by fiber_cancel() while this fiber is blocked at a cancellation point
+    int cancel_pending;//a fiber_cancel() which hasn't been delivered yet
+    volatile uint64_t wait_token;//claimed by the first of several waiters racing to wake this fiber (see fiber_select()). never reset
 } fiber_t;
 
 #ifdef __cplusplus
@@ -65,8 +72,19 @@ extern fiber_t* fiber_create_from_thread();
 
 extern int fiber_join(fiber_t* f, void** result);
 
+//returns FIBER_ERROR with errno set to ETIMEDOUT if 'f' hasn't finished by 'deadline' (CLOCK_MONOTONIC). 'f' can be joined again later
+extern int fiber_join_timed(fiber_t* f, void** result, const struct timespec* deadline);
+
 extern int fiber_tryjoin(fiber_t* f, void** result);
 
+/*
+    requests that 'f' stops what it's doing. the request is delivered at the next cancellation point - a blocking
+    wait in fiber_event (including fiber_sleep() and the I/O shims), fiber_mutex, fiber_cond, fiber_semaphore,
+    fiber_signal or the channels. the wait is abandoned and fails with errno set to ECANCELED. a request is
+    delivered once, so the fiber can still block while it cleans up. 'f' must not have been joined or detached yet
+*/
+extern int fiber_cancel(fiber_t* f);
+
 extern int fiber_yield();
 
 extern int fiber_detach(fiber_t* f);
@@ -0,0 +1,60 @@
+/*
+ * Copyright (c) 2012-2015, Brian Watling and other contributors
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#ifndef _FIBER_ADDRESS_H_
+#define _FIBER_ADDRESS_H_
+
+/*
+    Author: Brian Watling
+    Email: brianwatling@hotmail.com
+    Website: https://github.com/brianwatling
+
+    Description: Waiting on an address, in the style of a futex. A fiber waits
+                 only while the int at the address holds an expected value, and
+                 is woken by a fiber_wake_address() on the same address. Waiters
+                 are kept in a fixed table of wait queues shared by all
+                 addresses, so a primitive built on these needs no memory beyond
+                 the int it waits on and nothing has to be allocated or freed.
+*/
+
+#include <time.h>
+
+//the number of wait queues addresses are hashed into. must be a power of 2
+#define FIBER_ADDRESS_BUCKETS (256)
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//waits on 'address' if it still holds 'expected', until it's woken by fiber_wake_address(). returns FIBER_ERROR with
+//errno set to EAGAIN if the value didn't match or ETIMEDOUT if 'deadline' (CLOCK_MONOTONIC, NULL to wait forever)
+//passes first. a cancellation point: returns FIBER_ERROR with errno set to ECANCELED if the fiber is canceled while
+//waiting. as with a futex, the caller must re-check whatever it was waiting for
+extern int fiber_wait_address(volatile int* address, int expected, const struct timespec* deadline);
+
+//as fiber_wait_address() but not a cancellation point
+extern int fiber_wait_address_internal(volatile int* address, int expected, const struct timespec* deadline);
+
+//wakes up to 'count' fibers waiting on 'address', oldest first. returns the number of fibers woken
+extern int fiber_wake_address(volatile int* address, int count);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
@@ -29,6 +29,7 @@ typedef struct fiber_barrier {
     uint32_t count;
     volatile uint64_t counter;
     mpsc_fifo_t waiters;
+    volatile int wake_tokens;//see fiber_manager_wait_in_mpsc_queue_with_tokens()
 } fiber_barrier_t;
 
 #define FIBER_BARRIER_SERIAL_FIBER (1)
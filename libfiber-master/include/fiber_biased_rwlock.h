@@ -0,0 +1,81 @@
+/*
+ * Copyright (c) 2012-2015, Brian Watling and other contributors
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#ifndef _FIBER_BIASED_RWLOCK_H_
+#define _FIBER_BIASED_RWLOCK_H_
+
+/*
+    Author: Brian Watling
+    Email: brianwatling@hotmail.com
+    Website: https://github.com/brianwatling
+
+    Description: A reader/writer lock for data which is read constantly and
+                 written rarely, in the style of a big-reader lock. A reader
+                 only increments a counter in its own manager's slot, so readers
+                 on different managers never share a cache line. A writer
+                 revokes the readers' bias by setting 'writer', which sends new
+                 readers to wait, and then waits for the slots to drain. Writes
+                 are expensive (they touch every slot); use fiber_rwlock_t for
+                 data which is written often.
+
+                 A reader can be moved to another manager while it holds the
+                 lock, so a single slot may go negative. Only the sum matters.
+*/
+
+#include "machine_specific.h"
+
+typedef struct fiber_biased_rwlock_slot
+{
+    volatile intptr_t readers;
+    char _cache_padding1[CACHE_SIZE - sizeof(intptr_t)];
+} fiber_biased_rwlock_slot_t;
+
+typedef struct fiber_biased_rwlock
+{
+    volatile int writer;//1 while a writer holds the lock or waits for readers to leave
+    volatile int drained;//bumped by readers leaving while a writer waits
+    int slot_count;
+    fiber_biased_rwlock_slot_t* slots;//one per manager
+} fiber_biased_rwlock_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//call after fiber_manager_init(); one slot is allocated per manager
+extern int fiber_biased_rwlock_init(fiber_biased_rwlock_t* rwlock);
+
+extern void fiber_biased_rwlock_destroy(fiber_biased_rwlock_t* rwlock);
+
+extern int fiber_biased_rwlock_rdlock(fiber_biased_rwlock_t* rwlock);
+
+extern int fiber_biased_rwlock_wrlock(fiber_biased_rwlock_t* rwlock);
+
+extern int fiber_biased_rwlock_tryrdlock(fiber_biased_rwlock_t* rwlock);
+
+extern int fiber_biased_rwlock_trywrlock(fiber_biased_rwlock_t* rwlock);
+
+extern int fiber_biased_rwlock_rdunlock(fiber_biased_rwlock_t* rwlock);
+
+extern int fiber_biased_rwlock_wrunlock(fiber_biased_rwlock_t* rwlock);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
@@ -24,6 +24,7 @@
 */
 
 #include <assert.h>
+#include <errno.h>
 #include <stdint.h>
 #include <stddef.h>
 #include <malloc.h>
@@ -33,8 +34,11 @@
 #include "mpsc_fifo.h"
 #include "spsc_fifo.h"
 #include "fiber_signal.h"
+#include "fiber_node_pool.h"
 
 //a bounded channel. send and receive will block. there can be many senders but only one receiver
+#define FIBER_BOUNDED_CHANNEL_CLOSED ((uint64_t)1 << 63)//set in high by fiber_bounded_channel_close(), which freezes it
+
 typedef struct fiber_bounded_channel
 {
     //putting high and low on separate cache lines provides a slight performance increase
@@ -44,6 +48,7 @@ typedef struct fiber_bounded_channel
     char _cache_padding2[CACHE_SIZE - sizeof(uint64_t)];
     volatile uint64_t send_count;
     mpsc_fifo_t waiters;
+    volatile int waiters_owner;//see fiber_bounded_channel_internal_wake_sender()
     fiber_signal_t* ready_signal;
     uint32_t size;
     uint32_t power_of_2_mod;
@@ -72,12 +77,48 @@ static inline fiber_bounded_channel_t* fiber_bounded_channel_create(uint32_t pow
 static inline void fiber_bounded_channel_destroy(fiber_bounded_channel_t* channel)
 {
     if(channel) {
+        //release any entries left behind by senders which were canceled
+        fiber_manager_wake_from_mpsc_queue(fiber_manager_get(), &channel->waiters, 0);
         mpsc_fifo_destroy(&channel->waiters);
         free(channel);
     }
 }
 
-//returns 1 if a fiber was scheduled
+//undoes the send_count taken by a sender which found the channel closed
+static inline int fiber_bounded_channel_internal_closed(fiber_bounded_channel_t* channel, int count)
+{
+    __sync_fetch_and_sub(&channel->send_count, count);
+    errno = EPIPE;
+    return -1;
+}
+
+//'waiters' has a single consumer: the receiver, or close() once it takes the queue over for good (after which it wakes
+//every sender itself). a receiver which finds close() there skips its wake-up
+static inline void fiber_bounded_channel_internal_wake_sender(fiber_bounded_channel_t* channel, int count)
+{
+    if(__sync_bool_compare_and_swap(&channel->waiters_owner, 0, 1)) {
+        int i;
+        for(i = 0; i < count; ++i) {
+            if(!fiber_manager_wake_from_mpsc_queue(fiber_manager_get(), &channel->waiters, 0)) {
+                break;
+            }
+        }
+        write_barrier();
+        channel->waiters_owner = 0;
+    }
+}
+
+//called by a receiver which found no message. a sender may be blocked even though there's room (a select which was
+//handed a slot and then completed another case gives it back by raising the signal), so pass a wake-up on
+static inline void fiber_bounded_channel_internal_empty(fiber_bounded_channel_t* channel, uint64_t high, uint64_t send_count)
+{
+    if(high < send_count) {
+        fiber_bounded_channel_internal_wake_sender(channel, 1);
+    }
+}
+
+//returns 1 if a fiber was scheduled, or -1 with errno set to ECANCELED if the sender is canceled while the channel is full (see fiber_cancel())
+//or EPIPE if the channel is closed
 static inline int fiber_bounded_channel_send(fiber_bounded_channel_t* channel, void* message)
 {
     assert(channel);
@@ -89,6 +130,9 @@ static inline int fiber_bounded_channel_send(fiber_bounded_channel_t* channel, v
         const uint64_t low = channel->low;
         load_load_barrier();//read low first; this means the buffer will appear larger or equal to its actual size
         const uint64_t high = channel->high;
+        if(high & FIBER_BOUNDED_CHANNEL_CLOSED) {
+            return fiber_bounded_channel_internal_closed(channel, 1);
+        }
         const uint64_t index = high & channel->power_of_2_mod;
         if(!channel->buffer[index]
            && high - low < channel->size
@@ -99,11 +143,96 @@ static inline int fiber_bounded_channel_send(fiber_bounded_channel_t* channel, v
             }
             return 0;
         }
-        fiber_manager_wait_in_mpsc_queue(fiber_manager_get(), &channel->waiters);
+        if(!fiber_manager_wait_in_mpsc_queue_timed(fiber_manager_get(), &channel->waiters, NULL)) {
+            __sync_fetch_and_sub(&channel->send_count, 1);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+//returns 1 if the message was sent, 0 if the channel is full or -1 with errno set to EPIPE if it's closed
+static inline int fiber_bounded_channel_try_send(fiber_bounded_channel_t* channel, void* message)
+{
+    assert(channel);
+    assert(message);
+
+    //send_count has to cover every slot reserved, so the attempt is counted up front as in a blocking send
+    __sync_fetch_and_add(&channel->send_count, 1);
+
+    while(1) {
+        const uint64_t low = channel->low;
+        load_load_barrier();//read low first; this means the buffer will appear larger or equal to its actual size
+        const uint64_t high = channel->high;
+        if(high & FIBER_BOUNDED_CHANNEL_CLOSED) {
+            return fiber_bounded_channel_internal_closed(channel, 1);
+        }
+        const uint64_t index = high & channel->power_of_2_mod;
+        if(channel->buffer[index] || high - low >= channel->size) {
+            break;
+        }
+        if(__sync_bool_compare_and_swap(&channel->high, high, high + 1)) {
+            channel->buffer[index] = message;
+            if(channel->ready_signal) {
+                fiber_signal_raise(channel->ready_signal);
+            }
+            return 1;
+        }
+    }
+    __sync_fetch_and_sub(&channel->send_count, 1);
+    return 0;
+}
+
+//sends up to 'count' messages, reserving their slots with a single CAS and raising the signal once.
+//blocks only while the channel is full; returns the number sent, which is less than 'count' if the channel filled up,
+//or -1 with errno set to ECANCELED if the sender is canceled before sending anything or EPIPE if the channel is closed
+static inline int fiber_bounded_channel_send_n(fiber_bounded_channel_t* channel, void** messages, int count)
+{
+    assert(channel);
+    assert(messages);
+    assert(count > 0);
+
+    __sync_fetch_and_add(&channel->send_count, count);
+
+    while(1) {
+        const uint64_t low = channel->low;
+        load_load_barrier();//read low first; this means the buffer will appear larger or equal to its actual size
+        const uint64_t high = channel->high;
+        load_load_barrier();
+        if(high & FIBER_BOUNDED_CHANNEL_CLOSED) {
+            return fiber_bounded_channel_internal_closed(channel, count);
+        }
+        const uint64_t used = high - low;
+        const uint64_t space = used < channel->size ? channel->size - used : 0;
+        const uint64_t limit = space < (uint64_t)count ? space : (uint64_t)count;
+        uint64_t reserve = 0;
+        while(reserve < limit && !channel->buffer[(high + reserve) & channel->power_of_2_mod]) {
+            reserve += 1;
+        }
+        if(reserve && __sync_bool_compare_and_swap(&channel->high, high, high + reserve)) {
+            uint64_t i;
+            for(i = 0; i < reserve; ++i) {
+                assert(messages[i]);
+                channel->buffer[(high + i) & channel->power_of_2_mod] = messages[i];
+            }
+            if(reserve < (uint64_t)count) {
+                __sync_fetch_and_sub(&channel->send_count, count - reserve);
+            }
+            if(channel->ready_signal) {
+                fiber_signal_raise(channel->ready_signal);
+            }
+            return (int)reserve;
+        }
+        if(!reserve && !fiber_manager_wait_in_mpsc_queue_timed(fiber_manager_get(), &channel->waiters, NULL)) {
+            __sync_fetch_and_sub(&channel->send_count, count);
+            return -1;
+        }
     }
     return 0;
 }
 
+//returns NULL with errno set to ECANCELED if the receiver is canceled (see fiber_cancel()) or EPIPE if the channel is
+//closed and every message sent has been received
 static inline void* fiber_bounded_channel_receive(fiber_bounded_channel_t* channel)
 {
     assert(channel);
@@ -111,7 +240,8 @@ static inline void* fiber_bounded_channel_receive(fiber_bounded_channel_t* chann
     while(1) {
         const uint64_t send_count = channel->send_count;
         load_load_barrier();
-        const uint64_t high = channel->high;
+        const uint64_t high_and_closed = channel->high;
+        const uint64_t high = high_and_closed & ~FIBER_BOUNDED_CHANNEL_CLOSED;
         load_load_barrier();//read high first; this means the buffer will appear smaller or equal to its actual size
         const uint64_t low = channel->low;
         const uint64_t index = low & channel->power_of_2_mod;
@@ -121,24 +251,76 @@ static inline void* fiber_bounded_channel_receive(fiber_bounded_channel_t* chann
             write_barrier();
             channel->low = low + 1;
             if(high < send_count) {
-                fiber_manager_wake_from_mpsc_queue(fiber_manager_get(), &channel->waiters, 0);
+                fiber_bounded_channel_internal_wake_sender(channel, 1);
             }
             return ret;
         }
-        if(channel->ready_signal) {
-            fiber_signal_wait(channel->ready_signal);
+        if(high == low && (high_and_closed & FIBER_BOUNDED_CHANNEL_CLOSED)) {
+            errno = EPIPE;
+            return NULL;
+        }
+        fiber_bounded_channel_internal_empty(channel, high, send_count);
+        if(channel->ready_signal && !fiber_signal_wait(channel->ready_signal)) {
+            return NULL;
         }
     }
     return NULL;
 }
 
-static inline int fiber_bounded_channel_try_receive(fiber_bounded_channel_t* channel, void** out)
+//receives up to 'count' messages into 'out', releasing their slots with a single store. blocks until at least one
+//message is available; returns the number received, or 0 with errno set to ECANCELED if the receiver is canceled or
+//EPIPE if the channel is closed and drained
+static inline int fiber_bounded_channel_receive_n(fiber_bounded_channel_t* channel, void** out, int count)
+{
+    assert(channel);
+    assert(out);
+    assert(count > 0);
+
+    while(1) {
+        const uint64_t send_count = channel->send_count;
+        load_load_barrier();
+        const uint64_t high_and_closed = channel->high;
+        const uint64_t high = high_and_closed & ~FIBER_BOUNDED_CHANNEL_CLOSED;
+        load_load_barrier();//read high first; this means the buffer will appear smaller or equal to its actual size
+        const uint64_t low = channel->low;
+        int received = 0;
+        void* message;
+        while(received < count && low + received < high
+              && (message = channel->buffer[(low + received) & channel->power_of_2_mod])) {
+            channel->buffer[(low + received) & channel->power_of_2_mod] = 0;
+            out[received] = message;
+            received += 1;
+        }
+        if(received) {
+            write_barrier();
+            channel->low = low + received;
+            if(high < send_count) {
+                //each slot freed can let one blocked sender in
+                fiber_bounded_channel_internal_wake_sender(channel, received);
+            }
+            return received;
+        }
+        if(high == low && (high_and_closed & FIBER_BOUNDED_CHANNEL_CLOSED)) {
+            errno = EPIPE;
+            return 0;
+        }
+        fiber_bounded_channel_internal_empty(channel, high, send_count);
+        if(channel->ready_signal && !fiber_signal_wait(channel->ready_signal)) {
+            return 0;
+        }
+    }
+    return 0;
+}
+
+//as fiber_bounded_channel_try_receive() but returns -1 if the channel is closed and drained
+static inline int fiber_bounded_channel_internal_try_receive(fiber_bounded_channel_t* channel, void** out)
 {
     assert(channel);
 
     const uint64_t send_count = channel->send_count;
     load_load_barrier();
-    const uint64_t high = channel->high;
+    const uint64_t high_and_closed = channel->high;
+    const uint64_t high = high_and_closed & ~FIBER_BOUNDED_CHANNEL_CLOSED;
     load_load_barrier();//read high first; this means the buffer will appear smaller or equal to its actual size
     const uint64_t low = channel->low;
     const uint64_t index = low & channel->power_of_2_mod;
@@ -148,19 +330,121 @@ static inline int fiber_bounded_channel_try_receive(fiber_bounded_channel_t* cha
         write_barrier();
         channel->low = low + 1;
         if(high < send_count) {
-            fiber_manager_wake_from_mpsc_queue(fiber_manager_get(), &channel->waiters, 0);
+            fiber_bounded_channel_internal_wake_sender(channel, 1);
         }
         *out = ret;
         return 1;
     }
+    if(high == low && (high_and_closed & FIBER_BOUNDED_CHANNEL_CLOSED)) {
+        errno = EPIPE;
+        return -1;
+    }
+    fiber_bounded_channel_internal_empty(channel, high, send_count);
     return 0;
 }
 
+//returns 1 and sets *out if a message was received, or 0 if there wasn't one. errno is set to EPIPE if that's because
+//the channel is closed and drained
+static inline int fiber_bounded_channel_try_receive(fiber_bounded_channel_t* channel, void** out)
+{
+    return fiber_bounded_channel_internal_try_receive(channel, out) > 0;
+}
+
+//returns 1 and sets *out if a message arrives by 'deadline' (CLOCK_MONOTONIC), 0 with errno set to ETIMEDOUT, ECANCELED
+//or EPIPE (the channel is closed and drained) otherwise
+static inline int fiber_bounded_channel_receive_timed(fiber_bounded_channel_t* channel, void** out, const struct timespec* deadline)
+{
+    assert(channel);
+    assert(out);
+    assert(deadline);
+
+    int received;
+    while(!(received = fiber_bounded_channel_internal_try_receive(channel, out))) {
+        if(fiber_deadline_passed(deadline)) {
+            errno = ETIMEDOUT;
+            return 0;
+        }
+        if(channel->ready_signal && !fiber_signal_wait_timed(channel->ready_signal, deadline)) {
+            return 0;
+        }
+    }
+    return received > 0;
+}
+
+//senders fail with EPIPE from now on. the receiver can still take the messages already sent, after which receives
+//fail with EPIPE too. wakes the receiver and any blocked senders; returns 0 if the channel was already closed. any
+//fiber may close the channel
+static inline int fiber_bounded_channel_close(fiber_bounded_channel_t* channel)
+{
+    assert(channel);
+
+    const uint64_t high = __sync_fetch_and_or(&channel->high, FIBER_BOUNDED_CHANNEL_CLOSED);
+    if(high & FIBER_BOUNDED_CHANNEL_CLOSED) {
+        return 0;
+    }
+    if(channel->ready_signal) {
+        fiber_signal_raise(channel->ready_signal);
+    }
+    //take the waiters over from the receiver for good; it only holds them while it wakes a sender
+    while(!__sync_bool_compare_and_swap(&channel->waiters_owner, 0, 1)) {
+        fiber_yield();
+    }
+    //high is frozen, so every sender still counted beyond it will give up once it looks at the channel again.
+    //wake them until they're all gone; one which is about to queue up is waited for
+    while(channel->send_count > high) {
+        if(!fiber_manager_wake_from_mpsc_queue(fiber_manager_get(), &channel->waiters, 0)) {
+            fiber_yield();
+        }
+    }
+    return 1;
+}
+
+//the unbounded channels count the sends under way in 'senders' (in steps of 2) and set its low bit once closed. a
+//receiver which finds the channel empty knows it's drained once it sees the low bit alone
+#define FIBER_CHANNEL_CLOSED_BIT (1)
+
+static inline int fiber_channel_internal_enter(volatile uint64_t* senders)
+{
+    if(__sync_fetch_and_add(senders, 2) & FIBER_CHANNEL_CLOSED_BIT) {
+        __sync_fetch_and_sub(senders, 2);
+        errno = EPIPE;
+        return 0;
+    }
+    return 1;
+}
+
+static inline void fiber_channel_internal_leave(volatile uint64_t* senders)
+{
+    __sync_fetch_and_sub(senders, 2);
+}
+
+//returns 1 if the channel is closed and no sends are under way. everything sent is in the queue by then
+static inline int fiber_channel_internal_drained(volatile uint64_t* senders)
+{
+    const int drained = *senders == FIBER_CHANNEL_CLOSED_BIT;
+    load_load_barrier();
+    return drained;
+}
+
+static inline int fiber_channel_internal_close(volatile uint64_t* senders)
+{
+    if(__sync_fetch_and_or(senders, FIBER_CHANNEL_CLOSED_BIT) & FIBER_CHANNEL_CLOSED_BIT) {
+        return 0;
+    }
+    while(*senders != FIBER_CHANNEL_CLOSED_BIT) {
+        fiber_yield();//a sender is between its push and raising the signal
+    }
+    return 1;
+}
+
 //a unbounded channel. send and receive will block. there can be many senders but only one receiver
 typedef struct fiber_unbounded_channel
 {
     mpsc_fifo_t queue;
     fiber_signal_t* ready_signal;
+    volatile uint64_t senders;//see fiber_channel_internal_enter()
+    fiber_node_pool_t* pool;//message nodes for fiber_unbounded_channel_alloc_message(). either own_pool or shared by several channels
+    fiber_node_pool_t own_pool;
 } fiber_unbounded_channel_t;
 
 typedef mpsc_fifo_node_t fiber_unbounded_channel_message_t;
@@ -170,9 +454,36 @@ static inline int fiber_unbounded_channel_init(fiber_unbounded_channel_t* channe
 {
     assert(channel);
     channel->ready_signal = signal;
+    channel->senders = 0;
     if(!mpsc_fifo_init(&channel->queue)) {
         return 0;
     }
+    channel->pool = &channel->own_pool;
+    if(!fiber_node_pool_init(channel->pool, sizeof(fiber_unbounded_channel_message_t))) {
+        mpsc_fifo_destroy(&channel->queue);
+        return 0;
+    }
+    return 1;
+}
+
+//as fiber_unbounded_channel_init() but the channel's messages come from 'pool', which must out-live the channel. the
+//nodes in 'pool' can be larger than a message (eg. a message embedded in a bigger struct). every message the
+//receiver gets back, including the queue's first dummy, comes from the pool, so they can all be recycled into it
+static inline int fiber_unbounded_channel_init_with_pool(fiber_unbounded_channel_t* channel, fiber_signal_t* signal, fiber_node_pool_t* pool)
+{
+    assert(channel);
+    assert(pool && pool->node_size >= sizeof(fiber_unbounded_channel_message_t));
+    fiber_unbounded_channel_message_t* const dummy = (fiber_unbounded_channel_message_t*)fiber_node_pool_alloc(pool);
+    if(!dummy) {
+        return 0;
+    }
+    channel->ready_signal = signal;
+    channel->senders = 0;
+    mpsc_fifo_init_with_node(&channel->queue, dummy);
+    channel->pool = pool;
+    channel->own_pool.caches = NULL;
+    channel->own_pool.cache_count = 0;
+    channel->own_pool.shared = NULL;
     return 1;
 }
 
@@ -180,41 +491,173 @@ static inline void fiber_unbounded_channel_destroy(fiber_unbounded_channel_t* ch
 {
     if(channel) {
         mpsc_fifo_destroy(&channel->queue);
+        fiber_node_pool_destroy(&channel->own_pool);
     }
 }
 
 //the channel owns message when this function returns.
-//returns 1 if a fiber was scheduled
+//returns 1 if a fiber was scheduled, or -1 with errno set to EPIPE if the channel is closed (the caller keeps message)
 static inline int fiber_unbounded_channel_send(fiber_unbounded_channel_t* channel, fiber_unbounded_channel_message_t* message)
 {
     assert(channel);
     assert(message);
 
+    if(!fiber_channel_internal_enter(&channel->senders)) {
+        return -1;
+    }
     mpsc_fifo_push(&channel->queue, message);
+    int ret = 0;
     if(channel->ready_signal) {
-        return fiber_signal_raise(channel->ready_signal);
+        ret = fiber_signal_raise(channel->ready_signal);
     }
-    return 0;
+    fiber_channel_internal_leave(&channel->senders);
+    return ret;
+}
+
+//the channel owns the messages when this function returns. they're pushed with a single exchange and the signal is raised once.
+//returns 1 if a fiber was scheduled, or -1 with errno set to EPIPE if the channel is closed (the caller keeps the messages)
+static inline int fiber_unbounded_channel_send_n(fiber_unbounded_channel_t* channel, fiber_unbounded_channel_message_t** messages, int count)
+{
+    assert(channel);
+    assert(messages);
+    assert(count > 0);
+
+    if(!fiber_channel_internal_enter(&channel->senders)) {
+        return -1;
+    }
+    int i;
+    for(i = 1; i < count; ++i) {
+        messages[i - 1]->next = messages[i];
+    }
+    mpsc_fifo_push_chain(&channel->queue, messages[0], messages[count - 1]);
+    int ret = 0;
+    if(channel->ready_signal) {
+        ret = fiber_signal_raise(channel->ready_signal);
+    }
+    fiber_channel_internal_leave(&channel->senders);
+    return ret;
 }
 
-//the caller owns the message when this function returns
+//the caller owns the message when this function returns. returns NULL with errno set to ECANCELED if the receiver is canceled
+//or EPIPE if the channel is closed and drained
 static inline void* fiber_unbounded_channel_receive(fiber_unbounded_channel_t* channel)
 {
     assert(channel);
 
     fiber_unbounded_channel_message_t* ret;
     while(!(ret = mpsc_fifo_trypop(&channel->queue))) {
-        if(channel->ready_signal) {
-            fiber_signal_wait(channel->ready_signal);
+        if(fiber_channel_internal_drained(&channel->senders)) {
+            if((ret = mpsc_fifo_trypop(&channel->queue))) {
+                break;
+            }
+            errno = EPIPE;
+            return NULL;
+        }
+        if(channel->ready_signal && !fiber_signal_wait(channel->ready_signal)) {
+            return NULL;
         }
     }
     return ret;
 }
 
+//the caller owns the messages when this function returns. blocks until at least one message is available;
+//returns the number received, or 0 with errno set to ECANCELED if the receiver is canceled or EPIPE if the channel is
+//closed and drained
+static inline int fiber_unbounded_channel_receive_n(fiber_unbounded_channel_t* channel, fiber_unbounded_channel_message_t** out, int count)
+{
+    assert(channel);
+    assert(out);
+    assert(count > 0);
+
+    int received = 0;
+    while(!received) {
+        const int drained = fiber_channel_internal_drained(&channel->senders);
+        while(received < count && (out[received] = mpsc_fifo_trypop(&channel->queue))) {
+            received += 1;
+        }
+        if(!received && drained) {
+            errno = EPIPE;
+            return 0;
+        }
+        if(!received && channel->ready_signal && !fiber_signal_wait(channel->ready_signal)) {
+            return 0;
+        }
+    }
+    return received;
+}
+
+//returns NULL if there's no message, with errno set to EPIPE if the channel is also closed and drained
 static inline void* fiber_unbounded_channel_try_receive(fiber_unbounded_channel_t* channel)
 {
     assert(channel);
-    return mpsc_fifo_trypop(&channel->queue);
+    const int drained = fiber_channel_internal_drained(&channel->senders);
+    void* const ret = mpsc_fifo_trypop(&channel->queue);
+    if(!ret && drained) {
+        errno = EPIPE;
+    }
+    return ret;
+}
+
+//a message from the channel's pool. the pool keeps a free list per fiber manager, so this is usually a few loads and
+//stores instead of a malloc(). any message sent on the channel can be given back with fiber_unbounded_channel_free_message()
+static inline fiber_unbounded_channel_message_t* fiber_unbounded_channel_alloc_message(fiber_unbounded_channel_t* channel)
+{
+    assert(channel);
+    return (fiber_unbounded_channel_message_t*)fiber_node_pool_alloc(channel->pool);
+}
+
+//recycles a message the receiver is done with
+static inline void fiber_unbounded_channel_free_message(fiber_unbounded_channel_t* channel, fiber_unbounded_channel_message_t* message)
+{
+    assert(channel);
+    fiber_node_pool_free(channel->pool, message);
+}
+
+//sends 'data' in a message from the channel's pool. returns as fiber_unbounded_channel_send(), or -1 with errno set to
+//ENOMEM if there's no message to send it in
+static inline int fiber_unbounded_channel_send_data(fiber_unbounded_channel_t* channel, void* data)
+{
+    assert(channel);
+    assert(data);//NULL is returned by a canceled receive
+
+    fiber_unbounded_channel_message_t* const message = fiber_unbounded_channel_alloc_message(channel);
+    if(!message) {
+        errno = ENOMEM;
+        return -1;
+    }
+    message->data = data;
+    const int ret = fiber_unbounded_channel_send(channel, message);
+    if(ret < 0) {
+        fiber_unbounded_channel_free_message(channel, message);
+    }
+    return ret;
+}
+
+//receives the data from a message and recycles the message. returns NULL as fiber_unbounded_channel_receive() does
+static inline void* fiber_unbounded_channel_receive_data(fiber_unbounded_channel_t* channel)
+{
+    fiber_unbounded_channel_message_t* const message = (fiber_unbounded_channel_message_t*)fiber_unbounded_channel_receive(channel);
+    if(!message) {
+        return NULL;
+    }
+    void* const data = message->data;
+    fiber_unbounded_channel_free_message(channel, message);
+    return data;
+}
+
+//sends fail with EPIPE from now on. the receiver can still take the messages already sent, after which receives fail
+//with EPIPE too. waits for sends already under way to land and then wakes the receiver; returns 0 if the channel was
+//already closed
+static inline int fiber_unbounded_channel_close(fiber_unbounded_channel_t* channel)
+{
+    assert(channel);
+    if(!fiber_channel_internal_close(&channel->senders)) {
+        return 0;
+    }
+    if(channel->ready_signal) {
+        fiber_signal_raise(channel->ready_signal);
+    }
+    return 1;
 }
 
 //a unbounded channel. send and receive will block. there can be only one sender and one receiver
@@ -222,6 +665,9 @@ typedef struct fiber_unbounded_sp_channel
 {
     spsc_fifo_t queue;
     fiber_signal_t* ready_signal;
+    volatile uint64_t senders;//see fiber_channel_internal_enter()
+    fiber_node_pool_t* pool;//message nodes for fiber_unbounded_sp_channel_alloc_message(). either own_pool or shared by several channels
+    fiber_node_pool_t own_pool;
 } fiber_unbounded_sp_channel_t;
 
 typedef spsc_node_t fiber_unbounded_sp_channel_message_t;
@@ -231,9 +677,36 @@ static inline int fiber_unbounded_sp_channel_init(fiber_unbounded_sp_channel_t*
 {
     assert(channel);
     channel->ready_signal = signal;
+    channel->senders = 0;
     if(!spsc_fifo_init(&channel->queue)) {
         return 0;
     }
+    channel->pool = &channel->own_pool;
+    if(!fiber_node_pool_init(channel->pool, sizeof(fiber_unbounded_sp_channel_message_t))) {
+        spsc_fifo_destroy(&channel->queue);
+        return 0;
+    }
+    return 1;
+}
+
+//as fiber_unbounded_sp_channel_init() but the channel's messages come from 'pool', which must out-live the channel. the
+//nodes in 'pool' can be larger than a message (eg. a message embedded in a bigger struct). every message the
+//receiver gets back, including the queue's first dummy, comes from the pool, so they can all be recycled into it
+static inline int fiber_unbounded_sp_channel_init_with_pool(fiber_unbounded_sp_channel_t* channel, fiber_signal_t* signal, fiber_node_pool_t* pool)
+{
+    assert(channel);
+    assert(pool && pool->node_size >= sizeof(fiber_unbounded_sp_channel_message_t));
+    fiber_unbounded_sp_channel_message_t* const dummy = (fiber_unbounded_sp_channel_message_t*)fiber_node_pool_alloc(pool);
+    if(!dummy) {
+        return 0;
+    }
+    channel->ready_signal = signal;
+    channel->senders = 0;
+    spsc_fifo_init_with_node(&channel->queue, dummy);
+    channel->pool = pool;
+    channel->own_pool.caches = NULL;
+    channel->own_pool.cache_count = 0;
+    channel->own_pool.shared = NULL;
     return 1;
 }
 
@@ -241,41 +714,375 @@ static inline void fiber_unbounded_sp_channel_destroy(fiber_unbounded_sp_channel
 {
     if(channel) {
         spsc_fifo_destroy(&channel->queue);
+        fiber_node_pool_destroy(&channel->own_pool);
     }
 }
 
 //the channel owns message when this function returns.
-//returns 1 if a fiber was scheduled
+//returns 1 if a fiber was scheduled, or -1 with errno set to EPIPE if the channel is closed (the caller keeps message)
 static inline int fiber_unbounded_sp_channel_send(fiber_unbounded_sp_channel_t* channel, fiber_unbounded_sp_channel_message_t* message)
 {
     assert(channel);
     assert(message);
 
+    if(!fiber_channel_internal_enter(&channel->senders)) {
+        return -1;
+    }
     spsc_fifo_push(&channel->queue, message);
+    int ret = 0;
     if(channel->ready_signal) {
-        return fiber_signal_raise(channel->ready_signal);
+        ret = fiber_signal_raise(channel->ready_signal);
     }
-    return 0;
+    fiber_channel_internal_leave(&channel->senders);
+    return ret;
 }
 
-//the caller owns the message when this function returns
+//the channel owns the messages when this function returns. the signal is raised once for the whole batch.
+//returns 1 if a fiber was scheduled, or -1 with errno set to EPIPE if the channel is closed (the caller keeps the messages)
+static inline int fiber_unbounded_sp_channel_send_n(fiber_unbounded_sp_channel_t* channel, fiber_unbounded_sp_channel_message_t** messages, int count)
+{
+    assert(channel);
+    assert(messages);
+    assert(count > 0);
+
+    if(!fiber_channel_internal_enter(&channel->senders)) {
+        return -1;
+    }
+    int i;
+    for(i = 1; i < count; ++i) {
+        messages[i - 1]->next = messages[i];
+    }
+    spsc_fifo_push_chain(&channel->queue, messages[0], messages[count - 1]);
+    int ret = 0;
+    if(channel->ready_signal) {
+        ret = fiber_signal_raise(channel->ready_signal);
+    }
+    fiber_channel_internal_leave(&channel->senders);
+    return ret;
+}
+
+//the caller owns the message when this function returns. returns NULL with errno set to ECANCELED if the receiver is canceled
+//or EPIPE if the channel is closed and drained
 static inline void* fiber_unbounded_sp_channel_receive(fiber_unbounded_sp_channel_t* channel)
 {
     assert(channel);
 
     fiber_unbounded_sp_channel_message_t* ret;
     while(!(ret = spsc_fifo_trypop(&channel->queue))) {
-        if(channel->ready_signal) {
-            fiber_signal_wait(channel->ready_signal);
+        if(fiber_channel_internal_drained(&channel->senders)) {
+            if((ret = spsc_fifo_trypop(&channel->queue))) {
+                break;
+            }
+            errno = EPIPE;
+            return NULL;
+        }
+        if(channel->ready_signal && !fiber_signal_wait(channel->ready_signal)) {
+            return NULL;
         }
     }
     return ret;
 }
 
+//the caller owns the messages when this function returns. blocks until at least one message is available;
+//returns the number received, or 0 with errno set to ECANCELED if the receiver is canceled or EPIPE if the channel is
+//closed and drained
+static inline int fiber_unbounded_sp_channel_receive_n(fiber_unbounded_sp_channel_t* channel, fiber_unbounded_sp_channel_message_t** out, int count)
+{
+    assert(channel);
+    assert(out);
+    assert(count > 0);
+
+    int received = 0;
+    while(!received) {
+        const int drained = fiber_channel_internal_drained(&channel->senders);
+        while(received < count && (out[received] = spsc_fifo_trypop(&channel->queue))) {
+            received += 1;
+        }
+        if(!received && drained) {
+            errno = EPIPE;
+            return 0;
+        }
+        if(!received && channel->ready_signal && !fiber_signal_wait(channel->ready_signal)) {
+            return 0;
+        }
+    }
+    return received;
+}
+
+//returns NULL if there's no message, with errno set to EPIPE if the channel is also closed and drained
 static inline void* fiber_unbounded_sp_channel_try_receive(fiber_unbounded_sp_channel_t* channel)
 {
     assert(channel);
-    return spsc_fifo_trypop(&channel->queue);
+    const int drained = fiber_channel_internal_drained(&channel->senders);
+    void* const ret = spsc_fifo_trypop(&channel->queue);
+    if(!ret && drained) {
+        errno = EPIPE;
+    }
+    return ret;
+}
+
+//a message from the channel's pool. the pool keeps a free list per fiber manager, so this is usually a few loads and
+//stores instead of a malloc(). any message sent on the channel can be given back with fiber_unbounded_sp_channel_free_message()
+static inline fiber_unbounded_sp_channel_message_t* fiber_unbounded_sp_channel_alloc_message(fiber_unbounded_sp_channel_t* channel)
+{
+    assert(channel);
+    return (fiber_unbounded_sp_channel_message_t*)fiber_node_pool_alloc(channel->pool);
+}
+
+//recycles a message the receiver is done with
+static inline void fiber_unbounded_sp_channel_free_message(fiber_unbounded_sp_channel_t* channel, fiber_unbounded_sp_channel_message_t* message)
+{
+    assert(channel);
+    fiber_node_pool_free(channel->pool, message);
+}
+
+//sends 'data' in a message from the channel's pool. returns as fiber_unbounded_sp_channel_send(), or -1 with errno set to
+//ENOMEM if there's no message to send it in
+static inline int fiber_unbounded_sp_channel_send_data(fiber_unbounded_sp_channel_t* channel, void* data)
+{
+    assert(channel);
+    assert(data);//NULL is returned by a canceled receive
+
+    fiber_unbounded_sp_channel_message_t* const message = fiber_unbounded_sp_channel_alloc_message(channel);
+    if(!message) {
+        errno = ENOMEM;
+        return -1;
+    }
+    message->data = data;
+    const int ret = fiber_unbounded_sp_channel_send(channel, message);
+    if(ret < 0) {
+        fiber_unbounded_sp_channel_free_message(channel, message);
+    }
+    return ret;
+}
+
+//receives the data from a message and recycles the message. returns NULL as fiber_unbounded_sp_channel_receive() does
+static inline void* fiber_unbounded_sp_channel_receive_data(fiber_unbounded_sp_channel_t* channel)
+{
+    fiber_unbounded_sp_channel_message_t* const message = (fiber_unbounded_sp_channel_message_t*)fiber_unbounded_sp_channel_receive(channel);
+    if(!message) {
+        return NULL;
+    }
+    void* const data = message->data;
+    fiber_unbounded_sp_channel_free_message(channel, message);
+    return data;
+}
+
+//sends fail with EPIPE from now on. the receiver can still take the messages already sent, after which receives fail
+//with EPIPE too. waits for sends already under way to land and then wakes the receiver; returns 0 if the channel was
+//already closed
+static inline int fiber_unbounded_sp_channel_close(fiber_unbounded_sp_channel_t* channel)
+{
+    assert(channel);
+    if(!fiber_channel_internal_close(&channel->senders)) {
+        return 0;
+    }
+    if(channel->ready_signal) {
+        fiber_signal_raise(channel->ready_signal);
+    }
+    return 1;
+}
+
+//a request/response channel. there can be many callers but only one receiver. a call hands its request straight to a
+//waiting receiver and switches directly into it, and the reply switches directly back into the caller, so a round
+//trip between two fibers never goes through the run queue. these waits are not cancellation points
+typedef struct fiber_rendezvous_channel
+{
+    fiber_spinlock_t lock;
+    fiber_t* receiver;//the receiver if it's waiting for a call, protected by lock
+    mpsc_fifo_t callers;//callers waiting for the receiver, protected by lock
+    fiber_t* caller;//the caller whose request was received last. only used by the receiver
+    int closed;//protected by lock
+} fiber_rendezvous_channel_t;
+
+static inline int fiber_rendezvous_channel_init(fiber_rendezvous_channel_t* channel)
+{
+    assert(channel);
+    fiber_spinlock_init(&channel->lock);
+    channel->receiver = NULL;
+    channel->caller = NULL;
+    channel->closed = 0;
+    if(!mpsc_fifo_init(&channel->callers)) {
+        return 0;
+    }
+    return 1;
+}
+
+static inline void fiber_rendezvous_channel_destroy(fiber_rendezvous_channel_t* channel)
+{
+    if(channel) {
+        assert(!channel->caller);
+        mpsc_fifo_destroy(&channel->callers);
+    }
+}
+
+//sends 'request' and waits for the receiver's response, which is returned. returns NULL with errno set to EPIPE if the
+//channel is closed before the request is received
+static inline void* fiber_rendezvous_channel_call(fiber_rendezvous_channel_t* channel, void* request)
+{
+    assert(channel);
+    assert(request);//NULL is returned by a receive on a closed channel
+
+    fiber_manager_t* const manager = fiber_manager_get();
+    fiber_t* const this_fiber = manager->current_fiber;
+    assert(this_fiber->state == FIBER_STATE_RUNNING);
+    //scratch carries the request to the receiver and the response back
+    this_fiber->scratch = request;
+    fiber_spinlock_lock(&channel->lock);
+    if(channel->closed) {
+        fiber_spinlock_unlock(&channel->lock);
+        errno = EPIPE;
+        return NULL;
+    }
+    fiber_t* const receiver = channel->receiver;
+    this_fiber->state = FIBER_STATE_SAVING_STATE_TO_WAIT;
+    if(receiver) {
+        channel->receiver = NULL;
+        fiber_spinlock_unlock(&channel->lock);
+        receiver->scratch = this_fiber;
+        fiber_manager_yield_to(manager, receiver);
+    } else {
+        mpsc_fifo_node_t* const node = this_fiber->mpsc_fifo_node;
+        assert(node);
+        node->data = this_fiber;
+        this_fiber->mpsc_fifo_node = NULL;
+        mpsc_fifo_push(&channel->callers, node);
+        manager->spinlock_to_unlock = &channel->lock;
+        fiber_manager_yield(manager);
+        if(this_fiber->scratch == (void*)channel) {
+            //fiber_rendezvous_channel_close() sent us away
+            errno = EPIPE;
+            return NULL;
+        }
+    }
+    return this_fiber->scratch;
+}
+
+//takes the next caller off the queue. the lock must be held
+static inline fiber_t* fiber_rendezvous_channel_pop_caller(fiber_rendezvous_channel_t* channel)
+{
+    mpsc_fifo_node_t* const node = mpsc_fifo_trypop(&channel->callers);
+    if(!node) {
+        return NULL;
+    }
+    fiber_t* const caller = (fiber_t*)node->data;
+    assert(!caller->mpsc_fifo_node);
+    caller->mpsc_fifo_node = node;
+    return caller;
+}
+
+//parks the receiver until a call arrives, returning the caller or NULL with errno set to EPIPE if the channel is closed.
+//the lock must be held; it's released once this fiber has switched out, to 'to_run' if specified
+static inline fiber_t* fiber_rendezvous_channel_park_receiver(fiber_rendezvous_channel_t* channel, fiber_t* to_run)
+{
+    fiber_manager_t* const manager = fiber_manager_get();
+    fiber_t* const this_fiber = manager->current_fiber;
+    if(channel->closed) {
+        fiber_spinlock_unlock(&channel->lock);
+        if(to_run) {
+            fiber_manager_wake_entry(manager, to_run);
+        }
+        errno = EPIPE;
+        return NULL;
+    }
+    assert(!channel->receiver);
+    channel->receiver = this_fiber;
+    this_fiber->state = FIBER_STATE_SAVING_STATE_TO_WAIT;
+    manager->spinlock_to_unlock = &channel->lock;
+    if(to_run) {
+        fiber_manager_yield_to(manager, to_run);
+    } else {
+        fiber_manager_yield(manager);
+    }
+    //the caller switched straight into this fiber, or fiber_rendezvous_channel_close() woke us with no caller
+    fiber_t* const caller = (fiber_t*)this_fiber->scratch;
+    if(!caller) {
+        errno = EPIPE;
+    }
+    return caller;
+}
+
+//waits for the next call and returns its request. the caller stays blocked until it's replied to. returns NULL with
+//errno set to EPIPE once the channel is closed
+static inline void* fiber_rendezvous_channel_receive(fiber_rendezvous_channel_t* channel)
+{
+    assert(channel);
+    assert(!channel->caller);
+
+    fiber_spinlock_lock(&channel->lock);
+    fiber_t* caller = fiber_rendezvous_channel_pop_caller(channel);
+    if(caller) {
+        fiber_spinlock_unlock(&channel->lock);
+    } else if(!(caller = fiber_rendezvous_channel_park_receiver(channel, NULL))) {
+        return NULL;
+    }
+    channel->caller = caller;
+    return caller->scratch;
+}
+
+//hands 'response' to the caller received last and switches straight into it. this fiber is rescheduled
+static inline void fiber_rendezvous_channel_reply(fiber_rendezvous_channel_t* channel, void* response)
+{
+    assert(channel);
+    assert(channel->caller);
+
+    fiber_t* const caller = channel->caller;
+    channel->caller = NULL;
+    caller->scratch = response;
+    fiber_manager_yield_to(fiber_manager_get(), caller);
+}
+
+//replies and then waits for the next call. when no other caller is waiting this switches straight into the caller
+//without rescheduling this fiber, which is what lets a round trip skip the run queue. returns NULL with errno set to
+//EPIPE once the channel is closed (the caller is still replied to)
+static inline void* fiber_rendezvous_channel_reply_and_receive(fiber_rendezvous_channel_t* channel, void* response)
+{
+    assert(channel);
+    assert(channel->caller);
+
+    fiber_manager_t* const manager = fiber_manager_get();
+    fiber_t* const caller = channel->caller;
+    caller->scratch = response;
+    fiber_spinlock_lock(&channel->lock);
+    fiber_t* next = fiber_rendezvous_channel_pop_caller(channel);
+    if(next) {
+        //keep serving; the caller replied to goes through the scheduler instead
+        fiber_spinlock_unlock(&channel->lock);
+        fiber_manager_wake_entry(manager, caller);
+    } else if(!(next = fiber_rendezvous_channel_park_receiver(channel, caller))) {
+        channel->caller = NULL;
+        return NULL;
+    }
+    channel->caller = next;
+    return next->scratch;
+}
+
+//calls fail with EPIPE from now on, as do the calls waiting to be received. the receiver gets EPIPE once it has
+//replied to the call it holds, if any. returns 0 if the channel was already closed
+static inline int fiber_rendezvous_channel_close(fiber_rendezvous_channel_t* channel)
+{
+    assert(channel);
+
+    fiber_manager_t* const manager = fiber_manager_get();
+    fiber_spinlock_lock(&channel->lock);
+    if(channel->closed) {
+        fiber_spinlock_unlock(&channel->lock);
+        return 0;
+    }
+    channel->closed = 1;
+    fiber_t* caller;
+    while((caller = fiber_rendezvous_channel_pop_caller(channel))) {
+        caller->scratch = channel;//no response can be the channel itself, so this tells the caller it was closed
+        fiber_manager_wake_entry(manager, caller);
+    }
+    fiber_t* const receiver = channel->receiver;
+    channel->receiver = NULL;
+    fiber_spinlock_unlock(&channel->lock);
+    if(receiver) {
+        receiver->scratch = NULL;
+        fiber_manager_wake_entry(manager, receiver);
+    }
+    return 1;
 }
 
 #endif
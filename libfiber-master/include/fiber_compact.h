@@ -0,0 +1,143 @@
+/*
+ * Copyright (c) 2012-2015, Brian Watling and other contributors
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#ifndef _FIBER_COMPACT_H_
+#define _FIBER_COMPACT_H_
+
+/*
+    Author: Brian Watling
+    Email: brianwatling@hotmail.com
+    Website: https://github.com/brianwatling
+
+    Description: Compact versions of the mutex, condition variable, reader/writer
+                 lock and semaphore for fibers. Each is one or two ints and waits
+                 with fiber_wait_address(), so init allocates nothing, destroy
+                 frees nothing and an object nobody waits on costs nothing but
+                 its own bytes. They're meant for objects which exist in large
+                 numbers and are rarely contended; the regular primitives hand
+                 off more fairly under heavy contention.
+*/
+
+#include <time.h>
+
+//0 is unlocked, 1 is locked and 2 is locked with fibers (possibly) waiting
+typedef struct fiber_compact_mutex
+{
+    volatile int state;
+} fiber_compact_mutex_t;
+
+#define FIBER_COMPACT_MUTEX_INITIALIZER {0}
+
+//bumped by every signal and broadcast, which is what waiters wait on
+typedef struct fiber_compact_cond
+{
+    volatile int sequence;
+} fiber_compact_cond_t;
+
+#define FIBER_COMPACT_COND_INITIALIZER {0}
+
+//'state' is -1 while write locked, otherwise the number of readers. readers aren't held back by waiting writers
+typedef struct fiber_compact_rwlock
+{
+    volatile int state;
+    volatile int waiters;
+} fiber_compact_rwlock_t;
+
+#define FIBER_COMPACT_RWLOCK_INITIALIZER {0, 0}
+
+typedef struct fiber_compact_semaphore
+{
+    volatile int counter;
+    volatile int waiters;
+} fiber_compact_semaphore_t;
+
+#define FIBER_COMPACT_SEMAPHORE_INITIALIZER(value) {(value), 0}
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+extern int fiber_compact_mutex_init(fiber_compact_mutex_t* mutex);
+
+extern int fiber_compact_mutex_destroy(fiber_compact_mutex_t* mutex);
+
+//a cancellation point: returns FIBER_ERROR with errno set to ECANCELED if the fiber is canceled while waiting
+extern int fiber_compact_mutex_lock(fiber_compact_mutex_t* mutex);
+
+//as fiber_compact_mutex_lock() but not a cancellation point
+extern int fiber_compact_mutex_lock_internal(fiber_compact_mutex_t* mutex);
+
+//returns FIBER_ERROR with errno set to ETIMEDOUT if the lock isn't acquired by 'deadline' (CLOCK_MONOTONIC)
+extern int fiber_compact_mutex_lock_timed(fiber_compact_mutex_t* mutex, const struct timespec* deadline);
+
+extern int fiber_compact_mutex_trylock(fiber_compact_mutex_t* mutex);
+
+extern int fiber_compact_mutex_unlock(fiber_compact_mutex_t* mutex);
+
+extern int fiber_compact_cond_init(fiber_compact_cond_t* cond);
+
+extern void fiber_compact_cond_destroy(fiber_compact_cond_t* cond);
+
+extern int fiber_compact_cond_signal(fiber_compact_cond_t* cond);
+
+extern int fiber_compact_cond_broadcast(fiber_compact_cond_t* cond);
+
+//a cancellation point: returns FIBER_ERROR with errno set to ECANCELED if the fiber is canceled. the mutex is held on
+//return either way. wakeups can be spurious, so the caller must re-check its condition
+extern int fiber_compact_cond_wait(fiber_compact_cond_t* cond, fiber_compact_mutex_t* mutex);
+
+//returns FIBER_ERROR with errno set to ETIMEDOUT if not signaled by 'deadline' (CLOCK_MONOTONIC). the mutex is held on return
+extern int fiber_compact_cond_wait_timed(fiber_compact_cond_t* cond, fiber_compact_mutex_t* mutex, const struct timespec* deadline);
+
+extern int fiber_compact_rwlock_init(fiber_compact_rwlock_t* rwlock);
+
+extern void fiber_compact_rwlock_destroy(fiber_compact_rwlock_t* rwlock);
+
+extern int fiber_compact_rwlock_rdlock(fiber_compact_rwlock_t* rwlock);
+
+extern int fiber_compact_rwlock_wrlock(fiber_compact_rwlock_t* rwlock);
+
+extern int fiber_compact_rwlock_tryrdlock(fiber_compact_rwlock_t* rwlock);
+
+extern int fiber_compact_rwlock_trywrlock(fiber_compact_rwlock_t* rwlock);
+
+extern int fiber_compact_rwlock_rdunlock(fiber_compact_rwlock_t* rwlock);
+
+extern int fiber_compact_rwlock_wrunlock(fiber_compact_rwlock_t* rwlock);
+
+extern int fiber_compact_semaphore_init(fiber_compact_semaphore_t* semaphore, int value);
+
+extern int fiber_compact_semaphore_destroy(fiber_compact_semaphore_t* semaphore);
+
+//a cancellation point: returns FIBER_ERROR with errno set to ECANCELED if the fiber is canceled while waiting
+extern int fiber_compact_semaphore_wait(fiber_compact_semaphore_t* semaphore);
+
+//returns FIBER_ERROR with errno set to ETIMEDOUT if the semaphore isn't acquired by 'deadline' (CLOCK_MONOTONIC)
+extern int fiber_compact_semaphore_wait_timed(fiber_compact_semaphore_t* semaphore, const struct timespec* deadline);
+
+extern int fiber_compact_semaphore_trywait(fiber_compact_semaphore_t* semaphore);
+
+extern int fiber_compact_semaphore_post(fiber_compact_semaphore_t* semaphore);
+
+extern int fiber_compact_semaphore_getvalue(fiber_compact_semaphore_t* semaphore);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
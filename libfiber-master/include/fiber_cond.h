@@ -18,7 +18,7 @@
 #define _FIBER_COND_H_
 
 #include "fiber_mutex.h"
-#include "mpsc_fifo.h"
+#include "mpmc_fifo.h"
 #include <sys/types.h>
 #include <time.h>
 
@@ -27,15 +27,18 @@
     Email: brianwatling@hotmail.com
     Website: https://github.com/brianwatling
 
-    Description: A condition variable structure for fibers.
+    Description: A condition variable structure for fibers. Signalling and
+                 broadcasting don't wake the waiters: they're moved straight onto
+                 the caller's mutex (wait morphing, see fiber_mutex_requeue_waiter()),
+                 so they run one at a time as it's released instead of waking together
+                 only to queue up on the mutex again. Waiters queue in an mpmc_fifo_t,
+                 which lets any number of fibers signal at once without a lock.
 */
 
 typedef struct fiber_cond
 {
-    fiber_mutex_t* caller_mutex;
-    volatile intptr_t waiter_count;
-    mpsc_fifo_t waiters;
-    fiber_mutex_t internal_mutex;
+    fiber_mutex_t* volatile caller_mutex;
+    mpmc_fifo_t waiters;
 } fiber_cond_t;
 
 #ifdef __cplusplus
@@ -50,8 +53,13 @@ extern int fiber_cond_signal(fiber_cond_t* cond);
 
 extern int fiber_cond_broadcast(fiber_cond_t* cond);
 
+//a cancellation point: returns FIBER_ERROR with errno set to ECANCELED if the fiber is canceled. the mutex is held on return either way
 extern int fiber_cond_wait(fiber_cond_t* cond, fiber_mutex_t * mutex);
 
+//returns FIBER_ERROR with errno set to ETIMEDOUT if not signalled by 'deadline'. the mutex is held on return either way.
+//a waiter signalled in time succeeds even if the deadline passes while it waits for the mutex
+extern int fiber_cond_wait_timed(fiber_cond_t* cond, fiber_mutex_t* mutex, const struct timespec* deadline);
+
 #ifdef __cplusplus
 }
 #endif
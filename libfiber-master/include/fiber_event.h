@@ -19,13 +19,57 @@
 
 #include <stddef.h>
 #include <stdint.h>
+#include <time.h>
 
-//this variable controls how long idle threads wait for events, in milliseconds.
-//the value is important: high values may be better for workloads which are not truly parallel,
-//while lower values may allow idle threads to pick up new work sooner
-//TODO: make this a runtime config option?
+//this variable controls the resolution of the sleep timer, in milliseconds. it is also the default
+//for how long idle threads wait for events (see fiber_manager_set_poll_timeout())
 #define FIBER_TIME_RESOLUTION_MS 5 //ms
 
+//the number of events fetched by a single poll adapts between these bounds: it grows while polls
+//return full batches and shrinks again once they don't. the upper bound can be changed at runtime
+#define FIBER_EVENT_MIN_BATCH_SIZE (64)
+#define FIBER_EVENT_DEFAULT_MAX_BATCH_SIZE (4096)
+
+/* ABOUT TIMEOUTS
+The *_timed functions take an absolute deadline measured against CLOCK_MONOTONIC. On expiry they
+return FIBER_ERROR with errno set to ETIMEDOUT. Deadlines are checked against the sleep timer, which
+ticks every FIBER_TIME_RESOLUTION_MS, by idle managers as they poll for events and by busy managers
+as they schedule fibers (see fiber_event_expire_timeouts()). A wait can overrun its deadline by up to
+FIBER_TIME_RESOLUTION_MS plus the time it takes some manager to yield; a fiber which never yields
+holds up the timeouts on its manager until it does.
+*/
+
+struct fiber_timeout;
+
+typedef void (*fiber_timeout_callback_t)(struct fiber_timeout* timeout);
+
+typedef struct fiber_timeout
+{
+    fiber_timeout_callback_t callback;
+    void* data;
+    volatile int expired;//for use by the callback
+    void* event_data[8];//owned by the event system
+} fiber_timeout_t;
+
+//sets 'deadline' to the given amount of time from now
+static inline void fiber_deadline_after(struct timespec* deadline, uint32_t seconds, uint32_t useconds)
+{
+    clock_gettime(CLOCK_MONOTONIC, deadline);
+    deadline->tv_sec += seconds + useconds / 1000000;
+    deadline->tv_nsec += (useconds % 1000000) * 1000;
+    if(deadline->tv_nsec >= 1000000000) {
+        deadline->tv_sec += 1;
+        deadline->tv_nsec -= 1000000000;
+    }
+}
+
+static inline int fiber_deadline_passed(const struct timespec* deadline)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec > deadline->tv_sec || (now.tv_sec == deadline->tv_sec && now.tv_nsec >= deadline->tv_nsec);
+}
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -60,12 +104,40 @@ extern size_t fiber_poll_events_blocking(uint32_t seconds, uint32_t useconds);
 //ready to perform the operation(s) specified by events
 extern int fiber_wait_for_event(int fd, uint32_t events);
 
+//as above, but gives up at 'deadline' (errno is set to ETIMEDOUT)
+extern int fiber_wait_for_event_timed(int fd, uint32_t events, const struct timespec* deadline);
+
+//watches 'fd' for the operation(s) specified by events without blocking. the watch's callback is invoked once, from an
+//event polling thread, when the fd is ready or closed. as with timeouts, callbacks run with the event system locked
+extern void fiber_event_watch(int fd, uint32_t events, fiber_timeout_t* watch);
+
+//removes a watch. returns 1 if it was removed before firing, 0 if the callback has already run.
+//a watch's memory can only be reused once this returns
+extern int fiber_event_unwatch(int fd, fiber_timeout_t* watch);
+
 //puts the calling fiber to sleep
 extern int fiber_sleep(uint32_t seconds, uint32_t useconds);
 
 //called when a file descriptor is closed
 extern void fiber_fd_closed(int fd);
 
+//arms 'timeout'. its callback is invoked from an event polling thread once 'deadline' passes.
+//callbacks run with the timer locked: they must not block and must not start or stop timeouts
+extern void fiber_timeout_start(fiber_timeout_t* timeout, const struct timespec* deadline);
+
+//disarms 'timeout'. returns 1 if the timeout was disarmed before firing, 0 if the callback has already run.
+//a timeout's memory can only be reused once this returns
+extern int fiber_timeout_stop(fiber_timeout_t* timeout);
+
+//called by the fiber managers every so often while they schedule fibers, so timeouts expire even when no manager is
+//idle enough to poll for events. returns quickly unless a timeout is due. must not be called with a spin lock held
+extern void fiber_event_expire_timeouts();
+
+//sets the cap on the number of events fetched per poll. values below FIBER_EVENT_MIN_BATCH_SIZE are raised to it
+extern void fiber_event_set_max_batch_size(uint32_t max_batch_size);
+
+extern uint32_t fiber_event_get_max_batch_size();
+
 #ifdef __cplusplus
 }
 #endif
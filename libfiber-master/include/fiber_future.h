@@ -0,0 +1,127 @@
+/*
+ * Copyright (c) 2012-2015, Brian Watling and other contributors
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _FIBER_FUTURE_H_
+#define _FIBER_FUTURE_H_
+
+/*
+    Author: Brian Watling
+    Email: brianwatling@hotmail.com
+    Website: https://github.com/brianwatling
+
+    Description: Futures and promises for fibers. A promise is satisfied once with a
+                 value; its future hands that value to any number of fibers
+                 (fiber_future_get()) and continuations (fiber_future_then()). Any fiber
+                 can satisfy a promise, so an asynchronous result doesn't need a fiber of
+                 its own to join.
+
+                 Nothing is allocated per future: a promise embeds its future, and
+                 continuations and combinators live in storage owned by the caller.
+                 Waiting fibers park on the future's state (see fiber_wait_address()).
+                 Continuations are pushed onto a lock-free list which satisfying the
+                 promise closes with a single exchange.
+*/
+
+#include <stddef.h>
+#include <time.h>
+#include "fiber_manager.h"
+
+#define FIBER_FUTURE_PENDING (0)
+#define FIBER_FUTURE_SETTING (1)
+#define FIBER_FUTURE_READY (2)
+
+//the stack size of the fibers which run continuations on a chosen manager
+#define FIBER_FUTURE_CONTINUATION_STACK_SIZE (102400)
+
+struct fiber_future;
+
+typedef void (*fiber_future_callback_t)(struct fiber_future* future, void* arg);
+
+//caller-owned storage for a continuation. it must stay valid until its callback has started
+typedef struct fiber_future_continuation
+{
+    struct fiber_future_continuation* next;
+    struct fiber_future* future;
+    fiber_future_callback_t callback;
+    void* arg;
+    fiber_manager_t* manager;
+} fiber_future_continuation_t;
+
+typedef struct fiber_future
+{
+    volatile int state;
+    void* value;
+    fiber_future_continuation_t* volatile continuations;
+} fiber_future_t;
+
+typedef struct fiber_promise
+{
+    fiber_future_t future;
+} fiber_promise_t;
+
+//state for fiber_future_when_all() and fiber_future_when_any()
+typedef struct fiber_future_when
+{
+    fiber_promise_t promise;
+    volatile intptr_t remaining;//when_all only
+    fiber_future_t** futures;
+} fiber_future_when_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+extern int fiber_promise_init(fiber_promise_t* promise);
+
+extern void fiber_promise_destroy(fiber_promise_t* promise);
+
+static inline fiber_future_t* fiber_promise_get_future(fiber_promise_t* promise)
+{
+    return &promise->future;
+}
+
+//wakes the future's waiters and runs its continuations. returns FIBER_ERROR with errno set to EINVAL if the promise
+//has already been satisfied
+extern int fiber_promise_set_value(fiber_promise_t* promise, void* value);
+
+//a cancellation point: returns FIBER_ERROR with errno set to ECANCELED if the fiber is canceled (see fiber_cancel())
+extern int fiber_future_get(fiber_future_t* future, void** value);
+
+//returns FIBER_ERROR with errno set to ETIMEDOUT if the future isn't ready by 'deadline'
+extern int fiber_future_get_timed(fiber_future_t* future, void** value, const struct timespec* deadline);
+
+//returns FIBER_ERROR with errno set to EAGAIN if the future isn't ready
+extern int fiber_future_try_get(fiber_future_t* future, void** value);
+
+extern int fiber_future_is_ready(fiber_future_t* future);
+
+//runs 'callback' once the future is ready. with a NULL 'manager' it runs inline: in the fiber which satisfies the
+//promise, or right away if the future is ready already. otherwise it runs in a new fiber on 'manager'
+extern int fiber_future_then(fiber_future_t* future, fiber_future_continuation_t* continuation, fiber_future_callback_t callback, void* arg, fiber_manager_t* manager);
+
+//returns a future which is ready once all of 'futures' are. its value is 'futures'. 'continuations' must hold 'count'
+//entries; they, 'when' and 'futures' must stay valid until every one of 'futures' is ready
+extern fiber_future_t* fiber_future_when_all(fiber_future_when_t* when, fiber_future_t** futures, fiber_future_continuation_t* continuations, size_t count);
+
+//as fiber_future_when_all(), but the returned future is ready as soon as any of 'futures' is. its value is the first
+//one to become ready, or NULL if 'count' is 0. the storage must still outlive all of 'futures'
+extern fiber_future_t* fiber_future_when_any(fiber_future_when_t* when, fiber_future_t** futures, fiber_future_continuation_t* continuations, size_t count);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,157 @@
+/*
+ * Copyright (c) 2012-2015, Brian Watling and other contributors
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _FIBER_LOCK_PROFILE_H_
+#define _FIBER_LOCK_PROFILE_H_
+
+/*
+    Author: Brian Watling
+    Email: brianwatling@hotmail.com
+    Website: https://github.com/brianwatling
+
+    Description: Opt-in contention profiling for fiber_mutex_t, fiber_rwlock_t,
+                 fiber_spinlock_t and fiber_semaphore_t, in the spirit of pprof's
+                 mutex profile. It's only compiled in with -DFIBER_LOCK_PROFILE
+                 (make LOCK_PROFILE=1); otherwise the hooks in the locks compile to
+                 nothing and fiber_lock_profile_start() fails.
+
+                 While profiling runs, each acquisition is recorded against the
+                 lock's address and, with FIBER_LOCK_PROFILE_BY_CALLER, the address
+                 it was acquired from. A record keeps how long contended
+                 acquisitions waited, how many fibers were waiting ahead of them and
+                 how long exclusive holds lasted, with log2 histograms of the times.
+                 Shared holds (readers, semaphore permits) aren't timed, and a spin
+                 lock doesn't know how long its queue is, so its waiter depth is 0.
+*/
+
+#include <stdint.h>
+#include <stdio.h>
+
+#define FIBER_LOCK_PROFILE_MUTEX (0)
+#define FIBER_LOCK_PROFILE_RWLOCK_READ (1)
+#define FIBER_LOCK_PROFILE_RWLOCK_WRITE (2)
+#define FIBER_LOCK_PROFILE_SPINLOCK (3)
+#define FIBER_LOCK_PROFILE_SEMAPHORE (4)
+
+//keep a record per call site rather than one per lock
+#define FIBER_LOCK_PROFILE_BY_CALLER (1)
+
+//bucket i counts times in [2^(i-1), 2^i) nanoseconds. the last bucket also counts anything longer
+#define FIBER_LOCK_PROFILE_BUCKETS (32)
+
+//the number of lock/call site pairs which can be recorded. must be a power of 2
+#define FIBER_LOCK_PROFILE_RECORDS (4096)
+
+typedef struct fiber_lock_profile_stats
+{
+    uint64_t acquisitions;
+    uint64_t contentions;//acquisitions which had to wait
+    uint64_t wait_nsecs;
+    uint64_t max_wait_nsecs;
+    uint64_t waiters;//fibers found waiting ahead, summed over the contentions
+    uint64_t max_waiters;
+    uint64_t holds;//timed exclusive holds
+    uint64_t hold_nsecs;
+    uint64_t wait_histogram[FIBER_LOCK_PROFILE_BUCKETS];
+    uint64_t hold_histogram[FIBER_LOCK_PROFILE_BUCKETS];
+} fiber_lock_profile_stats_t;
+
+//a contended acquisition in progress (see FIBER_LOCK_PROFILE_WAIT())
+typedef struct fiber_lock_profile_wait
+{
+    uint64_t start;//0 if profiling isn't running
+    uint64_t waiters;
+} fiber_lock_profile_wait_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//starts recording. 'flags' is 0 or FIBER_LOCK_PROFILE_BY_CALLER. returns FIBER_ERROR with errno set to ENOSYS if
+//profiling isn't compiled in
+extern int fiber_lock_profile_start(int flags);
+
+extern void fiber_lock_profile_stop();
+
+//forgets everything recorded so far. stop profiling first
+extern void fiber_lock_profile_reset();
+
+//stats are *added* to the values currently in *out. they're summed over all of the lock's call sites
+extern void fiber_lock_profile_lock_stats(void* lock, fiber_lock_profile_stats_t* out);
+
+//writes the time waited per call site in pprof's legacy mutex profile format (one "<nanoseconds> <contentions> @ <pc>"
+//line each), for `pprof <binary> <file>`. without FIBER_LOCK_PROFILE_BY_CALLER the lock's address stands in for the pc
+extern void fiber_lock_profile_dump(FILE* out);
+
+//writes every record, with its histograms, for people to read
+extern void fiber_lock_profile_print(FILE* out);
+
+//the rest is for the locks themselves
+
+#ifdef FIBER_LOCK_PROFILE
+
+extern volatile int fiber_lock_profile_running;
+
+extern uint64_t fiber_lock_profile_now();
+
+//'wait' is NULL for an acquisition which didn't wait
+extern void fiber_lock_profile_acquired(void* lock, int kind, void* caller, const fiber_lock_profile_wait_t* wait);
+
+extern void fiber_lock_profile_released(void* lock);
+
+//the hooks below record the call site of the function they're used in, so they belong in the lock's public functions
+
+//declares 'wait' and starts timing a contended acquisition. 'waiters' is only evaluated while profiling runs
+#define FIBER_LOCK_PROFILE_WAIT(wait, waiters) \
+    const fiber_lock_profile_wait_t wait = {fiber_lock_profile_running ? fiber_lock_profile_now() : 0, \
+                                            fiber_lock_profile_running ? (uint64_t)(waiters) : 0}
+
+#define FIBER_LOCK_PROFILE_WAITED(lock, kind, wait) \
+    do { \
+        if((wait).start) { \
+            fiber_lock_profile_acquired((lock), (kind), __builtin_return_address(0), &(wait)); \
+        } \
+    } while(0)
+
+#define FIBER_LOCK_PROFILE_ACQUIRED(lock, kind) \
+    do { \
+        if(fiber_lock_profile_running) { \
+            fiber_lock_profile_acquired((lock), (kind), __builtin_return_address(0), NULL); \
+        } \
+    } while(0)
+
+#define FIBER_LOCK_PROFILE_RELEASED(lock) \
+    do { \
+        if(fiber_lock_profile_running) { \
+            fiber_lock_profile_released(lock); \
+        } \
+    } while(0)
+
+#else
+
+#define FIBER_LOCK_PROFILE_WAIT(wait, waiters) const int wait = 0
+#define FIBER_LOCK_PROFILE_WAITED(lock, kind, wait) ((void)(wait))
+#define FIBER_LOCK_PROFILE_ACQUIRED(lock, kind) ((void)0)
+#define FIBER_LOCK_PROFILE_RELEASED(lock) ((void)0)
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
@@ -24,6 +24,7 @@
 #include "mpsc_fifo.h"
 #include "mpmc_fifo.h"
 #include "fiber_scheduler.h"
+#include "fiber_event.h"
 
 typedef struct fiber_mpsc_to_push
 {
@@ -37,6 +38,8 @@ typedef struct fiber_mpmc_to_push
     mpmc_fifo_node_t* node;
 } fiber_mpmc_to_push_t;
 
+struct fiber_rcu_head;
+
 typedef struct fiber_manager
 {
     fiber_t* maintenance_fiber;
@@ -51,20 +54,79 @@ typedef struct fiber_manager
     fiber_spinlock_t* volatile spinlock_to_unlock;
     void** volatile set_wait_location;
     void* volatile set_wait_value;
+    fiber_spinlock_t* volatile cancel_lock_to_unlock;
     fiber_scheduler_t* scheduler;
     fiber_t* volatile done_fiber;
+    void* poll_events;//owned by the event system
+    uint32_t poll_batch_size;
+    uint32_t busy_poll_budget;//in microseconds. 0 disables busy-polling
+    uint64_t busy_poll_start;
     int id;
+    volatile uint64_t rcu_epoch;//the last RCU grace period this manager has seen (see fiber_rcu.h)
+    volatile int rcu_idle;//blocked waiting for events, so not running any RCU readers
+    struct fiber_rcu_head* rcu_next;//callbacks queued since the current batch started
+    struct fiber_rcu_head* rcu_waiting;//callbacks waiting for rcu_waiting_epoch to complete
+    uint64_t rcu_waiting_epoch;
+    mpsc_fifo_t remote_fibers;//scheduled from other threads (see fiber_manager_schedule_remote())
+    fiber_spinlock_node_t spinlock_node;//queues this manager's fiber for a contended fiber_spinlock_t
     uint64_t yield_count;
     uint64_t spin_count;
     uint64_t signal_spin_count;
     uint64_t multi_signal_spin_count;
-    uint64_t wake_mpsc_spin_count;
+    uint64_t wake_mpsc_spin_count;//no longer incremented: a waker leaves a token instead of spinning
+    uint64_t wake_mpsc_token_count;
     uint64_t wake_mpmc_spin_count;
     uint64_t poll_count;
     uint64_t event_wait_count;
     uint64_t lock_contention_count;
+    uint64_t busy_poll_usecs;
+    uint64_t blocked_poll_usecs;
 } fiber_manager_t;
 
+/*
+    a waiter which is able to give up before it's woken (see the *_timed functions). whoever moves the waiter
+    out of FIBER_WAITER_WAITING is responsible for scheduling its fiber. waiters are queued as tagged pointers so
+    they can share a queue with plain fibers. a waiter that gave up is left in the queue and is released by
+    whoever pops it.
+
+    a fiber can wait on several waiters at once (see fiber_select()) by giving each of them the same non-zero
+    token. a waker which moves such a waiter out of FIBER_WAITER_WAITING only schedules the fiber if it also
+    claims the token from the fiber's wait_token; the fiber releases the waiters which lost.
+*/
+typedef struct fiber_waiter
+{
+    fiber_t* fiber;
+    volatile int state;
+    uint64_t token;
+} fiber_waiter_t;
+
+#define FIBER_WAITER_WAITING (0)
+#define FIBER_WAITER_WOKEN (1)
+#define FIBER_WAITER_TIMEDOUT (2)
+#define FIBER_WAITER_CANCELED (3)
+//the waiter took a wake token instead of waiting (see fiber_manager_wait_in_mpsc_queue_with_tokens()). its entry is
+//released by whoever pops it and doesn't count as a waiter
+#define FIBER_WAITER_STALE (4)
+//the waiter has been signalled and moved to another queue (see fiber_cond_signal()). it can't time out or be canceled
+//any more; the next waker to pop it wakes it as if it were still waiting
+#define FIBER_WAITER_MOVED (5)
+
+#define FIBER_WAITER_TAG ((uintptr_t)1)
+
+static inline void* fiber_waiter_to_entry(fiber_waiter_t* waiter)
+{
+    return (void*)((uintptr_t)waiter | FIBER_WAITER_TAG);
+}
+
+//returns NULL if 'entry' is a plain fiber
+static inline fiber_waiter_t* fiber_waiter_from_entry(void* entry)
+{
+    if((uintptr_t)entry & FIBER_WAITER_TAG) {
+        return (fiber_waiter_t*)((uintptr_t)entry & ~FIBER_WAITER_TAG);
+    }
+    return NULL;
+}
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -78,10 +140,18 @@ static inline void fiber_manager_schedule(fiber_manager_t* manager, fiber_t* the
     fiber_scheduler_schedule(manager->scheduler, the_fiber);
 }
 
+//schedules a READY fiber on 'manager' from any thread. the fiber is handed to the manager's scheduler the next time it
+//yields or runs out of work, so an idle manager may not pick it up until its event poll times out
+extern void fiber_manager_schedule_remote(fiber_manager_t* manager, fiber_t* the_fiber);
+
 extern void fiber_manager_yield(fiber_manager_t* manager);
 
 extern fiber_manager_t* fiber_manager_get();
 
+//switches straight to 'to_run' without going through the scheduler. 'to_run' must be waiting (it may still be switching
+//out) and the caller must own its wake-up. the current fiber is rescheduled if it's still running
+extern void fiber_manager_yield_to(fiber_manager_t* manager, fiber_t* to_run);
+
 /* this should be called immediately when the applicaion starts */
 extern int fiber_manager_init(size_t num_threads);
 
@@ -95,18 +165,92 @@ extern int fiber_manager_get_state();
 
 extern int fiber_manager_get_kernel_thread_count();
 
+//returns the manager for kernel thread 'id' (0 <= id < fiber_manager_get_kernel_thread_count())
+extern fiber_manager_t* fiber_manager_get_by_id(int id);
+
 extern void fiber_manager_do_maintenance();
 
 extern void fiber_manager_wait_in_mpmc_queue(fiber_manager_t* manager, mpmc_fifo_t* fifo);
 
+//the timed waits return FIBER_ERROR with errno set to ETIMEDOUT if 'deadline' passes first, or ECANCELED if the fiber is
+//canceled. the queue entry is left behind. a NULL deadline waits without a timeout but is still a cancellation point
+extern int fiber_manager_wait_in_mpmc_queue_timed(fiber_manager_t* manager, mpmc_fifo_t* fifo, const struct timespec* deadline);
+
+//as fiber_manager_wait_in_mpmc_queue_timed(), unlocking 'mutex' once the fiber is queued
+extern int fiber_manager_wait_in_mpmc_queue_and_unlock_timed(fiber_manager_t* manager, mpmc_fifo_t* fifo, fiber_mutex_t* mutex, const struct timespec* deadline);
+
+//pops 'count' entries, waiting for them if necessary. returns the number of fibers woken, which is less than 'count' if
+//some of the waiters had given up. if count == 0, a single pop is attempted: the result is 1 if a fiber was woken,
+//0 if the queue was empty or -1 if the waiter popped had given up
 extern int fiber_manager_wake_from_mpmc_queue(fiber_manager_t* manager, mpmc_fifo_t* fifo, int count);
 
 extern void fiber_manager_wait_in_mpsc_queue(fiber_manager_t* manager, mpsc_fifo_t* fifo);
 
+extern int fiber_manager_wait_in_mpsc_queue_timed(fiber_manager_t* manager, mpsc_fifo_t* fifo, const struct timespec* deadline);
+
 extern void fiber_manager_wait_in_mpsc_queue_and_unlock(fiber_manager_t* manager, mpsc_fifo_t* fifo, fiber_mutex_t* mutex);
 
+extern int fiber_manager_wait_in_mpsc_queue_and_unlock_timed(fiber_manager_t* manager, mpsc_fifo_t* fifo, fiber_mutex_t* mutex, const struct timespec* deadline);
+
+//pops up to 'count' entries without waiting for more. returns the number of fibers woken, which is less than 'count' if
+//some of the waiters had given up or the queue ran dry. if count == 0, entries are popped until a fiber is woken or the
+//queue is empty. a primitive which counts its waiters before they're queued should use the *_with_tokens functions
 extern int fiber_manager_wake_from_mpsc_queue(fiber_manager_t* manager, mpsc_fifo_t* fifo, int count);
 
+/*
+    waits and wakes for primitives which count their waiters before queuing them (fiber_mutex, fiber_cond, ...).
+    a waker can find that a waiter it counted isn't queued yet. rather than waiting for it, the waker adds a token to
+    'tokens'; a waiter checks for tokens before and after it's queued and takes one instead of blocking. either the waiter sees
+    the token or the waker sees the waiter's entry, so no wake is lost and nobody spins
+*/
+//'mutex' (if any) is unlocked once the fiber is queued. a cancelable wait returns FIBER_ERROR with errno set to
+//ECANCELED if the fiber is canceled; a timed one (non-NULL 'deadline') returns FIBER_ERROR with errno set to ETIMEDOUT.
+//either way the entry is left behind for a waker to pop
+extern int fiber_manager_wait_in_mpsc_queue_with_tokens(fiber_manager_t* manager, mpsc_fifo_t* fifo, volatile int* tokens, fiber_mutex_t* mutex, int cancelable, const struct timespec* deadline);
+//wakes 'count' counted waiters, leaving a token for each one which isn't queued yet. never blocks or yields. returns
+//the number of waiters woken or left a token, which is less than 'count' if some of them had given up
+extern int fiber_manager_wake_from_mpsc_queue_with_tokens(fiber_manager_t* manager, mpsc_fifo_t* fifo, volatile int* tokens, int count);
+//takes one of the tokens left by fiber_manager_wake_from_mpsc_queue_with_tokens(). returns 1 if there was one
+extern int fiber_manager_take_token(volatile int* tokens);
+
+//wakes the fiber behind a queue entry. returns 1 if a fiber was scheduled, 0 if it was a waiter which had given up
+//or whose fiber was woken by one of its other waiters
+extern int fiber_manager_wake_entry(fiber_manager_t* manager, void* entry);
+
+//returns 1 if the waiter's fiber was scheduled, 0 if the waiter had already given up or lost its token
+extern int fiber_manager_wake_waiter(fiber_manager_t* manager, fiber_waiter_t* waiter);
+
+//arms 'timeout' to give up on 'waiter' at 'deadline'. the waiter's fiber must not be RUNNING (use SAVING_STATE_TO_WAIT)
+extern void fiber_manager_start_waiter_timeout(fiber_timeout_t* timeout, fiber_waiter_t* waiter, const struct timespec* deadline);
+
+//called by the waiter once it's running again. returns FIBER_SUCCESS if it was woken or FIBER_ERROR (errno = ETIMEDOUT) if it gave up
+extern int fiber_manager_stop_waiter_timeout(fiber_timeout_t* timeout);
+
+/*
+    cancellation points. before blocking, arm 'point' with the callback that interrupts the wait; fiber_cancel()
+    fires it. the callback must claim the wait, set point->expired and reschedule the fiber (as a timeout would).
+    arming fails with ECANCELED if a cancel is already pending, in which case the caller must not block. the
+    arming is held until this fiber has switched out, so the caller must block with no further yields
+*/
+extern int fiber_manager_arm_cancel(fiber_manager_t* manager, fiber_timeout_t* point, fiber_timeout_callback_t callback, void* data);
+
+//releases an armed cancellation point for a wait which didn't block after all
+extern void fiber_manager_abort_cancel(fiber_manager_t* manager, fiber_timeout_t* point);
+
+//called once running again. returns FIBER_ERROR with errno set to ECANCELED if fiber_cancel() interrupted the wait
+extern int fiber_manager_disarm_cancel(fiber_timeout_t* point);
+
+//a cancellation callback for waits on a fiber_waiter_t
+extern void fiber_manager_cancel_waiter(fiber_timeout_t* point);
+
+extern fiber_waiter_t* fiber_manager_get_waiter(fiber_t* fiber);
+
+extern void fiber_manager_return_waiter(fiber_waiter_t* waiter);
+
+extern mpsc_fifo_node_t* fiber_manager_get_mpsc_node();
+
+extern void fiber_manager_return_mpsc_node(mpsc_fifo_node_t* node);
+
 extern void fiber_manager_set_and_wait(fiber_manager_t* manager, void** location, void* value);
 
 extern void* fiber_manager_clear_or_wait(fiber_manager_t* manager, void** location);
@@ -123,6 +267,18 @@ extern void fiber_manager_return_mpmc_node(mpmc_fifo_node_t* node);
 
 extern void* fiber_manager_thread_func(void* param);
 
+//sets how long an idle fiber manager thread blocks waiting for events. defaults to FIBER_TIME_RESOLUTION_MS
+extern void fiber_manager_set_poll_timeout(uint32_t useconds);
+
+extern uint32_t fiber_manager_get_poll_timeout();
+
+//an idle manager with a busy-poll budget spins on its run queue and on fiber_poll_events() for up to 'useconds'
+//before falling back to a blocking poll. sockets created on such a manager also get SO_BUSY_POLL where available.
+//this trades a core for wakeup latency. 0 (the default) disables busy-polling
+extern void fiber_manager_set_busy_poll(fiber_manager_t* manager, uint32_t useconds);
+
+extern void fiber_manager_set_all_busy_poll(uint32_t useconds);
+
 typedef struct fiber_manager_stats
 {
     uint64_t yield_count;
@@ -131,11 +287,14 @@ typedef struct fiber_manager_stats
     uint64_t spin_count;
     uint64_t signal_spin_count;
     uint64_t multi_signal_spin_count;
-    uint64_t wake_mpsc_spin_count;
+    uint64_t wake_mpsc_spin_count;//no longer incremented: a waker leaves a token instead of spinning
+    uint64_t wake_mpsc_token_count;
     uint64_t wake_mpmc_spin_count;
     uint64_t poll_count;
     uint64_t event_wait_count;
     uint64_t lock_contention_count;
+    uint64_t busy_poll_usecs;
+    uint64_t blocked_poll_usecs;
 } fiber_manager_stats_t;
 
 //stats are *added* to the values currently in *out
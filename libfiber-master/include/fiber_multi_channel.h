@@ -14,8 +14,8 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
-#ifndef _FIBER_CHANNEL_H_
-#define _FIBER_CHANNEL_H_
+#ifndef _FIBER_MULTI_CHANNEL_H_
+#define _FIBER_MULTI_CHANNEL_H_
 
 /*
     Author: Brian Watling
@@ -24,6 +24,7 @@
 */
 
 #include <assert.h>
+#include <errno.h>
 #include <stdint.h>
 #include <stddef.h>
 #include <malloc.h>
@@ -31,6 +32,7 @@
 #include "machine_specific.h"
 #include "fiber_manager.h"
 #include "fiber_mutex.h"
+#include "fiber_semaphore.h"
 #include "fiber_signal.h"
 
 //a bounded channel with many senders and receivers. send and receive will block if necessary.
@@ -42,6 +44,7 @@ typedef struct fiber_multi_channel
     uint32_t size;
     uint32_t power_of_2_mod;
     fiber_t* waiters;
+    int closed;
     //buffer must be last - it spills outside of this struct
     void* buffer[];
 } fiber_multi_channel_t;
@@ -94,12 +97,18 @@ static inline void fiber_multi_channel_internal_wake(fiber_multi_channel_t* chan
     }
 }
 
-static inline void fiber_multi_channel_send(fiber_multi_channel_t* channel, void* message)
+//returns FIBER_ERROR with errno set to EPIPE if the channel is closed. not a cancellation point, nor is receive
+static inline int fiber_multi_channel_send(fiber_multi_channel_t* channel, void* message)
 {
     assert(channel);
 
     while(1) {
-        fiber_mutex_lock(&channel->lock);
+        fiber_mutex_lock_internal(&channel->lock);
+        if(channel->closed) {
+            fiber_mutex_unlock(&channel->lock);
+            errno = EPIPE;
+            return FIBER_ERROR;
+        }
         if(channel->high - channel->low < channel->size) {
             break;
         }
@@ -110,17 +119,24 @@ static inline void fiber_multi_channel_send(fiber_multi_channel_t* channel, void
     channel->high += 1;
     fiber_multi_channel_internal_wake(channel);
     fiber_mutex_unlock(&channel->lock);
+    return FIBER_SUCCESS;
 }
 
+//returns NULL with errno set to EPIPE if the channel is closed and drained
 static inline void* fiber_multi_channel_receive(fiber_multi_channel_t* channel)
 {
     assert(channel);
 
     while(1) {
-        fiber_mutex_lock(&channel->lock);
+        fiber_mutex_lock_internal(&channel->lock);
         if(channel->high > channel->low) {
             break;
         }
+        if(channel->closed) {
+            fiber_mutex_unlock(&channel->lock);
+            errno = EPIPE;
+            return NULL;
+        }
         fiber_multi_channel_internal_wait(channel);
     }
     const uint32_t index = channel->low & channel->power_of_2_mod;
@@ -132,5 +148,483 @@ static inline void* fiber_multi_channel_receive(fiber_multi_channel_t* channel)
     return ret;
 }
 
-#endif
+//sends fail with EPIPE from now on, and receives do too once the messages already sent are gone. wakes every waiter;
+//returns 0 if the channel was already closed
+static inline int fiber_multi_channel_close(fiber_multi_channel_t* channel)
+{
+    assert(channel);
+
+    fiber_mutex_lock_internal(&channel->lock);
+    const int was_closed = channel->closed;
+    channel->closed = 1;
+    while(channel->waiters) {
+        fiber_multi_channel_internal_wake(channel);
+    }
+    fiber_mutex_unlock(&channel->lock);
+    return !was_closed;
+}
+
+//a bounded channel with many senders and receivers which doesn't serialise on a lock. the slots form a
+//sequence-numbered ring (see Dmitry Vyukov's bounded MPMC queue); a pair of semaphores counts the free and
+//filled slots, so a fiber only parks when the ring is full (senders) or empty (receivers). closing the channel sets
+//a bit in high which freezes it, and posts one extra permit to each semaphore. a fiber which takes a permit but
+//finds the channel closed (senders) or closed and drained (receivers) passes its permit on, so every waiter wakes
+#define FIBER_BOUNDED_MPMC_CHANNEL_CLOSED ((uint64_t)1 << 63)
+
+typedef struct fiber_bounded_mpmc_channel_slot
+{
+    volatile uint64_t sequence;
+    void* volatile message;
+} fiber_bounded_mpmc_channel_slot_t;
+
+typedef struct fiber_bounded_mpmc_channel
+{
+    volatile uint64_t high;
+    char _cache_padding1[CACHE_SIZE - sizeof(uint64_t)];
+    volatile uint64_t low;
+    char _cache_padding2[CACHE_SIZE - sizeof(uint64_t)];
+    fiber_semaphore_t free_slots;//senders wait here while the ring is full
+    fiber_semaphore_t used_slots;//receivers wait here while the ring is empty
+    uint32_t size;
+    uint32_t power_of_2_mod;
+    //buffer must be last - it spills outside of this struct
+    fiber_bounded_mpmc_channel_slot_t buffer[];
+} fiber_bounded_mpmc_channel_t;
+
+static inline fiber_bounded_mpmc_channel_t* fiber_bounded_mpmc_channel_create(uint32_t power_of_2_size)
+{
+    assert(power_of_2_size && power_of_2_size < 32);
+    const size_t size = 1 << power_of_2_size;
+    const size_t required_size = sizeof(fiber_bounded_mpmc_channel_t) + size * sizeof(fiber_bounded_mpmc_channel_slot_t);
+    fiber_bounded_mpmc_channel_t* const channel = (fiber_bounded_mpmc_channel_t*)calloc(1, required_size);
+    if(channel) {
+        channel->size = size;
+        channel->power_of_2_mod = size - 1;
+        size_t i;
+        for(i = 0; i < size; ++i) {
+            channel->buffer[i].sequence = i;
+        }
+        if(!fiber_semaphore_init(&channel->free_slots, size)) {
+            free(channel);
+            return 0;
+        }
+        if(!fiber_semaphore_init(&channel->used_slots, 0)) {
+            fiber_semaphore_destroy(&channel->free_slots);
+            free(channel);
+            return 0;
+        }
+    }
+    return channel;
+}
+
+static inline void fiber_bounded_mpmc_channel_destroy(fiber_bounded_mpmc_channel_t* channel)
+{
+    if(channel) {
+        fiber_semaphore_destroy(&channel->free_slots);
+        fiber_semaphore_destroy(&channel->used_slots);
+        free(channel);
+    }
+}
+
+//the caller must own a free slot (see free_slots). returns 0 if the channel is closed
+static inline int fiber_bounded_mpmc_channel_internal_put(fiber_bounded_mpmc_channel_t* channel, void* message)
+{
+    uint64_t high;
+    do {
+        high = channel->high;
+        if(high & FIBER_BOUNDED_MPMC_CHANNEL_CLOSED) {
+            fiber_semaphore_post_internal(&channel->free_slots);
+            errno = EPIPE;
+            return 0;
+        }
+    } while(!__sync_bool_compare_and_swap(&channel->high, high, high + 1));
+    fiber_bounded_mpmc_channel_slot_t* const slot = &channel->buffer[high & channel->power_of_2_mod];
+    while(slot->sequence != high) {
+        cpu_relax();//the receiver from the previous lap has claimed this slot but not emptied it yet
+    }
+    slot->message = message;
+    write_barrier();
+    slot->sequence = high + 1;
+    fiber_semaphore_post_internal(&channel->used_slots);
+    return 1;
+}
+
+//the caller must own a used slot (see used_slots). returns 0 if the channel is closed and drained. while it's open
+//a used slot guarantees low < high, but after closing the extra permit doesn't, so low is claimed with a CAS
+static inline int fiber_bounded_mpmc_channel_internal_take(fiber_bounded_mpmc_channel_t* channel, void** out)
+{
+    uint64_t low;
+    do {
+        low = channel->low;
+        load_load_barrier();
+        if(low >= (channel->high & ~FIBER_BOUNDED_MPMC_CHANNEL_CLOSED)) {
+            fiber_semaphore_post_internal(&channel->used_slots);
+            errno = EPIPE;
+            return 0;
+        }
+    } while(!__sync_bool_compare_and_swap(&channel->low, low, low + 1));
+    fiber_bounded_mpmc_channel_slot_t* const slot = &channel->buffer[low & channel->power_of_2_mod];
+    while(slot->sequence != low + 1) {
+        cpu_relax();//the sender which claimed this slot hasn't filled it yet
+    }
+    load_load_barrier();
+    *out = slot->message;
+    write_barrier();
+    slot->sequence = low + channel->size;
+    fiber_semaphore_post_internal(&channel->free_slots);
+    return 1;
+}
+
+static inline int fiber_bounded_mpmc_channel_internal_is_closed(fiber_bounded_mpmc_channel_t* channel)
+{
+    if(channel->high & FIBER_BOUNDED_MPMC_CHANNEL_CLOSED) {
+        errno = EPIPE;
+        return 1;
+    }
+    return 0;
+}
+
+//blocks while the channel is full. a cancellation point: returns FIBER_ERROR with errno set to ECANCELED if the sender is canceled (see fiber_cancel())
+//or EPIPE if the channel is closed
+static inline int fiber_bounded_mpmc_channel_send(fiber_bounded_mpmc_channel_t* channel, void* message)
+{
+    assert(channel);
+    assert(message);//NULL is returned by a canceled receive
+    if(fiber_bounded_mpmc_channel_internal_is_closed(channel) || !fiber_semaphore_wait(&channel->free_slots)) {
+        return FIBER_ERROR;
+    }
+    return fiber_bounded_mpmc_channel_internal_put(channel, message);
+}
+
+//returns FIBER_ERROR with errno set to EPIPE if the channel is closed, or EAGAIN if it's full
+static inline int fiber_bounded_mpmc_channel_try_send(fiber_bounded_mpmc_channel_t* channel, void* message)
+{
+    assert(channel);
+    assert(message);
+    if(fiber_bounded_mpmc_channel_internal_is_closed(channel)) {
+        return FIBER_ERROR;
+    }
+    if(!fiber_semaphore_trywait(&channel->free_slots)) {
+        errno = EAGAIN;
+        return FIBER_ERROR;
+    }
+    return fiber_bounded_mpmc_channel_internal_put(channel, message);
+}
+
+//blocks while the channel is empty. returns NULL with errno set to ECANCELED if the receiver is canceled or EPIPE if
+//the channel is closed and drained
+static inline void* fiber_bounded_mpmc_channel_receive(fiber_bounded_mpmc_channel_t* channel)
+{
+    assert(channel);
+    void* ret = NULL;
+    if(fiber_semaphore_wait(&channel->used_slots)) {
+        fiber_bounded_mpmc_channel_internal_take(channel, &ret);
+    }
+    return ret;
+}
+
+//returns FIBER_ERROR with errno set to EPIPE if the channel is closed and drained, or EAGAIN if it's empty
+static inline int fiber_bounded_mpmc_channel_try_receive(fiber_bounded_mpmc_channel_t* channel, void** out)
+{
+    assert(channel);
+    assert(out);
+    if(!fiber_semaphore_trywait(&channel->used_slots)) {
+        //a closed channel's extra permit may be in another receiver's hands
+        const uint64_t low = channel->low;
+        load_load_barrier();
+        const uint64_t high = channel->high;
+        errno = (high & FIBER_BOUNDED_MPMC_CHANNEL_CLOSED) && low >= (high & ~FIBER_BOUNDED_MPMC_CHANNEL_CLOSED) ? EPIPE : EAGAIN;
+        return FIBER_ERROR;
+    }
+    return fiber_bounded_mpmc_channel_internal_take(channel, out);
+}
+
+//returns 1 and sets *out if a message arrives by 'deadline' (CLOCK_MONOTONIC), 0 with errno set to ETIMEDOUT, ECANCELED
+//or EPIPE (the channel is closed and drained) otherwise
+static inline int fiber_bounded_mpmc_channel_receive_timed(fiber_bounded_mpmc_channel_t* channel, void** out, const struct timespec* deadline)
+{
+    assert(channel);
+    assert(out);
+    if(!fiber_semaphore_wait_timed(&channel->used_slots, deadline)) {
+        return FIBER_ERROR;
+    }
+    return fiber_bounded_mpmc_channel_internal_take(channel, out);
+}
 
+//sends fail with EPIPE from now on, and receives do too once the messages already sent are gone. wakes every blocked
+//sender and receiver; returns 0 if the channel was already closed
+static inline int fiber_bounded_mpmc_channel_close(fiber_bounded_mpmc_channel_t* channel)
+{
+    assert(channel);
+    if(__sync_fetch_and_or(&channel->high, FIBER_BOUNDED_MPMC_CHANNEL_CLOSED) & FIBER_BOUNDED_MPMC_CHANNEL_CLOSED) {
+        return 0;
+    }
+    fiber_semaphore_post_internal(&channel->free_slots);
+    fiber_semaphore_post_internal(&channel->used_slots);
+    return 1;
+}
+
+//a single-producer ring which every subscriber reads in full (see the LMAX Disruptor). each subscriber keeps its own
+//cursor, so a message is published once however many subscribers there are. the producer either waits for the
+//slowest subscriber (FIBER_BROADCAST_BLOCK) or overwrites messages a subscriber hasn't read yet (FIBER_BROADCAST_DROP),
+//in which case the subscriber skips ahead and counts what it missed. subscribers park while they're caught up
+#define FIBER_BROADCAST_BLOCK (0)
+#define FIBER_BROADCAST_DROP (1)
+
+typedef struct fiber_broadcast_subscriber
+{
+    volatile uint64_t cursor;//the next message to read
+    char _cache_padding1[CACHE_SIZE - sizeof(uint64_t)];
+    struct fiber_broadcast_channel* channel;
+    uint64_t dropped;//messages overwritten before they were read
+    struct fiber_broadcast_subscriber* next;
+} fiber_broadcast_subscriber_t;
+
+typedef struct fiber_broadcast_channel
+{
+    volatile uint64_t published;//the number of messages published
+    uint64_t gating;//the slowest cursor the producer saw last. only used by the producer
+    char _cache_padding1[CACHE_SIZE - 2 * sizeof(uint64_t)];
+    mpsc_fifo_t waiters;//subscribers which are caught up. only the producer pops
+    volatile int producer_waiting;
+    fiber_signal_t space;//the producer waits here while the slowest subscriber is a full ring behind
+    fiber_spinlock_t lock;//protects subscribers
+    fiber_broadcast_subscriber_t* subscribers;
+    volatile int closed;
+    int mode;
+    uint32_t size;
+    uint32_t power_of_2_mod;
+    //buffer must be last - it spills outside of this struct
+    void* volatile buffer[];
+} fiber_broadcast_channel_t;
+
+static inline fiber_broadcast_channel_t* fiber_broadcast_channel_create(uint32_t power_of_2_size, int mode)
+{
+    assert(power_of_2_size && power_of_2_size < 32);
+    assert(mode == FIBER_BROADCAST_BLOCK || mode == FIBER_BROADCAST_DROP);
+    const size_t size = 1 << power_of_2_size;
+    const size_t required_size = sizeof(fiber_broadcast_channel_t) + size * sizeof(void*);
+    fiber_broadcast_channel_t* const channel = (fiber_broadcast_channel_t*)calloc(1, required_size);
+    if(channel) {
+        channel->size = size;
+        channel->power_of_2_mod = size - 1;
+        channel->mode = mode;
+        fiber_signal_init(&channel->space);
+        fiber_spinlock_init(&channel->lock);
+        if(!mpsc_fifo_init(&channel->waiters)) {
+            free(channel);
+            return 0;
+        }
+    }
+    return channel;
+}
+
+static inline void fiber_broadcast_channel_destroy(fiber_broadcast_channel_t* channel)
+{
+    if(channel) {
+        assert(!channel->subscribers);
+        //release any entries left behind by subscribers which were canceled
+        fiber_manager_wake_from_mpsc_queue(fiber_manager_get(), &channel->waiters, 0);
+        mpsc_fifo_destroy(&channel->waiters);
+        fiber_signal_destroy(&channel->space);
+        free(channel);
+    }
+}
+
+//a new subscriber starts with the next message published
+static inline void fiber_broadcast_channel_subscribe(fiber_broadcast_channel_t* channel, fiber_broadcast_subscriber_t* subscriber)
+{
+    assert(channel);
+    assert(subscriber);
+    subscriber->channel = channel;
+    subscriber->dropped = 0;
+    fiber_spinlock_lock(&channel->lock);
+    subscriber->cursor = channel->published;
+    subscriber->next = channel->subscribers;
+    channel->subscribers = subscriber;
+    fiber_spinlock_unlock(&channel->lock);
+}
+
+static inline void fiber_broadcast_channel_unsubscribe(fiber_broadcast_subscriber_t* subscriber)
+{
+    assert(subscriber);
+    fiber_broadcast_channel_t* const channel = subscriber->channel;
+    fiber_spinlock_lock(&channel->lock);
+    fiber_broadcast_subscriber_t** cur = &channel->subscribers;
+    while(*cur != subscriber) {
+        assert(*cur);
+        cur = &(*cur)->next;
+    }
+    *cur = subscriber->next;
+    fiber_spinlock_unlock(&channel->lock);
+    store_load_barrier();
+    if(channel->producer_waiting) {
+        fiber_signal_raise(&channel->space);//this may have been the slowest subscriber
+    }
+}
+
+static inline void fiber_broadcast_channel_internal_wake(fiber_broadcast_channel_t* channel)
+{
+    store_load_barrier();//parked subscribers re-check published (and closed) after queueing
+    if(channel->waiters.head->next) {
+        fiber_manager_t* const manager = fiber_manager_get();
+        while(fiber_manager_wake_from_mpsc_queue(manager, &channel->waiters, 0)) {
+        }
+    }
+}
+
+static inline uint64_t fiber_broadcast_channel_internal_gating(fiber_broadcast_channel_t* channel)
+{
+    uint64_t gating = channel->published;
+    fiber_spinlock_lock(&channel->lock);
+    fiber_broadcast_subscriber_t* subscriber;
+    for(subscriber = channel->subscribers; subscriber; subscriber = subscriber->next) {
+        const uint64_t cursor = subscriber->cursor;
+        if(cursor < gating) {
+            gating = cursor;
+        }
+    }
+    fiber_spinlock_unlock(&channel->lock);
+    return gating;
+}
+
+//only one fiber may publish. in FIBER_BROADCAST_BLOCK mode this waits while the slowest subscriber is a full ring
+//behind; a cancellation point: returns FIBER_ERROR with errno set to ECANCELED if the producer is canceled or EPIPE if
+//the channel is closed
+static inline int fiber_broadcast_channel_publish(fiber_broadcast_channel_t* channel, void* message)
+{
+    assert(channel);
+    assert(message);//NULL is returned by a canceled receive
+    if(channel->closed) {
+        errno = EPIPE;
+        return FIBER_ERROR;
+    }
+
+    const uint64_t sequence = channel->published;
+    if(channel->mode == FIBER_BROADCAST_BLOCK) {
+        while(sequence - channel->gating >= channel->size) {
+            channel->gating = fiber_broadcast_channel_internal_gating(channel);
+            if(sequence - channel->gating < channel->size) {
+                break;
+            }
+            channel->producer_waiting = 1;
+            store_load_barrier();//subscribers check producer_waiting after moving their cursors
+            channel->gating = fiber_broadcast_channel_internal_gating(channel);
+            if(sequence - channel->gating < channel->size) {
+                channel->producer_waiting = 0;
+                break;
+            }
+            const int ret = fiber_signal_wait(&channel->space);
+            channel->producer_waiting = 0;
+            if(!ret) {
+                return FIBER_ERROR;
+            }
+        }
+    }
+
+    channel->buffer[sequence & channel->power_of_2_mod] = message;
+    write_barrier();
+    channel->published = sequence + 1;
+    fiber_broadcast_channel_internal_wake(channel);
+    return FIBER_SUCCESS;
+}
+
+//called by the producer once it's done publishing. subscribers can still read what was published, after which their
+//receives fail with EPIPE. returns 0 if the channel was already closed
+static inline int fiber_broadcast_channel_close(fiber_broadcast_channel_t* channel)
+{
+    assert(channel);
+    if(channel->closed) {
+        return 0;
+    }
+    write_barrier();
+    channel->closed = 1;
+    fiber_broadcast_channel_internal_wake(channel);
+    return 1;
+}
+
+//parks the subscriber until something is published. returns FIBER_ERROR with errno set to ECANCELED if it's canceled
+static inline int fiber_broadcast_channel_internal_park(fiber_broadcast_subscriber_t* subscriber)
+{
+    fiber_broadcast_channel_t* const channel = subscriber->channel;
+    fiber_manager_t* const manager = fiber_manager_get();
+    fiber_t* const this_fiber = manager->current_fiber;
+    fiber_waiter_t* const waiter = fiber_manager_get_waiter(this_fiber);
+    fiber_timeout_t cancel_point;
+    if(!fiber_manager_arm_cancel(manager, &cancel_point, &fiber_manager_cancel_waiter, waiter)) {
+        fiber_manager_return_waiter(waiter);
+        return FIBER_ERROR;
+    }
+
+    this_fiber->state = FIBER_STATE_SAVING_STATE_TO_WAIT;
+    mpsc_fifo_node_t* const node = fiber_manager_get_mpsc_node();
+    node->data = fiber_waiter_to_entry(waiter);
+    mpsc_fifo_push(&channel->waiters, node);
+    store_load_barrier();//the producer checks for waiters after publishing
+    if((channel->published != subscriber->cursor || channel->closed)
+       && __sync_bool_compare_and_swap(&waiter->state, FIBER_WAITER_WAITING, FIBER_WAITER_CANCELED)) {
+        //something was published while we were queueing. the entry is left for the producer to release
+        fiber_manager_abort_cancel(manager, &cancel_point);
+        this_fiber->state = FIBER_STATE_RUNNING;
+        return FIBER_SUCCESS;
+    }
+    fiber_manager_yield(manager);
+    if(!fiber_manager_disarm_cancel(&cancel_point)) {
+        return FIBER_ERROR;
+    }
+    fiber_manager_return_waiter(waiter);
+    return FIBER_SUCCESS;
+}
+
+//blocks until there's a message the subscriber hasn't read. returns NULL with errno set to ECANCELED if the
+//subscriber is canceled or EPIPE if the channel is closed and the subscriber has read everything published
+static inline void* fiber_broadcast_channel_receive(fiber_broadcast_subscriber_t* subscriber)
+{
+    assert(subscriber);
+    fiber_broadcast_channel_t* const channel = subscriber->channel;
+    while(1) {
+        const uint64_t cursor = subscriber->cursor;
+        const uint64_t published = channel->published;
+        if(cursor == published) {
+            if(channel->closed) {
+                load_load_barrier();
+                if(channel->published == cursor) {
+                    errno = EPIPE;
+                    return NULL;
+                }
+                continue;
+            }
+            if(!fiber_broadcast_channel_internal_park(subscriber)) {
+                return NULL;
+            }
+            continue;
+        }
+        load_load_barrier();
+        if(channel->mode == FIBER_BROADCAST_DROP) {
+            //the slot for 'cursor' is rewritten once 'cursor + size' is being published
+            if(published - cursor >= channel->size) {
+                const uint64_t oldest = published - channel->size + 1;
+                subscriber->dropped += oldest - cursor;
+                subscriber->cursor = oldest;
+                continue;
+            }
+            void* const message = channel->buffer[cursor & channel->power_of_2_mod];
+            load_load_barrier();
+            if(channel->published - cursor >= channel->size) {
+                continue;//overwritten while we read it
+            }
+            subscriber->cursor = cursor + 1;
+            return message;
+        }
+        void* const message = channel->buffer[cursor & channel->power_of_2_mod];
+        subscriber->cursor = cursor + 1;
+        store_load_barrier();//the producer checks the cursors after setting producer_waiting
+        if(channel->producer_waiting) {
+            fiber_signal_raise(&channel->space);
+        }
+        return message;
+    }
+    return NULL;
+}
+
+#endif
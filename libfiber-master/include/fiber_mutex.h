@@ -29,14 +29,46 @@
                  to a value below 0 must wait. Unlocking is done by atomically incrementing
                  the counter. The unlocker must wake up a waiter if the counter is not 1
                  after an unlock operation (ie. other fibers were waiting).
+
+                 A mutex created with FIBER_MUTEX_BARGING uses the counter as a plain
+                 lock word instead (1 is unlocked). Unlocking releases the lock and wakes
+                 one waiter, which competes for it with any running fiber. A fiber which
+                 woke a waiter doesn't wake another until that one has tried again.
+
+                 A mutex created with FIBER_MUTEX_ADAPTIVE spins before waiting, but only
+                 while the owner is running on another manager. The spin limit follows
+                 how long acquiring the lock by spinning has taken recently.
+
+                 A handoff mutex can also take over a fiber waiting elsewhere (see
+                 fiber_mutex_requeue_waiter()). fiber_cond uses this to move its waiters
+                 straight to the mutex, so they run one at a time as the lock is released.
 */
 
+#include <time.h>
 #include "mpsc_fifo.h"
 
+struct fiber;
+struct fiber_waiter;
+
+//unlocking hands the lock to the oldest waiter (the default)
+#define FIBER_MUTEX_HANDOFF (0)
+//unlocking releases the lock and wakes a waiter to compete for it
+#define FIBER_MUTEX_BARGING (1)
+//spin while the owner is running on another manager before waiting
+#define FIBER_MUTEX_ADAPTIVE (2)
+
+#define FIBER_MUTEX_MAX_SPIN (1000)
+
 typedef struct fiber_mutex
 {
     volatile int counter;
+    int flags;
     mpsc_fifo_t waiters;
+    volatile int wake_tokens;//see fiber_manager_wait_in_mpsc_queue_with_tokens()
+    struct fiber* volatile owner;//only tracked by adaptive mutexes
+    volatile int spin_limit;
+    volatile int waiting;//barging only: fibers counted here will queue or take the lock
+    volatile int woken;//barging only: a woken waiter hasn't tried to take the lock yet
 } fiber_mutex_t;
 
 #ifdef __cplusplus
@@ -45,16 +77,35 @@ extern "C" {
 
 extern int fiber_mutex_init(fiber_mutex_t* mutex);
 
+//'flags' is FIBER_MUTEX_HANDOFF or FIBER_MUTEX_BARGING, optionally or'ed with FIBER_MUTEX_ADAPTIVE
+extern int fiber_mutex_init_with_flags(fiber_mutex_t* mutex, int flags);
+
 extern int fiber_mutex_destroy(fiber_mutex_t* mutex);
 
+//a cancellation point: returns FIBER_ERROR with errno set to ECANCELED if the fiber is canceled while waiting (see fiber_cancel())
 extern int fiber_mutex_lock(fiber_mutex_t* mutex);
 
+//as fiber_mutex_lock() but not a cancellation point, for callers which must end up holding the lock
+extern int fiber_mutex_lock_internal(fiber_mutex_t* mutex);
+
+//returns FIBER_ERROR with errno set to ETIMEDOUT if the lock isn't acquired by 'deadline' (CLOCK_MONOTONIC)
+extern int fiber_mutex_lock_timed(fiber_mutex_t* mutex, const struct timespec* deadline);
+
 extern int fiber_mutex_trylock(fiber_mutex_t* mutex);
 
 extern int fiber_mutex_unlock_internal(fiber_mutex_t* mutex);
 
 extern int fiber_mutex_unlock(fiber_mutex_t* mutex);
 
+//queues 'waiter' (whose fiber is waiting on something else) for the lock without waking it, as if its fiber had called
+//fiber_mutex_lock(). the fiber owns the lock once the waiter is woken and should call fiber_mutex_lock_requeued(). a
+//waiter which gives up in the meantime is skipped as usual. returns FIBER_ERROR for a barging mutex, which never hands
+//the lock to a waiter - wake the waiter directly instead
+extern int fiber_mutex_requeue_waiter(fiber_mutex_t* mutex, struct fiber_waiter* waiter);
+
+//completes the lock for a fiber which was handed it by way of fiber_mutex_requeue_waiter()
+extern void fiber_mutex_lock_requeued(fiber_mutex_t* mutex);
+
 #ifdef __cplusplus
 }
 #endif
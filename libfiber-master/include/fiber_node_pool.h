@@ -0,0 +1,174 @@
+/*
+ * Copyright (c) 2012-2015, Brian Watling and other contributors
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#ifndef _FIBER_NODE_POOL_H_
+#define _FIBER_NODE_POOL_H_
+
+/*
+    Author: Brian Watling
+    Email: brianwatling@hotmail.com
+    Website: https://github.com/brianwatling
+*/
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include "machine_specific.h"
+#include "fiber_manager.h"
+
+/*
+    a pool of fixed size nodes with a free list per fiber manager. fibers don't preempt each other, so a fiber
+    can use its manager's free list without atomics as long as it doesn't yield in between. a node freed on one
+    manager and needed on another (eg. a channel's receiver recycling the nodes its senders allocate) goes
+    through a shared list: a manager whose free list grows past FIBER_NODE_POOL_CACHE_MAX hands the whole list
+    over with one CAS, and a manager which runs dry takes everything on the shared list with one exchange. the
+    shared list is never popped one node at a time, so it doesn't suffer from ABA. the nodes taken are kept apart
+    from the free list and only allocated from, so they never have to be walked to find their tail or count.
+
+    nodes come from malloc(), so any node can be released with free() instead (eg. after the pool is destroyed).
+    the pool must be initialized after fiber_manager_init(); before that it just uses malloc() and free().
+*/
+
+#define FIBER_NODE_POOL_CACHE_MAX (256)
+
+typedef struct fiber_node_pool_node
+{
+    struct fiber_node_pool_node* next;
+} fiber_node_pool_node_t;
+
+typedef struct fiber_node_pool_cache
+{
+    fiber_node_pool_node_t* head;
+    fiber_node_pool_node_t* tail;//the first node freed into an empty list stays last until the list is handed over
+    size_t count;
+    fiber_node_pool_node_t* taken;//nodes taken from the shared list
+    char _cache_padding1[CACHE_SIZE - 3 * sizeof(fiber_node_pool_node_t*) - sizeof(size_t)];
+} fiber_node_pool_cache_t;
+
+typedef struct fiber_node_pool
+{
+    fiber_node_pool_node_t* volatile shared;
+    size_t node_size;
+    size_t cache_count;
+    fiber_node_pool_cache_t* caches;
+} fiber_node_pool_t;
+
+static inline int fiber_node_pool_init(fiber_node_pool_t* pool, size_t node_size)
+{
+    assert(pool);
+    assert(node_size >= sizeof(fiber_node_pool_node_t));
+    pool->shared = NULL;
+    pool->node_size = node_size;
+    pool->cache_count = fiber_manager_get_kernel_thread_count();
+    pool->caches = NULL;
+    if(pool->cache_count) {
+        pool->caches = (fiber_node_pool_cache_t*)calloc(pool->cache_count, sizeof(*pool->caches));
+        if(!pool->caches) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static inline void fiber_node_pool_free_list(fiber_node_pool_node_t* node)
+{
+    while(node) {
+        fiber_node_pool_node_t* const next = node->next;
+        free(node);
+        node = next;
+    }
+}
+
+//frees the nodes in the pool. nodes still in use can be released with free()
+static inline void fiber_node_pool_destroy(fiber_node_pool_t* pool)
+{
+    if(pool) {
+        size_t i;
+        for(i = 0; i < pool->cache_count; ++i) {
+            fiber_node_pool_free_list(pool->caches[i].head);
+            fiber_node_pool_free_list(pool->caches[i].taken);
+        }
+        fiber_node_pool_free_list(pool->shared);
+        free(pool->caches);
+        pool->caches = NULL;
+        pool->cache_count = 0;
+        pool->shared = NULL;
+    }
+}
+
+static inline fiber_node_pool_cache_t* fiber_node_pool_get_cache(fiber_node_pool_t* pool)
+{
+    const size_t id = fiber_manager_get()->id;
+    return id < pool->cache_count ? &pool->caches[id] : NULL;
+}
+
+static inline void* fiber_node_pool_alloc(fiber_node_pool_t* pool)
+{
+    assert(pool);
+    fiber_node_pool_cache_t* const cache = fiber_node_pool_get_cache(pool);
+    if(!cache) {
+        return malloc(pool->node_size);
+    }
+    fiber_node_pool_node_t* node = cache->head;
+    if(node) {
+        cache->head = node->next;
+        cache->count -= 1;
+        return node;
+    }
+    node = cache->taken;
+    if(!node && pool->shared) {
+        node = (fiber_node_pool_node_t*)atomic_exchange_pointer((void**)&pool->shared, NULL);
+    }
+    if(!node) {
+        return malloc(pool->node_size);
+    }
+    cache->taken = node->next;
+    return node;
+}
+
+static inline void fiber_node_pool_free(fiber_node_pool_t* pool, void* node)
+{
+    assert(pool);
+    if(!node) {
+        return;
+    }
+    fiber_node_pool_cache_t* const cache = fiber_node_pool_get_cache(pool);
+    if(!cache) {
+        free(node);
+        return;
+    }
+    fiber_node_pool_node_t* const n = (fiber_node_pool_node_t*)node;
+    n->next = cache->head;
+    if(!cache->head) {
+        cache->tail = n;
+    }
+    cache->head = n;
+    cache->count += 1;
+    if(cache->count > FIBER_NODE_POOL_CACHE_MAX) {
+        //hand the list over to the managers which are allocating
+        fiber_node_pool_node_t* shared;
+        do {
+            shared = pool->shared;
+            cache->tail->next = shared;
+        } while(!__sync_bool_compare_and_swap(&pool->shared, shared, cache->head));
+        cache->head = NULL;
+        cache->tail = NULL;
+        cache->count = 0;
+    }
+}
+
+#endif
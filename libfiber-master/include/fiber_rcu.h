@@ -0,0 +1,108 @@
+/*
+ * Copyright (c) 2012-2015, Brian Watling and other contributors
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#ifndef _FIBER_RCU_H_
+#define _FIBER_RCU_H_
+
+/*
+    Author: Brian Watling
+    Email: brianwatling@hotmail.com
+    Website: https://github.com/brianwatling
+
+    Description: Read-copy-update for fibers. Fibers are only switched when
+                 they yield, so a fiber which doesn't yield between
+                 fiber_rcu_read_lock() and fiber_rcu_read_unlock() can't be
+                 reading shared data whenever its manager is in the scheduler.
+                 Each manager records such a quiescent state every time a fiber
+                 yields (and while it's idle). A grace period ends once every
+                 manager has passed through one, after which no reader can
+                 still hold a pointer which was unpublished before it began.
+
+                 Readers pay nothing: the read lock and unlock compile away. A
+                 read-side section must not yield or block. Writers publish a
+                 new version with fiber_rcu_assign_pointer() and then either
+                 wait for readers of the old one with fiber_rcu_synchronize() or
+                 have it freed later with fiber_rcu_call(). Writers must
+                 serialize among themselves (with a fiber_mutex, for example).
+*/
+
+#include "fiber_manager.h"
+
+typedef struct fiber_rcu_head fiber_rcu_head_t;
+
+typedef void (*fiber_rcu_callback_t)(fiber_rcu_head_t* head);
+
+//embed one in an object to have it reclaimed by fiber_rcu_call()
+struct fiber_rcu_head
+{
+    fiber_rcu_head_t* next;
+    fiber_rcu_callback_t callback;
+};
+
+//bumped by each grace period which starts; managers copy it into rcu_epoch at each quiescent state
+extern volatile uint64_t fiber_rcu_epoch;
+
+#define fiber_rcu_read_lock() do {} while(0)
+
+#define fiber_rcu_read_unlock() do {} while(0)
+
+//loads an RCU-protected pointer inside a read-side section
+#define fiber_rcu_dereference(p) ({ \
+    __typeof__(p) _fiber_rcu_p = *(__typeof__(p) volatile*)&(p); \
+    load_load_barrier(); \
+    _fiber_rcu_p; \
+})
+
+//publishes 'v' to readers. everything written to *v beforehand is visible to a reader which loads it
+#define fiber_rcu_assign_pointer(p, v) do { \
+    write_barrier(); \
+    *(__typeof__(p) volatile*)&(p) = (v); \
+} while(0)
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//waits until every read-side section which was running when this was called has finished. not a cancellation point
+extern void fiber_rcu_synchronize();
+
+//calls 'callback' with 'head' once a grace period has passed. callbacks are batched per manager and run by that manager
+//at a later quiescent state, so they must not yield or block. the order they run in is unspecified
+extern void fiber_rcu_call(fiber_rcu_head_t* head, fiber_rcu_callback_t callback);
+
+//called by the manager at each quiescent state. returns quickly unless a grace period has started or callbacks are pending
+extern void fiber_rcu_quiescent_slow(fiber_manager_t* manager);
+
+static inline void fiber_rcu_quiescent(fiber_manager_t* manager)
+{
+    if(manager->rcu_epoch != fiber_rcu_epoch || manager->rcu_waiting || manager->rcu_next) {
+        fiber_rcu_quiescent_slow(manager);
+    }
+}
+
+//called by an idle manager before it blocks and after it wakes. a blocked manager runs no readers, so grace periods
+//don't wait for it
+extern void fiber_rcu_enter_idle(fiber_manager_t* manager);
+
+extern void fiber_rcu_exit_idle(fiber_manager_t* manager);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
@@ -43,6 +43,8 @@ typedef struct fiber_rwlock
     fiber_rwlock_state_t state;
     mpsc_fifo_t write_waiters;
     mpsc_fifo_t read_waiters;
+    volatile int write_tokens;//see fiber_manager_wait_in_mpsc_queue_with_tokens()
+    volatile int read_tokens;
 } fiber_rwlock_t;
 
 #ifdef __cplusplus
@@ -0,0 +1,78 @@
+/*
+ * Copyright (c) 2012-2015, Brian Watling and other contributors
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _FIBER_SCOPE_H_
+#define _FIBER_SCOPE_H_
+
+/*
+    Author: Brian Watling
+    Email: brianwatling@hotmail.com
+    Website: https://github.com/brianwatling
+*/
+
+#include <time.h>
+#include "fiber_manager.h"
+#include "fiber_signal.h"
+#include "fiber_spinlock.h"
+
+//a scope owns the fibers spawned into it. fiber_scope_wait() waits for all of them with a single wake-up
+//instead of joining each one, and a failing child (or a missed deadline) cancels the rest (see fiber_cancel())
+
+//a scoped function returns FIBER_SUCCESS, or FIBER_ERROR to fail the scope
+typedef int (*fiber_scope_function_t)(void* param);
+
+typedef struct fiber_scope_child fiber_scope_child_t;
+
+typedef struct fiber_scope
+{
+    fiber_spinlock_t lock;
+    fiber_scope_child_t* children;//the children which are still running, protected by lock
+    volatile int remaining;
+    volatile int canceled;
+    fiber_signal_t done;
+} fiber_scope_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+extern int fiber_scope_init(fiber_scope_t* scope);
+
+//the scope must have been waited on; there can't be any children left
+extern int fiber_scope_destroy(fiber_scope_t* scope);
+
+//starts a fiber running 'fn' in 'scope'. a child may spawn more children into its own scope.
+//if the scope has already been canceled the child starts out canceled
+extern int fiber_scope_spawn(fiber_scope_t* scope, size_t stack_size, fiber_scope_function_t fn, void* param);
+
+//cancels every child which is still running
+extern int fiber_scope_cancel(fiber_scope_t* scope);
+
+//waits until every child has finished. only one fiber may wait on a scope at a time.
+//returns FIBER_ERROR with errno set to ECANCELED if a child failed or the scope was canceled;
+//the scope can be re-used once this returns
+extern int fiber_scope_wait(fiber_scope_t* scope);
+
+//like fiber_scope_wait(), but cancels the remaining children once 'deadline' (CLOCK_MONOTONIC) passes.
+//the children still have to finish before this returns, after which errno is set to ETIMEDOUT
+extern int fiber_scope_wait_timed(fiber_scope_t* scope, const struct timespec* deadline);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
@@ -0,0 +1,113 @@
+/*
+ * Copyright (c) 2012-2015, Brian Watling and other contributors
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _FIBER_SELECT_H_
+#define _FIBER_SELECT_H_
+
+/*
+    Author: Brian Watling
+    Email: brianwatling@hotmail.com
+    Website: https://github.com/brianwatling
+*/
+
+#include <assert.h>
+#include <time.h>
+#include "fiber_manager.h"
+#include "fiber_channel.h"
+#include "fiber_event.h"
+
+//fiber_select() waits on several channels and fds at once and completes exactly one case. each case registers a
+//waiter which shares a token with the others; the first waker to claim the token wakes the fiber and the rest
+//are deregistered. a selected channel must have been created with a signal, and as with a plain receive the
+//selecting fiber must be the channel's only receiver. a closed channel completes its case straight away with 'closed'
+//set (see fiber_bounded_channel_close())
+
+#define FIBER_SELECT_RECEIVE (1)
+#define FIBER_SELECT_SEND (2)
+#define FIBER_SELECT_UNBOUNDED_RECEIVE (3)
+#define FIBER_SELECT_FD (4)
+
+typedef struct fiber_select_case
+{
+    int type;
+    void* channel;
+    void* message;//the message to send, or the message received
+    int closed;//set if the case completed because its channel is closed (and drained, for receives)
+    int fd;
+    uint32_t events;
+    //used by fiber_select() while it's waiting
+    fiber_waiter_t* waiter;
+    fiber_timeout_t watch;
+} fiber_select_case_t;
+
+static inline void fiber_select_case_receive(fiber_select_case_t* c, fiber_bounded_channel_t* channel)
+{
+    assert(c);
+    assert(channel && channel->ready_signal);
+    c->type = FIBER_SELECT_RECEIVE;
+    c->channel = channel;
+    c->message = NULL;
+    c->closed = 0;
+}
+
+static inline void fiber_select_case_send(fiber_select_case_t* c, fiber_bounded_channel_t* channel, void* message)
+{
+    assert(c);
+    //a slot handed to a losing send case is passed on by raising the signal (see fiber_select_deregister())
+    assert(channel && channel->ready_signal);
+    assert(message);
+    c->type = FIBER_SELECT_SEND;
+    c->channel = channel;
+    c->message = message;
+    c->closed = 0;
+}
+
+//the message received is a fiber_unbounded_channel_message_t
+static inline void fiber_select_case_unbounded_receive(fiber_select_case_t* c, fiber_unbounded_channel_t* channel)
+{
+    assert(c);
+    assert(channel && channel->ready_signal);
+    c->type = FIBER_SELECT_UNBOUNDED_RECEIVE;
+    c->channel = channel;
+    c->message = NULL;
+    c->closed = 0;
+}
+
+//ready once 'fd' can perform the operation(s) specified by events (FIBER_POLL_IN/FIBER_POLL_OUT) or is closed
+static inline void fiber_select_case_fd(fiber_select_case_t* c, int fd, uint32_t events)
+{
+    assert(c);
+    assert(fd >= 0);
+    c->type = FIBER_SELECT_FD;
+    c->closed = 0;
+    c->fd = fd;
+    c->events = events;
+}
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//completes one of the 'count' cases and returns its index. channel cases are tried in order before blocking, so
+//earlier cases win ties; an fd case is only seen to be ready once the select has blocked. returns -1 with errno set
+//to ETIMEDOUT if 'deadline' (CLOCK_MONOTONIC, NULL for none) passes first, or ECANCELED if the fiber is canceled
+extern int fiber_select(fiber_select_case_t* cases, int count, const struct timespec* deadline);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -23,12 +23,14 @@
     Website: https://github.com/brianwatling
 */
 
+#include <time.h>
 #include "mpmc_fifo.h"
 
 typedef struct fiber_semaphore
 {
     volatile int counter;
     mpmc_fifo_t waiters;
+    volatile int collecting;//1 while a fiber in fiber_semaphore_wait_n() takes its permits one at a time
 } fiber_semaphore_t;
 
 #ifdef __cplusplus
@@ -39,12 +41,31 @@ extern int fiber_semaphore_init(fiber_semaphore_t* semaphore, int value);
 
 extern int fiber_semaphore_destroy(fiber_semaphore_t* semaphore);
 
+//a cancellation point: returns FIBER_ERROR with errno set to ECANCELED if the fiber is canceled while waiting
 extern int fiber_semaphore_wait(fiber_semaphore_t* semaphore);
 
+//returns FIBER_ERROR with errno set to ETIMEDOUT if the semaphore isn't acquired by 'deadline' (CLOCK_MONOTONIC)
+extern int fiber_semaphore_wait_timed(fiber_semaphore_t* semaphore, const struct timespec* deadline);
+
 extern int fiber_semaphore_trywait(fiber_semaphore_t* semaphore);
 
+//acquires 'count' permits. if they aren't all available the fiber queues for them one at a time, and only one fiber
+//collects at once so two of them can't deadlock each holding part of what they need. a cancellation point: returns
+//FIBER_ERROR with errno set to ECANCELED (and none of the permits) if the fiber is canceled while waiting
+extern int fiber_semaphore_wait_n(fiber_semaphore_t* semaphore, int count);
+
+//as fiber_semaphore_post() but never yields to a woken waiter. returns 1 if a waiter was woken
+extern int fiber_semaphore_post_internal(fiber_semaphore_t* semaphore);
+
 extern int fiber_semaphore_post(fiber_semaphore_t* semaphore);
 
+//releases 'count' permits, waking up to 'count' waiters and updating the counter once. never yields. returns the
+//number of waiters woken
+extern int fiber_semaphore_post_n_internal(fiber_semaphore_t* semaphore, int count);
+
+//as fiber_semaphore_post() for 'count' permits. yields once if any waiter was woken
+extern int fiber_semaphore_post_n(fiber_semaphore_t* semaphore, int count);
+
 extern int fiber_semaphore_getvalue(fiber_semaphore_t* semaphore);
 
 #ifdef __cplusplus
@@ -25,10 +25,12 @@
 
 #include <assert.h>
 #include <stdint.h>
+#include <errno.h>
 
 #include "fiber.h"
 #include "machine_specific.h"
 
+//waiter is a fiber, or a tagged fiber_waiter_t entry left by fiber_select()
 typedef struct fiber_signal
 {
     fiber_t* waiter;
@@ -49,12 +51,36 @@ static inline void fiber_signal_destroy(fiber_signal_t* s)
     //empty
 }
 
-static inline void fiber_signal_wait(fiber_signal_t* s)
+//fired by a timeout or by fiber_cancel() to take the waiting fiber off the signal
+static inline void fiber_signal_abandon(fiber_timeout_t* timeout)
+{
+    fiber_signal_t* const s = (fiber_signal_t*)timeout->data;
+    fiber_t* const to_wake = s->waiter;
+    //there's only one waiter, so if a fiber is still registered it's the one this timeout belongs to
+    if(to_wake != FIBER_SIGNAL_NO_WAITER && to_wake != FIBER_SIGNAL_RAISED
+       && __sync_bool_compare_and_swap(&s->waiter, to_wake, FIBER_SIGNAL_NO_WAITER)) {
+        timeout->expired = 1;
+        fiber_manager_t* const manager = fiber_manager_get();
+        while(to_wake->scratch != FIBER_SIGNAL_READY_TO_WAKE) {
+            cpu_relax();//the other fiber is still in the process of going to sleep
+            manager->signal_spin_count += 1;
+        }
+        to_wake->state = FIBER_STATE_READY;
+        fiber_manager_schedule(manager, to_wake);
+    }
+}
+
+//returns 1 once the signal is raised, or 0 with errno set to ECANCELED if the fiber is canceled (see fiber_cancel())
+static inline int fiber_signal_wait(fiber_signal_t* s)
 {
     assert(s);
 
     fiber_manager_t* const manager = fiber_manager_get();
     fiber_t* const this_fiber = manager->current_fiber;
+    fiber_timeout_t cancel_point;
+    if(!fiber_manager_arm_cancel(manager, &cancel_point, &fiber_signal_abandon, s)) {
+        return 0;
+    }
     this_fiber->scratch = NULL;//clear scratch before marking this fiber to be signalled
     if(__sync_bool_compare_and_swap(&s->waiter, FIBER_SIGNAL_NO_WAITER, this_fiber)) {
         //the signal is not raised, we're now waiting
@@ -65,9 +91,59 @@ static inline void fiber_signal_wait(fiber_signal_t* s)
         manager->set_wait_value = FIBER_SIGNAL_READY_TO_WAKE;
         fiber_manager_yield(manager);
         this_fiber->scratch = NULL;
+        if(!fiber_manager_disarm_cancel(&cancel_point)) {
+            //a raise since then must stay pending
+            return 0;
+        }
+    } else {
+        fiber_manager_abort_cancel(manager, &cancel_point);
     }
     //the signal has been raised
     s->waiter = FIBER_SIGNAL_NO_WAITER;
+    return 1;
+}
+
+//returns 1 if the signal was raised, 0 (with errno set to ETIMEDOUT or ECANCELED) if 'deadline' passed or the fiber was canceled first
+static inline int fiber_signal_wait_timed(fiber_signal_t* s, const struct timespec* deadline)
+{
+    assert(s);
+    assert(deadline);
+
+    fiber_manager_t* const manager = fiber_manager_get();
+    fiber_t* const this_fiber = manager->current_fiber;
+    fiber_timeout_t cancel_point;
+    if(!fiber_manager_arm_cancel(manager, &cancel_point, &fiber_signal_abandon, s)) {
+        return 0;
+    }
+    this_fiber->scratch = NULL;//clear scratch before marking this fiber to be signalled
+    if(__sync_bool_compare_and_swap(&s->waiter, FIBER_SIGNAL_NO_WAITER, this_fiber)) {
+        //the signal is not raised, we're now waiting
+        assert(this_fiber->state == FIBER_STATE_RUNNING);
+        this_fiber->state = FIBER_STATE_WAITING;
+        manager->set_wait_location = (void**)&this_fiber->scratch;
+        manager->set_wait_value = FIBER_SIGNAL_READY_TO_WAKE;
+        fiber_timeout_t timeout;
+        timeout.callback = &fiber_signal_abandon;
+        timeout.data = s;
+        timeout.expired = 0;
+        fiber_timeout_start(&timeout, deadline);
+        fiber_manager_yield(manager);
+        this_fiber->scratch = NULL;
+        fiber_timeout_stop(&timeout);
+        if(!fiber_manager_disarm_cancel(&cancel_point)) {
+            return 0;
+        }
+        if(timeout.expired) {
+            //the timeout took us off the signal; a raise since then must stay pending
+            errno = ETIMEDOUT;
+            return 0;
+        }
+    } else {
+        fiber_manager_abort_cancel(manager, &cancel_point);
+    }
+    //the signal has been raised
+    s->waiter = FIBER_SIGNAL_NO_WAITER;
+    return 1;
 }
 
 //returns 1 if a fiber was woken
@@ -76,19 +152,23 @@ static inline int fiber_signal_raise(fiber_signal_t* s)
     assert(s);
 
     fiber_t* const old = (fiber_t*)atomic_exchange_pointer((void**)&s->waiter, FIBER_SIGNAL_RAISED);
-    if(old != FIBER_SIGNAL_NO_WAITER && old != FIBER_SIGNAL_RAISED) {
-        //we successfully signalled while a fiber was waiting
-        s->waiter = FIBER_SIGNAL_NO_WAITER;
-        fiber_manager_t* const manager = fiber_manager_get();
-        while(old->scratch != FIBER_SIGNAL_READY_TO_WAKE) {
-            cpu_relax();//the other fiber is still in the process of going to sleep
-            manager->signal_spin_count += 1;
-        }
-        old->state = FIBER_STATE_READY;
-        fiber_manager_schedule(manager, old);
-        return 1;
+    if(old == FIBER_SIGNAL_NO_WAITER || old == FIBER_SIGNAL_RAISED) {
+        return 0;
     }
-    return 0;
+    if(fiber_waiter_from_entry(old)) {
+        //a fiber_select() is waiting. the signal stays raised; the selecting fiber clears it when it deregisters
+        return fiber_manager_wake_entry(fiber_manager_get(), old);
+    }
+    //we successfully signalled while a fiber was waiting
+    s->waiter = FIBER_SIGNAL_NO_WAITER;
+    fiber_manager_t* const manager = fiber_manager_get();
+    while(old->scratch != FIBER_SIGNAL_READY_TO_WAKE) {
+        cpu_relax();//the other fiber is still in the process of going to sleep
+        manager->signal_spin_count += 1;
+    }
+    old->state = FIBER_STATE_READY;
+    fiber_manager_schedule(manager, old);
+    return 1;
 }
 
 typedef union fiber_multi_signal
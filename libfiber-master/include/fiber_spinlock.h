@@ -22,27 +22,41 @@
     Email: brianwatling@hotmail.com
     Website: https://github.com/brianwatling
 
-    Description: A spin lock for fibers, based on the ticket lock algorithm
-                 found at http://locklessinc.com/articles/locks/. This is meant
-                 to be used in places where a fiber does not want to or cannot
-                 perform a context switch.
+    Description: A spin lock for fibers, based on the queued (MCS) lock
+                 found in "Algorithms for Scalable Synchronization on Shared-Memory
+                 Multiprocessors" (Mellor-Crummey and Scott) as refined by Linux's
+                 qspinlock. This is meant to be used in places where a fiber does
+                 not want to or cannot perform a context switch.
+
+                 An uncontended lock is a single compare-and-swap. Contending fibers
+                 queue up in FIFO order and each spins on its manager's own node (see
+                 fiber_manager_t), so an unlock doesn't invalidate every spinner's
+                 cache line - only the fiber at the head of the queue watches the lock
+                 word. A fiber's node is released as soon as it takes the lock, so a
+                 manager needs just the one (a fiber never waits for two spin locks at
+                 once) and unlocking is a plain store.
+
+                 A fiber which has spun for a while gives its thread's CPU away, since
+                 the fiber it's waiting on may belong to a thread which was preempted.
 */
 
 #include <stddef.h>
 #include <stdint.h>
+#include "machine_specific.h"
+
+#define FIBER_SPINLOCK_SPINS_BEFORE_YIELD (1000)
 
-typedef union
+typedef struct fiber_spinlock_node
 {
-    struct {
-        uint32_t ticket;
-        uint32_t users;
-    } __attribute__ ((packed)) counters;
-    uint64_t blob;
-} __attribute__ ((packed)) fiber_spinlock_internal_t;
+    struct fiber_spinlock_node* volatile next;
+    volatile int waiting;
+    char _cache_padding1[CACHE_SIZE - sizeof(void*) - sizeof(int)];
+} fiber_spinlock_node_t;
 
 typedef struct fiber_spinlock
 {
-    fiber_spinlock_internal_t state;
+    volatile uint32_t locked;
+    fiber_spinlock_node_t* volatile tail;//the last fiber queued for the lock
 } fiber_spinlock_t;
 
 #ifdef __cplusplus
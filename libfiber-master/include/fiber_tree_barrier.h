@@ -0,0 +1,85 @@
+/*
+ * Copyright (c) 2012-2015, Brian Watling and other contributors
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _FIBER_TREE_BARRIER_H_
+#define _FIBER_TREE_BARRIER_H_
+
+/*
+    Author: Brian Watling
+    Email: brianwatling@hotmail.com
+    Website: https://github.com/brianwatling
+
+    Description: A barrier for large numbers of fibers spread over many
+                 managers, combining arrivals in two levels. A fiber arriving
+                 at the barrier counts itself in its manager's slot and, unless
+                 it's the first one there, waits on that slot. The first fiber
+                 lets the others on its manager catch up and then carries the
+                 whole batch to the root in one atomic add, so the root sees
+                 about one add per manager rather than one per fiber.
+
+                 The batch carriers wait for the root to release them, spinning
+                 (by yielding) for a while first, and then release the fibers
+                 waiting on their own slots. Waking is spread across the
+                 managers instead of one fiber waking everyone through a single
+                 queue, and a carrier that didn't have to sleep wakes its slot's
+                 fibers on their own manager. fiber_barrier_t is simpler and
+                 fine for small counts.
+*/
+
+#include "machine_specific.h"
+#include "fiber_barrier.h"
+#include "mpsc_fifo.h"
+
+//how many times a batch carrier yields while waiting for the root before it sleeps
+#define FIBER_TREE_BARRIER_MAX_SPIN (1000)
+
+typedef struct fiber_tree_barrier_slot
+{
+    volatile int pending;//arrivals not yet carried to the root
+    char _cache_padding1[CACHE_SIZE - sizeof(int)];
+    //indexed by the phase's parity, so a fiber already in the next phase is never woken by this one's release
+    mpsc_fifo_t waiters[2];
+    volatile int wake_tokens[2];//see fiber_manager_wait_in_mpsc_queue_with_tokens()
+    volatile int to_wake[2];//waiters counted into the phase. whoever takes it does the waking
+} fiber_tree_barrier_slot_t;
+
+typedef struct fiber_tree_barrier
+{
+    intptr_t count;
+    volatile intptr_t arrived;//carried to the root so far in this phase
+    volatile int phase;//bumped when everyone has arrived
+    int slot_count;
+    fiber_tree_barrier_slot_t* slots;//one per manager
+} fiber_tree_barrier_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//call after fiber_manager_init(); one slot is allocated per manager
+extern int fiber_tree_barrier_init(fiber_tree_barrier_t* barrier, uint32_t count);
+
+extern void fiber_tree_barrier_destroy(fiber_tree_barrier_t* barrier);
+
+//returns FIBER_BARRIER_SERIAL_FIBER in exactly one of the fibers released, 0 in the others
+extern int fiber_tree_barrier_wait(fiber_tree_barrier_t* barrier);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
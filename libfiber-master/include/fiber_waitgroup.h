@@ -0,0 +1,66 @@
+/*
+ * Copyright (c) 2012-2015, Brian Watling and other contributors
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _FIBER_WAITGROUP_H_
+#define _FIBER_WAITGROUP_H_
+
+/*
+    Author: Brian Watling
+    Email: brianwatling@hotmail.com
+    Website: https://github.com/brianwatling
+
+    Description: A wait group (a latch, or countdown) for fan-in. fiber_waitgroup_add()
+                 counts outstanding work, fiber_waitgroup_done() counts it off and
+                 fiber_waitgroup_wait() blocks until the count reaches zero. The count is
+                 a single atomic: done() is a plain atomic decrement unless it's the last
+                 one, which raises a fiber_multi_signal_t. Each woken waiter raises it
+                 again for the next one, so any number of fibers can wait.
+
+                 Like fiber_barrier_wait(), waiting is not a cancellation point.
+*/
+
+#include "fiber_manager.h"
+#include "fiber_signal.h"
+
+typedef struct fiber_waitgroup
+{
+    fiber_multi_signal_t signal;
+    volatile intptr_t counter;
+} fiber_waitgroup_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+extern int fiber_waitgroup_init(fiber_waitgroup_t* waitgroup, intptr_t count);
+
+extern void fiber_waitgroup_destroy(fiber_waitgroup_t* waitgroup);
+
+//'count' may be negative, but the total must never drop below zero. a wait group can be reused once every
+//fiber_waitgroup_wait() from the previous round has returned
+extern int fiber_waitgroup_add(fiber_waitgroup_t* waitgroup, intptr_t count);
+
+extern int fiber_waitgroup_done(fiber_waitgroup_t* waitgroup);
+
+extern int fiber_waitgroup_wait(fiber_waitgroup_t* waitgroup);
+
+extern intptr_t fiber_waitgroup_getvalue(fiber_waitgroup_t* waitgroup);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
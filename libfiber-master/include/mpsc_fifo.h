@@ -53,6 +53,17 @@ static inline int mpsc_fifo_init(mpsc_fifo_t* f)
     return 1;
 }
 
+//as mpsc_fifo_init() but the FIFO starts with 'dummy' (which it owns) instead of allocating its own. the node returned by
+//each pop is the previous dummy, so a caller which recycles popped nodes can keep them all the same size
+static inline void mpsc_fifo_init_with_node(mpsc_fifo_t* f, mpsc_fifo_node_t* dummy)
+{
+    assert(f);
+    assert(dummy);
+    dummy->next = NULL;
+    f->tail = dummy;
+    f->head = dummy;
+}
+
 static inline void mpsc_fifo_destroy(mpsc_fifo_t* f)
 {
     if(f) {
@@ -75,6 +86,18 @@ static inline void mpsc_fifo_push(mpsc_fifo_t* f, mpsc_fifo_node_t* new_node)
     prev_tail->next = new_node;
 }
 
+//pushes the nodes from 'first' to 'last' (already linked through next) with a single exchange. the FIFO owns the nodes after pushing
+static inline void mpsc_fifo_push_chain(mpsc_fifo_t* f, mpsc_fifo_node_t* first, mpsc_fifo_node_t* last)
+{
+    assert(f);
+    assert(first);
+    assert(last);
+    last->next = NULL;
+    write_barrier();//the chain must be terminated before it's visible to the reader
+    mpsc_fifo_node_t* const prev_tail = (mpsc_fifo_node_t*)atomic_exchange_pointer((void**)&f->tail, last);
+    prev_tail->next = first;
+}
+
 //returns 1 if a node is available, 0 otherwise
 static inline int mpsc_fifo_peek(mpsc_fifo_t* f, void** data)
 {
@@ -62,6 +62,17 @@ static inline int spsc_fifo_init(spsc_fifo_t* f)
     return 1;
 }
 
+//as spsc_fifo_init() but the FIFO starts with 'dummy' (which it owns) instead of allocating its own. the node returned by
+//each pop is the previous dummy, so a caller which recycles popped nodes can keep them all the same size
+static inline void spsc_fifo_init_with_node(spsc_fifo_t* f, spsc_node_t* dummy)
+{
+    assert(f);
+    assert(dummy);
+    dummy->next = NULL;
+    f->tail = dummy;
+    f->head = dummy;
+}
+
 static inline void spsc_fifo_destroy(spsc_fifo_t* f)
 {
     if(f) {
@@ -85,6 +96,19 @@ static inline void spsc_fifo_push(spsc_fifo_t* f, spsc_node_t* new_node)
     prev_tail->next = new_node;
 }
 
+//pushes the nodes from 'first' to 'last' (already linked through next). the FIFO owns the nodes after pushing
+static inline void spsc_fifo_push_chain(spsc_fifo_t* f, spsc_node_t* first, spsc_node_t* last)
+{
+    assert(f);
+    assert(first);
+    assert(last);
+    last->next = NULL;
+    write_barrier();//the chain must be terminated before it's visible to the reader
+    spsc_node_t* const prev_tail = f->tail;
+    f->tail = last;
+    prev_tail->next = first;
+}
+
 //the caller owns the node after popping
 static inline spsc_node_t* spsc_fifo_trypop(spsc_fifo_t* f)
 {
@@ -25,6 +25,29 @@
 #include <assert.h>
 #include <unistd.h>
 
+//wakes a fiber waiting in fiber_join() or fiber_join_timed(). returns 0 if the joiner had already timed out
+static int fiber_wake_joiner(fiber_manager_t* manager, void* joiner, void* result)
+{
+    fiber_waiter_t* const waiter = fiber_waiter_from_entry(joiner);
+    if(!waiter) {
+        fiber_t* const to_schedule = (fiber_t*)joiner;
+        to_schedule->result = result;
+        to_schedule->state = FIBER_STATE_READY;
+        fiber_manager_schedule(manager, to_schedule);
+        return 1;
+    }
+
+    fiber_t* const to_schedule = waiter->fiber;
+    if(!__sync_bool_compare_and_swap(&waiter->state, FIBER_WAITER_WAITING, FIBER_WAITER_WOKEN)) {
+        //the joiner gave up and left the waiter for us to release
+        fiber_manager_return_waiter(waiter);
+        return 0;
+    }
+    to_schedule->result = result;
+    fiber_manager_wake_entry(manager, to_schedule);
+    return 1;
+}
+
 void fiber_join_routine(fiber_t* the_fiber, void* result)
 {
     the_fiber->result = result;
@@ -37,10 +60,11 @@ void fiber_join_routine(fiber_t* the_fiber, void* result)
             fiber_manager_set_and_wait(fiber_manager_get(), (void**)&the_fiber->join_info, the_fiber);
         } else if(old_state == FIBER_DETACH_WAIT_TO_JOIN) {
             //the joining fiber is waiting for us to finish
-            fiber_t* const to_schedule = fiber_manager_clear_or_wait(fiber_manager_get(), (void**)&the_fiber->join_info);
-            to_schedule->result = the_fiber->result;
-            to_schedule->state = FIBER_STATE_READY;
-            fiber_manager_schedule(fiber_manager_get(), to_schedule);
+            void* const joiner = fiber_manager_clear_or_wait(fiber_manager_get(), (void**)&the_fiber->join_info);
+            if(!fiber_wake_joiner(fiber_manager_get(), joiner, the_fiber->result)) {
+                //the joiner timed out; wait for another one
+                fiber_manager_set_and_wait(fiber_manager_get(), (void**)&the_fiber->join_info, the_fiber);
+            }
         }
     }
 
@@ -101,6 +125,8 @@ fiber_t* fiber_create_no_sched(size_t stack_size, fiber_run_function_t run_funct
     ret->detach_state = FIBER_DETACH_NONE;
     ret->join_info = NULL;
     ret->result = NULL;
+    ret->cancel_point = NULL;
+    ret->cancel_pending = 0;
     ret->id += 1;
     if(FIBER_SUCCESS != fiber_context_init(&ret->context, stack_size, &fiber_go_function, ret)) {
         free(ret);
@@ -183,6 +209,63 @@ int fiber_join(fiber_t* f, void** result)
     return FIBER_SUCCESS;
 }
 
+int fiber_join_timed(fiber_t* f, void** result, const struct timespec* deadline)
+{
+    assert(f);
+    assert(deadline);
+    if(result) {
+        *result = NULL;
+    }
+    if(f->detach_state == FIBER_DETACH_DETACHED) {
+        return FIBER_ERROR;
+    }
+
+    const int old_state = atomic_exchange_int((int*)&f->detach_state, FIBER_DETACH_WAIT_TO_JOIN);
+    if(old_state == FIBER_DETACH_NONE) {
+        //need to wait till the fiber finishes. SAVING_STATE_TO_WAIT lets us publish join_info before switching away
+        fiber_manager_t* const manager = fiber_manager_get();
+        fiber_t* const current_fiber = manager->current_fiber;
+        fiber_waiter_t* const waiter = fiber_manager_get_waiter(current_fiber);
+        current_fiber->state = FIBER_STATE_SAVING_STATE_TO_WAIT;
+        write_barrier();
+        f->join_info = (fiber_t*)fiber_waiter_to_entry(waiter);
+        fiber_timeout_t timeout;
+        fiber_manager_start_waiter_timeout(&timeout, waiter, deadline);
+        fiber_manager_yield(manager);
+        if(!fiber_manager_stop_waiter_timeout(&timeout)) {
+            //withdraw. if the fiber is already finishing it's waiting for join_info - hand the waiter back
+            //so it can see we gave up (it releases the waiter and waits for another joiner)
+            void* const entry = atomic_exchange_pointer((void**)&f->join_info, NULL);
+            if(entry) {
+                if(__sync_bool_compare_and_swap(&f->detach_state, FIBER_DETACH_WAIT_TO_JOIN, FIBER_DETACH_NONE)) {
+                    fiber_manager_return_waiter(waiter);
+                } else {
+                    atomic_exchange_pointer((void**)&f->join_info, entry);
+                }
+            }
+            return FIBER_ERROR;
+        }
+        fiber_manager_return_waiter(waiter);
+        if(result) {
+            *result = current_fiber->result;
+        }
+        current_fiber->result = NULL;
+    } else if(old_state == FIBER_DETACH_WAIT_FOR_JOINER) {
+        //the other fiber is waiting for us to join
+        if(result) {
+            *result = f->result;
+        }
+        fiber_t* const to_schedule = fiber_manager_clear_or_wait(fiber_manager_get(), (void**)&f->join_info);
+        to_schedule->state = FIBER_STATE_READY;
+        fiber_manager_schedule(fiber_manager_get(), to_schedule);
+    } else {
+        //it's either WAIT_TO_JOIN or DETACHED - that's an error!
+        return FIBER_ERROR;
+    }
+
+    return FIBER_SUCCESS;
+}
+
 int fiber_tryjoin(fiber_t* f, void** result)
 {
     assert(f);
@@ -226,18 +309,39 @@ int fiber_detach(fiber_t* f)
         return FIBER_ERROR;
     }
     const int old_state = atomic_exchange_int((int*)&f->detach_state, FIBER_DETACH_DETACHED);
-    if(old_state == FIBER_DETACH_WAIT_FOR_JOINER
-       || old_state == FIBER_DETACH_WAIT_TO_JOIN) {
-        //wake up the fiber or the fiber trying to join it (this second case is a convenience, pthreads specifies undefined behaviour in that case)
+    if(old_state == FIBER_DETACH_WAIT_FOR_JOINER) {
+        //wake up the fiber
         fiber_t* const to_schedule = fiber_manager_clear_or_wait(fiber_manager_get(), (void**)&f->join_info);
         to_schedule->state = FIBER_STATE_READY;
         fiber_manager_schedule(fiber_manager_get(), to_schedule);
+    } else if(old_state == FIBER_DETACH_WAIT_TO_JOIN) {
+        //wake up the fiber trying to join it (this is a convenience, pthreads specifies undefined behaviour in that case)
+        void* const joiner = fiber_manager_clear_or_wait(fiber_manager_get(), (void**)&f->join_info);
+        fiber_wake_joiner(fiber_manager_get(), joiner, NULL);
     } else if(old_state == FIBER_DETACH_DETACHED) {
         return FIBER_ERROR;
     }
     return FIBER_SUCCESS;
 }
 
+int fiber_cancel(fiber_t* f)
+{
+    if(!f) {
+        return FIBER_ERROR;
+    }
+    fiber_spinlock_lock(&f->cancel_lock);
+    fiber_timeout_t* const point = f->cancel_point;
+    if(point) {
+        point->callback(point);
+    }
+    if(!point || !point->expired) {
+        //not blocked (or just woken by something else) - deliver at the next cancellation point
+        f->cancel_pending = 1;
+    }
+    fiber_spinlock_unlock(&f->cancel_lock);
+    return FIBER_SUCCESS;
+}
+
 void fiber_change(size_t index)
 {
     printf("API\n");
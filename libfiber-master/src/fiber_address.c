@@ -0,0 +1,171 @@
+/*
+ * Copyright (c) 2012-2015, Brian Watling and other contributors
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include "fiber_address.h"
+#include "fiber_manager.h"
+#include "fiber_spinlock.h"
+#include <errno.h>
+
+//lives on the waiting fiber's stack
+typedef struct fiber_address_waiter
+{
+    volatile int* address;
+    fiber_waiter_t* waiter;
+    struct fiber_address_waiter* prev;
+    struct fiber_address_waiter* next;
+    int queued;//protected by the bucket's lock
+} fiber_address_waiter_t;
+
+typedef struct fiber_address_bucket
+{
+    fiber_spinlock_t lock;
+    //fibers which are queued or about to check their value. lets a wake skip a bucket nobody is waiting in
+    volatile int waiters;
+    fiber_address_waiter_t* head;//protected by lock
+    fiber_address_waiter_t* tail;//protected by lock
+    char _cache_padding1[CACHE_SIZE - sizeof(fiber_spinlock_t) - sizeof(int) - 2 * sizeof(fiber_address_waiter_t*)];
+} fiber_address_bucket_t;
+
+static fiber_address_bucket_t fiber_address_buckets[FIBER_ADDRESS_BUCKETS];
+
+static inline fiber_address_bucket_t* fiber_address_get_bucket(volatile int* address)
+{
+    const uint32_t hash = (uint32_t)((uintptr_t)address >> 2) * 2654435761u;
+    return &fiber_address_buckets[(hash >> 16) & (FIBER_ADDRESS_BUCKETS - 1)];
+}
+
+static inline void fiber_address_push(fiber_address_bucket_t* bucket, fiber_address_waiter_t* entry)
+{
+    entry->next = NULL;
+    entry->prev = bucket->tail;
+    if(bucket->tail) {
+        bucket->tail->next = entry;
+    } else {
+        bucket->head = entry;
+    }
+    bucket->tail = entry;
+    entry->queued = 1;
+}
+
+static inline void fiber_address_remove(fiber_address_bucket_t* bucket, fiber_address_waiter_t* entry)
+{
+    if(entry->prev) {
+        entry->prev->next = entry->next;
+    } else {
+        bucket->head = entry->next;
+    }
+    if(entry->next) {
+        entry->next->prev = entry->prev;
+    } else {
+        bucket->tail = entry->prev;
+    }
+    entry->queued = 0;
+}
+
+static int fiber_wait_address_cancelable(volatile int* address, int expected, int cancelable, const struct timespec* deadline)
+{
+    assert(address);
+    fiber_manager_t* const manager = fiber_manager_get();
+    fiber_t* const this_fiber = manager->current_fiber;
+    assert(this_fiber->state == FIBER_STATE_RUNNING);
+    fiber_address_bucket_t* const bucket = fiber_address_get_bucket(address);
+
+    //counted before the value is checked. a waker changes the value before it checks the count
+    __sync_fetch_and_add(&bucket->waiters, 1);
+    fiber_spinlock_lock(&bucket->lock);
+    if(*address != expected) {
+        fiber_spinlock_unlock(&bucket->lock);
+        __sync_fetch_and_sub(&bucket->waiters, 1);
+        errno = EAGAIN;
+        return FIBER_ERROR;
+    }
+
+    fiber_address_waiter_t entry;
+    entry.address = address;
+    entry.waiter = fiber_manager_get_waiter(this_fiber);
+    fiber_timeout_t cancel_point;
+    if(cancelable && !fiber_manager_arm_cancel(manager, &cancel_point, &fiber_manager_cancel_waiter, entry.waiter)) {
+        fiber_spinlock_unlock(&bucket->lock);
+        __sync_fetch_and_sub(&bucket->waiters, 1);
+        fiber_manager_return_waiter(entry.waiter);
+        return FIBER_ERROR;
+    }
+    fiber_address_push(bucket, &entry);
+
+    this_fiber->state = FIBER_STATE_SAVING_STATE_TO_WAIT;
+    fiber_timeout_t timeout;
+    if(deadline) {
+        fiber_manager_start_waiter_timeout(&timeout, entry.waiter, deadline);
+    }
+    manager->spinlock_to_unlock = &bucket->lock;
+    fiber_manager_yield(manager);
+
+    const int timed_out = deadline && !fiber_manager_stop_waiter_timeout(&timeout);
+    const int canceled = cancelable && !fiber_manager_disarm_cancel(&cancel_point);
+    if(timed_out || canceled) {
+        //a waker unlinks an entry before claiming it, so ours may still be queued or in the hands of a waker
+        const int saved_errno = errno;
+        fiber_spinlock_lock(&bucket->lock);
+        if(entry.queued) {
+            fiber_address_remove(bucket, &entry);
+        }
+        fiber_spinlock_unlock(&bucket->lock);
+        errno = saved_errno;
+    }
+    __sync_fetch_and_sub(&bucket->waiters, 1);
+    fiber_manager_return_waiter(entry.waiter);
+    return timed_out || canceled ? FIBER_ERROR : FIBER_SUCCESS;
+}
+
+int fiber_wait_address(volatile int* address, int expected, const struct timespec* deadline)
+{
+    return fiber_wait_address_cancelable(address, expected, 1, deadline);
+}
+
+int fiber_wait_address_internal(volatile int* address, int expected, const struct timespec* deadline)
+{
+    return fiber_wait_address_cancelable(address, expected, 0, deadline);
+}
+
+int fiber_wake_address(volatile int* address, int count)
+{
+    assert(address);
+    fiber_address_bucket_t* const bucket = fiber_address_get_bucket(address);
+    //pairs with the waiter counting itself before checking its value
+    store_load_barrier();
+    if(!bucket->waiters || count <= 0) {
+        return 0;
+    }
+
+    fiber_manager_t* const manager = fiber_manager_get();
+    int woken = 0;
+    fiber_spinlock_lock(&bucket->lock);
+    fiber_address_waiter_t* entry = bucket->head;
+    while(entry && woken < count) {
+        fiber_address_waiter_t* const next = entry->next;
+        if(entry->address == address) {
+            //the entry belongs to the waiting fiber, which can return as soon as it's claimed
+            fiber_waiter_t* const waiter = entry->waiter;
+            fiber_address_remove(bucket, entry);
+            woken += fiber_manager_wake_waiter(manager, waiter);
+        }
+        entry = next;
+    }
+    fiber_spinlock_unlock(&bucket->lock);
+    return woken;
+}
+
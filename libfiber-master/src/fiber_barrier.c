@@ -23,6 +23,7 @@ int fiber_barrier_init(fiber_barrier_t* barrier, uint32_t count)
     assert(count > 0);
     barrier->count = count;
     barrier->counter = 0;
+    barrier->wake_tokens = 0;
     if(!mpsc_fifo_init(&barrier->waiters)) {
         return FIBER_ERROR;
     }
@@ -33,6 +34,8 @@ int fiber_barrier_init(fiber_barrier_t* barrier, uint32_t count)
 void fiber_barrier_destroy(fiber_barrier_t* barrier)
 {
     assert(barrier);
+    //release any entries left behind by waiters which took a token
+    fiber_manager_wake_from_mpsc_queue(fiber_manager_get(), &barrier->waiters, 0);
     mpsc_fifo_destroy(&barrier->waiters);
 }
 
@@ -42,10 +45,10 @@ int fiber_barrier_wait(fiber_barrier_t* barrier)
 
     uint64_t const new_value = __sync_add_and_fetch(&barrier->counter, 1);
     if(new_value % barrier->count == 0) {
-        fiber_manager_wake_from_mpsc_queue(fiber_manager_get(), &barrier->waiters, barrier->count - 1);
+        fiber_manager_wake_from_mpsc_queue_with_tokens(fiber_manager_get(), &barrier->waiters, &barrier->wake_tokens, barrier->count - 1);
         return FIBER_BARRIER_SERIAL_FIBER;
     } else {
-        fiber_manager_wait_in_mpsc_queue(fiber_manager_get(), &barrier->waiters);
+        fiber_manager_wait_in_mpsc_queue_with_tokens(fiber_manager_get(), &barrier->waiters, &barrier->wake_tokens, NULL, 0, NULL);
         return 0;
     }
 }
@@ -0,0 +1,149 @@
+/*
+ * Copyright (c) 2012-2015, Brian Watling and other contributors
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include "fiber_biased_rwlock.h"
+#include "fiber_address.h"
+#include "fiber_manager.h"
+#include <limits.h>
+#include <stdlib.h>
+
+int fiber_biased_rwlock_init(fiber_biased_rwlock_t* rwlock)
+{
+    assert(rwlock);
+    rwlock->slot_count = fiber_manager_get_kernel_thread_count();
+    if(rwlock->slot_count < 1) {
+        rwlock->slot_count = 1;
+    }
+    rwlock->slots = calloc(rwlock->slot_count, sizeof(*rwlock->slots));
+    if(!rwlock->slots) {
+        return FIBER_ERROR;
+    }
+    rwlock->writer = 0;
+    rwlock->drained = 0;
+    write_barrier();
+    return FIBER_SUCCESS;
+}
+
+void fiber_biased_rwlock_destroy(fiber_biased_rwlock_t* rwlock)
+{
+    if(rwlock) {
+        free(rwlock->slots);
+        rwlock->slots = NULL;
+    }
+}
+
+static inline fiber_biased_rwlock_slot_t* fiber_biased_rwlock_get_slot(fiber_biased_rwlock_t* rwlock)
+{
+    return &rwlock->slots[fiber_manager_get()->id % rwlock->slot_count];
+}
+
+static intptr_t fiber_biased_rwlock_readers(fiber_biased_rwlock_t* rwlock)
+{
+    intptr_t readers = 0;
+    int i;
+    for(i = 0; i < rwlock->slot_count; ++i) {
+        readers += rwlock->slots[i].readers;
+    }
+    return readers;
+}
+
+//called once a reader's slot has been decremented. the decrement is a full barrier, so either a draining writer sees
+//it or we see the writer
+static inline void fiber_biased_rwlock_reader_left(fiber_biased_rwlock_t* rwlock)
+{
+    if(rwlock->writer) {
+        __sync_fetch_and_add(&rwlock->drained, 1);
+        fiber_wake_address(&rwlock->drained, 1);
+    }
+}
+
+int fiber_biased_rwlock_tryrdlock(fiber_biased_rwlock_t* rwlock)
+{
+    assert(rwlock);
+    fiber_biased_rwlock_slot_t* const slot = fiber_biased_rwlock_get_slot(rwlock);
+    __sync_fetch_and_add(&slot->readers, 1);
+    if(!rwlock->writer) {
+        return FIBER_SUCCESS;
+    }
+    //a writer has revoked the bias. back out (we haven't yielded, so it's still our slot)
+    __sync_fetch_and_sub(&slot->readers, 1);
+    fiber_biased_rwlock_reader_left(rwlock);
+    return FIBER_ERROR;
+}
+
+int fiber_biased_rwlock_rdlock(fiber_biased_rwlock_t* rwlock)
+{
+    while(!fiber_biased_rwlock_tryrdlock(rwlock)) {
+        fiber_wait_address_internal(&rwlock->writer, 1, NULL);
+    }
+    return FIBER_SUCCESS;
+}
+
+int fiber_biased_rwlock_rdunlock(fiber_biased_rwlock_t* rwlock)
+{
+    assert(rwlock);
+    //the fiber may have moved since it locked; any slot will do
+    __sync_fetch_and_sub(&fiber_biased_rwlock_get_slot(rwlock)->readers, 1);
+    fiber_biased_rwlock_reader_left(rwlock);
+    return FIBER_SUCCESS;
+}
+
+static void fiber_biased_rwlock_release(fiber_biased_rwlock_t* rwlock)
+{
+    __sync_fetch_and_sub(&rwlock->writer, 1);
+    fiber_wake_address(&rwlock->writer, INT_MAX);
+}
+
+int fiber_biased_rwlock_trywrlock(fiber_biased_rwlock_t* rwlock)
+{
+    assert(rwlock);
+    if(!__sync_bool_compare_and_swap(&rwlock->writer, 0, 1)) {
+        return FIBER_ERROR;
+    }
+    if(fiber_biased_rwlock_readers(rwlock)) {
+        fiber_biased_rwlock_release(rwlock);
+        return FIBER_ERROR;
+    }
+    return FIBER_SUCCESS;
+}
+
+int fiber_biased_rwlock_wrlock(fiber_biased_rwlock_t* rwlock)
+{
+    assert(rwlock);
+    while(!__sync_bool_compare_and_swap(&rwlock->writer, 0, 1)) {
+        fiber_wait_address_internal(&rwlock->writer, 1, NULL);
+    }
+    //new readers back out now. wait for the ones already in to leave
+    while(1) {
+        const int drained = rwlock->drained;
+        load_load_barrier();
+        if(!fiber_biased_rwlock_readers(rwlock)) {
+            break;
+        }
+        fiber_wait_address_internal(&rwlock->drained, drained, NULL);
+    }
+    return FIBER_SUCCESS;
+}
+
+int fiber_biased_rwlock_wrunlock(fiber_biased_rwlock_t* rwlock)
+{
+    assert(rwlock);
+    assert(rwlock->writer == 1);
+    fiber_biased_rwlock_release(rwlock);
+    return FIBER_SUCCESS;
+}
+
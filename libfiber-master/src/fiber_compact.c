@@ -0,0 +1,309 @@
+/*
+ * Copyright (c) 2012-2015, Brian Watling and other contributors
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include "fiber_compact.h"
+#include "fiber_address.h"
+#include "fiber_event.h"
+#include "fiber_manager.h"
+#include <errno.h>
+#include <limits.h>
+
+//waits on 'address' while it holds 'expected'. returns FIBER_SUCCESS if the caller should try again
+static inline int fiber_compact_wait(volatile int* address, int expected, int cancelable, const struct timespec* deadline)
+{
+    const int ret = cancelable
+        ? fiber_wait_address(address, expected, deadline)
+        : fiber_wait_address_internal(address, expected, deadline);
+    return ret || errno == EAGAIN ? FIBER_SUCCESS : FIBER_ERROR;
+}
+
+int fiber_compact_mutex_init(fiber_compact_mutex_t* mutex)
+{
+    assert(mutex);
+    mutex->state = 0;
+    write_barrier();
+    return FIBER_SUCCESS;
+}
+
+int fiber_compact_mutex_destroy(fiber_compact_mutex_t* mutex)
+{
+    assert(mutex);
+    assert(!mutex->state);
+    return FIBER_SUCCESS;
+}
+
+static int fiber_compact_mutex_lock_contended(fiber_compact_mutex_t* mutex, int cancelable, const struct timespec* deadline)
+{
+    //mark the mutex as contended so whoever holds it wakes a waiter when unlocking
+    while(atomic_exchange_int((int*)&mutex->state, 2)) {
+        if(!fiber_compact_wait(&mutex->state, 2, cancelable, deadline)) {
+            return FIBER_ERROR;
+        }
+    }
+    return FIBER_SUCCESS;
+}
+
+int fiber_compact_mutex_lock(fiber_compact_mutex_t* mutex)
+{
+    assert(mutex);
+    if(__sync_bool_compare_and_swap(&mutex->state, 0, 1)) {
+        return FIBER_SUCCESS;
+    }
+    return fiber_compact_mutex_lock_contended(mutex, 1, NULL);
+}
+
+int fiber_compact_mutex_lock_internal(fiber_compact_mutex_t* mutex)
+{
+    assert(mutex);
+    if(__sync_bool_compare_and_swap(&mutex->state, 0, 1)) {
+        return FIBER_SUCCESS;
+    }
+    return fiber_compact_mutex_lock_contended(mutex, 0, NULL);
+}
+
+int fiber_compact_mutex_lock_timed(fiber_compact_mutex_t* mutex, const struct timespec* deadline)
+{
+    assert(mutex);
+    assert(deadline);
+    if(__sync_bool_compare_and_swap(&mutex->state, 0, 1)) {
+        return FIBER_SUCCESS;
+    }
+    if(fiber_deadline_passed(deadline)) {
+        errno = ETIMEDOUT;
+        return FIBER_ERROR;
+    }
+    return fiber_compact_mutex_lock_contended(mutex, 1, deadline);
+}
+
+int fiber_compact_mutex_trylock(fiber_compact_mutex_t* mutex)
+{
+    assert(mutex);
+    return __sync_bool_compare_and_swap(&mutex->state, 0, 1) ? FIBER_SUCCESS : FIBER_ERROR;
+}
+
+int fiber_compact_mutex_unlock(fiber_compact_mutex_t* mutex)
+{
+    assert(mutex);
+    assert(mutex->state);
+    if(__sync_fetch_and_sub(&mutex->state, 1) != 1) {
+        //it was contended. release it fully and wake a waiter to compete for it
+        mutex->state = 0;
+        fiber_wake_address(&mutex->state, 1);
+    }
+    return FIBER_SUCCESS;
+}
+
+int fiber_compact_cond_init(fiber_compact_cond_t* cond)
+{
+    assert(cond);
+    cond->sequence = 0;
+    write_barrier();
+    return FIBER_SUCCESS;
+}
+
+void fiber_compact_cond_destroy(fiber_compact_cond_t* cond)
+{
+    assert(cond);
+}
+
+int fiber_compact_cond_signal(fiber_compact_cond_t* cond)
+{
+    assert(cond);
+    __sync_fetch_and_add(&cond->sequence, 1);
+    fiber_wake_address(&cond->sequence, 1);
+    return FIBER_SUCCESS;
+}
+
+int fiber_compact_cond_broadcast(fiber_compact_cond_t* cond)
+{
+    assert(cond);
+    __sync_fetch_and_add(&cond->sequence, 1);
+    fiber_wake_address(&cond->sequence, INT_MAX);
+    return FIBER_SUCCESS;
+}
+
+int fiber_compact_cond_wait_timed(fiber_compact_cond_t* cond, fiber_compact_mutex_t* mutex, const struct timespec* deadline)
+{
+    assert(cond);
+    assert(mutex);
+    //a signal after this read changes the sequence, so the wait below won't miss it
+    const int sequence = cond->sequence;
+    fiber_compact_mutex_unlock(mutex);
+    const int ret = fiber_compact_wait(&cond->sequence, sequence, 1, deadline);
+    const int saved_errno = errno;
+    //other woken fibers may be waiting for the mutex, so take it as contended
+    fiber_compact_mutex_lock_contended(mutex, 0, NULL);
+    errno = saved_errno;
+    return ret;
+}
+
+int fiber_compact_cond_wait(fiber_compact_cond_t* cond, fiber_compact_mutex_t* mutex)
+{
+    return fiber_compact_cond_wait_timed(cond, mutex, NULL);
+}
+
+int fiber_compact_rwlock_init(fiber_compact_rwlock_t* rwlock)
+{
+    assert(rwlock);
+    rwlock->state = 0;
+    rwlock->waiters = 0;
+    write_barrier();
+    return FIBER_SUCCESS;
+}
+
+void fiber_compact_rwlock_destroy(fiber_compact_rwlock_t* rwlock)
+{
+    assert(rwlock);
+    assert(!rwlock->state);
+}
+
+int fiber_compact_rwlock_rdlock(fiber_compact_rwlock_t* rwlock)
+{
+    assert(rwlock);
+    while(1) {
+        int state;
+        while((state = rwlock->state) >= 0) {
+            if(__sync_bool_compare_and_swap(&rwlock->state, state, state + 1)) {
+                return FIBER_SUCCESS;
+            }
+        }
+        //counted before the state is checked again; an unlock changes the state before checking for waiters
+        __sync_fetch_and_add(&rwlock->waiters, 1);
+        fiber_wait_address_internal(&rwlock->state, state, NULL);
+        __sync_fetch_and_sub(&rwlock->waiters, 1);
+    }
+}
+
+int fiber_compact_rwlock_wrlock(fiber_compact_rwlock_t* rwlock)
+{
+    assert(rwlock);
+    while(!__sync_bool_compare_and_swap(&rwlock->state, 0, -1)) {
+        const int state = rwlock->state;
+        if(state) {
+            __sync_fetch_and_add(&rwlock->waiters, 1);
+            fiber_wait_address_internal(&rwlock->state, state, NULL);
+            __sync_fetch_and_sub(&rwlock->waiters, 1);
+        }
+    }
+    return FIBER_SUCCESS;
+}
+
+int fiber_compact_rwlock_tryrdlock(fiber_compact_rwlock_t* rwlock)
+{
+    assert(rwlock);
+    int state;
+    while((state = rwlock->state) >= 0) {
+        if(__sync_bool_compare_and_swap(&rwlock->state, state, state + 1)) {
+            return FIBER_SUCCESS;
+        }
+    }
+    return FIBER_ERROR;
+}
+
+int fiber_compact_rwlock_trywrlock(fiber_compact_rwlock_t* rwlock)
+{
+    assert(rwlock);
+    return __sync_bool_compare_and_swap(&rwlock->state, 0, -1) ? FIBER_SUCCESS : FIBER_ERROR;
+}
+
+int fiber_compact_rwlock_rdunlock(fiber_compact_rwlock_t* rwlock)
+{
+    assert(rwlock);
+    assert(rwlock->state > 0);
+    //readers only wait while a writer holds the lock, so the last reader out only has writers to wake
+    if(!__sync_sub_and_fetch(&rwlock->state, 1) && rwlock->waiters) {
+        fiber_wake_address(&rwlock->state, 1);
+    }
+    return FIBER_SUCCESS;
+}
+
+int fiber_compact_rwlock_wrunlock(fiber_compact_rwlock_t* rwlock)
+{
+    assert(rwlock);
+    assert(rwlock->state == -1);
+    __sync_fetch_and_add(&rwlock->state, 1);
+    if(rwlock->waiters) {
+        fiber_wake_address(&rwlock->state, INT_MAX);
+    }
+    return FIBER_SUCCESS;
+}
+
+int fiber_compact_semaphore_init(fiber_compact_semaphore_t* semaphore, int value)
+{
+    assert(semaphore);
+    assert(value >= 0);
+    semaphore->counter = value;
+    semaphore->waiters = 0;
+    write_barrier();
+    return FIBER_SUCCESS;
+}
+
+int fiber_compact_semaphore_destroy(fiber_compact_semaphore_t* semaphore)
+{
+    assert(semaphore);
+    assert(!semaphore->waiters);
+    return FIBER_SUCCESS;
+}
+
+int fiber_compact_semaphore_trywait(fiber_compact_semaphore_t* semaphore)
+{
+    assert(semaphore);
+    int counter;
+    while((counter = semaphore->counter) > 0) {
+        if(__sync_bool_compare_and_swap(&semaphore->counter, counter, counter - 1)) {
+            return FIBER_SUCCESS;
+        }
+    }
+    return FIBER_ERROR;
+}
+
+int fiber_compact_semaphore_wait_timed(fiber_compact_semaphore_t* semaphore, const struct timespec* deadline)
+{
+    assert(semaphore);
+    while(!fiber_compact_semaphore_trywait(semaphore)) {
+        //counted before the counter is checked again; a post changes the counter before checking for waiters
+        __sync_fetch_and_add(&semaphore->waiters, 1);
+        const int ret = fiber_compact_wait(&semaphore->counter, 0, 1, deadline);
+        __sync_fetch_and_sub(&semaphore->waiters, 1);
+        if(!ret) {
+            return FIBER_ERROR;
+        }
+    }
+    return FIBER_SUCCESS;
+}
+
+int fiber_compact_semaphore_wait(fiber_compact_semaphore_t* semaphore)
+{
+    return fiber_compact_semaphore_wait_timed(semaphore, NULL);
+}
+
+int fiber_compact_semaphore_post(fiber_compact_semaphore_t* semaphore)
+{
+    assert(semaphore);
+    __sync_fetch_and_add(&semaphore->counter, 1);
+    if(semaphore->waiters) {
+        fiber_wake_address(&semaphore->counter, 1);
+    }
+    return FIBER_SUCCESS;
+}
+
+int fiber_compact_semaphore_getvalue(fiber_compact_semaphore_t* semaphore)
+{
+    assert(semaphore);
+    return semaphore->counter;
+}
+
@@ -16,16 +16,15 @@
 
 #include "fiber_cond.h"
 #include "fiber_manager.h"
+#include <errno.h>
 
 int fiber_cond_init(fiber_cond_t* cond)
 {
     assert(cond);
-    memset(cond, 0, sizeof(*cond));
-    if(!mpsc_fifo_init(&cond->waiters)) {
-        return FIBER_ERROR;
-    }
-    if(!fiber_mutex_init(&cond->internal_mutex)) {
-        mpsc_fifo_destroy(&cond->waiters);
+    cond->caller_mutex = NULL;
+    mpmc_fifo_node_t* const initial_node = fiber_manager_get_mpmc_node();
+    if(!mpmc_fifo_init(&cond->waiters, initial_node)) {
+        fiber_manager_return_mpmc_node(initial_node);
         return FIBER_ERROR;
     }
     write_barrier();
@@ -35,24 +34,46 @@ int fiber_cond_init(fiber_cond_t* cond)
 void fiber_cond_destroy(fiber_cond_t* cond)
 {
     assert(cond);
-    fiber_mutex_destroy(&cond->internal_mutex);
-    mpsc_fifo_destroy(&cond->waiters);
+    fiber_manager_t* const manager = fiber_manager_get();
+    //release any entries left behind by waiters which timed out or were canceled
+    while(fiber_manager_wake_from_mpmc_queue(manager, &cond->waiters, 0) < 0) {
+        //keep going until the queue is empty
+    }
+    mpmc_fifo_destroy(fiber_manager_get_hazard_record(manager), &cond->waiters);
     memset(cond, 0, sizeof(*cond));
 }
 
+//moves the oldest waiter onto the caller's mutex, or wakes it if the mutex can't take it. returns 1 if a waiter was
+//moved, 0 if it had given up already or -1 if there are no waiters. once moved the waiter has been signalled: it can't
+//time out or be canceled while it waits for the mutex, so the signal is never lost to a waiter that leaves
+static int fiber_cond_wake_one(fiber_cond_t* cond, fiber_manager_t* manager, hazard_pointer_thread_record_t* hptr)
+{
+    void* const entry = mpmc_fifo_trypop(hptr, &cond->waiters);
+    if(!entry) {
+        return -1;
+    }
+    fiber_waiter_t* const waiter = fiber_waiter_from_entry(entry);
+    assert(waiter);
+    if(!__sync_bool_compare_and_swap(&waiter->state, FIBER_WAITER_WAITING, FIBER_WAITER_MOVED)) {
+        //the waiter left its entry for us to release
+        fiber_manager_return_waiter(waiter);
+        return 0;
+    }
+    if(!fiber_mutex_requeue_waiter(cond->caller_mutex, waiter)) {
+        return fiber_manager_wake_entry(manager, entry);
+    }
+    return 1;
+}
+
 int fiber_cond_signal(fiber_cond_t* cond)
 {
     assert(cond);
 
-    fiber_mutex_lock(&cond->internal_mutex);
-    intptr_t new_val = __sync_sub_and_fetch(&cond->waiter_count, 1);
-    if(new_val >= 0) {
-        fiber_manager_wake_from_mpsc_queue(fiber_manager_get(), &cond->waiters, 1);
-    } else {
-        new_val = __sync_add_and_fetch(&cond->waiter_count, 1);
-        assert(new_val >= 0);
+    fiber_manager_t* const manager = fiber_manager_get();
+    hazard_pointer_thread_record_t* const hptr = fiber_manager_get_hazard_record(manager);
+    //skip over waiters which timed out or were canceled
+    while(!fiber_cond_wake_one(cond, manager, hptr)) {
     }
-    fiber_mutex_unlock(&cond->internal_mutex);
 
     return FIBER_SUCCESS;
 }
@@ -61,28 +82,51 @@ int fiber_cond_broadcast(fiber_cond_t* cond)
 {
     assert(cond);
 
-    fiber_mutex_lock(&cond->internal_mutex);
-    const intptr_t original = (intptr_t)atomic_exchange_pointer((void**)&cond->waiter_count, 0);
-    if(original) {
-        fiber_manager_wake_from_mpsc_queue(fiber_manager_get(), &cond->waiters, original);
+    fiber_manager_t* const manager = fiber_manager_get();
+    hazard_pointer_thread_record_t* const hptr = fiber_manager_get_hazard_record(manager);
+    while(fiber_cond_wake_one(cond, manager, hptr) >= 0) {
     }
-    fiber_mutex_unlock(&cond->internal_mutex);
 
     return FIBER_SUCCESS;
 }
 
+static int fiber_cond_wait_internal(fiber_cond_t* cond, fiber_mutex_t* mutex, const struct timespec* deadline)
+{
+    assert(!cond->caller_mutex || cond->caller_mutex == mutex);
+    cond->caller_mutex = mutex;
+
+    //our entry is queued before the mutex is released, so a signaller holding the mutex always finds it
+    if(fiber_manager_wait_in_mpmc_queue_and_unlock_timed(fiber_manager_get(), &cond->waiters, mutex, deadline)) {
+        if(mutex->flags & FIBER_MUTEX_BARGING) {
+            fiber_mutex_lock_internal(mutex);
+        } else {
+            //we were moved onto the mutex and woken by being handed it
+            fiber_mutex_lock_requeued(mutex);
+        }
+        return FIBER_SUCCESS;
+    }
+
+    //on a timeout our entry stays queued; signal and broadcast skip over it
+    const int saved_errno = errno;
+    //like pthread_cond_timedwait(), the mutex is re-acquired even if the wait timed out
+    fiber_mutex_lock_internal(mutex);
+    errno = saved_errno;
+    return FIBER_ERROR;
+}
+
 int fiber_cond_wait(fiber_cond_t* cond, fiber_mutex_t * mutex)
 {
     assert(cond);
     assert(mutex);
 
-    assert(!cond->caller_mutex || cond->caller_mutex == mutex);
-    cond->caller_mutex = mutex;
-    __sync_fetch_and_add(&cond->waiter_count, 1);
+    return fiber_cond_wait_internal(cond, mutex, NULL);
+}
 
-    fiber_manager_wait_in_mpsc_queue_and_unlock(fiber_manager_get(), &cond->waiters, mutex);
-    fiber_mutex_lock(mutex);
+int fiber_cond_wait_timed(fiber_cond_t* cond, fiber_mutex_t* mutex, const struct timespec* deadline)
+{
+    assert(cond);
+    assert(mutex);
+    assert(deadline);
 
-    return FIBER_SUCCESS;
+    return fiber_cond_wait_internal(cond, mutex, deadline);
 }
-
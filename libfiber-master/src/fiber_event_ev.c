@@ -21,6 +21,8 @@
 #include <stdio.h>
 #include <assert.h>
 #include <unistd.h>
+#include <errno.h>
+#include <string.h>
 #ifndef __USE_GNU
 #define __USE_GNU
 #endif
@@ -33,6 +35,7 @@ static struct ev_loop* volatile fiber_loop = NULL;
 static fiber_spinlock_t fiber_loop_spinlock = FIBER_SPINLOCK_INITIALIER;
 static volatile int num_events_triggered = 0;
 static volatile int active_threads = 0;
+static volatile uint32_t max_batch_size = FIBER_EVENT_DEFAULT_MAX_BATCH_SIZE;
 
 int fiber_event_init()
 {
@@ -86,6 +89,24 @@ int fiber_poll_events()
     return local_copy;
 }
 
+//the next time a busy manager runs the loop to expire timers, in nanoseconds
+static volatile uint64_t next_timer_check = 0;
+
+void fiber_event_expire_timeouts()
+{
+    if(!fiber_loop) {
+        return;
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    const uint64_t nsecs = now.tv_sec * 1000000000ULL + now.tv_nsec;
+    const uint64_t next = next_timer_check;
+    //libev only fires timers from inside the loop, so run it without waiting once per tick between all the managers
+    if(nsecs >= next && __sync_bool_compare_and_swap(&next_timer_check, next, nsecs + FIBER_TIME_RESOLUTION_MS * 1000000ULL)) {
+        fiber_poll_events();
+    }
+}
+
 size_t fiber_poll_events_blocking(uint32_t seconds, uint32_t useconds)
 {
     if(!fiber_loop) {
@@ -124,19 +145,67 @@ size_t fiber_poll_events_blocking(uint32_t seconds, uint32_t useconds)
     return local_copy;
 }
 
-static void fd_ready(struct ev_loop* loop, ev_io* watcher, int revents)
+int fiber_wait_for_event(int fd, uint32_t events)
 {
-    ev_io_stop(loop, watcher);
-    fiber_manager_t* const manager = fiber_manager_get();
-    fiber_t* const the_fiber = watcher->data;
-    the_fiber->state = FIBER_STATE_READY;
-    fiber_manager_schedule(manager, the_fiber);
+    return fiber_wait_for_event_timed(fd, events, NULL);
+}
+
+typedef struct fiber_timed_wait
+{
+    ev_io fd_event;
+    ev_timer timer_event;
+    fiber_t* fiber;
+    int timed_out;
+} fiber_timed_wait_t;
+
+//fired by fiber_cancel(). the wait is over if the fd or the timer got there first
+static void timed_fd_canceled(fiber_timeout_t* point)
+{
+    fiber_timed_wait_t* const wait = (fiber_timed_wait_t*)point->data;
+    fiber_spinlock_lock(&fiber_loop_spinlock);
+    if(wait->fd_event.active) {
+        ev_io_stop(fiber_loop, &wait->fd_event);
+        ev_timer_stop(fiber_loop, &wait->timer_event);
+        point->expired = 1;
+        wait->fiber->state = FIBER_STATE_READY;
+        fiber_manager_schedule(fiber_manager_get(), wait->fiber);
+    }
+    fiber_spinlock_unlock(&fiber_loop_spinlock);
+}
+
+//both watchers are only touched with fiber_loop_spinlock held, so whichever fires first simply stops the other
+static void timed_fd_ready(struct ev_loop* loop, ev_io* watcher, int revents)
+{
+    fiber_timed_wait_t* const wait = (fiber_timed_wait_t*)watcher->data;
+    ev_io_stop(loop, &wait->fd_event);
+    ev_timer_stop(loop, &wait->timer_event);
+    wait->fiber->state = FIBER_STATE_READY;
+    fiber_manager_schedule(fiber_manager_get(), wait->fiber);
     ++num_events_triggered;
 }
 
-int fiber_wait_for_event(int fd, uint32_t events)
+static void timed_fd_expired(struct ev_loop* loop, ev_timer* watcher, int revents)
+{
+    fiber_timed_wait_t* const wait = (fiber_timed_wait_t*)watcher->data;
+    ev_io_stop(loop, &wait->fd_event);
+    ev_timer_stop(loop, &wait->timer_event);
+    wait->timed_out = 1;
+    wait->fiber->state = FIBER_STATE_READY;
+    fiber_manager_schedule(fiber_manager_get(), wait->fiber);
+    ++num_events_triggered;
+}
+
+static double fiber_event_seconds_until(const struct timespec* deadline)
 {
-    ev_io fd_event = {};
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    const double ret = (deadline->tv_sec - now.tv_sec) + (deadline->tv_nsec - now.tv_nsec) * 0.000000001;
+    return ret > 0 ? ret : 0;
+}
+
+int fiber_wait_for_event_timed(int fd, uint32_t events, const struct timespec* deadline)
+{
+    fiber_timed_wait_t wait = {};
     int poll_events = 0;
     if(events & FIBER_POLL_IN) {
         poll_events |= EV_READ;
@@ -144,24 +213,44 @@ int fiber_wait_for_event(int fd, uint32_t events)
     if(events & FIBER_POLL_OUT) {
         poll_events |= EV_WRITE;
     }
-    //this code should really use ev_io_init(), but ev_io_init has compile warnings.
-    ev_set_cb(&fd_event, &fd_ready);
-    ev_io_set(&fd_event, fd, poll_events);
+    ev_set_cb(&wait.fd_event, &timed_fd_ready);
+    ev_io_set(&wait.fd_event, fd, poll_events);
+    wait.fd_event.data = &wait;
+    ev_set_cb(&wait.timer_event, &timed_fd_expired);
+    wait.timer_event.data = &wait;
+
+    fiber_manager_t* const manager = fiber_manager_get();
+    fiber_timeout_t cancel_point;
+    if(!fiber_manager_arm_cancel(manager, &cancel_point, &timed_fd_canceled, &wait)) {
+        return FIBER_ERROR;
+    }
 
     fiber_spinlock_lock(&fiber_loop_spinlock);
 
-    fiber_manager_t* const manager = fiber_manager_get();
     manager->event_wait_count += 1;
     fiber_t* const this_fiber = manager->current_fiber;
-
-    fd_event.data = this_fiber;
-    ev_io_start(fiber_loop, &fd_event);
+    wait.fiber = this_fiber;
+
+    ev_io_start(fiber_loop, &wait.fd_event);
+    if(deadline) {
+        ev_now_update(fiber_loop);
+        wait.timer_event.at = fiber_event_seconds_until(deadline);
+        wait.timer_event.repeat = 0;
+        ev_timer_start(fiber_loop, &wait.timer_event);
+    }
 
     this_fiber->state = FIBER_STATE_WAITING;
     manager->spinlock_to_unlock = &fiber_loop_spinlock;
 
     fiber_manager_yield(manager);
 
+    if(!fiber_manager_disarm_cancel(&cancel_point)) {
+        return FIBER_ERROR;
+    }
+    if(wait.timed_out) {
+        errno = ETIMEDOUT;
+        return FIBER_ERROR;
+    }
     return FIBER_SUCCESS;
 }
 
@@ -175,6 +264,20 @@ static void timer_trigger(struct ev_loop* loop, ev_timer* watcher, int revents)
     ++num_events_triggered;
 }
 
+static void sleep_canceled(fiber_timeout_t* point)
+{
+    ev_timer* const timer_event = (ev_timer*)point->data;
+    fiber_spinlock_lock(&fiber_loop_spinlock);
+    if(ev_is_active(timer_event)) {
+        ev_timer_stop(fiber_loop, timer_event);
+        point->expired = 1;
+        fiber_t* const the_fiber = timer_event->data;
+        the_fiber->state = FIBER_STATE_READY;
+        fiber_manager_schedule(fiber_manager_get(), the_fiber);
+    }
+    fiber_spinlock_unlock(&fiber_loop_spinlock);
+}
+
 int fiber_sleep(uint32_t seconds, uint32_t useconds)
 {
     if(!fiber_loop) {
@@ -189,9 +292,14 @@ int fiber_sleep(uint32_t seconds, uint32_t useconds)
     timer_event.at = sleep_time;
     timer_event.repeat = 0;
 
+    fiber_manager_t* const manager = fiber_manager_get();
+    fiber_timeout_t cancel_point;
+    if(!fiber_manager_arm_cancel(manager, &cancel_point, &sleep_canceled, &timer_event)) {
+        return FIBER_ERROR;
+    }
+
     fiber_spinlock_lock(&fiber_loop_spinlock);
 
-    fiber_manager_t* const manager = fiber_manager_get();
     fiber_t* const this_fiber = manager->current_fiber;
 
     timer_event.data = this_fiber;
@@ -203,7 +311,91 @@ int fiber_sleep(uint32_t seconds, uint32_t useconds)
 
     fiber_manager_yield(manager);
 
-    return FIBER_SUCCESS;
+    return fiber_manager_disarm_cancel(&cancel_point);
+}
+
+static void timeout_trigger(struct ev_loop* loop, ev_timer* watcher, int revents)
+{
+    ev_timer_stop(loop, watcher);
+    fiber_timeout_t* const timeout = (fiber_timeout_t*)watcher->data;
+    timeout->callback(timeout);
+    ++num_events_triggered;
+}
+
+void fiber_timeout_start(fiber_timeout_t* timeout, const struct timespec* deadline)
+{
+    assert(timeout);
+    assert(deadline);
+    assert(fiber_loop);
+    assert(sizeof(ev_timer) <= sizeof(timeout->event_data));
+    ev_timer* const timer_event = (ev_timer*)timeout->event_data;
+    memset(timer_event, 0, sizeof(*timer_event));
+    ev_set_cb(timer_event, &timeout_trigger);
+    timer_event->data = timeout;
+
+    fiber_spinlock_lock(&fiber_loop_spinlock);
+    ev_now_update(fiber_loop);
+    timer_event->at = fiber_event_seconds_until(deadline);
+    timer_event->repeat = 0;
+    ev_timer_start(fiber_loop, timer_event);
+    fiber_spinlock_unlock(&fiber_loop_spinlock);
+}
+
+int fiber_timeout_stop(fiber_timeout_t* timeout)
+{
+    assert(timeout);
+    ev_timer* const timer_event = (ev_timer*)timeout->event_data;
+    fiber_spinlock_lock(&fiber_loop_spinlock);
+    const int active = ev_is_active(timer_event);
+    if(active) {
+        ev_timer_stop(fiber_loop, timer_event);
+    }
+    fiber_spinlock_unlock(&fiber_loop_spinlock);
+    return active;
+}
+
+static void watch_trigger(struct ev_loop* loop, ev_io* watcher, int revents)
+{
+    ev_io_stop(loop, watcher);
+    fiber_timeout_t* const watch = (fiber_timeout_t*)watcher->data;
+    watch->callback(watch);
+    ++num_events_triggered;
+}
+
+void fiber_event_watch(int fd, uint32_t events, fiber_timeout_t* watch)
+{
+    assert(watch);
+    assert(fiber_loop);
+    assert(sizeof(ev_io) <= sizeof(watch->event_data));
+    ev_io* const fd_event = (ev_io*)watch->event_data;
+    memset(fd_event, 0, sizeof(*fd_event));
+    int poll_events = 0;
+    if(events & FIBER_POLL_IN) {
+        poll_events |= EV_READ;
+    }
+    if(events & FIBER_POLL_OUT) {
+        poll_events |= EV_WRITE;
+    }
+    ev_set_cb(fd_event, &watch_trigger);
+    ev_io_set(fd_event, fd, poll_events);
+    fd_event->data = watch;
+
+    fiber_spinlock_lock(&fiber_loop_spinlock);
+    ev_io_start(fiber_loop, fd_event);
+    fiber_spinlock_unlock(&fiber_loop_spinlock);
+}
+
+int fiber_event_unwatch(int fd, fiber_timeout_t* watch)
+{
+    assert(watch);
+    ev_io* const fd_event = (ev_io*)watch->event_data;
+    fiber_spinlock_lock(&fiber_loop_spinlock);
+    const int active = ev_is_active(fd_event);
+    if(active) {
+        ev_io_stop(fiber_loop, fd_event);
+    }
+    fiber_spinlock_unlock(&fiber_loop_spinlock);
+    return active;
 }
 
 void fiber_fd_closed(int fd)
@@ -211,3 +403,14 @@ void fiber_fd_closed(int fd)
     //NOP
 }
 
+//libev sizes its own event buffers; the cap is only recorded
+void fiber_event_set_max_batch_size(uint32_t size)
+{
+    max_batch_size = size < FIBER_EVENT_MIN_BATCH_SIZE ? FIBER_EVENT_MIN_BATCH_SIZE : size;
+}
+
+uint32_t fiber_event_get_max_batch_size()
+{
+    return max_batch_size;
+}
+
@@ -36,12 +36,22 @@
 #error OS not supported
 #endif
 
+//fibers waiting on an fd link themselves in using a node on their stack. a timed waiter which gives up
+//unlinks itself under the fd's spinlock before returning. a watch's node lives in its event_data
+typedef struct fd_waiter
+{
+    fiber_waiter_t waiter;
+    intptr_t result;
+    struct fd_waiter* next;
+    fiber_timeout_t* watch;
+} fd_waiter_t;
+
 typedef struct fd_wait_info
 {
     int events;
     int added;
     fiber_spinlock_t spinlock;
-    void* waiters;
+    fd_waiter_t* waiters;
 } fd_wait_info_t;
 
 static fd_wait_info_t* wait_info = NULL;
@@ -49,32 +59,51 @@ static int max_fd = 0;
 static int event_fd = -1;
 static fiber_spinlock_t sleep_spinlock = FIBER_SPINLOCK_INITIALIER;
 static uint64_t timer_trigger_count = 0;
+static volatile uint64_t next_wake_time = UINT64_MAX;//the earliest sleeper's wake_time. it can be stale after a stop, which only costs a check
+static struct timespec timer_start_time;//tick N of the timer happens no earlier than timer_start_time + N * FIBER_TIME_RESOLUTION_MS
+static volatile uint32_t max_batch_size = FIBER_EVENT_DEFAULT_MAX_BATCH_SIZE;
 
 #if defined(LINUX)
 static int timer_fd = -1;
 typedef ssize_t (*readFnType) (int, void *, size_t);
 static readFnType fibershim_read = NULL;
+typedef struct epoll_event poll_event_t;
 #elif defined(SOLARIS)
 static timer_t timer_id = -1;
-static hrtime_t last_timer_trigger = 0;
+typedef port_event_t poll_event_t;
 #else
 #error OS not supported
 #endif
 
-//a tree of linked lists
+//a tree of linked lists. each timeout's node lives in its event_data
 typedef struct waiter_el
 {
     uint64_t wake_time;
-    void* waiter;
+    fiber_timeout_t* timeout;
     struct waiter_el* next;
     struct waiter_el* left;
     struct waiter_el* right;
+    int queued;
 } waiter_el_t;
 
 static waiter_el_t* sleepers = NULL;
 
+//the number of timer ticks since timer_start_time
+static uint64_t fiber_event_current_tick()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    const int64_t elapsed = (now.tv_sec - timer_start_time.tv_sec) * 1000000000LL + (now.tv_nsec - timer_start_time.tv_nsec);
+    return elapsed / (FIBER_TIME_RESOLUTION_MS * 1000000LL);
+}
+
 void waiter_insert(waiter_el_t** tree, waiter_el_t* node)
 {
+    node->next = NULL;
+    node->left = NULL;
+    node->right = NULL;
+    node->queued = 1;
+
     if(!(*tree)) {
         *tree = node;
         return;
@@ -113,6 +142,47 @@ waiter_el_t* waiter_remove_less_than(waiter_el_t** tree, const uint64_t wake_tim
     return NULL;
 }
 
+//removes a node which is known to be in the tree
+void waiter_remove(waiter_el_t** tree, waiter_el_t* node)
+{
+    while((*tree)->wake_time != node->wake_time) {
+        tree = node->wake_time < (*tree)->wake_time ? &(*tree)->left : &(*tree)->right;
+        assert(*tree);
+    }
+
+    waiter_el_t* const head = *tree;
+    if(head != node) {
+        //the node is in the list hanging off the tree
+        waiter_el_t* prev = head;
+        while(prev->next != node) {
+            prev = prev->next;
+            assert(prev);
+        }
+        prev->next = node->next;
+    } else if(node->next) {
+        //promote the next node in the list into the tree
+        node->next->left = node->left;
+        node->next->right = node->right;
+        *tree = node->next;
+    } else if(!node->left) {
+        *tree = node->right;
+    } else if(!node->right) {
+        *tree = node->left;
+    } else {
+        //replace the node with its successor
+        waiter_el_t** successor = &node->right;
+        while((*successor)->left) {
+            successor = &(*successor)->left;
+        }
+        waiter_el_t* const replacement = *successor;
+        *successor = replacement->right;
+        replacement->left = node->left;
+        replacement->right = node->right;
+        *tree = replacement;
+    }
+    node->queued = 0;
+}
+
 int fiber_event_init()
 {
     if(event_fd >= 0) {
@@ -128,6 +198,8 @@ int fiber_event_init()
     wait_info = calloc(max_fd, sizeof(*wait_info));
     assert(wait_info);
 
+    clock_gettime(CLOCK_MONOTONIC, &timer_start_time);
+
 #if defined(LINUX)
     timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
     assert(timer_fd >= 0);
@@ -206,39 +278,114 @@ void fiber_event_destroy()
 static void fiber_event_wake_waiters(fiber_manager_t* manager, fd_wait_info_t* info, intptr_t result)
 {
     while(info->waiters) {
-        fiber_t* const to_schedule = (fiber_t*)info->waiters;
-        info->waiters = to_schedule->scratch;
-        to_schedule->scratch = NULL;
-        to_schedule->state = FIBER_STATE_READY;
-        to_schedule->scratch = (void*)result;
-        fiber_manager_schedule(manager, to_schedule);
+        fd_waiter_t* const to_wake = info->waiters;
+        info->waiters = to_wake->next;
+        to_wake->next = NULL;
+        to_wake->result = result;
+        if(to_wake->watch) {
+            to_wake->watch->callback(to_wake->watch);
+            continue;
+        }
+        //a waiter which timed out is waiting on the spinlock to unlink itself; it's already off the list
+        fiber_manager_wake_waiter(manager, &to_wake->waiter);
     }
 }
 
-static void fiber_event_wake_sleepers(fiber_manager_t* manager, uint64_t trigger_count)
+//the caller holds sleep_spinlock
+static void fiber_event_wake_sleepers_locked()
 {
-    fiber_spinlock_lock(&sleep_spinlock);
-    timer_trigger_count += trigger_count;
+    //the tick comes from the clock rather than the timer, so it's right no matter who reads the timer or when
+    const uint64_t tick = fiber_event_current_tick();
+    if(tick > timer_trigger_count) {
+        timer_trigger_count = tick;
+    }
 
     waiter_el_t* to_wake = NULL;
     while((to_wake = waiter_remove_less_than(&sleepers, timer_trigger_count))) {
         do {
-            assert(to_wake->waiter);
-            fiber_t* const to_schedule = (fiber_t*)to_wake->waiter;
-            to_schedule->state = FIBER_STATE_READY;
-            fiber_manager_schedule(manager, to_schedule);
-            to_wake = to_wake->next;
+            waiter_el_t* const next = to_wake->next;
+            fiber_timeout_t* const timeout = to_wake->timeout;
+            assert(timeout);
+            to_wake->queued = 0;
+            timeout->callback(timeout);
+            to_wake = next;
         } while(to_wake);
     }
 
+    waiter_el_t* first = sleepers;
+    while(first && first->left) {
+        first = first->left;
+    }
+    next_wake_time = first ? first->wake_time : UINT64_MAX;
+}
+
+static void fiber_event_wake_sleepers()
+{
+    fiber_spinlock_lock(&sleep_spinlock);
+    fiber_event_wake_sleepers_locked();
     fiber_spinlock_unlock(&sleep_spinlock);
 }
 
+void fiber_event_expire_timeouts()
+{
+    if(next_wake_time == UINT64_MAX || fiber_event_current_tick() <= next_wake_time) {
+        return;
+    }
+    //if the timer is busy, a later check (or the fiber holding it) gets them
+    if(fiber_spinlock_trylock(&sleep_spinlock)) {
+        fiber_event_wake_sleepers_locked();
+        fiber_spinlock_unlock(&sleep_spinlock);
+    }
+}
+
+void fiber_event_set_max_batch_size(uint32_t size)
+{
+    max_batch_size = size < FIBER_EVENT_MIN_BATCH_SIZE ? FIBER_EVENT_MIN_BATCH_SIZE : size;
+}
+
+uint32_t fiber_event_get_max_batch_size()
+{
+    return max_batch_size;
+}
+
+//each manager polls into its own buffer. the buffer only ever grows; poll_batch_size is how much of it is used
+static poll_event_t* fiber_event_get_batch(fiber_manager_t* manager)
+{
+    if(!manager->poll_events) {
+        manager->poll_events = malloc(FIBER_EVENT_MIN_BATCH_SIZE * sizeof(poll_event_t));
+        assert(manager->poll_events);
+        manager->poll_batch_size = FIBER_EVENT_MIN_BATCH_SIZE;
+    }
+    return (poll_event_t*)manager->poll_events;
+}
+
+//grow the batch after a full poll so a burst is drained with fewer calls. shrink it after a sparse poll
+//so a single thread doesn't grab events which other idle threads could be handling
+static void fiber_event_adapt_batch(fiber_manager_t* manager, uint32_t count)
+{
+    const uint32_t batch_size = manager->poll_batch_size;
+    const uint32_t max_size = max_batch_size;
+    if(count == batch_size && batch_size < max_size) {
+        const uint32_t new_size = batch_size * 2 < max_size ? batch_size * 2 : max_size;
+        void* const new_events = realloc(manager->poll_events, new_size * sizeof(poll_event_t));
+        if(new_events) {
+            manager->poll_events = new_events;
+            manager->poll_batch_size = new_size;
+        }
+    } else if(count < batch_size / 4 && batch_size > FIBER_EVENT_MIN_BATCH_SIZE) {
+        manager->poll_batch_size = batch_size / 2;
+    } else if(batch_size > max_size) {
+        manager->poll_batch_size = max_size;
+    }
+}
+
 static int fiber_poll_events_internal(uint32_t seconds, uint32_t useconds)
 {
+    fiber_manager_t* const manager = fiber_manager_get();
+    poll_event_t* const events = fiber_event_get_batch(manager);
+    const uint32_t batch_size = manager->poll_batch_size;
 #if defined(LINUX)
-    struct epoll_event events[64];
-    const int count = epoll_wait(event_fd, events, 64, seconds * 1000 + useconds / 1000);
+    const int count = epoll_wait(event_fd, events, batch_size, seconds * 1000 + useconds / 1000);
     if(count < 0) {
         if(errno == EINTR) { //interrupted, just try again later (could be gdb'ing etc)
             return 0;
@@ -249,7 +396,6 @@ static int fiber_poll_events_internal(uint32_t seconds, uint32_t useconds)
         (void)ret;
         abort();
     }
-    fiber_manager_t* const manager = fiber_manager_get();
     manager->poll_count += 1;
     int i;
     for(i = 0; i < count; ++i) {
@@ -261,7 +407,7 @@ static int fiber_poll_events_internal(uint32_t seconds, uint32_t useconds)
                 assert(errno == EWOULDBLOCK || errno == EAGAIN);
                 continue;
             }
-            fiber_event_wake_sleepers(manager, timer_count);
+            fiber_event_wake_sleepers();
         } else {
             fd_wait_info_t* const info = &wait_info[the_fd];
             fiber_spinlock_lock(&info->spinlock);
@@ -277,23 +423,19 @@ static int fiber_poll_events_internal(uint32_t seconds, uint32_t useconds)
             fiber_spinlock_unlock(&info->spinlock);
         }
     }
+    fiber_event_adapt_batch(manager, count);
     return count;
 #elif defined(SOLARIS)
-    port_event_t events[64];
     uint_t nget = 1;
     errno = 0;
     timespec_t timeout = {seconds, useconds * 1000};
-    const int ret = port_getn(event_fd, events, 64, &nget, &timeout);
-    fiber_manager_t* const manager = fiber_manager_get();
+    const int ret = port_getn(event_fd, events, batch_size, &nget, &timeout);
     manager->poll_count += 1;
     uint_t i;
     for(i = 0; i < nget; ++i) {
         port_event_t* const this_event = &events[i];
         if(this_event->portev_source == PORT_SOURCE_TIMER) {
-            hrtime_t const now = gethrtime();
-            const int timer_count = (now - last_timer_trigger) / (FIBER_TIME_RESOLUTION_MS * 1000000);
-            last_timer_trigger += timer_count * (FIBER_TIME_RESOLUTION_MS * 1000000);
-            fiber_event_wake_sleepers(manager, timer_count);
+            fiber_event_wake_sleepers();
         } else if(this_event->portev_source == PORT_SOURCE_FD) {
             fd_wait_info_t* const info = &wait_info[this_event->portev_object];
             fiber_spinlock_lock(&info->spinlock);
@@ -313,6 +455,7 @@ static int fiber_poll_events_internal(uint32_t seconds, uint32_t useconds)
         (void)ret;
         abort();
     }
+    fiber_event_adapt_batch(manager, nget);
     return nget;
 #else
 #error OS not supported
@@ -338,7 +481,7 @@ size_t fiber_poll_events_blocking(uint32_t seconds, uint32_t useconds)
     return fiber_poll_events_internal(seconds, useconds);
 }
 
-int fiber_wait_for_event(int fd, uint32_t events)
+static fd_wait_info_t* fiber_event_register(int fd, uint32_t events)
 {
     assert(fd >= 0);
     assert(fd < max_fd);
@@ -375,17 +518,132 @@ int fiber_wait_for_event(int fd, uint32_t events)
 #error OS not supported
 #endif
 
+    return info;
+}
+
+//unlinks 'node' if it's still on the fd's list. returns 1 if it was found
+static int fiber_event_unlink(fd_wait_info_t* info, fd_waiter_t* node)
+{
+    fiber_spinlock_lock(&info->spinlock);
+    fd_waiter_t** cur = &info->waiters;
+    while(*cur && *cur != node) {
+        cur = &(*cur)->next;
+    }
+    const int found = *cur != NULL;
+    if(found) {
+        *cur = node->next;
+    }
+    fiber_spinlock_unlock(&info->spinlock);
+    return found;
+}
+
+void fiber_event_watch(int fd, uint32_t events, fiber_timeout_t* watch)
+{
+    assert(watch);
+    assert(sizeof(fd_waiter_t) <= sizeof(watch->event_data));
+    fd_waiter_t* const node = (fd_waiter_t*)watch->event_data;
+    memset(node, 0, sizeof(*node));
+    node->watch = watch;
+
+    fd_wait_info_t* const info = fiber_event_register(fd, events);
+    node->next = info->waiters;
+    info->waiters = node;
+    fiber_spinlock_unlock(&info->spinlock);
+}
+
+int fiber_event_unwatch(int fd, fiber_timeout_t* watch)
+{
+    assert(watch);
+    assert(fd >= 0);
+    assert(fd < max_fd);
+    return fiber_event_unlink(&wait_info[fd], (fd_waiter_t*)watch->event_data);
+}
+
+int fiber_wait_for_event(int fd, uint32_t events)
+{
+    return fiber_wait_for_event_timed(fd, events, NULL);
+}
+
+int fiber_wait_for_event_timed(int fd, uint32_t events, const struct timespec* deadline)
+{
     fiber_manager_t* const manager = fiber_manager_get();
-    manager->event_wait_count += 1;
     fiber_t* const this_fiber = manager->current_fiber;
-    this_fiber->scratch = info->waiters;//use scratch field as a linked list of waiters
-    info->waiters = this_fiber;
-    this_fiber->state = FIBER_STATE_WAITING;
+    fd_waiter_t node = {};
+    node.waiter.fiber = this_fiber;
+    node.waiter.state = FIBER_WAITER_WAITING;
+    fiber_timeout_t cancel_point;
+    if(!fiber_manager_arm_cancel(manager, &cancel_point, &fiber_manager_cancel_waiter, &node.waiter)) {
+        return FIBER_ERROR;
+    }
+
+    fd_wait_info_t* const info = fiber_event_register(fd, events);
+
+    manager->event_wait_count += 1;
+    node.next = info->waiters;
+    info->waiters = &node;
+    //the timeout can fire before the switch; SAVING_STATE_TO_WAIT keeps the scheduler off this fiber until then
+    this_fiber->state = FIBER_STATE_SAVING_STATE_TO_WAIT;
+    fiber_timeout_t timeout;
+    if(deadline) {
+        fiber_manager_start_waiter_timeout(&timeout, &node.waiter, deadline);
+    }
     manager->spinlock_to_unlock = &info->spinlock;
     fiber_manager_yield(manager);
 
-    //if the fd is closed while we're polling, this_fiber->scratch will be non-NULL (see fiber_fd_closed)
-    return this_fiber->scratch ? FIBER_ERROR : FIBER_SUCCESS;
+    const int timed_out = deadline && !fiber_manager_stop_waiter_timeout(&timeout);
+    const int canceled = !fiber_manager_disarm_cancel(&cancel_point);
+    if(timed_out || canceled) {
+        //we gave up, so we're possibly still on the fd's list
+        fiber_event_unlink(info, &node);
+        errno = canceled ? ECANCELED : ETIMEDOUT;
+        return FIBER_ERROR;
+    }
+
+    //if the fd is closed while we're polling, the result will be non-zero (see fiber_fd_closed)
+    return node.result ? FIBER_ERROR : FIBER_SUCCESS;
+}
+
+//converts a deadline into the tick count which has to be exceeded for the deadline to have passed
+static uint64_t fiber_event_wake_time(const struct timespec* deadline)
+{
+    const int64_t resolution = FIBER_TIME_RESOLUTION_MS * 1000000LL;
+    const int64_t offset = (deadline->tv_sec - timer_start_time.tv_sec) * 1000000000LL
+                           + (deadline->tv_nsec - timer_start_time.tv_nsec);
+    if(offset <= resolution) {
+        return 0;
+    }
+    return (offset + resolution - 1) / resolution - 1;
+}
+
+void fiber_timeout_start(fiber_timeout_t* timeout, const struct timespec* deadline)
+{
+    assert(timeout);
+    assert(deadline);
+    assert(event_fd >= 0);
+    assert(sizeof(waiter_el_t) <= sizeof(timeout->event_data));
+    waiter_el_t* const node = (waiter_el_t*)timeout->event_data;
+    node->wake_time = fiber_event_wake_time(deadline);
+    node->timeout = timeout;
+
+    fiber_spinlock_lock(&sleep_spinlock);
+    waiter_insert(&sleepers, node);
+    if(node->wake_time < next_wake_time) {
+        next_wake_time = node->wake_time;
+    }
+    fiber_spinlock_unlock(&sleep_spinlock);
+}
+
+int fiber_timeout_stop(fiber_timeout_t* timeout)
+{
+    assert(timeout);
+    waiter_el_t* const node = (waiter_el_t*)timeout->event_data;
+    fiber_spinlock_lock(&sleep_spinlock);
+    const int queued = node->queued;
+    if(queued) {
+        waiter_remove(&sleepers, node);
+    }
+    fiber_spinlock_unlock(&sleep_spinlock);
+    return queued;
 }
 
 int fiber_sleep(uint32_t seconds, uint32_t useconds)
@@ -395,23 +653,27 @@ int fiber_sleep(uint32_t seconds, uint32_t useconds)
         return FIBER_SUCCESS;
     }
 
-    const uint64_t sleep_ms = seconds * 1000 + useconds / 1000 + 1;//ms
-    waiter_el_t wake_info = {};
-
-    fiber_spinlock_lock(&sleep_spinlock);
-
-    const uint64_t wake_time = timer_trigger_count + sleep_ms;
-    wake_info.wake_time = wake_time;
-    waiter_insert(&sleepers, &wake_info);
+    struct timespec deadline;
+    fiber_deadline_after(&deadline, seconds, useconds);
 
+    //the waiter lets the timer and fiber_cancel() agree on who wakes this fiber. nothing else refers to it
     fiber_manager_t* const manager = fiber_manager_get();
     fiber_t* const this_fiber = manager->current_fiber;
-    wake_info.waiter = this_fiber;
-    this_fiber->state = FIBER_STATE_WAITING;
-    manager->spinlock_to_unlock = &sleep_spinlock;
+    fiber_waiter_t waiter = {};
+    waiter.fiber = this_fiber;
+    waiter.state = FIBER_WAITER_WAITING;
+    fiber_timeout_t cancel_point;
+    if(!fiber_manager_arm_cancel(manager, &cancel_point, &fiber_manager_cancel_waiter, &waiter)) {
+        return FIBER_ERROR;
+    }
+
+    this_fiber->state = FIBER_STATE_SAVING_STATE_TO_WAIT;
+    fiber_timeout_t timeout;
+    fiber_manager_start_waiter_timeout(&timeout, &waiter, &deadline);
     fiber_manager_yield(manager);
 
-    return FIBER_SUCCESS;
+    fiber_timeout_stop(&timeout);
+    return fiber_manager_disarm_cancel(&cancel_point);
 }
 
 void fiber_fd_closed(int fd)
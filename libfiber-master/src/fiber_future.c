@@ -0,0 +1,230 @@
+/*
+ * Copyright (c) 2012-2015, Brian Watling and other contributors
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "fiber_future.h"
+#include "fiber_address.h"
+#include <errno.h>
+#include <limits.h>
+
+//marks the continuation list of a ready future. continuations added afterwards run right away
+#define FIBER_FUTURE_CLOSED ((fiber_future_continuation_t*)(intptr_t)-1)
+
+int fiber_promise_init(fiber_promise_t* promise)
+{
+    assert(promise);
+    promise->future.state = FIBER_FUTURE_PENDING;
+    promise->future.value = NULL;
+    promise->future.continuations = NULL;
+    write_barrier();
+    return FIBER_SUCCESS;
+}
+
+void fiber_promise_destroy(fiber_promise_t* promise)
+{
+    assert(promise);
+    assert(promise->future.state != FIBER_FUTURE_SETTING);
+}
+
+static void* fiber_future_run_continuation(void* param)
+{
+    fiber_future_continuation_t* const continuation = (fiber_future_continuation_t*)param;
+    continuation->callback(continuation->future, continuation->arg);
+    return NULL;
+}
+
+static void fiber_future_start_continuation(fiber_future_continuation_t* continuation)
+{
+    fiber_manager_t* const target = continuation->manager;
+    if(!target) {
+        continuation->callback(continuation->future, continuation->arg);
+        return;
+    }
+    fiber_t* const the_fiber = fiber_create_no_sched(FIBER_FUTURE_CONTINUATION_STACK_SIZE, &fiber_future_run_continuation, continuation);
+    //continuations can't fail, and neither could the callers which satisfy promises
+    assert(the_fiber);
+    fiber_detach(the_fiber);
+    fiber_manager_t* const manager = fiber_manager_get();
+    if(target == manager) {
+        fiber_manager_schedule(manager, the_fiber);
+    } else {
+        fiber_manager_schedule_remote(target, the_fiber);
+    }
+}
+
+//returns 0 without touching errno if the promise has already been satisfied
+static int fiber_promise_try_set_value(fiber_promise_t* promise, void* value)
+{
+    fiber_future_t* const future = &promise->future;
+    if(!__sync_bool_compare_and_swap(&future->state, FIBER_FUTURE_PENDING, FIBER_FUTURE_SETTING)) {
+        return 0;
+    }
+    future->value = value;
+    //close the list before the future is ready: a getter may free the promise as soon as it sees FIBER_FUTURE_READY,
+    //so after that only the address of the state is used (as the wake key)
+    fiber_future_continuation_t* pending = (fiber_future_continuation_t*)atomic_exchange_pointer((void**)&future->continuations, FIBER_FUTURE_CLOSED);
+    write_barrier();
+    future->state = FIBER_FUTURE_READY;
+    fiber_wake_address(&future->state, INT_MAX);
+
+    //the list was pushed newest first; run the continuations in the order they were added
+    fiber_future_continuation_t* in_order = NULL;
+    while(pending) {
+        fiber_future_continuation_t* const next = pending->next;
+        pending->next = in_order;
+        in_order = pending;
+        pending = next;
+    }
+    while(in_order) {
+        //a continuation may be reused as soon as its callback starts
+        fiber_future_continuation_t* const next = in_order->next;
+        fiber_future_start_continuation(in_order);
+        in_order = next;
+    }
+    return 1;
+}
+
+int fiber_promise_set_value(fiber_promise_t* promise, void* value)
+{
+    assert(promise);
+    if(!fiber_promise_try_set_value(promise, value)) {
+        errno = EINVAL;
+        return FIBER_ERROR;
+    }
+    return FIBER_SUCCESS;
+}
+
+static int fiber_future_get_internal(fiber_future_t* future, void** value, const struct timespec* deadline)
+{
+    int state;
+    while((state = future->state) != FIBER_FUTURE_READY) {
+        if(!fiber_wait_address(&future->state, state, deadline) && errno != EAGAIN) {
+            return FIBER_ERROR;
+        }
+    }
+    load_load_barrier();
+    if(value) {
+        *value = future->value;
+    }
+    return FIBER_SUCCESS;
+}
+
+int fiber_future_get(fiber_future_t* future, void** value)
+{
+    assert(future);
+    return fiber_future_get_internal(future, value, NULL);
+}
+
+int fiber_future_get_timed(fiber_future_t* future, void** value, const struct timespec* deadline)
+{
+    assert(future);
+    assert(deadline);
+    return fiber_future_get_internal(future, value, deadline);
+}
+
+int fiber_future_try_get(fiber_future_t* future, void** value)
+{
+    assert(future);
+    if(future->state != FIBER_FUTURE_READY) {
+        errno = EAGAIN;
+        return FIBER_ERROR;
+    }
+    load_load_barrier();
+    if(value) {
+        *value = future->value;
+    }
+    return FIBER_SUCCESS;
+}
+
+int fiber_future_is_ready(fiber_future_t* future)
+{
+    assert(future);
+    return future->state == FIBER_FUTURE_READY;
+}
+
+int fiber_future_then(fiber_future_t* future, fiber_future_continuation_t* continuation, fiber_future_callback_t callback, void* arg, fiber_manager_t* manager)
+{
+    assert(future);
+    assert(continuation);
+    assert(callback);
+
+    continuation->future = future;
+    continuation->callback = callback;
+    continuation->arg = arg;
+    continuation->manager = manager;
+    while(1) {
+        fiber_future_continuation_t* const head = future->continuations;
+        if(head == FIBER_FUTURE_CLOSED) {
+            //the setter closes the list just before the future becomes ready
+            while(future->state != FIBER_FUTURE_READY) {
+                cpu_relax();
+            }
+            load_load_barrier();
+            fiber_future_start_continuation(continuation);
+            return FIBER_SUCCESS;
+        }
+        continuation->next = head;
+        if(__sync_bool_compare_and_swap(&future->continuations, head, continuation)) {
+            return FIBER_SUCCESS;
+        }
+    }
+}
+
+static void fiber_future_when_all_callback(fiber_future_t* future, void* arg)
+{
+    fiber_future_when_t* const when = (fiber_future_when_t*)arg;
+    if(!__sync_sub_and_fetch(&when->remaining, 1)) {
+        fiber_promise_try_set_value(&when->promise, when->futures);
+    }
+}
+
+static void fiber_future_when_any_callback(fiber_future_t* future, void* arg)
+{
+    fiber_future_when_t* const when = (fiber_future_when_t*)arg;
+    //only the first one to become ready counts
+    fiber_promise_try_set_value(&when->promise, future);
+}
+
+static void fiber_future_when(fiber_future_when_t* when, fiber_future_t** futures, fiber_future_continuation_t* continuations, size_t count, fiber_future_callback_t callback)
+{
+    assert(when);
+    assert(!count || (futures && continuations));
+
+    fiber_promise_init(&when->promise);
+    when->futures = futures;
+    size_t i;
+    for(i = 0; i < count; ++i) {
+        fiber_future_then(futures[i], &continuations[i], callback, when, NULL);
+    }
+}
+
+fiber_future_t* fiber_future_when_all(fiber_future_when_t* when, fiber_future_t** futures, fiber_future_continuation_t* continuations, size_t count)
+{
+    //an extra count is held until every continuation is registered, so the combined future can't be ready early
+    when->remaining = count + 1;
+    fiber_future_when(when, futures, continuations, count, &fiber_future_when_all_callback);
+    fiber_future_when_all_callback(NULL, when);
+    return fiber_promise_get_future(&when->promise);
+}
+
+fiber_future_t* fiber_future_when_any(fiber_future_when_t* when, fiber_future_t** futures, fiber_future_continuation_t* continuations, size_t count)
+{
+    fiber_future_when(when, futures, continuations, count, &fiber_future_when_any_callback);
+    if(!count) {
+        //nothing to wait for
+        fiber_promise_try_set_value(&when->promise, NULL);
+    }
+    return fiber_promise_get_future(&when->promise);
+}
@@ -115,6 +115,7 @@ typedef ssize_t (*sendmsgFnType)(int sockfd, const struct msghdr* msg, int flags
 typedef ssize_t (*recvFnType)(int, void*, size_t, int);
 typedef ssize_t (*recvmsgFnType)(int sockfd, struct msghdr* msg, int flags);
 typedef int (*closeFnType)(int fd);
+typedef int (*setsockoptFnType)(int sockfd, int level, int optname, const void* optval, socklen_t optlen);
 
 /*static openFnType fibershim_open = NULL;
 static pollFnType fibershim_poll = NULL;
@@ -137,6 +138,7 @@ static pipeFnType fibershim_pipe = NULL;
 static fcntlFnType fibershim_fcntl = NULL;
 static ioctlFnType fibershim_ioctl = NULL;
 static closeFnType fibershim_close = NULL;
+static setsockoptFnType fibershim_setsockopt = NULL;
 
 #define STRINGIFY(x) XSTRINGIFY(x)
 #define XSTRINGIFY(x) #x
@@ -161,6 +163,8 @@ selectFnType get_select_fn()
 typedef struct fiber_fd_info
 {
     volatile uint8_t flags_;
+    uint32_t recv_timeout_ms;//SO_RCVTIMEO. 0 means no timeout
+    uint32_t send_timeout_ms;//SO_SNDTIMEO. 0 means no timeout
 } fiber_fd_info_t;
 
 static fiber_fd_info_t* fd_info = NULL;
@@ -187,6 +191,7 @@ int fiber_io_init()
     fibershim_recvfrom = (recvfromFnType)dlsym(RTLD_NEXT, "recvfrom");
     fibershim_recvmsg = (recvmsgFnType)dlsym(RTLD_NEXT, "recvmsg");
     fibershim_close = (closeFnType)dlsym(RTLD_NEXT, "close");
+    fibershim_setsockopt = (setsockoptFnType)dlsym(RTLD_NEXT, "setsockopt");
 
     if(fd_info) {
         return FIBER_ERROR;
@@ -229,6 +234,27 @@ static inline int should_block(int fd)
     return 0;
 }
 
+//waits until fd is ready, honouring the socket's SO_RCVTIMEO/SO_SNDTIMEO. the deadline is set by the
+//first wait of an I/O call and shared by its retries. a timeout fails with EAGAIN, as a blocking socket would
+static int wait_for_event(int fd, uint32_t events, struct timespec* deadline)
+{
+    const uint32_t timeout_ms = (events & FIBER_POLL_IN) ? fd_info[fd].recv_timeout_ms : fd_info[fd].send_timeout_ms;
+    if(!timeout_ms) {
+        return fiber_wait_for_event(fd, events);
+    }
+
+    if(!deadline->tv_sec && !deadline->tv_nsec) {
+        fiber_deadline_after(deadline, timeout_ms / 1000, (timeout_ms % 1000) * 1000);
+    }
+    if(!fiber_wait_for_event_timed(fd, events, deadline)) {
+        if(errno == ETIMEDOUT) {
+            errno = EAGAIN;
+        }
+        return FIBER_ERROR;
+    }
+    return FIBER_SUCCESS;
+}
+
 static int setup_socket(int sock)
 {
     if(thread_locked) {
@@ -249,6 +275,15 @@ static int setup_socket(int sock)
         return ret;
     }
 
+#ifdef SO_BUSY_POLL
+    fiber_manager_t* const manager = fiber_manager_get();
+    if(manager && manager->busy_poll_budget) {
+        //best effort - raising the value may require privileges and not every socket type supports it
+        int busy_poll = manager->busy_poll_budget;
+        setsockopt(sock, SOL_SOCKET, SO_BUSY_POLL, &busy_poll, sizeof(busy_poll));
+    }
+#endif
+
     int on = 1;
     return setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
 }
@@ -296,9 +331,10 @@ int accept(ACCEPTPARAMS)
         fibershim_accept = (acceptFnType)dlsym(RTLD_NEXT, "accept");
     }
 
+    struct timespec deadline = {};
     int sock = fibershim_accept(sockfd, addr, addrlen);
     if(sock < 0 && (errno == EWOULDBLOCK || errno == EAGAIN) && should_block(sockfd)) {
-        if(!fiber_wait_for_event(sockfd, FIBER_POLL_IN)) {
+        if(!wait_for_event(sockfd, FIBER_POLL_IN, &deadline)) {
             return -1;
         }
 
@@ -321,10 +357,11 @@ ssize_t read(int fd, void* buf, size_t count)
         fibershim_read = (readFnType)dlsym(RTLD_NEXT, "read");
     }
 
+    struct timespec deadline = {};
     int ret;
     do {
         if(should_block(fd)) {
-            if(!fiber_wait_for_event(fd, FIBER_POLL_IN)) {
+            if(!wait_for_event(fd, FIBER_POLL_IN, &deadline)) {
                 return -1;
             }
         }
@@ -340,10 +377,11 @@ ssize_t readv(int fd, const struct iovec* iov, int iovcnt)
         fibershim_readv = (readvFnType)dlsym(RTLD_NEXT, "readv");
     }
 
+    struct timespec deadline = {};
     int ret;
     do {
         if(should_block(fd)) {
-            if(!fiber_wait_for_event(fd, FIBER_POLL_IN)) {
+            if(!wait_for_event(fd, FIBER_POLL_IN, &deadline)) {
                 return -1;
             }
         }
@@ -359,10 +397,11 @@ ssize_t recv(int fd, void* buf, size_t len, int flags)
         fibershim_recv = (recvFnType)dlsym(RTLD_NEXT, "recv");
     }
 
+    struct timespec deadline = {};
     int ret;
     do {
         if(!(flags & MSG_DONTWAIT) && should_block(fd)) {
-            if(!fiber_wait_for_event(fd, FIBER_POLL_IN)) {
+            if(!wait_for_event(fd, FIBER_POLL_IN, &deadline)) {
                 return -1;
             }
         }
@@ -378,10 +417,11 @@ ssize_t recvfrom(RECVFROMPARAMS)
         fibershim_recvfrom = (recvfromFnType)dlsym(RTLD_NEXT, "recvfrom");
     }
 
+    struct timespec deadline = {};
     int ret;
     do {
         if(!(flags & MSG_DONTWAIT) && should_block(sockfd)) {
-            if(!fiber_wait_for_event(sockfd, FIBER_POLL_IN)) {
+            if(!wait_for_event(sockfd, FIBER_POLL_IN, &deadline)) {
                 return -1;
             }
         }
@@ -397,10 +437,11 @@ ssize_t recvmsg(int sockfd, struct msghdr* msg, int flags)
         fibershim_recvmsg = (recvmsgFnType)dlsym(RTLD_NEXT, "recvmsg");
     }
 
+    struct timespec deadline = {};
     int ret;
     do {
         if(!(flags & MSG_DONTWAIT) && should_block(sockfd)) {
-            if(!fiber_wait_for_event(sockfd, FIBER_POLL_IN)) {
+            if(!wait_for_event(sockfd, FIBER_POLL_IN, &deadline)) {
                 return -1;
             }
         }
@@ -416,9 +457,10 @@ ssize_t write(int fd, const void* buf, size_t count)
         fibershim_write = (writeFnType)dlsym(RTLD_NEXT, "write");
     }
 
+    struct timespec deadline = {};
     int ret = fibershim_write(fd, buf, count);
     while(ret < 0 && (errno == EWOULDBLOCK || errno == EAGAIN) && should_block(fd)) {
-        if(!fiber_wait_for_event(fd, FIBER_POLL_OUT)) {
+        if(!wait_for_event(fd, FIBER_POLL_OUT, &deadline)) {
             return -1;
         }
         ret = fibershim_write(fd, buf, count);
@@ -433,9 +475,10 @@ ssize_t writev(int fd, const struct iovec* iov, int iovcnt)
         fibershim_writev = (writevFnType)dlsym(RTLD_NEXT, "writev");
     }
 
+    struct timespec deadline = {};
     int ret = fibershim_writev(fd, iov, iovcnt);
     while(ret < 0 && (errno == EWOULDBLOCK || errno == EAGAIN) && should_block(fd)) {
-        if(!fiber_wait_for_event(fd, FIBER_POLL_OUT)) {
+        if(!wait_for_event(fd, FIBER_POLL_OUT, &deadline)) {
             return -1;
         }
         ret = fibershim_writev(fd, iov, iovcnt);
@@ -450,9 +493,10 @@ ssize_t send(int sockfd, const void* buf, size_t len, int flags)
         fibershim_send = (sendFnType)dlsym(RTLD_NEXT, "send");
     }
 
+    struct timespec deadline = {};
     ssize_t ret = fibershim_send(sockfd, buf, len, flags);
     while(ret < 0 && (errno == EWOULDBLOCK || errno == EAGAIN) && !(flags & MSG_DONTWAIT) && should_block(sockfd)) {
-        if(!fiber_wait_for_event(sockfd, FIBER_POLL_OUT)) {
+        if(!wait_for_event(sockfd, FIBER_POLL_OUT, &deadline)) {
             return -1;
         }
         ret = fibershim_send(sockfd, buf, len, flags);
@@ -467,9 +511,10 @@ ssize_t sendto(int sockfd, const void* buf, size_t len, int flags, const struct
         fibershim_sendto = (sendtoFnType)dlsym(RTLD_NEXT, "sendto");
     }
 
+    struct timespec deadline = {};
     ssize_t ret = fibershim_sendto(sockfd, buf, len, flags, dest_addr, addrlen);
     while(ret < 0 && (errno == EWOULDBLOCK || errno == EAGAIN) && !(flags & MSG_DONTWAIT) && should_block(sockfd)) {
-        if(!fiber_wait_for_event(sockfd, FIBER_POLL_OUT)) {
+        if(!wait_for_event(sockfd, FIBER_POLL_OUT, &deadline)) {
             return -1;
         }
         ret = fibershim_sendto(sockfd, buf, len, flags, dest_addr, addrlen);
@@ -484,9 +529,10 @@ ssize_t sendmsg(int sockfd, const struct msghdr* msg, int flags)
         fibershim_sendmsg = (sendmsgFnType)dlsym(RTLD_NEXT, "sendmsg");
     }
 
+    struct timespec deadline = {};
     ssize_t ret = fibershim_sendmsg(sockfd, msg, flags);
     while(ret < 0 && (errno == EWOULDBLOCK || errno == EAGAIN) && !(flags & MSG_DONTWAIT) && should_block(sockfd)) {
-        if(!fiber_wait_for_event(sockfd, FIBER_POLL_OUT)) {
+        if(!wait_for_event(sockfd, FIBER_POLL_OUT, &deadline)) {
             return -1;
         }
         ret = fibershim_sendmsg(sockfd, msg, flags);
@@ -501,10 +547,14 @@ int connect(int sockfd, const struct sockaddr* addr, socklen_t addrlen)
         fibershim_connect = (connectFnType)dlsym(RTLD_NEXT, "connect");
     }
 
+    struct timespec deadline = {};
     int ret = fibershim_connect(sockfd, addr, addrlen);
     if(ret < 0 && errno == EINPROGRESS && should_block(sockfd))
     {
-        if(!fiber_wait_for_event(sockfd, FIBER_POLL_OUT)) {
+        if(!wait_for_event(sockfd, FIBER_POLL_OUT, &deadline)) {
+            if(errno == EAGAIN) {
+                errno = EINPROGRESS;
+            }
             return -1;
         }
 
@@ -533,15 +583,40 @@ static sleepFnType fibershim_sleep = NULL;
 static usleepFnType fibershim_usleep = NULL;
 static nanosleepFnType fibershim_nanosleep = NULL;
 
+//the time left until 'deadline', used to report how much of an interrupted sleep remains
+static void time_left(const struct timespec* deadline, struct timespec* left)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    left->tv_sec = 0;
+    left->tv_nsec = 0;
+    if(now.tv_sec > deadline->tv_sec || (now.tv_sec == deadline->tv_sec && now.tv_nsec >= deadline->tv_nsec)) {
+        return;
+    }
+    left->tv_sec = deadline->tv_sec - now.tv_sec;
+    left->tv_nsec = deadline->tv_nsec - now.tv_nsec;
+    if(left->tv_nsec < 0) {
+        left->tv_sec -= 1;
+        left->tv_nsec += 1000000000;
+    }
+}
+
 unsigned int sleep(unsigned int seconds)
 {
      if(!thread_locked && fiber_manager_get()) {
-         fiber_sleep(seconds, 0);
+         struct timespec deadline;
+         fiber_deadline_after(&deadline, seconds, 0);
+         if(!fiber_sleep(seconds, 0)) {
+             //canceled; report the unslept time like an interrupted sleep()
+             struct timespec left;
+             time_left(&deadline, &left);
+             return left.tv_sec + (left.tv_nsec ? 1 : 0);
+         }
      } else {
          if(!fibershim_sleep) {
              fibershim_sleep = (sleepFnType)dlsym(RTLD_NEXT, "sleep");
          }
-         fibershim_sleep(seconds);
+         return fibershim_sleep(seconds);
      }
      return 0;
 }
@@ -549,12 +624,14 @@ unsigned int sleep(unsigned int seconds)
 int usleep(useconds_t useconds)
 {
      if(!thread_locked && fiber_manager_get()) {
-         fiber_sleep(useconds / 1000000, useconds % 1000000);
+         if(!fiber_sleep(useconds / 1000000, useconds % 1000000)) {
+             return -1;
+         }
      } else {
          if(!fibershim_usleep) {
              fibershim_usleep = (usleepFnType)dlsym(RTLD_NEXT, "usleep");
          }
-         fibershim_usleep(useconds);
+         return fibershim_usleep(useconds);
      }
      return 0;
 }
@@ -562,17 +639,21 @@ int usleep(useconds_t useconds)
 int nanosleep(const struct timespec* rqtp,  struct timespec* rmtp)
 {
      if(!thread_locked && fiber_manager_get()) {
-         fiber_sleep(rqtp->tv_sec, rqtp->tv_nsec / 1000 + 1);
+         struct timespec deadline;
+         fiber_deadline_after(&deadline, rqtp->tv_sec, rqtp->tv_nsec / 1000 + 1);
+         const int ret = fiber_sleep(rqtp->tv_sec, rqtp->tv_nsec / 1000 + 1);
          if(rmtp) {
-             rmtp->tv_sec = 0;
-             rmtp->tv_nsec = 0;
+             time_left(&deadline, rmtp);
+         }
+         if(!ret) {
+             return -1;
          }
      } else {
          if(!fibershim_nanosleep) {
              fibershim_nanosleep = (nanosleepFnType)dlsym(RTLD_NEXT, 
 "nanosleep");
          }
-         fibershim_nanosleep(rqtp, rmtp);
+         return fibershim_nanosleep(rqtp, rmtp);
      }
      return 0;
 }
@@ -685,6 +766,28 @@ int ioctl(IOCTLPARAMS)
     return fibershim_ioctl(d, request, val);
 }
 
+int setsockopt(int sockfd, int level, int optname, const void* optval, socklen_t optlen)
+{
+    if(!fibershim_setsockopt) {
+        fibershim_setsockopt = (setsockoptFnType)dlsym(RTLD_NEXT, "setsockopt");
+    }
+
+    const int ret = fibershim_setsockopt(sockfd, level, optname, optval, optlen);
+    //our sockets are non-blocking underneath, so the kernel never applies these. record them for wait_for_event()
+    if(!ret && level == SOL_SOCKET && (optname == SO_RCVTIMEO || optname == SO_SNDTIMEO)
+       && fd_info && sockfd >= 0 && sockfd < max_fd && optval && optlen >= sizeof(struct timeval)) {
+        const struct timeval* const tv = (const struct timeval*)optval;
+        const uint64_t ms = tv->tv_sec * 1000ULL + (tv->tv_usec + 999) / 1000;
+        const uint32_t timeout_ms = ms > UINT32_MAX ? UINT32_MAX : ms;
+        if(optname == SO_RCVTIMEO) {
+            fd_info[sockfd].recv_timeout_ms = timeout_ms;
+        } else {
+            fd_info[sockfd].send_timeout_ms = timeout_ms;
+        }
+    }
+    return ret;
+}
+
 int close(int fd)
 {
     if(!fibershim_close) {
@@ -694,6 +797,8 @@ int close(int fd)
     fiber_fd_closed(fd);
     if (fd_info && fd < max_fd) {
         fd_info[fd].flags_ = 0;
+        fd_info[fd].recv_timeout_ms = 0;
+        fd_info[fd].send_timeout_ms = 0;
     }
     return fibershim_close(fd);
 }
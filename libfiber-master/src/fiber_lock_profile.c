@@ -0,0 +1,323 @@
+/*
+ * Copyright (c) 2012-2015, Brian Watling and other contributors
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#define _GNU_SOURCE
+#include "fiber_lock_profile.h"
+#include "fiber.h"
+#include "machine_specific.h"
+#include <assert.h>
+#include <errno.h>
+
+#ifdef FIBER_LOCK_PROFILE
+
+#include <dlfcn.h>
+#include <inttypes.h>
+#include <string.h>
+#include <time.h>
+
+typedef struct fiber_lock_profile_record
+{
+    void* volatile lock;//NULL while the record is unused. records are only freed by fiber_lock_profile_reset()
+    void* caller;
+    int kind;
+    //the lock's current exclusive hold. kept in the lock's record with no caller, whichever record it's charged to
+    struct fiber_lock_profile_record* volatile holder;
+    uint64_t hold_start;
+    fiber_lock_profile_stats_t stats;
+} fiber_lock_profile_record_t;
+
+volatile int fiber_lock_profile_running = 0;
+static int fiber_lock_profile_flags = 0;
+static fiber_lock_profile_record_t fiber_lock_profile_records[FIBER_LOCK_PROFILE_RECORDS];
+static volatile int fiber_lock_profile_inserting = 0;
+static volatile uint64_t fiber_lock_profile_dropped = 0;//acquisitions which found the table full
+
+static const char* const fiber_lock_profile_kinds[] = {"mutex", "rwlock (read)", "rwlock (write)", "spinlock", "semaphore"};
+
+uint64_t fiber_lock_profile_now()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static inline int fiber_lock_profile_bucket(uint64_t nsecs)
+{
+    const int bucket = nsecs ? 64 - __builtin_clzll(nsecs) : 0;
+    return bucket < FIBER_LOCK_PROFILE_BUCKETS ? bucket : FIBER_LOCK_PROFILE_BUCKETS - 1;
+}
+
+static inline void fiber_lock_profile_max(uint64_t* location, uint64_t value)
+{
+    uint64_t current;
+    while((current = *(volatile uint64_t*)location) < value && !__sync_bool_compare_and_swap(location, current, value)) {
+    }
+}
+
+static fiber_lock_profile_record_t* fiber_lock_profile_find(void* lock, void* caller, int kind, int insert)
+{
+    const uint32_t hash = (uint32_t)(((uintptr_t)lock >> 3) ^ ((uintptr_t)caller >> 2)) * 2654435761u;
+    const uint32_t first = (hash >> 16) & (FIBER_LOCK_PROFILE_RECORDS - 1);
+    uint32_t i;
+    for(i = 0; i < FIBER_LOCK_PROFILE_RECORDS; ++i) {
+        fiber_lock_profile_record_t* const record = &fiber_lock_profile_records[(first + i) & (FIBER_LOCK_PROFILE_RECORDS - 1)];
+        void* const record_lock = record->lock;
+        if(!record_lock) {
+            break;
+        }
+        load_load_barrier();//the caller is written before the lock
+        if(record_lock == lock && record->caller == caller) {
+            return record;
+        }
+    }
+    if(!insert) {
+        return NULL;
+    }
+
+    //records are added one at a time so a pair can't be added twice. this can't use a fiber lock, since they call us
+    while(!__sync_bool_compare_and_swap(&fiber_lock_profile_inserting, 0, 1)) {
+        cpu_relax();
+    }
+    fiber_lock_profile_record_t* found = NULL;
+    for(i = 0; i < FIBER_LOCK_PROFILE_RECORDS; ++i) {
+        fiber_lock_profile_record_t* const record = &fiber_lock_profile_records[(first + i) & (FIBER_LOCK_PROFILE_RECORDS - 1)];
+        if(!record->lock) {
+            record->caller = caller;
+            record->kind = kind;
+            write_barrier();
+            record->lock = lock;
+            found = record;
+            break;
+        }
+        if(record->lock == lock && record->caller == caller) {
+            found = record;
+            break;
+        }
+    }
+    write_barrier();
+    fiber_lock_profile_inserting = 0;
+    if(!found) {
+        __sync_fetch_and_add(&fiber_lock_profile_dropped, 1);
+    }
+    return found;
+}
+
+static void fiber_lock_profile_clear_holders()
+{
+    int i;
+    for(i = 0; i < FIBER_LOCK_PROFILE_RECORDS; ++i) {
+        fiber_lock_profile_records[i].holder = NULL;
+    }
+}
+
+int fiber_lock_profile_start(int flags)
+{
+    assert(!(flags & ~FIBER_LOCK_PROFILE_BY_CALLER));
+    //locks acquired while we weren't looking are released without a hold being charged
+    fiber_lock_profile_clear_holders();
+    fiber_lock_profile_flags = flags;
+    write_barrier();
+    fiber_lock_profile_running = 1;
+    return FIBER_SUCCESS;
+}
+
+void fiber_lock_profile_stop()
+{
+    fiber_lock_profile_running = 0;
+    write_barrier();
+}
+
+void fiber_lock_profile_reset()
+{
+    assert(!fiber_lock_profile_running);
+    memset(fiber_lock_profile_records, 0, sizeof(fiber_lock_profile_records));
+    fiber_lock_profile_dropped = 0;
+    write_barrier();
+}
+
+void fiber_lock_profile_acquired(void* lock, int kind, void* caller, const fiber_lock_profile_wait_t* wait)
+{
+    if(!(fiber_lock_profile_flags & FIBER_LOCK_PROFILE_BY_CALLER)) {
+        caller = NULL;
+    }
+    fiber_lock_profile_record_t* const record = fiber_lock_profile_find(lock, caller, kind, 1);
+    if(!record) {
+        return;
+    }
+    fiber_lock_profile_stats_t* const stats = &record->stats;
+    const uint64_t now = fiber_lock_profile_now();
+    __sync_fetch_and_add(&stats->acquisitions, 1);
+    if(wait && wait->start) {
+        const uint64_t waited = now - wait->start;
+        __sync_fetch_and_add(&stats->contentions, 1);
+        __sync_fetch_and_add(&stats->wait_nsecs, waited);
+        __sync_fetch_and_add(&stats->wait_histogram[fiber_lock_profile_bucket(waited)], 1);
+        __sync_fetch_and_add(&stats->waiters, wait->waiters);
+        fiber_lock_profile_max(&stats->max_wait_nsecs, waited);
+        fiber_lock_profile_max(&stats->max_waiters, wait->waiters);
+    }
+
+    if(kind == FIBER_LOCK_PROFILE_MUTEX || kind == FIBER_LOCK_PROFILE_RWLOCK_WRITE || kind == FIBER_LOCK_PROFILE_SPINLOCK) {
+        fiber_lock_profile_record_t* const base = caller ? fiber_lock_profile_find(lock, NULL, kind, 1) : record;
+        if(base) {
+            base->hold_start = now;
+            write_barrier();
+            base->holder = record;
+        }
+    }
+}
+
+void fiber_lock_profile_released(void* lock)
+{
+    fiber_lock_profile_record_t* const base = fiber_lock_profile_find(lock, NULL, 0, 0);
+    if(!base) {
+        return;
+    }
+    fiber_lock_profile_record_t* const holder = base->holder;
+    if(!holder) {
+        return;
+    }
+    load_load_barrier();
+    const uint64_t held = fiber_lock_profile_now() - base->hold_start;
+    base->holder = NULL;
+    fiber_lock_profile_stats_t* const stats = &holder->stats;
+    __sync_fetch_and_add(&stats->holds, 1);
+    __sync_fetch_and_add(&stats->hold_nsecs, held);
+    __sync_fetch_and_add(&stats->hold_histogram[fiber_lock_profile_bucket(held)], 1);
+}
+
+void fiber_lock_profile_lock_stats(void* lock, fiber_lock_profile_stats_t* out)
+{
+    assert(out);
+    int i;
+    for(i = 0; i < FIBER_LOCK_PROFILE_RECORDS; ++i) {
+        const fiber_lock_profile_record_t* const record = &fiber_lock_profile_records[i];
+        if(record->lock != lock) {
+            continue;
+        }
+        const fiber_lock_profile_stats_t* const stats = &record->stats;
+        out->acquisitions += stats->acquisitions;
+        out->contentions += stats->contentions;
+        out->wait_nsecs += stats->wait_nsecs;
+        out->max_wait_nsecs = stats->max_wait_nsecs > out->max_wait_nsecs ? stats->max_wait_nsecs : out->max_wait_nsecs;
+        out->waiters += stats->waiters;
+        out->max_waiters = stats->max_waiters > out->max_waiters ? stats->max_waiters : out->max_waiters;
+        out->holds += stats->holds;
+        out->hold_nsecs += stats->hold_nsecs;
+        int bucket;
+        for(bucket = 0; bucket < FIBER_LOCK_PROFILE_BUCKETS; ++bucket) {
+            out->wait_histogram[bucket] += stats->wait_histogram[bucket];
+            out->hold_histogram[bucket] += stats->hold_histogram[bucket];
+        }
+    }
+}
+
+void fiber_lock_profile_dump(FILE* out)
+{
+    assert(out);
+    fprintf(out, "--- mutex:\ncycles/second=1000000000\nsampling period=1\n");
+    int i;
+    for(i = 0; i < FIBER_LOCK_PROFILE_RECORDS; ++i) {
+        const fiber_lock_profile_record_t* const record = &fiber_lock_profile_records[i];
+        if(record->lock && record->stats.contentions) {
+            fprintf(out, "%" PRIu64 " %" PRIu64 " @ %p\n", record->stats.wait_nsecs, record->stats.contentions,
+                    record->caller ? record->caller : record->lock);
+        }
+    }
+}
+
+static void fiber_lock_profile_print_histogram(FILE* out, const char* name, const uint64_t* histogram)
+{
+    fprintf(out, "  %s:", name);
+    int bucket;
+    for(bucket = 0; bucket < FIBER_LOCK_PROFILE_BUCKETS; ++bucket) {
+        if(histogram[bucket]) {
+            fprintf(out, " <2^%dns=%" PRIu64, bucket, histogram[bucket]);
+        }
+    }
+    fprintf(out, "\n");
+}
+
+void fiber_lock_profile_print(FILE* out)
+{
+    assert(out);
+    int i;
+    for(i = 0; i < FIBER_LOCK_PROFILE_RECORDS; ++i) {
+        const fiber_lock_profile_record_t* const record = &fiber_lock_profile_records[i];
+        const fiber_lock_profile_stats_t* const stats = &record->stats;
+        if(!record->lock || !stats->acquisitions) {
+            continue;
+        }
+        fprintf(out, "%s %p", fiber_lock_profile_kinds[record->kind], record->lock);
+        if(record->caller) {
+            Dl_info info;
+            if(dladdr(record->caller, &info) && info.dli_sname) {
+                fprintf(out, " from %s+%#lx", info.dli_sname, (unsigned long)((char*)record->caller - (char*)info.dli_saddr));
+            } else {
+                fprintf(out, " from %p", record->caller);
+            }
+        }
+        fprintf(out, ": %" PRIu64 " acquisitions, %" PRIu64 " contended", stats->acquisitions, stats->contentions);
+        if(stats->contentions) {
+            fprintf(out, ", waited %" PRIu64 "ns (max %" PRIu64 "ns), %.1lf waiters ahead (max %" PRIu64 ")",
+                    stats->wait_nsecs, stats->max_wait_nsecs, (double)stats->waiters / stats->contentions, stats->max_waiters);
+        }
+        if(stats->holds) {
+            fprintf(out, ", held %" PRIu64 "ns over %" PRIu64 " holds", stats->hold_nsecs, stats->holds);
+        }
+        fprintf(out, "\n");
+        if(stats->contentions) {
+            fiber_lock_profile_print_histogram(out, "wait", stats->wait_histogram);
+        }
+        if(stats->holds) {
+            fiber_lock_profile_print_histogram(out, "hold", stats->hold_histogram);
+        }
+    }
+    if(fiber_lock_profile_dropped) {
+        fprintf(out, "%" PRIu64 " acquisitions weren't recorded: the table is full\n", fiber_lock_profile_dropped);
+    }
+}
+
+#else
+
+int fiber_lock_profile_start(int flags)
+{
+    errno = ENOSYS;
+    return FIBER_ERROR;
+}
+
+void fiber_lock_profile_stop()
+{
+}
+
+void fiber_lock_profile_reset()
+{
+}
+
+void fiber_lock_profile_lock_stats(void* lock, fiber_lock_profile_stats_t* out)
+{
+}
+
+void fiber_lock_profile_dump(FILE* out)
+{
+}
+
+void fiber_lock_profile_print(FILE* out)
+{
+}
+
+#endif
+
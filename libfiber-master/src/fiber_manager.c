@@ -30,7 +30,9 @@
 #endif
 #include <dlfcn.h>
 #include <sched.h>
+#include <time.h>
 #include "lockfree_ring_buffer.h"
+#include "fiber_rcu.h"
 #include "../include/fiber_manager.h"
 #include "../include/fiber_event.h"
 #include "../include/fiber_io.h"
@@ -52,11 +54,24 @@ void splitstack_disable_block_signals()
 }
 #endif
 
+//how many yields a busy manager goes between checking for expired timeouts. must be a power of 2
+#define FIBER_MANAGER_TIMEOUT_CHECK_INTERVAL (16)
+
+//a manager which always has fibers to run never polls for events, so it checks the timeouts itself now and then. the
+//caller can't be holding a spin lock: timeout callbacks take locks of their own
+static inline void fiber_manager_expire_timeouts(fiber_manager_t* manager)
+{
+    if(!(manager->yield_count & (FIBER_MANAGER_TIMEOUT_CHECK_INTERVAL - 1))) {
+        fiber_event_expire_timeouts();
+    }
+}
+
 static int fiber_manager_state = FIBER_MANAGER_STATE_NONE;
 static int fiber_manager_num_threads = 0;
 static pthread_t* fiber_manager_threads = NULL;
 static fiber_manager_t** fiber_managers = NULL;
 static volatile int fiber_shutting_down = 0;
+static volatile uint32_t fiber_manager_poll_timeout = FIBER_TIME_RESOLUTION_MS * 1000;
 
 void fiber_destroy(fiber_t* f)
 {
@@ -84,9 +99,37 @@ fiber_manager_t* fiber_manager_create(fiber_scheduler_t* scheduler)
         free(manager);
         return NULL;
     }
+    if(!mpsc_fifo_init(&manager->remote_fibers)) {
+        fiber_destroy(manager->thread_fiber);
+        free(manager);
+        errno = ENOMEM;
+        return NULL;
+    }
     return manager;
 }
 
+void fiber_manager_schedule_remote(fiber_manager_t* manager, fiber_t* the_fiber)
+{
+    assert(manager);
+    assert(the_fiber);
+    mpsc_fifo_node_t* const node = the_fiber->mpsc_fifo_node;
+    assert(node);
+    the_fiber->mpsc_fifo_node = NULL;
+    node->data = the_fiber;
+    mpsc_fifo_push(&manager->remote_fibers, node);
+}
+
+//moves fibers scheduled by other threads onto our own scheduler, which only this thread may push to
+static inline void fiber_manager_take_remote(fiber_manager_t* manager)
+{
+    mpsc_fifo_node_t* node;
+    while((node = mpsc_fifo_trypop(&manager->remote_fibers))) {
+        fiber_t* const the_fiber = (fiber_t*)node->data;
+        the_fiber->mpsc_fifo_node = node;
+        fiber_manager_schedule(manager, the_fiber);
+    }
+}
+
 //static void* fiber_manager_thread_func(void* param);
 
 static inline void fiber_manager_switch_to(fiber_manager_t* manager, fiber_t* old_fiber, fiber_t* new_fiber)
@@ -111,6 +154,7 @@ void fiber_manager_yield(fiber_manager_t* manager)
     fiber_t* const current_fiber = manager->current_fiber;
     while(1) {
         manager->yield_count += 1;
+        fiber_manager_take_remote(manager);
         const fiber_state_t state = current_fiber->state;
 
         fiber_t* const new_fiber = fiber_scheduler_next(manager->scheduler);
@@ -129,6 +173,9 @@ void fiber_manager_yield(fiber_manager_t* manager)
             //re-grab the manager, since we could be on a different thread now
             manager = fiber_manager_get();
         } else {
+            //nothing else to run, so no switch; a running fiber has no deferred unlocks pending
+            fiber_rcu_quiescent(manager);
+            fiber_manager_expire_timeouts(manager);
             //occasionally steal some work from threads with more load
             if((manager->yield_count & 1023) == 0) {
                 fiber_scheduler_load_balance(manager->scheduler);
@@ -138,6 +185,21 @@ void fiber_manager_yield(fiber_manager_t* manager)
     }
 }
 
+void fiber_manager_yield_to(fiber_manager_t* manager, fiber_t* to_run)
+{
+    assert(fiber_manager_state == FIBER_MANAGER_STATE_STARTED);
+    assert(manager);
+    assert(to_run);
+    assert(to_run != manager->current_fiber);
+
+    while(to_run->state != FIBER_STATE_WAITING) {
+        cpu_relax();//the other fiber is still in the process of going to sleep
+        manager->spin_count += 1;
+    }
+    manager->yield_count += 1;
+    fiber_manager_switch_to(manager, manager->current_fiber, to_run);
+}
+
 void* fiber_load_symbol(const char* symbol)
 {
     void* ret = dlsym(RTLD_NEXT, symbol);
@@ -183,6 +245,33 @@ fiber_manager_t* fiber_manager_get()
 }
 #endif
 
+static uint64_t fiber_manager_usecs()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000ULL + now.tv_nsec / 1000;
+}
+
+//returns 1 if an idle manager should keep spinning rather than block
+static int fiber_manager_busy_poll(fiber_manager_t* manager)
+{
+    if(!manager->busy_poll_budget) {
+        return 0;
+    }
+    const uint64_t now = fiber_manager_usecs();
+    if(!manager->busy_poll_start) {
+        manager->busy_poll_start = now;
+        return 1;
+    }
+    if(now - manager->busy_poll_start < manager->busy_poll_budget) {
+        cpu_relax();
+        return 1;
+    }
+    manager->busy_poll_usecs += now - manager->busy_poll_start;
+    manager->busy_poll_start = 0;
+    return 0;
+}
+
 void* fiber_manager_thread_func(void* param)
 {
     /* set the thread local, then start running fibers */
@@ -208,15 +297,27 @@ void* fiber_manager_thread_func(void* param)
     while(!fiber_shutting_down) {
         //fiber_scheduler_load_balance(manager->scheduler);
 
+        fiber_manager_take_remote(manager);
         fiber_t* const new_fiber = fiber_scheduler_next(manager->scheduler);
         if(new_fiber) {
+            if(manager->busy_poll_start) {
+                //the busy-poll found work
+                manager->busy_poll_usecs += fiber_manager_usecs() - manager->busy_poll_start;
+                manager->busy_poll_start = 0;
+            }
             //make this fiber wait so we aren't scheduled again until all work is done
             manager->maintenance_fiber->state = FIBER_STATE_SAVING_STATE_TO_WAIT;
             fiber_manager_switch_to(manager, manager->maintenance_fiber, new_fiber);
         } else {
+            fiber_rcu_quiescent(manager);
             const int num_events = fiber_poll_events();
-            if(num_events == 0) {
-                fiber_poll_events_blocking(0, FIBER_TIME_RESOLUTION_MS * 1000);
+            if(num_events == 0 && !fiber_manager_busy_poll(manager)) {
+                const uint32_t timeout = fiber_manager_poll_timeout;
+                const uint64_t start = fiber_manager_usecs();
+                fiber_rcu_enter_idle(manager);
+                fiber_poll_events_blocking(timeout / 1000000, timeout % 1000000);
+                fiber_rcu_exit_idle(manager);
+                manager->blocked_poll_usecs += fiber_manager_usecs() - start;
             }
         }
     }
@@ -323,6 +424,32 @@ void fiber_shutdown()
     }
 }
 
+void fiber_manager_set_poll_timeout(uint32_t useconds)
+{
+    fiber_manager_poll_timeout = useconds;
+}
+
+uint32_t fiber_manager_get_poll_timeout()
+{
+    return fiber_manager_poll_timeout;
+}
+
+void fiber_manager_set_busy_poll(fiber_manager_t* manager, uint32_t useconds)
+{
+    assert(manager);
+    manager->busy_poll_budget = useconds;
+}
+
+void fiber_manager_set_all_busy_poll(uint32_t useconds)
+{
+    if(fiber_managers) {
+        int i;
+        for(i = 0; i < fiber_manager_num_threads; ++i) {
+            fiber_manager_set_busy_poll(fiber_managers[i], useconds);
+        }
+    }
+}
+
 int fiber_manager_get_state()
 {
     return fiber_manager_state;
@@ -333,6 +460,12 @@ int fiber_manager_get_kernel_thread_count()
     return fiber_manager_num_threads;
 }
 
+fiber_manager_t* fiber_manager_get_by_id(int id)
+{
+    assert(id >= 0 && id < fiber_manager_num_threads);
+    return fiber_managers[id];
+}
+
 extern int fiber_mutex_unlock_internal(fiber_mutex_t* mutex);
 
 extern mpmc_lifo_t fiber_free_fibers;
@@ -386,6 +519,110 @@ void fiber_manager_do_maintenance()
         manager->set_wait_location = NULL;
         manager->set_wait_value = NULL;
     }
+
+    //last, so a canceled wait is fully set up before fiber_cancel() interrupts it
+    if(manager->cancel_lock_to_unlock) {
+        fiber_spinlock_t* const to_unlock = manager->cancel_lock_to_unlock;
+        manager->cancel_lock_to_unlock = NULL;
+        fiber_spinlock_unlock(to_unlock);
+    }
+
+    //neither fiber is inside an RCU read-side section across a switch. this comes after the deferred unlocks since
+    //ending a grace period wakes waiters and runs callbacks, which may need the locks the old fiber was waiting under
+    fiber_rcu_quiescent(manager);
+    fiber_manager_expire_timeouts(manager);
+}
+
+static void fiber_manager_push_waiter(fiber_manager_t* manager, mpsc_fifo_t* mpsc_fifo, mpmc_fifo_t* mpmc_fifo, fiber_waiter_t* waiter)
+{
+    //the entry can outlive the wait, so it can't use the fiber's own node
+    if(mpsc_fifo) {
+        mpsc_fifo_node_t* const node = fiber_manager_get_mpsc_node();
+        node->data = fiber_waiter_to_entry(waiter);
+        mpsc_fifo_push(mpsc_fifo, node);
+    } else {
+        mpmc_fifo_node_t* const node = fiber_manager_get_mpmc_node();
+        node->value = fiber_waiter_to_entry(waiter);
+        mpmc_fifo_push(fiber_manager_get_hazard_record(manager), mpmc_fifo, node);
+    }
+}
+
+int fiber_manager_take_token(volatile int* tokens)
+{
+    int available;
+    while((available = *tokens) > 0) {
+        if(__sync_bool_compare_and_swap(tokens, available, available - 1)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+//waits in one of the queues as a fiber_waiter_t, which lets the wait time out or be canceled. 'mutex' (if any) is unlocked either way.
+//if 'tokens' is given the fiber takes a wake token (see fiber_manager_wake_from_mpsc_queue_with_tokens()) rather than blocking
+static int fiber_manager_wait_in_queue_timed(fiber_manager_t* manager, mpsc_fifo_t* mpsc_fifo, mpmc_fifo_t* mpmc_fifo, volatile int* tokens, fiber_mutex_t* mutex, int cancelable, const struct timespec* deadline)
+{
+    assert(manager);
+    fiber_t* const this_fiber = manager->current_fiber;
+    assert(this_fiber->state == FIBER_STATE_RUNNING);
+    if(tokens && fiber_manager_take_token(tokens)) {
+        //a waker got here first. taking its token now means we don't leave a stale entry behind
+        if(mutex) {
+            fiber_mutex_unlock_internal(mutex);
+        }
+        return FIBER_SUCCESS;
+    }
+    fiber_waiter_t* waiter = fiber_manager_get_waiter(this_fiber);
+    fiber_timeout_t cancel_point;
+    if(cancelable && !fiber_manager_arm_cancel(manager, &cancel_point, &fiber_manager_cancel_waiter, waiter)) {
+        //already canceled. the caller has been counted as a waiter, so leave a dead entry for the waker to skip
+        waiter->state = FIBER_WAITER_CANCELED;
+        fiber_manager_push_waiter(manager, mpsc_fifo, mpmc_fifo, waiter);
+        if(mutex) {
+            fiber_mutex_unlock_internal(mutex);
+        }
+        return FIBER_ERROR;
+    }
+
+    this_fiber->state = FIBER_STATE_SAVING_STATE_TO_WAIT;
+    fiber_manager_push_waiter(manager, mpsc_fifo, mpmc_fifo, waiter);
+    if(tokens) {
+        //a waker which didn't see our entry has left a token. the barrier pairs with the one after the waker adds it
+        store_load_barrier();
+        while(*tokens > 0) {
+            if(!__sync_bool_compare_and_swap(&waiter->state, FIBER_WAITER_WAITING, FIBER_WAITER_STALE)) {
+                break;//we've been woken already
+            }
+            if(fiber_manager_take_token(tokens)) {
+                this_fiber->state = FIBER_STATE_RUNNING;
+                if(cancelable) {
+                    fiber_manager_abort_cancel(manager, &cancel_point);
+                }
+                if(mutex) {
+                    fiber_mutex_unlock_internal(mutex);
+                }
+                return FIBER_SUCCESS;
+            }
+            //another waiter got the token and our entry is stale now, so queue a new one
+            waiter = fiber_manager_get_waiter(this_fiber);
+            cancel_point.data = waiter;
+            fiber_manager_push_waiter(manager, mpsc_fifo, mpmc_fifo, waiter);
+            store_load_barrier();
+        }
+    }
+    manager->mutex_to_unlock = mutex;
+    fiber_timeout_t timeout;
+    if(deadline) {
+        fiber_manager_start_waiter_timeout(&timeout, waiter, deadline);
+    }
+    fiber_manager_yield(manager);
+
+    const int timed_out = deadline && !fiber_manager_stop_waiter_timeout(&timeout);
+    if((cancelable && !fiber_manager_disarm_cancel(&cancel_point)) || timed_out) {
+        return FIBER_ERROR;
+    }
+    fiber_manager_return_waiter(waiter);
+    return FIBER_SUCCESS;
 }
 
 void fiber_manager_wait_in_mpmc_queue(fiber_manager_t* manager, mpmc_fifo_t* fifo)
@@ -401,25 +638,39 @@ void fiber_manager_wait_in_mpmc_queue(fiber_manager_t* manager, mpmc_fifo_t* fif
     fiber_manager_yield(manager);
 }
 
+int fiber_manager_wait_in_mpmc_queue_timed(fiber_manager_t* manager, mpmc_fifo_t* fifo, const struct timespec* deadline)
+{
+    assert(fifo);
+    return fiber_manager_wait_in_queue_timed(manager, NULL, fifo, NULL, NULL, 1, deadline);
+}
+
+int fiber_manager_wait_in_mpmc_queue_and_unlock_timed(fiber_manager_t* manager, mpmc_fifo_t* fifo, fiber_mutex_t* mutex, const struct timespec* deadline)
+{
+    assert(fifo);
+    assert(mutex);
+    return fiber_manager_wait_in_queue_timed(manager, NULL, fifo, NULL, mutex, 1, deadline);
+}
+
 int fiber_manager_wake_from_mpmc_queue(fiber_manager_t* manager, mpmc_fifo_t* fifo, int count)
 {
     //wake at least 'count' fibers; if count == 0, simply attempt to wake a fiber
     void* out = NULL;
+    int pop_count = 0;
     int wake_count = 0;
     hazard_pointer_thread_record_t* hptr = fiber_manager_get_hazard_record(manager);
     do {
         if((out = mpmc_fifo_trypop(hptr, fifo))) {
-            count -= 1;
-            fiber_t* const to_schedule = (fiber_t*)out;
-            assert(to_schedule->state == FIBER_STATE_WAITING);
-            to_schedule->state = FIBER_STATE_READY;
-            fiber_manager_schedule(manager, to_schedule);
-            wake_count += 1;
+            pop_count += 1;
+            if(fiber_manager_wake_entry(manager, out)) {
+                wake_count += 1;
+            } else if(!count) {
+                return -1;
+            }
         } else if(count > 0) {
             cpu_relax();//back off if we failed to pop something
             manager->wake_mpmc_spin_count += 1;
         }
-    } while(wake_count < count);
+    } while(pop_count < count);
     return wake_count;
 }
 
@@ -438,36 +689,230 @@ void fiber_manager_wait_in_mpsc_queue(fiber_manager_t* manager, mpsc_fifo_t* fif
     fiber_manager_yield(manager);
 }
 
+int fiber_manager_wait_in_mpsc_queue_timed(fiber_manager_t* manager, mpsc_fifo_t* fifo, const struct timespec* deadline)
+{
+    assert(fifo);
+    return fiber_manager_wait_in_queue_timed(manager, fifo, NULL, NULL, NULL, 1, deadline);
+}
+
 void fiber_manager_wait_in_mpsc_queue_and_unlock(fiber_manager_t* manager, mpsc_fifo_t* fifo, fiber_mutex_t* mutex)
 {
     manager->mutex_to_unlock = mutex;
     fiber_manager_wait_in_mpsc_queue(manager, fifo);
 }
 
+int fiber_manager_wait_in_mpsc_queue_and_unlock_timed(fiber_manager_t* manager, mpsc_fifo_t* fifo, fiber_mutex_t* mutex, const struct timespec* deadline)
+{
+    assert(fifo);
+    assert(mutex);
+    return fiber_manager_wait_in_queue_timed(manager, fifo, NULL, NULL, mutex, 1, deadline);
+}
+
+int fiber_manager_wait_in_mpsc_queue_with_tokens(fiber_manager_t* manager, mpsc_fifo_t* fifo, volatile int* tokens, fiber_mutex_t* mutex, int cancelable, const struct timespec* deadline)
+{
+    assert(fifo);
+    assert(tokens);
+    return fiber_manager_wait_in_queue_timed(manager, fifo, NULL, tokens, mutex, cancelable, deadline);
+}
+
+static void* fiber_manager_pop_mpsc_entry(mpsc_fifo_t* fifo)
+{
+    mpsc_fifo_node_t* const out = mpsc_fifo_trypop(fifo);
+    if(!out) {
+        return NULL;
+    }
+    void* const entry = out->data;
+    if(fiber_waiter_from_entry(entry)) {
+        //a timed waiter keeps its own node, so this one goes back to the pool
+        fiber_manager_return_mpsc_node(out);
+    } else {
+        fiber_t* const to_schedule = (fiber_t*)entry;
+        assert(!to_schedule->mpsc_fifo_node);
+        to_schedule->mpsc_fifo_node = out;
+    }
+    return entry;
+}
+
 int fiber_manager_wake_from_mpsc_queue(fiber_manager_t* manager, mpsc_fifo_t* fifo, int count)
 {
-    //wake at least 'count' fibers; if count == 0, simply attempt to wake a fiber
-    mpsc_fifo_node_t* out = NULL;
+    //pop up to 'count' entries; if count == 0, pop until a fiber is woken or the queue is empty
+    int pop_count = 0;
     int wake_count = 0;
-    do {
-        if((out = mpsc_fifo_trypop(fifo))) {
-            fiber_t* const to_schedule = (fiber_t*)out->data;
-            assert(!to_schedule->mpsc_fifo_node);
-            to_schedule->mpsc_fifo_node = out;
-            if(to_schedule->state == FIBER_STATE_WAITING) {
-                to_schedule->state = FIBER_STATE_READY;
+    void* entry;
+    while((count ? pop_count < count : !wake_count) && (entry = fiber_manager_pop_mpsc_entry(fifo))) {
+        pop_count += 1;
+        wake_count += fiber_manager_wake_entry(manager, entry);
+    }
+    return wake_count;
+}
+
+int fiber_manager_wake_from_mpsc_queue_with_tokens(fiber_manager_t* manager, mpsc_fifo_t* fifo, volatile int* tokens, int count)
+{
+    assert(tokens);
+    assert(count > 0);
+    int wake_count = 0;
+    while(count > 0) {
+        void* const entry = fiber_manager_pop_mpsc_entry(fifo);
+        if(entry) {
+            fiber_waiter_t* const waiter = fiber_waiter_from_entry(entry);
+            if(waiter && waiter->state == FIBER_WAITER_STALE) {
+                //its fiber took a token instead; it isn't one of the waiters we're after
+                fiber_manager_return_waiter(waiter);
+                continue;
             }
-            fiber_manager_schedule(manager, to_schedule);
-            wake_count += 1;
-        } else if(count > 0) {
-            manager->wake_mpsc_spin_count += 1;
-            fiber_manager_yield(manager);
-            manager = fiber_manager_get();
+            wake_count += fiber_manager_wake_entry(manager, entry);
+            count -= 1;
+            continue;
         }
-    } while(wake_count < count);
+        //the waiter hasn't been queued yet (or is still being queued). leave it a token
+        manager->wake_mpsc_token_count += 1;
+        __sync_add_and_fetch(tokens, 1);
+        store_load_barrier();
+        if(mpsc_fifo_peek(fifo, NULL) && fiber_manager_take_token(tokens)) {
+            //a waiter queued itself before it could see the token - wake it the usual way
+            continue;
+        }
+        wake_count += 1;
+        count -= 1;
+    }
     return wake_count;
 }
 
+static void fiber_manager_schedule_waiting(fiber_manager_t* manager, fiber_t* to_schedule)
+{
+    //the fiber may still be saving its state, in which case the scheduler holds on to it until it's done
+    if(to_schedule->state == FIBER_STATE_WAITING) {
+        to_schedule->state = FIBER_STATE_READY;
+    }
+    fiber_manager_schedule(manager, to_schedule);
+}
+
+//moves the waiter to 'state' and schedules its fiber, marking 'timeout' (if any) as expired first. returns 1 if the fiber
+//was scheduled, 0 if the waiter had already given up or -1 if another of the fiber's waiters claimed its token first
+static int fiber_manager_claim_waiter(fiber_manager_t* manager, fiber_waiter_t* waiter, int state, fiber_timeout_t* timeout)
+{
+    //read first; the waiter can be released as soon as its state changes
+    fiber_t* const to_schedule = waiter->fiber;
+    const uint64_t token = waiter->token;
+    if(!__sync_bool_compare_and_swap(&waiter->state, FIBER_WAITER_WAITING, state)
+       && (state != FIBER_WAITER_WOKEN || !__sync_bool_compare_and_swap(&waiter->state, FIBER_WAITER_MOVED, state))) {
+        return 0;
+    }
+    if(token && !__sync_bool_compare_and_swap(&to_schedule->wait_token, token, token + 1)) {
+        return -1;
+    }
+    if(timeout) {
+        timeout->expired = 1;
+    }
+    fiber_manager_schedule_waiting(manager, to_schedule);
+    return 1;
+}
+
+int fiber_manager_wake_waiter(fiber_manager_t* manager, fiber_waiter_t* waiter)
+{
+    return fiber_manager_claim_waiter(manager, waiter, FIBER_WAITER_WOKEN, NULL) > 0;
+}
+
+int fiber_manager_wake_entry(fiber_manager_t* manager, void* entry)
+{
+    fiber_waiter_t* const waiter = fiber_waiter_from_entry(entry);
+    if(!waiter) {
+        fiber_manager_schedule_waiting(manager, (fiber_t*)entry);
+        return 1;
+    }
+    const int woken = fiber_manager_claim_waiter(manager, waiter, FIBER_WAITER_WOKEN, NULL);
+    if(!woken) {
+        //the waiter gave up and left its entry for us to release
+        fiber_manager_return_waiter(waiter);
+    }
+    //otherwise the waiter's fiber releases it
+    return woken > 0;
+}
+
+static void fiber_manager_abandon_waiter(fiber_timeout_t* timeout, int state)
+{
+    fiber_manager_claim_waiter(fiber_manager_get(), (fiber_waiter_t*)timeout->data, state, timeout);
+}
+
+static void fiber_manager_waiter_timed_out(fiber_timeout_t* timeout)
+{
+    fiber_manager_abandon_waiter(timeout, FIBER_WAITER_TIMEDOUT);
+}
+
+void fiber_manager_cancel_waiter(fiber_timeout_t* point)
+{
+    fiber_manager_abandon_waiter(point, FIBER_WAITER_CANCELED);
+}
+
+void fiber_manager_start_waiter_timeout(fiber_timeout_t* timeout, fiber_waiter_t* waiter, const struct timespec* deadline)
+{
+    assert(timeout);
+    assert(waiter);
+    assert(waiter->fiber->state != FIBER_STATE_RUNNING);
+    timeout->callback = &fiber_manager_waiter_timed_out;
+    timeout->data = waiter;
+    timeout->expired = 0;
+    fiber_timeout_start(timeout, deadline);
+}
+
+int fiber_manager_stop_waiter_timeout(fiber_timeout_t* timeout)
+{
+    assert(timeout);
+    fiber_timeout_stop(timeout);
+    if(timeout->expired) {
+        errno = ETIMEDOUT;
+        return FIBER_ERROR;
+    }
+    return FIBER_SUCCESS;
+}
+
+int fiber_manager_arm_cancel(fiber_manager_t* manager, fiber_timeout_t* point, fiber_timeout_callback_t callback, void* data)
+{
+    assert(manager);
+    assert(point);
+    assert(callback);
+    fiber_t* const this_fiber = manager->current_fiber;
+    point->callback = callback;
+    point->data = data;
+    point->expired = 0;
+    fiber_spinlock_lock(&this_fiber->cancel_lock);
+    if(this_fiber->cancel_pending) {
+        this_fiber->cancel_pending = 0;
+        fiber_spinlock_unlock(&this_fiber->cancel_lock);
+        errno = ECANCELED;
+        return FIBER_ERROR;
+    }
+    this_fiber->cancel_point = point;
+    //fiber_cancel() has to wait until this fiber has switched out before it can fire the point
+    manager->cancel_lock_to_unlock = &this_fiber->cancel_lock;
+    return FIBER_SUCCESS;
+}
+
+void fiber_manager_abort_cancel(fiber_manager_t* manager, fiber_timeout_t* point)
+{
+    assert(manager);
+    fiber_t* const this_fiber = manager->current_fiber;
+    assert(this_fiber->cancel_point == point);
+    this_fiber->cancel_point = NULL;
+    manager->cancel_lock_to_unlock = NULL;
+    fiber_spinlock_unlock(&this_fiber->cancel_lock);
+}
+
+int fiber_manager_disarm_cancel(fiber_timeout_t* point)
+{
+    assert(point);
+    fiber_t* const this_fiber = fiber_manager_get()->current_fiber;
+    //taking the lock waits out a fiber_cancel() which is still using the point
+    fiber_spinlock_lock(&this_fiber->cancel_lock);
+    this_fiber->cancel_point = NULL;
+    fiber_spinlock_unlock(&this_fiber->cancel_lock);
+    if(point->expired) {
+        errno = ECANCELED;
+        return FIBER_ERROR;
+    }
+    return FIBER_SUCCESS;
+}
+
 void fiber_manager_set_and_wait(fiber_manager_t* manager, void** location, void* value)
 {
     assert(manager);
@@ -525,14 +970,32 @@ hazard_pointer_thread_record_t* fiber_manager_get_hazard_record(fiber_manager_t*
     return manager->mpmc_hptr;
 }
 
+static lockfree_ring_buffer_t* fiber_manager_get_pool(lockfree_ring_buffer_t* volatile* pool)
+{
+    lockfree_ring_buffer_t* free_nodes = *pool;
+    if(!free_nodes) {
+        free_nodes = lockfree_ring_buffer_create(10);
+        if(!__sync_bool_compare_and_swap(pool, NULL, free_nodes)) {
+            lockfree_ring_buffer_destroy(free_nodes);
+            free_nodes = *pool;
+        }
+    }
+    return free_nodes;
+}
+
+static void fiber_manager_return_to_pool(lockfree_ring_buffer_t* volatile* pool, void* node)
+{
+    lockfree_ring_buffer_t* const free_nodes = *pool;
+    if(!free_nodes || !lockfree_ring_buffer_trypush(free_nodes, node)) {
+        free(node);
+    }
+}
+
 static lockfree_ring_buffer_t* volatile fiber_free_mpmc_nodes = NULL;
 
 static void fiber_manager_return_mpmc_node_internal(void* user_data, hazard_node_t* hazard)
 {
-    lockfree_ring_buffer_t* const free_nodes = fiber_free_mpmc_nodes;
-    if(!free_nodes || !lockfree_ring_buffer_trypush(free_nodes, hazard)) {
-        free(hazard);
-    }
+    fiber_manager_return_to_pool(&fiber_free_mpmc_nodes, hazard);
 }
 
 void fiber_manager_return_mpmc_node(mpmc_fifo_node_t* node)
@@ -542,15 +1005,7 @@ void fiber_manager_return_mpmc_node(mpmc_fifo_node_t* node)
 
 mpmc_fifo_node_t* fiber_manager_get_mpmc_node()
 {
-    lockfree_ring_buffer_t* free_nodes = fiber_free_mpmc_nodes;
-    if(!free_nodes) {
-        free_nodes = lockfree_ring_buffer_create(10);
-        if(!__sync_bool_compare_and_swap(&fiber_free_mpmc_nodes, NULL, free_nodes)) {
-            lockfree_ring_buffer_destroy(free_nodes);
-            free_nodes = fiber_free_mpmc_nodes;
-        }
-    }
-    mpmc_fifo_node_t* ret = lockfree_ring_buffer_trypop(free_nodes);
+    mpmc_fifo_node_t* ret = lockfree_ring_buffer_trypop(fiber_manager_get_pool(&fiber_free_mpmc_nodes));
     if(!ret) {
         ret = (mpmc_fifo_node_t*)malloc(sizeof(*ret));
         assert(ret);
@@ -560,6 +1015,43 @@ mpmc_fifo_node_t* fiber_manager_get_mpmc_node()
     return ret;
 }
 
+static lockfree_ring_buffer_t* volatile fiber_free_mpsc_nodes = NULL;
+
+void fiber_manager_return_mpsc_node(mpsc_fifo_node_t* node)
+{
+    fiber_manager_return_to_pool(&fiber_free_mpsc_nodes, node);
+}
+
+mpsc_fifo_node_t* fiber_manager_get_mpsc_node()
+{
+    mpsc_fifo_node_t* ret = lockfree_ring_buffer_trypop(fiber_manager_get_pool(&fiber_free_mpsc_nodes));
+    if(!ret) {
+        ret = (mpsc_fifo_node_t*)calloc(1, sizeof(*ret));
+        assert(ret);
+    }
+    return ret;
+}
+
+static lockfree_ring_buffer_t* volatile fiber_free_waiters = NULL;
+
+void fiber_manager_return_waiter(fiber_waiter_t* waiter)
+{
+    fiber_manager_return_to_pool(&fiber_free_waiters, waiter);
+}
+
+fiber_waiter_t* fiber_manager_get_waiter(fiber_t* fiber)
+{
+    fiber_waiter_t* ret = lockfree_ring_buffer_trypop(fiber_manager_get_pool(&fiber_free_waiters));
+    if(!ret) {
+        ret = (fiber_waiter_t*)malloc(sizeof(*ret));
+        assert(ret);
+    }
+    ret->fiber = fiber;
+    ret->state = FIBER_WAITER_WAITING;
+    ret->token = 0;
+    return ret;
+}
+
 void fiber_manager_stats(fiber_manager_t* manager, fiber_manager_stats_t* out)
 {
     assert(manager);
@@ -570,10 +1062,13 @@ void fiber_manager_stats(fiber_manager_t* manager, fiber_manager_stats_t* out)
     out->signal_spin_count += manager->signal_spin_count;
     out->multi_signal_spin_count += manager->multi_signal_spin_count;
     out->wake_mpsc_spin_count += manager->wake_mpsc_spin_count;
+    out->wake_mpsc_token_count += manager->wake_mpsc_token_count;
     out->wake_mpmc_spin_count += manager->wake_mpmc_spin_count;
     out->poll_count += manager->poll_count;
     out->event_wait_count += manager->event_wait_count;
     out->lock_contention_count += manager->lock_contention_count;
+    out->busy_poll_usecs += manager->busy_poll_usecs;
+    out->blocked_poll_usecs += manager->blocked_poll_usecs;
 }
 
 void fiber_manager_all_stats(fiber_manager_stats_t* out)
@@ -15,16 +15,30 @@
  */
 
 #include "fiber_mutex.h"
+#include "fiber_lock_profile.h"
 #include "fiber_manager.h"
 #include "../include/machine_specific.h"
 #include "../include/fiber_context.h"
 #include "../include/mpsc_fifo.h"
 #include "../include/fiber_manager.h"
+#include <errno.h>
 
 int fiber_mutex_init(fiber_mutex_t* mutex)
+{
+    return fiber_mutex_init_with_flags(mutex, FIBER_MUTEX_HANDOFF);
+}
+
+int fiber_mutex_init_with_flags(fiber_mutex_t* mutex, int flags)
 {
     assert(mutex);
+    assert(!(flags & ~(FIBER_MUTEX_BARGING | FIBER_MUTEX_ADAPTIVE)));
     mutex->counter = 1;
+    mutex->flags = flags;
+    mutex->owner = NULL;
+    mutex->spin_limit = 0;
+    mutex->waiting = 0;
+    mutex->woken = 0;
+    mutex->wake_tokens = 0;
     if(!mpsc_fifo_init(&mutex->waiters)) {
         return FIBER_ERROR;
     }
@@ -36,63 +50,277 @@ int fiber_mutex_destroy(fiber_mutex_t* mutex)
 {
     assert(mutex);
     mutex->counter = 1;
+    //release any entries left behind by waiters which timed out or were canceled
+    fiber_manager_wake_from_mpsc_queue(fiber_manager_get(), &mutex->waiters, 0);
     mpsc_fifo_destroy(&mutex->waiters);
     return FIBER_SUCCESS;
 }
 
-int fiber_mutex_lock(fiber_mutex_t* mutex)
+static inline void fiber_mutex_set_owner(fiber_mutex_t* mutex, fiber_manager_t* manager)
 {
-    assert(mutex);
+    if(mutex->flags & FIBER_MUTEX_ADAPTIVE) {
+        mutex->owner = manager->current_fiber;
+    }
+}
+
+//returns 1 if the lock was taken by spinning. spinning only makes sense while the owner is running on another
+//manager - otherwise it can't release the lock until we yield. the limit adapts to how long recent spins took
+static int fiber_mutex_spin(fiber_mutex_t* mutex, fiber_manager_t* manager)
+{
+    if(!(mutex->flags & FIBER_MUTEX_ADAPTIVE)) {
+        return 0;
+    }
+    const int spin_limit = mutex->spin_limit;
+    const int max_spins = spin_limit * 2 + 10 < FIBER_MUTEX_MAX_SPIN ? spin_limit * 2 + 10 : FIBER_MUTEX_MAX_SPIN;
+    int spins = 0;
+    int acquired = 0;
+    for(; spins < max_spins; ++spins) {
+        if(mutex->counter == 1 && __sync_bool_compare_and_swap(&mutex->counter, 1, 0)) {
+            acquired = 1;
+            break;
+        }
+        //fibers are never freed, so a stale owner is harmless
+        struct fiber* const owner = mutex->owner;
+        if(!owner || owner->state != FIBER_STATE_RUNNING) {
+            break;
+        }
+        cpu_relax();
+    }
+    manager->spin_count += spins;
+    mutex->spin_limit = spin_limit + (spins - spin_limit) / 8;
+    return acquired;
+}
+
+//a barging mutex's waiters count themselves in 'waiting' before their last attempt at the lock. a fiber which
+//fails queues an entry (a dead one if it's canceled or times out); one which succeeds takes its count back. an
+//unlocker takes a count and pops an entry while still holding the lock, so the entry is sure to show up
+static int fiber_mutex_lock_barging(fiber_mutex_t* mutex, fiber_manager_t* manager, int cancelable, const struct timespec* deadline)
+{
+    manager->lock_contention_count += 1;
+    while(1) {
+        __sync_add_and_fetch(&mutex->waiting, 1);
+        if(__sync_bool_compare_and_swap(&mutex->counter, 1, 0)) {
+            __sync_sub_and_fetch(&mutex->waiting, 1);
+            fiber_mutex_set_owner(mutex, manager);
+            return FIBER_SUCCESS;
+        }
+        if(!fiber_manager_wait_in_mpsc_queue_with_tokens(manager, &mutex->waiters, &mutex->wake_tokens, NULL, cancelable, deadline)) {
+            return FIBER_ERROR;
+        }
+        manager = fiber_manager_get();
+        //our waker won't wake anyone else until we've tried again
+        mutex->woken = 0;
+        if(fiber_mutex_spin(mutex, manager)) {
+            fiber_mutex_set_owner(mutex, manager);
+            return FIBER_SUCCESS;
+        }
+    }
+}
+
+static int fiber_mutex_lock_contended(fiber_mutex_t* mutex, int cancelable, const struct timespec* deadline)
+{
+    fiber_manager_t* const manager = fiber_manager_get();
+    if(fiber_mutex_spin(mutex, manager)) {
+        fiber_mutex_set_owner(mutex, manager);
+        return FIBER_SUCCESS;
+    }
+    if(mutex->flags & FIBER_MUTEX_BARGING) {
+        return fiber_mutex_lock_barging(mutex, manager, cancelable, deadline);
+    }
 
     const int val = __sync_sub_and_fetch(&mutex->counter, 1);
     if(val == 0) {
-        //we just got the lock, there was no contention
+        fiber_mutex_set_owner(mutex, manager);
         return FIBER_SUCCESS;
     }
 
-    //we failed to acquire the lock (there's contention). we'll wait.
-    fiber_manager_t* const manager = fiber_manager_get();
+    //we failed to acquire the lock (there's contention). we'll wait, unless we're canceled. a canceled or timed out
+    //waiter's decrement of the counter stays; whoever pops its entry undoes it (see fiber_mutex_unlock_internal)
     manager->lock_contention_count += 1;
-    fiber_manager_wait_in_mpsc_queue(manager, &mutex->waiters);
-
+    if(!fiber_manager_wait_in_mpsc_queue_with_tokens(manager, &mutex->waiters, &mutex->wake_tokens, NULL, cancelable, deadline)) {
+        return FIBER_ERROR;
+    }
+    //the unlocker handed the lock to us
+    fiber_mutex_set_owner(mutex, fiber_manager_get());
     return FIBER_SUCCESS;
 }
 
+static inline int fiber_mutex_try_acquire(fiber_mutex_t* mutex)
+{
+    if(__sync_bool_compare_and_swap(&mutex->counter, 1, 0)) {
+        //we just got the lock, there was no contention
+        if(mutex->flags & FIBER_MUTEX_ADAPTIVE) {
+            fiber_mutex_set_owner(mutex, fiber_manager_get());
+        }
+        return FIBER_SUCCESS;
+    }
+    return FIBER_ERROR;
+}
+
+//the number of fibers waiting for the lock, for the contention profile
+static inline int fiber_mutex_waiters(fiber_mutex_t* mutex)
+{
+    const int waiters = (mutex->flags & FIBER_MUTEX_BARGING) ? mutex->waiting : -mutex->counter;
+    return waiters > 0 ? waiters : 0;
+}
+
+int fiber_mutex_lock(fiber_mutex_t* mutex)
+{
+    assert(mutex);
+
+    if(fiber_mutex_try_acquire(mutex)) {
+        FIBER_LOCK_PROFILE_ACQUIRED(mutex, FIBER_LOCK_PROFILE_MUTEX);
+        return FIBER_SUCCESS;
+    }
+    FIBER_LOCK_PROFILE_WAIT(profile, fiber_mutex_waiters(mutex));
+    const int ret = fiber_mutex_lock_contended(mutex, 1, NULL);
+    if(ret) {
+        FIBER_LOCK_PROFILE_WAITED(mutex, FIBER_LOCK_PROFILE_MUTEX, profile);
+    }
+    return ret;
+}
+
+int fiber_mutex_lock_internal(fiber_mutex_t* mutex)
+{
+    assert(mutex);
+
+    if(fiber_mutex_try_acquire(mutex)) {
+        FIBER_LOCK_PROFILE_ACQUIRED(mutex, FIBER_LOCK_PROFILE_MUTEX);
+        return FIBER_SUCCESS;
+    }
+    FIBER_LOCK_PROFILE_WAIT(profile, fiber_mutex_waiters(mutex));
+    const int ret = fiber_mutex_lock_contended(mutex, 0, NULL);
+    if(ret) {
+        FIBER_LOCK_PROFILE_WAITED(mutex, FIBER_LOCK_PROFILE_MUTEX, profile);
+    }
+    return ret;
+}
+
+int fiber_mutex_lock_timed(fiber_mutex_t* mutex, const struct timespec* deadline)
+{
+    assert(mutex);
+    assert(deadline);
+
+    if(fiber_mutex_try_acquire(mutex)) {
+        FIBER_LOCK_PROFILE_ACQUIRED(mutex, FIBER_LOCK_PROFILE_MUTEX);
+        return FIBER_SUCCESS;
+    }
+    if(fiber_deadline_passed(deadline)) {
+        errno = ETIMEDOUT;
+        return FIBER_ERROR;
+    }
+    FIBER_LOCK_PROFILE_WAIT(profile, fiber_mutex_waiters(mutex));
+    const int ret = fiber_mutex_lock_contended(mutex, 1, deadline);
+    if(ret) {
+        FIBER_LOCK_PROFILE_WAITED(mutex, FIBER_LOCK_PROFILE_MUTEX, profile);
+    }
+    return ret;
+}
+
 int fiber_mutex_trylock(fiber_mutex_t* mutex)
 {
     assert(mutex);
 
-    if(__sync_bool_compare_and_swap(&mutex->counter, 1, 0)) {
-        //we just got the lock, there was no contention
+    if(fiber_mutex_try_acquire(mutex)) {
+        FIBER_LOCK_PROFILE_ACQUIRED(mutex, FIBER_LOCK_PROFILE_MUTEX);
         return FIBER_SUCCESS;
     }
     return FIBER_ERROR;
 }
 
+//wakes a waiter, which then has to compete for the lock, unless one woken earlier hasn't tried yet. returns 1 if a
+//fiber was woken
+static int fiber_mutex_unlock_barging(fiber_mutex_t* mutex)
+{
+    int woken = 0;
+    do {
+        while(mutex->waiting > 0 && !mutex->woken) {
+            __sync_sub_and_fetch(&mutex->waiting, 1);
+            mutex->woken = 1;
+            if(fiber_manager_wake_from_mpsc_queue_with_tokens(fiber_manager_get(), &mutex->waiters, &mutex->wake_tokens, 1)) {
+                woken = 1;
+                break;
+            }
+            //the entry belonged to a waiter which gave up
+            mutex->woken = 0;
+        }
+        __sync_add_and_fetch(&mutex->counter, 1);
+        //a fiber which counted itself after we looked (or the one we woke, if it ran elsewhere already) may have
+        //failed to take the lock before we released it. if nobody else has taken it since, wake it on its behalf
+    } while(mutex->waiting > 0 && !mutex->woken && __sync_bool_compare_and_swap(&mutex->counter, 1, 0));
+    return woken;
+}
+
 int fiber_mutex_unlock_internal(fiber_mutex_t* mutex)
 {
     assert(mutex);
 
+    FIBER_LOCK_PROFILE_RELEASED(mutex);
+    mutex->owner = NULL;
+    if(mutex->flags & FIBER_MUTEX_BARGING) {
+        return fiber_mutex_unlock_barging(mutex);
+    }
+
     //assumption: the atomic operation below provides read/write ordering (ie. read and writes performed before unlocking actually occur before unlocking)
 
-    //unlock and wake a waiting fiber if there is one
-    const int new_val = __sync_add_and_fetch(&mutex->counter, 1);
-    if (new_val != 1) {
-        fiber_manager_wake_from_mpsc_queue(fiber_manager_get(), &mutex->waiters, 1);
-        return 1;
+    //unlock and wake a waiting fiber if there is one. if the waiter we pop had timed out, it never got
+    //the lock - release it again on the waiter's behalf
+    while(__sync_add_and_fetch(&mutex->counter, 1) != 1) {
+        if(fiber_manager_wake_from_mpsc_queue_with_tokens(fiber_manager_get(), &mutex->waiters, &mutex->wake_tokens, 1)) {
+            return 1;
+        }
     }
-    
+
     return 0;
 }
 
 int fiber_mutex_unlock(fiber_mutex_t* mutex)
 {
     const int contended = fiber_mutex_unlock_internal(mutex);
-    if(contended) {
-        //the lock was contended - be nice and let the waiter run
+    if(contended && !(mutex->flags & FIBER_MUTEX_BARGING)) {
+        //the lock was handed to a waiter - be nice and let it run. a barging unlocker keeps going; the waiter will
+        //take the lock if it's free when it runs
         fiber_yield();
     }
 
     return FIBER_SUCCESS;
 }
 
+int fiber_mutex_requeue_waiter(fiber_mutex_t* mutex, struct fiber_waiter* waiter)
+{
+    assert(mutex);
+    assert(waiter);
+
+    if(mutex->flags & FIBER_MUTEX_BARGING) {
+        return FIBER_ERROR;
+    }
+    fiber_manager_t* const manager = fiber_manager_get();
+    if(mutex->counter == 1 && __sync_bool_compare_and_swap(&mutex->counter, 1, 0)) {
+        //the lock is free - take it on the waiter's behalf and wake it right away
+        if(!fiber_manager_wake_entry(manager, fiber_waiter_to_entry(waiter))) {
+            //it gave up in the meantime
+            fiber_mutex_unlock_internal(mutex);
+        }
+        return FIBER_SUCCESS;
+    }
+
+    //unlike a locking fiber, the entry is queued before it's counted: its fiber is asleep and can't take a wake token,
+    //so an unlocker must never need to leave it one. if the lock was released before we counted the entry, or an
+    //unlocker left a token for an entry it couldn't see yet, we hold the lock for a queued entry whose count has been
+    //spent. count it again and hand the lock to the oldest waiter
+    mpsc_fifo_node_t* const node = fiber_manager_get_mpsc_node();
+    node->data = fiber_waiter_to_entry(waiter);
+    mpsc_fifo_push(&mutex->waiters, node);
+    if(__sync_sub_and_fetch(&mutex->counter, 1) == 0 || fiber_manager_take_token(&mutex->wake_tokens)) {
+        __sync_sub_and_fetch(&mutex->counter, 1);
+        fiber_mutex_unlock_internal(mutex);
+    }
+    return FIBER_SUCCESS;
+}
+
+void fiber_mutex_lock_requeued(fiber_mutex_t* mutex)
+{
+    assert(mutex);
+    fiber_mutex_set_owner(mutex, fiber_manager_get());
+    FIBER_LOCK_PROFILE_ACQUIRED(mutex, FIBER_LOCK_PROFILE_MUTEX);
+}
@@ -0,0 +1,134 @@
+/*
+ * Copyright (c) 2012-2015, Brian Watling and other contributors
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include "fiber_rcu.h"
+#include "fiber_address.h"
+#include <limits.h>
+
+volatile uint64_t fiber_rcu_epoch = 0;
+//the latest grace period known to have ended
+static volatile uint64_t fiber_rcu_completed = 0;
+//bumped whenever fiber_rcu_completed moves, for fiber_rcu_synchronize() to wait on
+static volatile int fiber_rcu_completions = 0;
+
+//completes every grace period which all of the running managers have seen
+static void fiber_rcu_check_completed()
+{
+    //read first. an idle manager can't be holding anything from before a grace period that has already started
+    uint64_t oldest = fiber_rcu_epoch;
+    load_load_barrier();
+    const int count = fiber_manager_get_kernel_thread_count();
+    int i;
+    for(i = 0; i < count; ++i) {
+        fiber_manager_t* const manager = fiber_manager_get_by_id(i);
+        if(!manager->rcu_idle && manager->rcu_epoch < oldest) {
+            oldest = manager->rcu_epoch;
+        }
+    }
+    uint64_t completed;
+    while((completed = fiber_rcu_completed) < oldest) {
+        if(__sync_bool_compare_and_swap(&fiber_rcu_completed, completed, oldest)) {
+            __sync_fetch_and_add(&fiber_rcu_completions, 1);
+            fiber_wake_address(&fiber_rcu_completions, INT_MAX);
+            break;
+        }
+    }
+}
+
+//starts a new grace period and returns it. the caller must be quiescent
+static uint64_t fiber_rcu_start(fiber_manager_t* manager)
+{
+    //a full barrier, so whatever the caller unpublished is gone before any manager sees the new grace period
+    const uint64_t epoch = __sync_add_and_fetch(&fiber_rcu_epoch, 1);
+    manager->rcu_epoch = epoch;
+    store_load_barrier();
+    fiber_rcu_check_completed();
+    return epoch;
+}
+
+void fiber_rcu_quiescent_slow(fiber_manager_t* manager)
+{
+    const uint64_t epoch = fiber_rcu_epoch;
+    if(manager->rcu_epoch != epoch) {
+        //the reads made by fibers on this manager so far come before the store, and the store before the scan
+        store_load_barrier();
+        manager->rcu_epoch = epoch;
+        store_load_barrier();
+        fiber_rcu_check_completed();
+    }
+    if(manager->rcu_waiting && fiber_rcu_completed >= manager->rcu_waiting_epoch) {
+        fiber_rcu_head_t* head = manager->rcu_waiting;
+        manager->rcu_waiting = NULL;
+        while(head) {
+            fiber_rcu_head_t* const next = head->next;
+            head->callback(head);
+            head = next;
+        }
+    }
+    if(!manager->rcu_waiting && manager->rcu_next) {
+        //the next batch waits for a grace period of its own
+        manager->rcu_waiting = manager->rcu_next;
+        manager->rcu_next = NULL;
+        manager->rcu_waiting_epoch = fiber_rcu_start(manager);
+    }
+}
+
+void fiber_rcu_enter_idle(fiber_manager_t* manager)
+{
+    assert(manager);
+    manager->rcu_idle = 1;
+    store_load_barrier();
+    //a grace period may have been waiting on this manager alone
+    fiber_rcu_check_completed();
+}
+
+void fiber_rcu_exit_idle(fiber_manager_t* manager)
+{
+    assert(manager);
+    manager->rcu_idle = 0;
+    //the flag has to be visible before the fibers about to run read anything
+    store_load_barrier();
+    fiber_rcu_quiescent(manager);
+}
+
+void fiber_rcu_synchronize()
+{
+    const uint64_t epoch = fiber_rcu_start(fiber_manager_get());
+    while(1) {
+        const int completions = fiber_rcu_completions;
+        load_load_barrier();
+        if(fiber_rcu_completed >= epoch) {
+            break;
+        }
+        //waiting yields, which is a quiescent state for this manager
+        fiber_wait_address_internal(&fiber_rcu_completions, completions, NULL);
+    }
+    //the caller's frees come after the readers are done
+    store_load_barrier();
+}
+
+void fiber_rcu_call(fiber_rcu_head_t* head, fiber_rcu_callback_t callback)
+{
+    assert(head);
+    assert(callback);
+    //only this manager touches its batch, and fibers aren't preempted, so no atomics are needed
+    fiber_manager_t* const manager = fiber_manager_get();
+    head->callback = callback;
+    head->next = manager->rcu_next;
+    manager->rcu_next = head;
+}
+
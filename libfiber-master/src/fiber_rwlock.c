@@ -15,6 +15,7 @@
  */
 
 #include "fiber_rwlock.h"
+#include "fiber_lock_profile.h"
 #include "fiber_manager.h"
 
 #ifdef __GNUC__
@@ -40,6 +41,8 @@ int fiber_rwlock_init(fiber_rwlock_t* rwlock)
         return FIBER_ERROR;
     }
     rwlock->state.blob = 0;
+    rwlock->write_tokens = 0;
+    rwlock->read_tokens = 0;
     write_barrier();
     return FIBER_SUCCESS;
 }
@@ -47,6 +50,9 @@ int fiber_rwlock_init(fiber_rwlock_t* rwlock)
 void fiber_rwlock_destroy(fiber_rwlock_t* rwlock)
 {
     if(rwlock) {
+        //release any entries left behind by waiters which took a token
+        fiber_manager_wake_from_mpsc_queue(fiber_manager_get(), &rwlock->write_waiters, 0);
+        fiber_manager_wake_from_mpsc_queue(fiber_manager_get(), &rwlock->read_waiters, 0);
         mpsc_fifo_destroy(&rwlock->write_waiters);
         mpsc_fifo_destroy(&rwlock->read_waiters);
     }
@@ -64,8 +70,10 @@ int fiber_rwlock_rdlock(fiber_rwlock_t* rwlock)
             current_state.state.waiting_readers += 1;
             if(__sync_bool_compare_and_swap(&rwlock->state.blob, snapshot, current_state.blob)) {
                 //currently write locked or a writer is waiting - be friendly and wait
-                fiber_manager_wait_in_mpsc_queue(fiber_manager_get(), &rwlock->read_waiters);
-                break;
+                FIBER_LOCK_PROFILE_WAIT(profile, current_state.state.waiting_readers - 1 + current_state.state.waiting_writers);
+                fiber_manager_wait_in_mpsc_queue_with_tokens(fiber_manager_get(), &rwlock->read_waiters, &rwlock->read_tokens, NULL, 0, NULL);
+                FIBER_LOCK_PROFILE_WAITED(rwlock, FIBER_LOCK_PROFILE_RWLOCK_READ, profile);
+                return FIBER_SUCCESS;
             }
         } else {
             current_state.state.reader_count += 1;
@@ -75,6 +83,7 @@ int fiber_rwlock_rdlock(fiber_rwlock_t* rwlock)
             }
         }
     }
+    FIBER_LOCK_PROFILE_ACQUIRED(rwlock, FIBER_LOCK_PROFILE_RWLOCK_READ);
     return FIBER_SUCCESS;
 }
 
@@ -90,8 +99,10 @@ int fiber_rwlock_wrlock(fiber_rwlock_t* rwlock)
             current_state.state.waiting_writers += 1;
             if(__sync_bool_compare_and_swap(&rwlock->state.blob, snapshot, current_state.blob)) {
                 //currently locked or a reader is waiting - be friendly and wait
-                fiber_manager_wait_in_mpsc_queue(fiber_manager_get(), &rwlock->write_waiters);
-                break;
+                FIBER_LOCK_PROFILE_WAIT(profile, current_state.state.waiting_writers - 1 + current_state.state.waiting_readers);
+                fiber_manager_wait_in_mpsc_queue_with_tokens(fiber_manager_get(), &rwlock->write_waiters, &rwlock->write_tokens, NULL, 0, NULL);
+                FIBER_LOCK_PROFILE_WAITED(rwlock, FIBER_LOCK_PROFILE_RWLOCK_WRITE, profile);
+                return FIBER_SUCCESS;
             }
         } else {
             current_state.state.write_locked = 1;
@@ -101,6 +112,7 @@ int fiber_rwlock_wrlock(fiber_rwlock_t* rwlock)
             }
         }
     }
+    FIBER_LOCK_PROFILE_ACQUIRED(rwlock, FIBER_LOCK_PROFILE_RWLOCK_WRITE);
     return FIBER_SUCCESS;
 }
 
@@ -120,6 +132,7 @@ int fiber_rwlock_tryrdlock(fiber_rwlock_t* rwlock)
             break;
         }
     }
+    FIBER_LOCK_PROFILE_ACQUIRED(rwlock, FIBER_LOCK_PROFILE_RWLOCK_READ);
     return FIBER_SUCCESS;
 }
 
@@ -139,6 +152,7 @@ int fiber_rwlock_trywrlock(fiber_rwlock_t* rwlock)
             break;
         }
     }
+    FIBER_LOCK_PROFILE_ACQUIRED(rwlock, FIBER_LOCK_PROFILE_RWLOCK_WRITE);
     return FIBER_SUCCESS;
 }
 
@@ -161,7 +175,7 @@ int fiber_rwlock_rdunlock(fiber_rwlock_t* rwlock)
                 current_state.state.write_locked = 1;
                 current_state.state.waiting_writers -= 1;
                 if(__sync_bool_compare_and_swap(&rwlock->state.blob, snapshot, current_state.blob)) {
-                    fiber_manager_wake_from_mpsc_queue(fiber_manager_get(), &rwlock->write_waiters, 1);
+                    fiber_manager_wake_from_mpsc_queue_with_tokens(fiber_manager_get(), &rwlock->write_waiters, &rwlock->write_tokens, 1);
                     break;
                 }
                 continue;
@@ -171,7 +185,7 @@ int fiber_rwlock_rdunlock(fiber_rwlock_t* rwlock)
                 current_state.state.reader_count = current_state.state.waiting_readers;
                 current_state.state.waiting_readers = 0;
                 if(__sync_bool_compare_and_swap(&rwlock->state.blob, snapshot, current_state.blob)) {
-                    fiber_manager_wake_from_mpsc_queue(fiber_manager_get(), &rwlock->read_waiters, current_state.state.reader_count);
+                    fiber_manager_wake_from_mpsc_queue_with_tokens(fiber_manager_get(), &rwlock->read_waiters, &rwlock->read_tokens, current_state.state.reader_count);
                     break;
                 }
                 continue;
@@ -188,6 +202,8 @@ int fiber_rwlock_wrunlock(fiber_rwlock_t* rwlock)
 {
     assert(rwlock);
 
+    FIBER_LOCK_PROFILE_RELEASED(rwlock);
+
     fiber_rwlock_state_t current_state;
     while(1) {
         const uint64_t snapshot = rwlock->state.blob;
@@ -202,7 +218,7 @@ int fiber_rwlock_wrunlock(fiber_rwlock_t* rwlock)
             current_state.state.write_locked = 1;
             current_state.state.waiting_writers -= 1;
             if(__sync_bool_compare_and_swap(&rwlock->state.blob, snapshot, current_state.blob)) {
-                fiber_manager_wake_from_mpsc_queue(fiber_manager_get(), &rwlock->write_waiters, 1);
+                fiber_manager_wake_from_mpsc_queue_with_tokens(fiber_manager_get(), &rwlock->write_waiters, &rwlock->write_tokens, 1);
                 break;
             }
             continue;
@@ -212,7 +228,7 @@ int fiber_rwlock_wrunlock(fiber_rwlock_t* rwlock)
             current_state.state.reader_count = current_state.state.waiting_readers;
             current_state.state.waiting_readers = 0;
             if(__sync_bool_compare_and_swap(&rwlock->state.blob, snapshot, current_state.blob)) {
-                fiber_manager_wake_from_mpsc_queue(fiber_manager_get(), &rwlock->read_waiters, current_state.state.reader_count);
+                fiber_manager_wake_from_mpsc_queue_with_tokens(fiber_manager_get(), &rwlock->read_waiters, &rwlock->read_tokens, current_state.state.reader_count);
                 break;
             }
             continue;
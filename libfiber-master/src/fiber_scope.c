@@ -0,0 +1,186 @@
+/*
+ * Copyright (c) 2012-2015, Brian Watling and other contributors
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "fiber_scope.h"
+#include "fiber_manager.h"
+#include <errno.h>
+#include <stdlib.h>
+
+struct fiber_scope_child
+{
+    fiber_scope_t* scope;
+    fiber_scope_function_t fn;
+    void* param;
+    fiber_t* fiber;
+    fiber_scope_child_t* prev;
+    fiber_scope_child_t* next;
+};
+
+int fiber_scope_init(fiber_scope_t* scope)
+{
+    assert(scope);
+    fiber_spinlock_init(&scope->lock);
+    scope->children = NULL;
+    scope->remaining = 0;
+    scope->canceled = 0;
+    fiber_signal_init(&scope->done);
+    write_barrier();
+    return FIBER_SUCCESS;
+}
+
+int fiber_scope_destroy(fiber_scope_t* scope)
+{
+    assert(scope);
+    assert(!scope->remaining);
+    fiber_signal_destroy(&scope->done);
+    fiber_spinlock_destroy(&scope->lock);
+    return FIBER_SUCCESS;
+}
+
+//must be called with the scope's lock held
+static void fiber_scope_cancel_children(fiber_scope_t* scope)
+{
+    scope->canceled = 1;
+    fiber_scope_child_t* child;
+    for(child = scope->children; child; child = child->next) {
+        fiber_cancel(child->fiber);
+    }
+}
+
+static void* fiber_scope_run(void* param)
+{
+    fiber_scope_child_t* const child = (fiber_scope_child_t*)param;
+    fiber_scope_t* const scope = child->scope;
+
+    const int ret = child->fn(child->param);
+
+    fiber_spinlock_lock(&scope->lock);
+    if(!ret) {
+        fiber_scope_cancel_children(scope);
+    }
+    //unlink before finishing so a cancel never reaches a fiber which has been recycled
+    if(child->prev) {
+        child->prev->next = child->next;
+    } else {
+        scope->children = child->next;
+    }
+    if(child->next) {
+        child->next->prev = child->prev;
+    }
+    //the waiter may destroy the scope as soon as remaining hits zero, so the signal is raised under the lock
+    //and fiber_scope_wait() takes the lock once before returning
+    if(!__sync_sub_and_fetch(&scope->remaining, 1)) {
+        fiber_signal_raise(&scope->done);
+    }
+    fiber_spinlock_unlock(&scope->lock);
+
+    free(child);
+    return NULL;
+}
+
+int fiber_scope_spawn(fiber_scope_t* scope, size_t stack_size, fiber_scope_function_t fn, void* param)
+{
+    assert(scope);
+    assert(fn);
+
+    fiber_scope_child_t* const child = malloc(sizeof(*child));
+    if(!child) {
+        errno = ENOMEM;
+        return FIBER_ERROR;
+    }
+    child->scope = scope;
+    child->fn = fn;
+    child->param = param;
+    child->fiber = fiber_create_no_sched(stack_size, &fiber_scope_run, child);
+    if(!child->fiber) {
+        free(child);
+        return FIBER_ERROR;
+    }
+    //nobody joins a scoped fiber; it hasn't run yet so there's no need for the exchange in fiber_detach()
+    child->fiber->detach_state = FIBER_DETACH_DETACHED;
+
+    fiber_spinlock_lock(&scope->lock);
+    child->prev = NULL;
+    child->next = scope->children;
+    if(child->next) {
+        child->next->prev = child;
+    }
+    scope->children = child;
+    __sync_fetch_and_add(&scope->remaining, 1);
+    if(scope->canceled) {
+        fiber_cancel(child->fiber);
+    }
+    fiber_spinlock_unlock(&scope->lock);
+
+    fiber_manager_schedule(fiber_manager_get(), child->fiber);
+    return FIBER_SUCCESS;
+}
+
+int fiber_scope_cancel(fiber_scope_t* scope)
+{
+    assert(scope);
+    fiber_spinlock_lock(&scope->lock);
+    fiber_scope_cancel_children(scope);
+    fiber_spinlock_unlock(&scope->lock);
+    return FIBER_SUCCESS;
+}
+
+static int fiber_scope_finish_wait(fiber_scope_t* scope, int timed_out)
+{
+    while(scope->remaining) {
+        if(!fiber_signal_wait(&scope->done)) {
+            //the waiter was canceled; pass it on to the children
+            fiber_scope_cancel(scope);
+        }
+    }
+    //the last child raises the signal under the lock; make sure it's done with the scope
+    fiber_spinlock_lock(&scope->lock);
+    const int canceled = scope->canceled;
+    scope->canceled = 0;
+    fiber_spinlock_unlock(&scope->lock);
+
+    if(timed_out) {
+        errno = ETIMEDOUT;
+        return FIBER_ERROR;
+    }
+    if(canceled) {
+        errno = ECANCELED;
+        return FIBER_ERROR;
+    }
+    return FIBER_SUCCESS;
+}
+
+int fiber_scope_wait(fiber_scope_t* scope)
+{
+    assert(scope);
+    return fiber_scope_finish_wait(scope, 0);
+}
+
+int fiber_scope_wait_timed(fiber_scope_t* scope, const struct timespec* deadline)
+{
+    assert(scope);
+    assert(deadline);
+
+    while(scope->remaining) {
+        if(!fiber_signal_wait_timed(&scope->done, deadline)) {
+            //ETIMEDOUT or ECANCELED; check the clock rather than errno, which is thread local
+            const int timed_out = fiber_deadline_passed(deadline);
+            fiber_scope_cancel(scope);
+            return fiber_scope_finish_wait(scope, timed_out);
+        }
+    }
+    return fiber_scope_finish_wait(scope, 0);
+}
@@ -0,0 +1,271 @@
+/*
+ * Copyright (c) 2012-2015, Brian Watling and other contributors
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "fiber_select.h"
+#include "fiber_manager.h"
+#include <errno.h>
+
+#define FIBER_SELECT_NONE (-1)
+#define FIBER_SELECT_CANCELED (-2)
+
+static fiber_signal_t* fiber_select_signal(fiber_select_case_t* c)
+{
+    if(c->type == FIBER_SELECT_RECEIVE) {
+        return ((fiber_bounded_channel_t*)c->channel)->ready_signal;
+    }
+    if(c->type == FIBER_SELECT_UNBOUNDED_RECEIVE) {
+        return ((fiber_unbounded_channel_t*)c->channel)->ready_signal;
+    }
+    return NULL;
+}
+
+//completes the case if it can be done without blocking, which includes finding its channel closed. fds are only
+//known to be ready once they've been watched
+static int fiber_select_try(fiber_select_case_t* c)
+{
+    int ret = 0;
+    switch(c->type) {
+    case FIBER_SELECT_RECEIVE:
+        ret = fiber_bounded_channel_internal_try_receive((fiber_bounded_channel_t*)c->channel, &c->message);
+        break;
+    case FIBER_SELECT_SEND:
+        ret = fiber_bounded_channel_try_send((fiber_bounded_channel_t*)c->channel, c->message);
+        break;
+    case FIBER_SELECT_UNBOUNDED_RECEIVE: {
+        fiber_unbounded_channel_t* const channel = (fiber_unbounded_channel_t*)c->channel;
+        const int drained = fiber_channel_internal_drained(&channel->senders);
+        c->message = fiber_unbounded_channel_try_receive(channel);
+        ret = c->message ? 1 : (drained ? -1 : 0);
+        break;
+    }
+    default:
+        break;
+    }
+    if(ret < 0) {
+        c->closed = 1;
+        if(c->type != FIBER_SELECT_SEND) {
+            c->message = NULL;
+        }
+        return 1;
+    }
+    return ret;
+}
+
+static int fiber_select_has_space(fiber_bounded_channel_t* channel)
+{
+    const uint64_t low = channel->low;
+    load_load_barrier();
+    const uint64_t high = channel->high;
+    if(high & FIBER_BOUNDED_CHANNEL_CLOSED) {
+        return 1;//ready to fail
+    }
+    return high - low < channel->size && !channel->buffer[high & channel->power_of_2_mod];
+}
+
+static void fiber_select_fd_ready(fiber_timeout_t* watch)
+{
+    fiber_manager_wake_waiter(fiber_manager_get(), (fiber_waiter_t*)watch->data);
+}
+
+//registers a waiter for cases[index]. returns 1 if the case already looks ready
+static int fiber_select_register(fiber_select_case_t* cases, int index, fiber_t* this_fiber, uint64_t token)
+{
+    fiber_select_case_t* const c = &cases[index];
+    c->waiter = NULL;
+
+    if(c->type == FIBER_SELECT_FD) {
+        c->waiter = fiber_manager_get_waiter(this_fiber);
+        c->waiter->token = token;
+        c->watch.callback = &fiber_select_fd_ready;
+        c->watch.data = c->waiter;
+        c->watch.expired = 0;
+        fiber_event_watch(c->fd, c->events, &c->watch);
+        return 0;
+    }
+
+    if(c->type == FIBER_SELECT_SEND) {
+        //queue up like a blocked sender. the entry can outlive the select, so it gets a node from the pool
+        fiber_bounded_channel_t* const channel = (fiber_bounded_channel_t*)c->channel;
+        c->waiter = fiber_manager_get_waiter(this_fiber);
+        c->waiter->token = token;
+        mpsc_fifo_node_t* const node = fiber_manager_get_mpsc_node();
+        node->data = fiber_waiter_to_entry(c->waiter);
+        __sync_fetch_and_add(&channel->send_count, 1);
+        mpsc_fifo_push(&channel->waiters, node);
+        //a slot may have been freed before the entry was queued
+        return fiber_select_has_space(channel);
+    }
+
+    fiber_signal_t* const s = fiber_select_signal(c);
+    int i;
+    for(i = 0; i < index; ++i) {
+        if(fiber_select_signal(&cases[i]) == s) {
+            return 0;//channels can share a signal; one registration covers them all
+        }
+    }
+    fiber_waiter_t* const waiter = fiber_manager_get_waiter(this_fiber);
+    waiter->token = token;
+    fiber_t* const entry = (fiber_t*)fiber_waiter_to_entry(waiter);
+    while(1) {
+        fiber_t* const current = s->waiter;
+        if(current == FIBER_SIGNAL_RAISED) {
+            if(__sync_bool_compare_and_swap(&s->waiter, FIBER_SIGNAL_RAISED, FIBER_SIGNAL_NO_WAITER)) {
+                fiber_manager_return_waiter(waiter);
+                return 1;
+            }
+        } else {
+            assert(current == FIBER_SIGNAL_NO_WAITER && "only one fiber can wait on a signal");
+            if(__sync_bool_compare_and_swap(&s->waiter, FIBER_SIGNAL_NO_WAITER, entry)) {
+                c->waiter = waiter;
+                return 0;
+            }
+        }
+        cpu_relax();
+    }
+}
+
+//takes the case's waiter back. returns 1 if it was an fd watch which fired
+static int fiber_select_deregister(fiber_select_case_t* c)
+{
+    fiber_waiter_t* const waiter = c->waiter;
+    if(!waiter) {
+        return 0;
+    }
+    c->waiter = NULL;
+
+    if(c->type == FIBER_SELECT_FD) {
+        const int fired = !fiber_event_unwatch(c->fd, &c->watch);
+        fiber_manager_return_waiter(waiter);
+        return fired;
+    }
+
+    if(c->type == FIBER_SELECT_SEND) {
+        fiber_bounded_channel_t* const channel = (fiber_bounded_channel_t*)c->channel;
+        int handed_slot = 0;
+        if(__sync_bool_compare_and_swap(&waiter->state, FIBER_WAITER_WAITING, FIBER_WAITER_CANCELED)) {
+            //the entry stays queued; whoever pops it releases the waiter
+        } else {
+            //a receiver popped the entry to hand us a free slot
+            fiber_manager_return_waiter(waiter);
+            handed_slot = 1;
+        }
+        __sync_fetch_and_sub(&channel->send_count, 1);
+        if(handed_slot && channel->ready_signal) {
+            //only the receiver may pop the queue, so have it pass the wake-up on in case another case wins
+            fiber_signal_raise(channel->ready_signal);
+        }
+        return 0;
+    }
+
+    fiber_signal_t* const s = fiber_select_signal(c);
+    if(__sync_bool_compare_and_swap(&s->waiter, fiber_waiter_to_entry(waiter), FIBER_SIGNAL_NO_WAITER)) {
+        fiber_manager_return_waiter(waiter);
+        return 0;
+    }
+    //a raise took the entry and left the signal raised. clear it; the channels are tried again afterwards
+    s->waiter = FIBER_SIGNAL_NO_WAITER;
+    if(!__sync_bool_compare_and_swap(&waiter->state, FIBER_WAITER_WAITING, FIBER_WAITER_CANCELED)) {
+        fiber_manager_return_waiter(waiter);
+    }
+    return 0;
+}
+
+//blocks until one of the cases might be ready. returns the index of an fd case which fired, FIBER_SELECT_NONE if
+//the channels should be tried again, or FIBER_SELECT_CANCELED
+static int fiber_select_wait(fiber_select_case_t* cases, int count, const struct timespec* deadline)
+{
+    fiber_manager_t* manager = fiber_manager_get();
+    fiber_t* const this_fiber = manager->current_fiber;
+
+    //every waiter registered below shares this token. wait_token stays monotonic, so a stale waker can't claim it
+    const uint64_t token = (this_fiber->wait_token | 1) + 1;
+    this_fiber->wait_token = token;
+
+    fiber_waiter_t cancel_waiter = {};
+    cancel_waiter.fiber = this_fiber;
+    cancel_waiter.state = FIBER_WAITER_WAITING;
+    cancel_waiter.token = token;
+    fiber_timeout_t cancel_point;
+    if(!fiber_manager_arm_cancel(manager, &cancel_point, &fiber_manager_cancel_waiter, &cancel_waiter)) {
+        return FIBER_SELECT_CANCELED;
+    }
+
+    //wakers can schedule this fiber as soon as the first waiter is registered
+    this_fiber->state = FIBER_STATE_SAVING_STATE_TO_WAIT;
+    int ready = 0;
+    int i;
+    for(i = 0; i < count; ++i) {
+        ready |= fiber_select_register(cases, i, this_fiber, token);
+    }
+
+    int canceled = 0;
+    if(ready && __sync_bool_compare_and_swap(&this_fiber->wait_token, token, token + 1)) {
+        //claimed our own token, so nothing else will schedule this fiber
+        fiber_manager_abort_cancel(manager, &cancel_point);
+        this_fiber->state = FIBER_STATE_RUNNING;
+    } else {
+        fiber_waiter_t timeout_waiter = {};
+        timeout_waiter.fiber = this_fiber;
+        timeout_waiter.state = FIBER_WAITER_WAITING;
+        timeout_waiter.token = token;
+        fiber_timeout_t timeout;
+        if(deadline) {
+            fiber_manager_start_waiter_timeout(&timeout, &timeout_waiter, deadline);
+        }
+        fiber_manager_yield(manager);
+        manager = fiber_manager_get();
+        if(deadline) {
+            fiber_timeout_stop(&timeout);
+        }
+        canceled = !fiber_manager_disarm_cancel(&cancel_point);
+    }
+
+    int fired = FIBER_SELECT_NONE;
+    for(i = 0; i < count; ++i) {
+        if(fiber_select_deregister(&cases[i]) && fired == FIBER_SELECT_NONE) {
+            fired = i;
+        }
+    }
+    return canceled ? FIBER_SELECT_CANCELED : fired;
+}
+
+int fiber_select(fiber_select_case_t* cases, int count, const struct timespec* deadline)
+{
+    assert(cases);
+    assert(count > 0);
+
+    while(1) {
+        int i;
+        for(i = 0; i < count; ++i) {
+            if(fiber_select_try(&cases[i])) {
+                return i;
+            }
+        }
+        if(deadline && fiber_deadline_passed(deadline)) {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+        const int fired = fiber_select_wait(cases, count, deadline);
+        if(fired == FIBER_SELECT_CANCELED) {
+            errno = ECANCELED;
+            return -1;
+        }
+        if(fired != FIBER_SELECT_NONE) {
+            return fired;
+        }
+    }
+    return -1;
+}
@@ -15,12 +15,16 @@
  */
 
 #include "fiber_semaphore.h"
+#include "fiber_address.h"
+#include "fiber_lock_profile.h"
 #include "fiber_manager.h"
+#include <errno.h>
 
 int fiber_semaphore_init(fiber_semaphore_t* semaphore, int value)
 {
     assert(semaphore);
     semaphore->counter = value;
+    semaphore->collecting = 0;
     mpmc_fifo_node_t* const initial_node = fiber_manager_get_mpmc_node();
     if(!mpmc_fifo_init(&semaphore->waiters, initial_node)) {
         fiber_manager_return_mpmc_node(initial_node);
@@ -34,6 +38,10 @@ int fiber_semaphore_destroy(fiber_semaphore_t* semaphore)
 {
     assert(semaphore);
     semaphore->counter = 0;
+    //release any entries left behind by waiters which timed out or were canceled
+    while(fiber_manager_wake_from_mpmc_queue(fiber_manager_get(), &semaphore->waiters, 0) < 0) {
+        //keep going until the queue is empty
+    }
     mpmc_fifo_destroy(fiber_manager_get_hazard_record(fiber_manager_get()), &semaphore->waiters);
     return FIBER_SUCCESS;
 }
@@ -45,47 +53,142 @@ int fiber_semaphore_wait(fiber_semaphore_t* semaphore)
     const int val = __sync_sub_and_fetch(&semaphore->counter, 1);
     if(val >= 0) {
         //we just got in, there was no contention
+        FIBER_LOCK_PROFILE_ACQUIRED(semaphore, FIBER_LOCK_PROFILE_SEMAPHORE);
         return FIBER_SUCCESS;
     }
 
-    //we didn't get in, we'll wait
-    fiber_manager_wait_in_mpmc_queue(fiber_manager_get(), &semaphore->waiters);
+    //we didn't get in, we'll wait (unless we're canceled, see fiber_semaphore_wait_timed)
+    FIBER_LOCK_PROFILE_WAIT(profile, -val - 1);
+    const int ret = fiber_manager_wait_in_mpmc_queue_timed(fiber_manager_get(), &semaphore->waiters, NULL);
+    if(ret) {
+        FIBER_LOCK_PROFILE_WAITED(semaphore, FIBER_LOCK_PROFILE_SEMAPHORE, profile);
+    }
+    return ret;
+}
 
-    return FIBER_SUCCESS;
+static inline int fiber_semaphore_try_acquire(fiber_semaphore_t* semaphore, int count)
+{
+    int counter;
+    while((counter = semaphore->counter) >= count) {
+        if(__sync_bool_compare_and_swap(&semaphore->counter, counter, counter - count)) {
+            return FIBER_SUCCESS;
+        }
+    }
+    return FIBER_ERROR;
+}
+
+int fiber_semaphore_wait_timed(fiber_semaphore_t* semaphore, const struct timespec* deadline)
+{
+    assert(semaphore);
+    assert(deadline);
+
+    if(fiber_semaphore_try_acquire(semaphore, 1)) {
+        FIBER_LOCK_PROFILE_ACQUIRED(semaphore, FIBER_LOCK_PROFILE_SEMAPHORE);
+        return FIBER_SUCCESS;
+    }
+    if(fiber_deadline_passed(deadline)) {
+        errno = ETIMEDOUT;
+        return FIBER_ERROR;
+    }
+
+    const int val = __sync_sub_and_fetch(&semaphore->counter, 1);
+    if(val >= 0) {
+        FIBER_LOCK_PROFILE_ACQUIRED(semaphore, FIBER_LOCK_PROFILE_SEMAPHORE);
+        return FIBER_SUCCESS;
+    }
+
+    //on a timeout our decrement of the counter stays; whoever pops our entry undoes it (see fiber_semaphore_post_n_internal)
+    FIBER_LOCK_PROFILE_WAIT(profile, -val - 1);
+    const int ret = fiber_manager_wait_in_mpmc_queue_timed(fiber_manager_get(), &semaphore->waiters, deadline);
+    if(ret) {
+        FIBER_LOCK_PROFILE_WAITED(semaphore, FIBER_LOCK_PROFILE_SEMAPHORE, profile);
+    }
+    return ret;
 }
 
 int fiber_semaphore_trywait(fiber_semaphore_t* semaphore)
 {
     assert(semaphore);
 
-    int counter;
-    while((counter = semaphore->counter) > 0) {
-        if(__sync_bool_compare_and_swap(&semaphore->counter, counter, counter - 1)) {
-            return FIBER_SUCCESS;
-        }
+    if(fiber_semaphore_try_acquire(semaphore, 1)) {
+        FIBER_LOCK_PROFILE_ACQUIRED(semaphore, FIBER_LOCK_PROFILE_SEMAPHORE);
+        return FIBER_SUCCESS;
     }
     return FIBER_ERROR;
 }
 
-//returns 1 if another fiber was woken after releasing the semaphore, 0 otherwise
-int fiber_semaphore_post_internal(fiber_semaphore_t* semaphore)
+int fiber_semaphore_wait_n(fiber_semaphore_t* semaphore, int count)
+{
+    assert(semaphore);
+    assert(count >= 0);
+
+    if(fiber_semaphore_try_acquire(semaphore, count)) {
+        //nobody is waiting and there's enough for all of them
+        FIBER_LOCK_PROFILE_ACQUIRED(semaphore, FIBER_LOCK_PROFILE_SEMAPHORE);
+        return FIBER_SUCCESS;
+    }
+
+    FIBER_LOCK_PROFILE_WAIT(profile, semaphore->counter < 0 ? -semaphore->counter : 0);
+    while(!__sync_bool_compare_and_swap(&semaphore->collecting, 0, 1)) {
+        if(!fiber_wait_address(&semaphore->collecting, 1, NULL) && errno == ECANCELED) {
+            return FIBER_ERROR;
+        }
+    }
+    int taken = 0;
+    while(taken < count) {
+        if(__sync_sub_and_fetch(&semaphore->counter, 1) < 0
+           && !fiber_manager_wait_in_mpmc_queue_timed(fiber_manager_get(), &semaphore->waiters, NULL)) {
+            break;
+        }
+        taken += 1;
+    }
+    const int saved_errno = errno;
+    write_barrier();
+    semaphore->collecting = 0;
+    fiber_wake_address(&semaphore->collecting, 1);
+
+    if(taken < count) {
+        //canceled part way - give back what we took
+        fiber_semaphore_post_n_internal(semaphore, taken);
+        errno = saved_errno;
+        return FIBER_ERROR;
+    }
+    FIBER_LOCK_PROFILE_WAITED(semaphore, FIBER_LOCK_PROFILE_SEMAPHORE, profile);
+    return FIBER_SUCCESS;
+}
+
+int fiber_semaphore_post_n_internal(fiber_semaphore_t* semaphore, int count)
 {
     assert(semaphore);
+    assert(count >= 0);
 
     //assumption: the atomic operations below provide read/write ordering (ie. read and writes performed before posting actually occur before posting)
 
-    int prev_counter;
-    do {
-        while((prev_counter = semaphore->counter) < 0) {
-            //another fiber is waiting; attempt to schedule it to take this fiber's place
-            if(fiber_manager_wake_from_mpmc_queue(fiber_manager_get(), &semaphore->waiters, 0)) {
-                __sync_add_and_fetch(&semaphore->counter, 1);
-                return 1;
-            }
+    //each woken waiter takes one of our permits, and each waiter which gave up hands back the count it took. the counter
+    //is settled for all of them at the end, so while we're waking it still counts the waiters we've woken
+    fiber_manager_t* const manager = fiber_manager_get();
+    int woken = 0;
+    int given_back = 0;
+    while(woken < count && semaphore->counter + woken + given_back < 0) {
+        //another fiber is waiting; attempt to schedule it to take this fiber's place
+        const int ret = fiber_manager_wake_from_mpmc_queue(manager, &semaphore->waiters, 0);
+        if(ret > 0) {
+            woken += 1;
+        } else if(ret < 0) {
+            given_back += 1;
         }
-    } while(!__sync_bool_compare_and_swap(&semaphore->counter, prev_counter, prev_counter + 1));
+        //otherwise the waiter has counted itself but isn't queued yet
+    }
+    if(count + given_back) {
+        __sync_add_and_fetch(&semaphore->counter, count + given_back);
+    }
+    return woken;
+}
 
-    return 0;
+//returns 1 if another fiber was woken after releasing the semaphore, 0 otherwise
+int fiber_semaphore_post_internal(fiber_semaphore_t* semaphore)
+{
+    return fiber_semaphore_post_n_internal(semaphore, 1);
 }
 
 int fiber_semaphore_post(fiber_semaphore_t* semaphore)
@@ -98,6 +201,15 @@ int fiber_semaphore_post(fiber_semaphore_t* semaphore)
     return FIBER_SUCCESS;
 }
 
+int fiber_semaphore_post_n(fiber_semaphore_t* semaphore, int count)
+{
+    if(fiber_semaphore_post_n_internal(semaphore, count)) {
+        //the semaphore was contended - let the waiters run
+        fiber_yield();
+    }
+    return FIBER_SUCCESS;
+}
+
 int fiber_semaphore_getvalue(fiber_semaphore_t* semaphore)
 {
     assert(semaphore);
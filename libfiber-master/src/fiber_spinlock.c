@@ -15,27 +15,16 @@
  */
 
 #include "fiber_spinlock.h"
+#include "fiber_lock_profile.h"
 #include "fiber_manager.h"
 #include "fiber.h"
 #include "sched.h"
 
-#ifdef __GNUC__
-#define STATIC_ASSERT_HELPER(expr, msg) \
-    (!!sizeof (struct { unsigned int STATIC_ASSERTION__##msg: (expr) ? 1 : -1; }))
-#define STATIC_ASSERT(expr, msg) \
-    extern int (*assert_function__(void)) [STATIC_ASSERT_HELPER(expr, msg)]
-#else
-    #define STATIC_ASSERT(expr, msg)   \
-    extern char STATIC_ASSERTION__##msg[1]; \
-    extern char STATIC_ASSERTION__##msg[(expr)?1:2]
-#endif /* #ifdef __GNUC__ */
-
-STATIC_ASSERT(sizeof(fiber_spinlock_internal_t) == sizeof(uint64_t), state_is_not_sized_properly);
-
 int fiber_spinlock_init(fiber_spinlock_t* spinlock)
 {
     assert(spinlock);
-    spinlock->state.blob = 0;
+    spinlock->locked = 0;
+    spinlock->tail = NULL;
     write_barrier();
     return FIBER_SUCCESS;
 }
@@ -46,17 +35,59 @@ int fiber_spinlock_destroy(fiber_spinlock_t* spinlock)
     return FIBER_SUCCESS;
 }
 
+static inline void fiber_spinlock_spin(fiber_manager_t* manager, uint32_t* spins)
+{
+    cpu_relax();
+    manager->spin_count += 1;
+    *spins += 1;
+    if(*spins >= FIBER_SPINLOCK_SPINS_BEFORE_YIELD) {
+        //the fiber we're waiting on can't make progress while its thread is off the CPU
+        *spins = 0;
+        sched_yield();
+    }
+}
+
 int fiber_spinlock_lock(fiber_spinlock_t* spinlock)
 {
     assert(spinlock);
 
-    const uint32_t my_ticket = __sync_fetch_and_add(&spinlock->state.counters.users, 1);
-    while(spinlock->state.counters.ticket != my_ticket) {
-        cpu_relax();
-        fiber_manager_get()->spin_count += 1;
+    //barging is only allowed while nobody is queued, which keeps the lock fair
+    if(!spinlock->tail && __sync_bool_compare_and_swap(&spinlock->locked, 0, 1)) {
+        FIBER_LOCK_PROFILE_ACQUIRED(spinlock, FIBER_LOCK_PROFILE_SPINLOCK);
+        return FIBER_SUCCESS;
+    }
+
+    FIBER_LOCK_PROFILE_WAIT(profile, 0);
+
+    fiber_manager_t* const manager = fiber_manager_get();
+    fiber_spinlock_node_t* const node = &manager->spinlock_node;
+    uint32_t spins = 0;
+    node->next = NULL;
+    node->waiting = 1;
+    fiber_spinlock_node_t* const prev = (fiber_spinlock_node_t*)atomic_exchange_pointer((void**)&spinlock->tail, node);
+    if(prev) {
+        //wait on our own cache line until the fiber ahead of us reaches the lock
+        prev->next = node;
+        while(node->waiting) {
+            fiber_spinlock_spin(manager, &spins);
+        }
+    }
+
+    //we're at the head of the queue, so we're the only one watching the lock word
+    while(spinlock->locked || !__sync_bool_compare_and_swap(&spinlock->locked, 0, 1)) {
+        fiber_spinlock_spin(manager, &spins);
+    }
+
+    //hand the head of the queue to the next fiber. our node is free again once nobody refers to it
+    if(spinlock->tail != node || !__sync_bool_compare_and_swap(&spinlock->tail, node, NULL)) {
+        fiber_spinlock_node_t* next;
+        while(!(next = node->next)) {
+            fiber_spinlock_spin(manager, &spins);//the next fiber is still linking itself in
+        }
+        next->waiting = 0;
     }
-    load_load_barrier();//any future reads should happen after reading the new ticket
 
+    FIBER_LOCK_PROFILE_WAITED(spinlock, FIBER_LOCK_PROFILE_SPINLOCK, profile);
     return FIBER_SUCCESS;
 }
 
@@ -64,15 +95,10 @@ int fiber_spinlock_trylock(fiber_spinlock_t* spinlock)
 {
     assert(spinlock);
 
-    fiber_spinlock_internal_t old;
-    old.blob = spinlock->state.blob;
-    old.counters.ticket = old.counters.users;
-    fiber_spinlock_internal_t new;
-    new.blob = old.blob;
-    new.counters.users += 1;
-    if(!__sync_bool_compare_and_swap(&spinlock->state.blob, old.blob, new.blob)) {
+    if(spinlock->tail || spinlock->locked || !__sync_bool_compare_and_swap(&spinlock->locked, 0, 1)) {
         return FIBER_ERROR;
     }
+    FIBER_LOCK_PROFILE_ACQUIRED(spinlock, FIBER_LOCK_PROFILE_SPINLOCK);
 
     return FIBER_SUCCESS;
 }
@@ -81,9 +107,9 @@ int fiber_spinlock_unlock(fiber_spinlock_t* spinlock)
 {
     assert(spinlock);
 
-    write_barrier();//flush this fiber's writes before incrementing the ticket
-    spinlock->state.counters.ticket = spinlock->state.counters.ticket + 1;
-    load_load_barrier();//any future read should happen after reading the ticket as part of the increment
+    FIBER_LOCK_PROFILE_RELEASED(spinlock);
+    write_barrier();//flush this fiber's writes before releasing the lock
+    spinlock->locked = 0;
 
     return FIBER_SUCCESS;
 }
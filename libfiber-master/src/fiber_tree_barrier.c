@@ -0,0 +1,128 @@
+/*
+ * Copyright (c) 2012-2015, Brian Watling and other contributors
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "fiber_tree_barrier.h"
+#include "fiber_address.h"
+#include "fiber_manager.h"
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+
+static void fiber_tree_barrier_destroy_slots(fiber_tree_barrier_slot_t* slots, int count)
+{
+    int i;
+    for(i = 0; i < count; ++i) {
+        int parity;
+        for(parity = 0; parity < 2; ++parity) {
+            if(slots[i].waiters[parity].head) {
+                //release any entries left behind by waiters which took a token
+                fiber_manager_wake_from_mpsc_queue(fiber_manager_get(), &slots[i].waiters[parity], 0);
+                mpsc_fifo_destroy(&slots[i].waiters[parity]);
+            }
+        }
+    }
+    free(slots);
+}
+
+int fiber_tree_barrier_init(fiber_tree_barrier_t* barrier, uint32_t count)
+{
+    assert(barrier);
+    assert(count > 0);
+    barrier->slot_count = fiber_manager_get_kernel_thread_count();
+    if(barrier->slot_count < 1) {
+        barrier->slot_count = 1;
+    }
+    barrier->slots = calloc(barrier->slot_count, sizeof(*barrier->slots));
+    if(!barrier->slots) {
+        return FIBER_ERROR;
+    }
+    int i;
+    for(i = 0; i < barrier->slot_count; ++i) {
+        if(!mpsc_fifo_init(&barrier->slots[i].waiters[0]) || !mpsc_fifo_init(&barrier->slots[i].waiters[1])) {
+            fiber_tree_barrier_destroy_slots(barrier->slots, i + 1);
+            barrier->slots = NULL;
+            errno = ENOMEM;
+            return FIBER_ERROR;
+        }
+    }
+    barrier->count = count;
+    barrier->arrived = 0;
+    barrier->phase = 0;
+    write_barrier();
+    return FIBER_SUCCESS;
+}
+
+void fiber_tree_barrier_destroy(fiber_tree_barrier_t* barrier)
+{
+    if(barrier && barrier->slots) {
+        fiber_tree_barrier_destroy_slots(barrier->slots, barrier->slot_count);
+        barrier->slots = NULL;
+    }
+}
+
+static inline void fiber_tree_barrier_release_slot(fiber_tree_barrier_slot_t* slot, int parity)
+{
+    //a slot can have several batch carriers in a phase but its queue can only have one consumer
+    const int count = atomic_exchange_int((int*)&slot->to_wake[parity], 0);
+    if(count) {
+        fiber_manager_wake_from_mpsc_queue_with_tokens(fiber_manager_get(), &slot->waiters[parity], &slot->wake_tokens[parity], count);
+    }
+}
+
+int fiber_tree_barrier_wait(fiber_tree_barrier_t* barrier)
+{
+    assert(barrier);
+    //the phase can't move on until we've arrived, so this is the phase we're arriving in
+    const int phase = barrier->phase;
+    const int parity = phase & 1;
+    fiber_manager_t* const manager = fiber_manager_get();
+    fiber_tree_barrier_slot_t* const slot = &barrier->slots[manager->id % barrier->slot_count];
+
+    if(__sync_fetch_and_add(&slot->pending, 1)) {
+        //a fiber ahead of us on this slot hasn't carried its batch up yet and will take us with it
+        fiber_manager_wait_in_mpsc_queue_with_tokens(manager, &slot->waiters[parity], &slot->wake_tokens[parity], NULL, 0, NULL);
+        return 0;
+    }
+
+    //let the other fibers on this manager arrive before carrying the batch to the root
+    fiber_yield();
+    const int batch = atomic_exchange_int((int*)&slot->pending, 0);
+    if(batch > 1) {
+        //counted before the root hears of them, so they're all counted by the time the phase completes
+        __sync_fetch_and_add(&slot->to_wake[parity], batch - 1);
+    }
+    if(__sync_add_and_fetch(&barrier->arrived, batch) == barrier->count) {
+        //nobody can arrive in the next phase until it starts
+        barrier->arrived = 0;
+        __sync_fetch_and_add(&barrier->phase, 1);
+        fiber_wake_address(&barrier->phase, INT_MAX);
+        fiber_tree_barrier_release_slot(slot, parity);
+        return FIBER_BARRIER_SERIAL_FIBER;
+    }
+
+    int spins = 0;
+    while(barrier->phase == phase) {
+        if(spins < FIBER_TREE_BARRIER_MAX_SPIN) {
+            ++spins;
+            fiber_yield();
+        } else {
+            fiber_wait_address_internal(&barrier->phase, phase, NULL);
+        }
+    }
+    fiber_tree_barrier_release_slot(slot, parity);
+    return 0;
+}
+
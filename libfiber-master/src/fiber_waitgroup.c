@@ -0,0 +1,84 @@
+/*
+ * Copyright (c) 2012-2015, Brian Watling and other contributors
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "fiber_waitgroup.h"
+
+int fiber_waitgroup_init(fiber_waitgroup_t* waitgroup, intptr_t count)
+{
+    assert(waitgroup);
+    assert(count >= 0);
+    fiber_multi_signal_init(&waitgroup->signal);
+    waitgroup->counter = count;
+    write_barrier();
+    return FIBER_SUCCESS;
+}
+
+void fiber_waitgroup_destroy(fiber_waitgroup_t* waitgroup)
+{
+    assert(waitgroup);
+    fiber_multi_signal_destroy(&waitgroup->signal);
+}
+
+int fiber_waitgroup_add(fiber_waitgroup_t* waitgroup, intptr_t count)
+{
+    assert(waitgroup);
+
+    const intptr_t new_value = __sync_add_and_fetch(&waitgroup->counter, count);
+    assert(new_value >= 0);
+    if(!new_value && count) {
+        fiber_multi_signal_raise(&waitgroup->signal);
+    }
+    return FIBER_SUCCESS;
+}
+
+int fiber_waitgroup_done(fiber_waitgroup_t* waitgroup)
+{
+    assert(waitgroup);
+
+    //assumption: the atomic operation below provides read/write ordering (ie. the work being counted off is visible to the waiters)
+    const intptr_t new_value = __sync_sub_and_fetch(&waitgroup->counter, 1);
+    assert(new_value >= 0);
+    if(!new_value) {
+        //wake the first waiter; it wakes the next (see fiber_waitgroup_wait())
+        fiber_multi_signal_raise(&waitgroup->signal);
+    }
+    return FIBER_SUCCESS;
+}
+
+int fiber_waitgroup_wait(fiber_waitgroup_t* waitgroup)
+{
+    assert(waitgroup);
+
+    if(!waitgroup->counter) {
+        load_load_barrier();
+        return FIBER_SUCCESS;
+    }
+    //a raise left over from the previous round (see below) can wake us early, so check the count again each time
+    do {
+        fiber_multi_signal_wait(&waitgroup->signal);
+    } while(waitgroup->counter > 0);
+    load_load_barrier();
+    //pass the wake-up along. the last waiter leaves the signal raised, which is harmless
+    fiber_multi_signal_raise(&waitgroup->signal);
+    return FIBER_SUCCESS;
+}
+
+intptr_t fiber_waitgroup_getvalue(fiber_waitgroup_t* waitgroup)
+{
+    assert(waitgroup);
+    return waitgroup->counter;
+}
+
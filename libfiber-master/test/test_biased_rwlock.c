@@ -0,0 +1,156 @@
+/*
+ * Copyright (c) 2012-2015, Brian Watling and other contributors
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include "fiber_biased_rwlock.h"
+#include "fiber_rwlock.h"
+#include "fiber_manager.h"
+#include "test_helper.h"
+#include <stdlib.h>
+
+#define PER_FIBER_COUNT 10000
+#define NUM_FIBERS 100
+#define READ_COUNT 1000000
+
+int NUM_THREADS = 4;
+
+fiber_biased_rwlock_t biased;
+fiber_rwlock_t plain;
+volatile int readers = 0;
+volatile int writers = 0;
+volatile int try_rd = 0;
+volatile int try_wr = 0;
+
+void* run_function(void* param)
+{
+    int i;
+    for(i = 0; i < PER_FIBER_COUNT; ++i) {
+        if(i % 100 == 0) {
+            fiber_biased_rwlock_wrlock(&biased);
+            test_assert(__sync_add_and_fetch(&writers, 1) == 1);
+            test_assert(!readers);
+            fiber_yield();
+            test_assert(!readers);
+            __sync_fetch_and_sub(&writers, 1);
+            fiber_biased_rwlock_wrunlock(&biased);
+        } else if(i % 100 == 1 && fiber_biased_rwlock_trywrlock(&biased)) {
+            __sync_fetch_and_add(&try_wr, 1);
+            test_assert(__sync_add_and_fetch(&writers, 1) == 1);
+            test_assert(!readers);
+            __sync_fetch_and_sub(&writers, 1);
+            fiber_biased_rwlock_wrunlock(&biased);
+        } else if(i % 100 == 2 && fiber_biased_rwlock_tryrdlock(&biased)) {
+            __sync_fetch_and_add(&try_rd, 1);
+            __sync_fetch_and_add(&readers, 1);
+            test_assert(!writers);
+            __sync_fetch_and_sub(&readers, 1);
+            fiber_biased_rwlock_rdunlock(&biased);
+        } else {
+            fiber_biased_rwlock_rdlock(&biased);
+            __sync_fetch_and_add(&readers, 1);
+            test_assert(!writers);
+            //the fiber may come back on another manager and unlock from there
+            fiber_yield();
+            test_assert(!writers);
+            __sync_fetch_and_sub(&readers, 1);
+            fiber_biased_rwlock_rdunlock(&biased);
+        }
+    }
+    return NULL;
+}
+
+void* plain_read_function(void* param)
+{
+    int i;
+    for(i = 0; i < READ_COUNT; ++i) {
+        fiber_rwlock_rdlock(&plain);
+        fiber_rwlock_rdunlock(&plain);
+    }
+    return NULL;
+}
+
+void* biased_read_function(void* param)
+{
+    int i;
+    for(i = 0; i < READ_COUNT; ++i) {
+        fiber_biased_rwlock_rdlock(&biased);
+        fiber_biased_rwlock_rdunlock(&biased);
+    }
+    return NULL;
+}
+
+//runs 'readers' fibers doing READ_COUNT read locks each, returning the number of read locks per microsecond
+double time_reads(void* (*fn)(void*), int reader_count)
+{
+    fiber_t* fibers[reader_count];
+    struct timespec start;
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int i;
+    for(i = 0; i < reader_count; ++i) {
+        fibers[i] = fiber_create(20000, fn, NULL);
+    }
+    for(i = 0; i < reader_count; ++i) {
+        fiber_join(fibers[i], NULL);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    const int64_t usecs = ((end.tv_sec - start.tv_sec) * 1000000000LL + end.tv_nsec - start.tv_nsec) / 1000;
+    return (double)reader_count * READ_COUNT / (usecs ? usecs : 1);
+}
+
+int main(int argc, char* argv[])
+{
+    if(argc > 1) {
+        NUM_THREADS = atoi(argv[1]);
+    }
+    fiber_manager_init(NUM_THREADS);
+
+    test_assert(fiber_biased_rwlock_init(&biased));
+    test_assert(fiber_rwlock_init(&plain));
+
+    fiber_t* fibers[NUM_FIBERS];
+    int i;
+    for(i = 0; i < NUM_FIBERS; ++i) {
+        fibers[i] = fiber_create(20000, &run_function, NULL);
+    }
+    for(i = 0; i < NUM_FIBERS; ++i) {
+        fiber_join(fibers[i], NULL);
+    }
+    printf("try_rd %d try_wr %d\n", try_rd, try_wr);
+
+    test_assert(fiber_biased_rwlock_tryrdlock(&biased));
+    test_assert(!fiber_biased_rwlock_trywrlock(&biased));
+    fiber_biased_rwlock_rdunlock(&biased);
+    test_assert(fiber_biased_rwlock_trywrlock(&biased));
+    test_assert(!fiber_biased_rwlock_tryrdlock(&biased));
+    fiber_biased_rwlock_wrunlock(&biased);
+
+    //read scaling: reads per microsecond with 1 to NUM_THREADS concurrent readers
+    printf("readers fiber_rwlock fiber_biased_rwlock\n");
+    int reader_count;
+    for(reader_count = 1; reader_count <= NUM_THREADS; ++reader_count) {
+        const double plain_rate = time_reads(&plain_read_function, reader_count);
+        const double biased_rate = time_reads(&biased_read_function, reader_count);
+        printf("%d %.2lf %.2lf\n", reader_count, plain_rate, biased_rate);
+    }
+
+    fiber_rwlock_destroy(&plain);
+    fiber_biased_rwlock_destroy(&biased);
+
+    fiber_manager_print_stats();
+    return 0;
+}
+
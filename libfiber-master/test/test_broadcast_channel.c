@@ -0,0 +1,127 @@
+/*
+ * Copyright (c) 2012-2015, Brian Watling and other contributors
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include "fiber_multi_channel.h"
+#include "fiber_manager.h"
+#include "test_helper.h"
+#include <errno.h>
+
+#define NUM_THREADS 2
+#define MESSAGE_COUNT 100000
+#define MAX_SUBSCRIBERS 256
+
+fiber_broadcast_channel_t* channel = NULL;
+fiber_broadcast_subscriber_t subscribers[MAX_SUBSCRIBERS];
+
+int64_t time_diff(const struct timespec* start, const struct timespec* end) {
+    return (end->tv_sec * 1000000000LL + end->tv_nsec) - (start->tv_sec * 1000000000LL + start->tv_nsec);
+}
+
+__attribute__((noinline)) int current_errno()
+{
+    __asm__ __volatile__ ("" ::: "memory");//errno is thread local and fibers can move between threads
+    return errno;
+}
+
+void* publish_function(void* param)
+{
+    intptr_t i;
+    for(i = 1; i <= MESSAGE_COUNT; ++i) {
+        test_assert(fiber_broadcast_channel_publish(channel, (void*)i));
+    }
+    return NULL;
+}
+
+//every subscriber sees every message, in order
+void* subscribe_function(void* param)
+{
+    fiber_broadcast_subscriber_t* const subscriber = (fiber_broadcast_subscriber_t*)param;
+    intptr_t i;
+    for(i = 1; i <= MESSAGE_COUNT; ++i) {
+        test_assert(fiber_broadcast_channel_receive(subscriber) == (void*)i);
+    }
+    fiber_broadcast_channel_unsubscribe(subscriber);
+    return NULL;
+}
+
+void run_broadcast(int subscriber_count)
+{
+    channel = fiber_broadcast_channel_create(8, FIBER_BROADCAST_BLOCK);
+    test_assert(channel);
+    fiber_t* fibers[MAX_SUBSCRIBERS];
+    int i;
+    for(i = 0; i < subscriber_count; ++i) {
+        fiber_broadcast_channel_subscribe(channel, &subscribers[i]);
+    }
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(i = 0; i < subscriber_count; ++i) {
+        fibers[i] = fiber_create(20000, &subscribe_function, &subscribers[i]);
+    }
+    publish_function(NULL);
+    for(i = 0; i < subscriber_count; ++i) {
+        fiber_join(fibers[i], NULL);
+    }
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    printf("%d subscribers: %d messages in %lf seconds\n", subscriber_count, MESSAGE_COUNT, time_diff(&start, &end) / 1000000000.0);
+    fiber_broadcast_channel_destroy(channel);
+}
+
+void* cancel_function(void* param)
+{
+    fiber_broadcast_subscriber_t* const subscriber = (fiber_broadcast_subscriber_t*)param;
+    test_assert(fiber_broadcast_channel_receive(subscriber) == NULL);
+    test_assert(current_errno() == ECANCELED);
+    return NULL;
+}
+
+int main(int argc, char* argv[])
+{
+    fiber_manager_init(NUM_THREADS);
+
+    run_broadcast(1);
+    run_broadcast(16);
+    run_broadcast(256);
+
+    //a slow subscriber skips the messages which were overwritten
+    channel = fiber_broadcast_channel_create(4, FIBER_BROADCAST_DROP);
+    fiber_broadcast_channel_subscribe(channel, &subscribers[0]);
+    intptr_t i;
+    for(i = 1; i <= 100; ++i) {
+        test_assert(fiber_broadcast_channel_publish(channel, (void*)i));
+    }
+    for(i = 86; i <= 100; ++i) {
+        test_assert(fiber_broadcast_channel_receive(&subscribers[0]) == (void*)i);
+    }
+    test_assert(subscribers[0].dropped == 85);
+
+    //a parked subscriber can be canceled
+    fiber_t* fiber = fiber_create(20000, &cancel_function, &subscribers[0]);
+    fiber_yield();
+    test_assert(fiber_cancel(fiber));
+    fiber_join(fiber, NULL);
+    test_assert(fiber_broadcast_channel_publish(channel, (void*)101));
+    test_assert(fiber_broadcast_channel_receive(&subscribers[0]) == (void*)101);
+    fiber_broadcast_channel_unsubscribe(&subscribers[0]);
+    fiber_broadcast_channel_destroy(channel);
+
+    fiber_manager_print_stats();
+    return 0;
+}
@@ -0,0 +1,75 @@
+/*
+ * Copyright (c) 2012-2015, Brian Watling and other contributors
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "fiber_manager.h"
+#include "test_helper.h"
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define NUM_THREADS 1
+#define PER_FIBER_COUNT 10000
+
+int sockets[2];
+
+void* pong_function(void* param)
+{
+    int i;
+    for(i = 0; i < PER_FIBER_COUNT; ++i) {
+        char c = 0;
+        test_assert(read(sockets[1], &c, 1) == 1);
+        test_assert(write(sockets[1], &c, 1) == 1);
+    }
+    return NULL;
+}
+
+int main(int argc, char* argv[])
+{
+    fiber_manager_init(NUM_THREADS);
+
+    //specifying an argument sets the busy-poll budget in microseconds
+    const uint32_t busy_poll = argc > 1 ? atoi(argv[1]) : 0;
+    fiber_manager_set_all_busy_poll(busy_poll);
+
+    test_assert(!socketpair(AF_UNIX, SOCK_STREAM, 0, sockets));
+
+    fiber_t* const pong_fiber = fiber_create(20000, &pong_function, NULL);
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int i;
+    for(i = 0; i < PER_FIBER_COUNT; ++i) {
+        char c = (char)i;
+        test_assert(write(sockets[0], &c, 1) == 1);
+        test_assert(read(sockets[0], &c, 1) == 1);
+        test_assert(c == (char)i);
+    }
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    fiber_join(pong_fiber, NULL);
+
+    close(sockets[0]);
+    close(sockets[1]);
+
+    const uint64_t elapsed = (end.tv_sec - start.tv_sec) * 1000000000ULL + end.tv_nsec - start.tv_nsec;
+    printf("busy poll: %u us, average round trip: %" PRIu64 " ns\n", busy_poll, elapsed / PER_FIBER_COUNT);
+    fiber_manager_print_stats();
+    return 0;
+}
+
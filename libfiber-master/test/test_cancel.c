@@ -0,0 +1,250 @@
+/*
+ * Copyright (c) 2012-2015, Brian Watling and other contributors
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "fiber_manager.h"
+#include "fiber_mutex.h"
+#include "fiber_cond.h"
+#include "fiber_semaphore.h"
+#include "fiber_channel.h"
+#include "fiber_multi_channel.h"
+#include "fiber_event.h"
+#include "fiber_io.h"
+#include "fiber_address.h"
+#include "test_helper.h"
+#include <sys/socket.h>
+#include <errno.h>
+#include <unistd.h>
+
+#define NUM_THREADS 2
+
+fiber_mutex_t mutex;
+fiber_cond_t cond;
+fiber_semaphore_t semaphore;
+fiber_bounded_channel_t* channel = NULL;
+fiber_unbounded_channel_t unbounded_channel;
+fiber_multi_channel_t* multi_channel = NULL;
+int sv[2];
+volatile int go = 0;
+volatile int address_value = 0;
+
+//errno is thread local and a fiber can resume on another thread, so don't let the compiler cache its address
+static int __attribute__((noinline)) current_errno()
+{
+    __asm__ __volatile__("" ::: "memory");
+    return errno;
+}
+
+//each blocking function returns the errno it failed with, or 0 if it was not interrupted
+void* mutex_function(void* param)
+{
+    if(fiber_mutex_lock(&mutex)) {
+        fiber_mutex_unlock(&mutex);
+        return NULL;
+    }
+    return (void*)(intptr_t)current_errno();
+}
+
+void* cond_function(void* param)
+{
+    fiber_mutex_lock(&mutex);
+    int ret = 0;
+    if(!fiber_cond_wait(&cond, &mutex)) {
+        ret = current_errno();
+    }
+    //the mutex is held again even though the wait was canceled
+    test_assert(!fiber_mutex_trylock(&mutex));
+    fiber_mutex_unlock(&mutex);
+    return (void*)(intptr_t)ret;
+}
+
+void* semaphore_function(void* param)
+{
+    if(fiber_semaphore_wait(&semaphore)) {
+        return NULL;
+    }
+    return (void*)(intptr_t)current_errno();
+}
+
+void* address_function(void* param)
+{
+    if(fiber_wait_address(&address_value, 0, NULL)) {
+        return NULL;
+    }
+    return (void*)(intptr_t)current_errno();
+}
+
+void* sleep_function(void* param)
+{
+    if(fiber_sleep(10, 0)) {
+        return NULL;
+    }
+    return (void*)(intptr_t)current_errno();
+}
+
+void* read_function(void* param)
+{
+    char c;
+    if(read(sv[0], &c, 1) == 1) {
+        return NULL;
+    }
+    return (void*)(intptr_t)current_errno();
+}
+
+void* receive_function(void* param)
+{
+    if(fiber_bounded_channel_receive(channel)) {
+        return NULL;
+    }
+    return (void*)(intptr_t)current_errno();
+}
+
+void* send_function(void* param)
+{
+    if(fiber_bounded_channel_send(channel, (void*)1) >= 0) {
+        return NULL;
+    }
+    return (void*)(intptr_t)current_errno();
+}
+
+void* unbounded_receive_function(void* param)
+{
+    if(fiber_unbounded_channel_receive(&unbounded_channel)) {
+        return NULL;
+    }
+    return (void*)(intptr_t)current_errno();
+}
+
+void* multi_send_function(void* param)
+{
+    if(fiber_multi_channel_send(multi_channel, (void*)1)) {
+        return NULL;
+    }
+    return (void*)(intptr_t)current_errno();
+}
+
+//the cancel arrives before the fiber blocks; the next cancellation point consumes it
+void* pending_function(void* param)
+{
+    while(!go) {
+        fiber_yield();
+    }
+    int ret = 0;
+    if(!fiber_semaphore_wait(&semaphore)) {
+        ret = current_errno();
+    }
+    //the cancel is only delivered once
+    test_assert(fiber_sleep(0, 1000));
+    return (void*)(intptr_t)ret;
+}
+
+//starts 'fn', lets it block, cancels it and returns the errno it reported
+static intptr_t cancel_blocked(void* (*fn)(void*))
+{
+    fiber_t* const f = fiber_create(20000, fn, NULL);
+    fiber_sleep(0, 10000);
+    test_assert(fiber_cancel(f));
+    void* result = NULL;
+    fiber_join(f, &result);
+    return (intptr_t)result;
+}
+
+int main()
+{
+    fiber_manager_init(NUM_THREADS);
+
+    fiber_mutex_init(&mutex);
+    fiber_cond_init(&cond);
+    fiber_semaphore_init(&semaphore, 0);
+
+    fiber_mutex_lock(&mutex);
+    test_assert(cancel_blocked(&mutex_function) == ECANCELED);
+    fiber_mutex_unlock(&mutex);
+    //the canceled waiter didn't leave the mutex locked
+    test_assert(fiber_mutex_trylock(&mutex));
+    fiber_mutex_unlock(&mutex);
+
+    test_assert(cancel_blocked(&cond_function) == ECANCELED);
+
+    test_assert(cancel_blocked(&semaphore_function) == ECANCELED);
+    //the canceled waiter doesn't swallow a post
+    fiber_semaphore_post(&semaphore);
+    test_assert(fiber_semaphore_trywait(&semaphore));
+
+    test_assert(cancel_blocked(&address_function) == ECANCELED);
+    //the canceled waiter isn't left queued
+    test_assert(fiber_wake_address(&address_value, 1) == 0);
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    test_assert(cancel_blocked(&sleep_function) == ECANCELED);
+    struct timespec deadline = start;
+    deadline.tv_sec += 5;
+    test_assert(!fiber_deadline_passed(&deadline));
+
+    test_assert(!socketpair(AF_UNIX, SOCK_STREAM, 0, sv));
+    test_assert(cancel_blocked(&read_function) == ECANCELED);
+    close(sv[0]);
+    close(sv[1]);
+
+    fiber_signal_t signal;
+    fiber_signal_init(&signal);
+    channel = fiber_bounded_channel_create(1, &signal);//room for two messages
+    test_assert(cancel_blocked(&receive_function) == ECANCELED);
+    fiber_bounded_channel_send(channel, (void*)1);
+    fiber_bounded_channel_send(channel, (void*)2);
+    test_assert(cancel_blocked(&send_function) == ECANCELED);
+    //the channel still works after both sides gave up
+    test_assert(fiber_bounded_channel_receive(channel) == (void*)1);
+    test_assert(fiber_bounded_channel_receive(channel) == (void*)2);
+    fiber_bounded_channel_destroy(channel);
+    fiber_signal_destroy(&signal);
+
+    fiber_signal_init(&signal);
+    fiber_unbounded_channel_init(&unbounded_channel, &signal);
+    test_assert(cancel_blocked(&unbounded_receive_function) == ECANCELED);
+    fiber_unbounded_channel_destroy(&unbounded_channel);
+    fiber_signal_destroy(&signal);
+
+    //the multi channel isn't a cancellation point: a sender canceled while it waits for the channel's lock still
+    //takes it and sends
+    multi_channel = fiber_multi_channel_create(1, NULL);
+    fiber_mutex_lock(&multi_channel->lock);
+    fiber_t* const multi_sender = fiber_create(20000, &multi_send_function, NULL);
+    fiber_sleep(0, 10000);
+    test_assert(fiber_cancel(multi_sender));
+    fiber_mutex_unlock(&multi_channel->lock);
+    void* multi_result = (void*)-1;
+    fiber_join(multi_sender, &multi_result);
+    test_assert(!multi_result);
+    test_assert(fiber_multi_channel_receive(multi_channel) == (void*)1);
+    test_assert(fiber_mutex_trylock(&multi_channel->lock));
+    fiber_mutex_unlock(&multi_channel->lock);
+    fiber_multi_channel_destroy(multi_channel);
+
+    fiber_t* const pending = fiber_create(20000, &pending_function, NULL);
+    test_assert(fiber_cancel(pending));
+    go = 1;
+    void* result = NULL;
+    fiber_join(pending, &result);
+    test_assert((intptr_t)result == ECANCELED);
+
+    fiber_semaphore_destroy(&semaphore);
+    fiber_cond_destroy(&cond);
+    fiber_mutex_destroy(&mutex);
+
+    fiber_manager_print_stats();
+    return 0;
+}
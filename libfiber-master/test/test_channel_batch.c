@@ -0,0 +1,200 @@
+/*
+ * Copyright (c) 2012-2015, Brian Watling and other contributors
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "fiber_channel.h"
+#include "fiber_manager.h"
+#include "test_helper.h"
+#include <time.h>
+
+#define NUM_THREADS 2
+#define MESSAGE_COUNT (1 << 18)
+#define MAX_BATCH 256
+
+fiber_bounded_channel_t* bounded_channel = NULL;
+fiber_unbounded_channel_t unbounded_channel;
+fiber_unbounded_sp_channel_t sp_channel;
+
+int64_t time_diff(const struct timespec* start, const struct timespec* end) {
+    return (end->tv_sec * 1000000000LL + end->tv_nsec) - (start->tv_sec * 1000000000LL + start->tv_nsec);
+}
+
+void* bounded_send_function(void* param)
+{
+    const int batch = (intptr_t)param;
+    void* messages[MAX_BATCH];
+    intptr_t next = 1;
+    while(next <= MESSAGE_COUNT) {
+        int count = 0;
+        while(count < batch && next + count <= MESSAGE_COUNT) {
+            messages[count] = (void*)(next + count);
+            count += 1;
+        }
+        const int sent = fiber_bounded_channel_send_n(bounded_channel, messages, count);
+        test_assert(sent > 0 && sent <= count);
+        next += sent;
+    }
+    return NULL;
+}
+
+void* unbounded_send_function(void* param)
+{
+    const int batch = (intptr_t)param;
+    fiber_unbounded_channel_message_t* messages[MAX_BATCH];
+    int next = 0;
+    while(next < MESSAGE_COUNT) {
+        int count = 0;
+        while(count < batch && next < MESSAGE_COUNT) {
+            fiber_unbounded_channel_message_t* const node = malloc(sizeof(*node));
+            test_assert(node);
+            node->data = (void*)(intptr_t)(++next);
+            messages[count++] = node;
+        }
+        fiber_unbounded_channel_send_n(&unbounded_channel, messages, count);
+    }
+    return NULL;
+}
+
+void* sp_send_function(void* param)
+{
+    const int batch = (intptr_t)param;
+    fiber_unbounded_sp_channel_message_t* messages[MAX_BATCH];
+    int next = 0;
+    while(next < MESSAGE_COUNT) {
+        int count = 0;
+        while(count < batch && next < MESSAGE_COUNT) {
+            fiber_unbounded_sp_channel_message_t* const node = malloc(sizeof(*node));
+            test_assert(node);
+            node->data = (void*)(intptr_t)(++next);
+            messages[count++] = node;
+        }
+        fiber_unbounded_sp_channel_send_n(&sp_channel, messages, count);
+    }
+    return NULL;
+}
+
+//a single sender keeps its messages in order; returns the time taken to receive all of them
+int64_t run_bounded(int batch)
+{
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    fiber_t* const sender = fiber_create(20000, &bounded_send_function, (void*)(intptr_t)batch);
+    void* out[MAX_BATCH];
+    intptr_t expected = 1;
+    while(expected <= MESSAGE_COUNT) {
+        const int received = fiber_bounded_channel_receive_n(bounded_channel, out, batch);
+        test_assert(received > 0 && received <= batch);
+        int i;
+        for(i = 0; i < received; ++i) {
+            test_assert(out[i] == (void*)expected);
+            expected += 1;
+        }
+    }
+    fiber_join(sender, NULL);
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return time_diff(&start, &end);
+}
+
+int64_t run_unbounded(int batch)
+{
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    fiber_t* const sender = fiber_create(20000, &unbounded_send_function, (void*)(intptr_t)batch);
+    fiber_unbounded_channel_message_t* out[MAX_BATCH];
+    intptr_t expected = 1;
+    while(expected <= MESSAGE_COUNT) {
+        const int received = fiber_unbounded_channel_receive_n(&unbounded_channel, out, batch);
+        test_assert(received > 0 && received <= batch);
+        int i;
+        for(i = 0; i < received; ++i) {
+            test_assert(out[i]->data == (void*)expected);
+            free(out[i]);
+            expected += 1;
+        }
+    }
+    fiber_join(sender, NULL);
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return time_diff(&start, &end);
+}
+
+int64_t run_sp(int batch)
+{
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    fiber_t* const sender = fiber_create(20000, &sp_send_function, (void*)(intptr_t)batch);
+    fiber_unbounded_sp_channel_message_t* out[MAX_BATCH];
+    intptr_t expected = 1;
+    while(expected <= MESSAGE_COUNT) {
+        const int received = fiber_unbounded_sp_channel_receive_n(&sp_channel, out, batch);
+        test_assert(received > 0 && received <= batch);
+        int i;
+        for(i = 0; i < received; ++i) {
+            test_assert(out[i]->data == (void*)expected);
+            free(out[i]);
+            expected += 1;
+        }
+    }
+    fiber_join(sender, NULL);
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return time_diff(&start, &end);
+}
+
+int main(int argc, char* argv[])
+{
+    fiber_manager_init(NUM_THREADS);
+
+    fiber_signal_t bounded_signal;
+    fiber_signal_init(&bounded_signal);
+    fiber_signal_t unbounded_signal;
+    fiber_signal_init(&unbounded_signal);
+    fiber_signal_t sp_signal;
+    fiber_signal_init(&sp_signal);
+
+    bounded_channel = fiber_bounded_channel_create(10, &bounded_signal);
+    test_assert(bounded_channel);
+    test_assert(fiber_unbounded_channel_init(&unbounded_channel, &unbounded_signal));
+    test_assert(fiber_unbounded_sp_channel_init(&sp_channel, &sp_signal));
+
+    //a batch bigger than the free space is cut short
+    void* messages[4] = {(void*)1, (void*)2, (void*)3, (void*)4};
+    fiber_bounded_channel_t* const small = fiber_bounded_channel_create(1, NULL);
+    test_assert(fiber_bounded_channel_send_n(small, messages, 4) == 2);
+    void* out[4];
+    test_assert(fiber_bounded_channel_receive_n(small, out, 4) == 2);
+    test_assert(out[0] == (void*)1 && out[1] == (void*)2);
+    fiber_bounded_channel_destroy(small);
+
+    int batch;
+    for(batch = 1; batch <= MAX_BATCH; batch *= 2) {
+        const int64_t bounded_time = run_bounded(batch);
+        const int64_t unbounded_time = run_unbounded(batch);
+        const int64_t sp_time = run_sp(batch);
+        printf("batch %3d: bounded %.1lf, unbounded %.1lf, unbounded_sp %.1lf million messages per second\n", batch,
+               1000.0 * MESSAGE_COUNT / bounded_time, 1000.0 * MESSAGE_COUNT / unbounded_time, 1000.0 * MESSAGE_COUNT / sp_time);
+    }
+
+    fiber_bounded_channel_destroy(bounded_channel);
+    fiber_unbounded_channel_destroy(&unbounded_channel);
+    fiber_unbounded_sp_channel_destroy(&sp_channel);
+    fiber_signal_destroy(&bounded_signal);
+    fiber_signal_destroy(&unbounded_signal);
+    fiber_signal_destroy(&sp_signal);
+
+    fiber_manager_print_stats();
+    return 0;
+}
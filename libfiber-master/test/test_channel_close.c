@@ -0,0 +1,407 @@
+/*
+ * Copyright (c) 2012-2015, Brian Watling and other contributors
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include "fiber_channel.h"
+#include "fiber_multi_channel.h"
+#include "fiber_select.h"
+#include "fiber_manager.h"
+#include "test_helper.h"
+#include <errno.h>
+
+#define NUM_THREADS 2
+#define NUM_WORKERS 8
+#define PER_WORKER_COUNT 10000
+
+__attribute__((noinline)) int current_errno()
+{
+    __asm__ __volatile__ ("" ::: "memory");//errno is thread local and fibers can move between threads
+    return errno;
+}
+
+fiber_bounded_channel_t* bounded_channel = NULL;
+fiber_unbounded_channel_t unbounded_channel;
+fiber_multi_channel_t* multi_channel = NULL;
+fiber_bounded_mpmc_channel_t* mpmc_channel = NULL;
+fiber_broadcast_channel_t* broadcast_channel = NULL;
+fiber_rendezvous_channel_t rendezvous;
+volatile intptr_t total = 0;
+
+void* bounded_receive_function(void* param)
+{
+    test_assert(fiber_bounded_channel_receive(bounded_channel) == NULL);
+    test_assert(current_errno() == EPIPE);
+    return NULL;
+}
+
+void* bounded_send_function(void* param)
+{
+    test_assert(fiber_bounded_channel_send(bounded_channel, param) == -1);
+    test_assert(current_errno() == EPIPE);
+    return NULL;
+}
+
+void* bounded_stream_function(void* param)
+{
+    intptr_t i;
+    for(i = 1; i <= PER_WORKER_COUNT; ++i) {
+        if(fiber_bounded_channel_send(bounded_channel, (void*)i) < 0) {
+            test_assert(current_errno() == EPIPE);
+            break;
+        }
+    }
+    return NULL;
+}
+
+void* bounded_drain_function(void* param)
+{
+    void* message;
+    while((message = fiber_bounded_channel_receive(bounded_channel))) {
+        __sync_fetch_and_add(&total, 1);
+    }
+    test_assert(current_errno() == EPIPE);
+    return NULL;
+}
+
+void test_bounded()
+{
+    fiber_signal_t signal;
+    fiber_signal_init(&signal);
+    bounded_channel = fiber_bounded_channel_create(2, &signal);
+
+    //a receiver parked on an empty channel wakes up
+    fiber_t* fiber = fiber_create(20000, &bounded_receive_function, NULL);
+    fiber_yield();
+    test_assert(fiber_bounded_channel_close(bounded_channel));
+    test_assert(!fiber_bounded_channel_close(bounded_channel));
+    fiber_join(fiber, NULL);
+    fiber_bounded_channel_destroy(bounded_channel);
+
+    //senders blocked on a full channel fail, and the messages sent before closing can still be received
+    bounded_channel = fiber_bounded_channel_create(2, &signal);
+    intptr_t i;
+    for(i = 1; i <= 4; ++i) {
+        test_assert(fiber_bounded_channel_send(bounded_channel, (void*)i) >= 0);
+    }
+    test_assert(fiber_bounded_channel_try_send(bounded_channel, (void*)5) == 0);
+    fiber_t* senders[NUM_WORKERS];
+    for(i = 0; i < NUM_WORKERS; ++i) {
+        senders[i] = fiber_create(20000, &bounded_send_function, (void*)5);
+    }
+    fiber_yield();
+    fiber_bounded_channel_close(bounded_channel);
+    for(i = 0; i < NUM_WORKERS; ++i) {
+        fiber_join(senders[i], NULL);
+    }
+    test_assert(fiber_bounded_channel_try_send(bounded_channel, (void*)5) == -1);
+    void* messages[2];
+    test_assert(fiber_bounded_channel_receive_n(bounded_channel, messages, 2) == 2);
+    test_assert(messages[0] == (void*)1 && messages[1] == (void*)2);
+    test_assert(fiber_bounded_channel_receive(bounded_channel) == (void*)3);
+    void* out = NULL;
+    test_assert(fiber_bounded_channel_try_receive(bounded_channel, &out) == 1 && out == (void*)4);
+    test_assert(!fiber_bounded_channel_try_receive(bounded_channel, &out));
+    test_assert(current_errno() == EPIPE);
+    test_assert(fiber_bounded_channel_receive(bounded_channel) == NULL);
+    test_assert(current_errno() == EPIPE);
+    test_assert(fiber_bounded_channel_receive_n(bounded_channel, messages, 2) == 0);
+
+    //a select finds the channel closed
+    fiber_select_case_t c;
+    fiber_select_case_receive(&c, bounded_channel);
+    test_assert(fiber_select(&c, 1, NULL) == 0 && c.closed);
+
+    fiber_bounded_channel_destroy(bounded_channel);
+
+    //a fiber other than the receiver closes the channel while the receiver is busy and senders are blocked
+    bounded_channel = fiber_bounded_channel_create(2, &signal);
+    total = 0;
+    fiber_t* const receiver = fiber_create(20000, &bounded_drain_function, NULL);
+    for(i = 0; i < NUM_WORKERS; ++i) {
+        senders[i] = fiber_create(20000, &bounded_stream_function, NULL);
+    }
+    while(total < PER_WORKER_COUNT) {
+        fiber_yield();
+    }
+    test_assert(fiber_bounded_channel_close(bounded_channel));
+    for(i = 0; i < NUM_WORKERS; ++i) {
+        fiber_join(senders[i], NULL);
+    }
+    fiber_join(receiver, NULL);
+    test_assert(total >= PER_WORKER_COUNT && total < NUM_WORKERS * PER_WORKER_COUNT);
+    fiber_bounded_channel_destroy(bounded_channel);
+    fiber_signal_destroy(&signal);
+}
+
+void* unbounded_send_function(void* param)
+{
+    intptr_t i;
+    for(i = 1; i <= PER_WORKER_COUNT; ++i) {
+        fiber_unbounded_channel_message_t* const node = (fiber_unbounded_channel_message_t*)malloc(sizeof(*node));
+        node->data = (void*)i;
+        if(fiber_unbounded_channel_send(&unbounded_channel, node) < 0) {
+            test_assert(current_errno() == EPIPE);
+            free(node);
+            break;
+        }
+    }
+    return NULL;
+}
+
+void* unbounded_receive_function(void* param)
+{
+    fiber_unbounded_channel_message_t* node;
+    while((node = (fiber_unbounded_channel_message_t*)fiber_unbounded_channel_receive(&unbounded_channel))) {
+        total += (intptr_t)node->data;
+        free(node);
+    }
+    test_assert(current_errno() == EPIPE);
+    return NULL;
+}
+
+void test_unbounded()
+{
+    fiber_signal_t signal;
+    fiber_signal_init(&signal);
+    fiber_unbounded_channel_init(&unbounded_channel, &signal);
+    total = 0;
+
+    //the receiver drains everything sent before the close
+    fiber_t* receiver = fiber_create(20000, &unbounded_receive_function, NULL);
+    fiber_t* senders[NUM_WORKERS];
+    int i;
+    for(i = 0; i < NUM_WORKERS; ++i) {
+        senders[i] = fiber_create(20000, &unbounded_send_function, NULL);
+    }
+    for(i = 0; i < NUM_WORKERS; ++i) {
+        fiber_join(senders[i], NULL);
+    }
+    test_assert(fiber_unbounded_channel_close(&unbounded_channel));
+    fiber_join(receiver, NULL);
+    test_assert(total == NUM_WORKERS * (intptr_t)PER_WORKER_COUNT * (PER_WORKER_COUNT + 1) / 2);
+
+    //senders racing with the close either get through or fail
+    fiber_unbounded_channel_destroy(&unbounded_channel);
+    fiber_unbounded_channel_init(&unbounded_channel, &signal);
+    for(i = 0; i < NUM_WORKERS; ++i) {
+        senders[i] = fiber_create(20000, &unbounded_send_function, NULL);
+    }
+    receiver = fiber_create(20000, &unbounded_receive_function, NULL);
+    fiber_yield();
+    fiber_unbounded_channel_close(&unbounded_channel);
+    for(i = 0; i < NUM_WORKERS; ++i) {
+        fiber_join(senders[i], NULL);
+    }
+    fiber_join(receiver, NULL);
+    test_assert(!fiber_unbounded_channel_try_receive(&unbounded_channel));
+
+    fiber_unbounded_channel_destroy(&unbounded_channel);
+    fiber_signal_destroy(&signal);
+
+    fiber_unbounded_sp_channel_t sp_channel;
+    fiber_unbounded_sp_channel_init(&sp_channel, NULL);
+    fiber_unbounded_sp_channel_message_t* node = (fiber_unbounded_sp_channel_message_t*)malloc(sizeof(*node));
+    node->data = (void*)1;
+    test_assert(fiber_unbounded_sp_channel_send(&sp_channel, node) == 0);
+    fiber_unbounded_sp_channel_close(&sp_channel);
+    test_assert(fiber_unbounded_sp_channel_send(&sp_channel, node) == -1);
+    node = (fiber_unbounded_sp_channel_message_t*)fiber_unbounded_sp_channel_receive(&sp_channel);
+    test_assert(node && node->data == (void*)1);
+    free(node);
+    test_assert(fiber_unbounded_sp_channel_receive(&sp_channel) == NULL);
+    test_assert(current_errno() == EPIPE);
+    fiber_unbounded_sp_channel_destroy(&sp_channel);
+}
+
+void* multi_receive_function(void* param)
+{
+    void* message;
+    while((message = fiber_multi_channel_receive(multi_channel))) {
+        __sync_fetch_and_add(&total, (intptr_t)message);
+    }
+    test_assert(current_errno() == EPIPE);
+    return NULL;
+}
+
+void* mpmc_send_function(void* param)
+{
+    intptr_t i;
+    for(i = 1; i <= PER_WORKER_COUNT; ++i) {
+        if(!fiber_bounded_mpmc_channel_send(mpmc_channel, (void*)i)) {
+            test_assert(current_errno() == EPIPE);
+            break;
+        }
+    }
+    return NULL;
+}
+
+void* mpmc_receive_function(void* param)
+{
+    void* message;
+    while((message = fiber_bounded_mpmc_channel_receive(mpmc_channel))) {
+        __sync_fetch_and_add(&total, (intptr_t)message);
+    }
+    test_assert(current_errno() == EPIPE);
+    return NULL;
+}
+
+//a pipeline shuts down with one call: every consumer drains what was sent and exits
+void test_multi()
+{
+    multi_channel = fiber_multi_channel_create(4, NULL);
+    total = 0;
+    fiber_t* receivers[NUM_WORKERS];
+    intptr_t i;
+    for(i = 0; i < NUM_WORKERS; ++i) {
+        receivers[i] = fiber_create(20000, &multi_receive_function, NULL);
+    }
+    for(i = 1; i <= PER_WORKER_COUNT; ++i) {
+        test_assert(fiber_multi_channel_send(multi_channel, (void*)i));
+    }
+    test_assert(fiber_multi_channel_close(multi_channel));
+    test_assert(!fiber_multi_channel_send(multi_channel, (void*)1));
+    for(i = 0; i < NUM_WORKERS; ++i) {
+        fiber_join(receivers[i], NULL);
+    }
+    test_assert(total == (intptr_t)PER_WORKER_COUNT * (PER_WORKER_COUNT + 1) / 2);
+    fiber_multi_channel_destroy(multi_channel);
+
+    mpmc_channel = fiber_bounded_mpmc_channel_create(4);
+    total = 0;
+    fiber_t* senders[NUM_WORKERS];
+    for(i = 0; i < NUM_WORKERS; ++i) {
+        receivers[i] = fiber_create(20000, &mpmc_receive_function, NULL);
+        senders[i] = fiber_create(20000, &mpmc_send_function, NULL);
+    }
+    for(i = 0; i < NUM_WORKERS; ++i) {
+        fiber_join(senders[i], NULL);
+    }
+    test_assert(fiber_bounded_mpmc_channel_close(mpmc_channel));
+    for(i = 0; i < NUM_WORKERS; ++i) {
+        fiber_join(receivers[i], NULL);
+    }
+    test_assert(total == NUM_WORKERS * (intptr_t)PER_WORKER_COUNT * (PER_WORKER_COUNT + 1) / 2);
+    void* out;
+    test_assert(!fiber_bounded_mpmc_channel_try_receive(mpmc_channel, &out) && current_errno() == EPIPE);
+    fiber_bounded_mpmc_channel_destroy(mpmc_channel);
+
+    //senders blocked on a full channel wake up too
+    mpmc_channel = fiber_bounded_mpmc_channel_create(2);
+    for(i = 0; i < NUM_WORKERS; ++i) {
+        senders[i] = fiber_create(20000, &mpmc_send_function, NULL);
+    }
+    fiber_yield();
+    fiber_bounded_mpmc_channel_close(mpmc_channel);
+    for(i = 0; i < NUM_WORKERS; ++i) {
+        fiber_join(senders[i], NULL);
+    }
+    test_assert(!fiber_bounded_mpmc_channel_try_send(mpmc_channel, (void*)1) && current_errno() == EPIPE);
+    fiber_bounded_mpmc_channel_destroy(mpmc_channel);
+}
+
+void* subscribe_function(void* param)
+{
+    fiber_broadcast_subscriber_t* const subscriber = (fiber_broadcast_subscriber_t*)param;
+    intptr_t sum = 0;
+    void* message;
+    while((message = fiber_broadcast_channel_receive(subscriber))) {
+        sum += (intptr_t)message;
+    }
+    test_assert(current_errno() == EPIPE);
+    test_assert(sum == (intptr_t)PER_WORKER_COUNT * (PER_WORKER_COUNT + 1) / 2);
+    fiber_broadcast_channel_unsubscribe(subscriber);
+    return NULL;
+}
+
+void test_broadcast()
+{
+    broadcast_channel = fiber_broadcast_channel_create(4, FIBER_BROADCAST_BLOCK);
+    fiber_broadcast_subscriber_t subscribers[NUM_WORKERS];
+    fiber_t* fibers[NUM_WORKERS];
+    intptr_t i;
+    for(i = 0; i < NUM_WORKERS; ++i) {
+        fiber_broadcast_channel_subscribe(broadcast_channel, &subscribers[i]);
+        fibers[i] = fiber_create(20000, &subscribe_function, &subscribers[i]);
+    }
+    for(i = 1; i <= PER_WORKER_COUNT; ++i) {
+        test_assert(fiber_broadcast_channel_publish(broadcast_channel, (void*)i));
+    }
+    test_assert(fiber_broadcast_channel_close(broadcast_channel));
+    test_assert(!fiber_broadcast_channel_publish(broadcast_channel, (void*)1));
+    for(i = 0; i < NUM_WORKERS; ++i) {
+        fiber_join(fibers[i], NULL);
+    }
+    fiber_broadcast_channel_destroy(broadcast_channel);
+}
+
+void* call_function(void* param)
+{
+    test_assert(fiber_rendezvous_channel_call(&rendezvous, param) == NULL);
+    test_assert(current_errno() == EPIPE);
+    return NULL;
+}
+
+void* serve_function(void* param)
+{
+    void* request = fiber_rendezvous_channel_receive(&rendezvous);
+    while(request) {
+        request = fiber_rendezvous_channel_reply_and_receive(&rendezvous, request);
+    }
+    test_assert(current_errno() == EPIPE);
+    return NULL;
+}
+
+void test_rendezvous()
+{
+    //callers queued behind a missing receiver are sent away
+    fiber_rendezvous_channel_init(&rendezvous);
+    fiber_t* callers[NUM_WORKERS];
+    int i;
+    for(i = 0; i < NUM_WORKERS; ++i) {
+        callers[i] = fiber_create(20000, &call_function, (void*)1);
+    }
+    fiber_yield();
+    test_assert(fiber_rendezvous_channel_close(&rendezvous));
+    for(i = 0; i < NUM_WORKERS; ++i) {
+        fiber_join(callers[i], NULL);
+    }
+    test_assert(fiber_rendezvous_channel_receive(&rendezvous) == NULL);
+    fiber_rendezvous_channel_destroy(&rendezvous);
+
+    //a parked receiver wakes up
+    fiber_rendezvous_channel_init(&rendezvous);
+    fiber_t* server = fiber_create(20000, &serve_function, NULL);
+    for(i = 1; i <= 100; ++i) {
+        test_assert(fiber_rendezvous_channel_call(&rendezvous, (void*)(intptr_t)i) == (void*)(intptr_t)i);
+    }
+    fiber_rendezvous_channel_close(&rendezvous);
+    fiber_join(server, NULL);
+    fiber_rendezvous_channel_destroy(&rendezvous);
+}
+
+int main(int argc, char* argv[])
+{
+    fiber_manager_init(NUM_THREADS);
+
+    test_bounded();
+    test_unbounded();
+    test_multi();
+    test_broadcast();
+    test_rendezvous();
+
+    fiber_manager_print_stats();
+    return 0;
+}
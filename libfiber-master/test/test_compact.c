@@ -0,0 +1,181 @@
+/*
+ * Copyright (c) 2012-2015, Brian Watling and other contributors
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "fiber_compact.h"
+#include "fiber_manager.h"
+#include "fiber_event.h"
+#include "test_helper.h"
+#include <errno.h>
+
+#define NUM_THREADS 4
+#define NUM_FIBERS 100
+#define PER_FIBER_COUNT 1000
+#define SEMAPHORE_LIMIT 3
+
+fiber_compact_mutex_t mutex = FIBER_COMPACT_MUTEX_INITIALIZER;
+fiber_compact_cond_t cond = FIBER_COMPACT_COND_INITIALIZER;
+fiber_compact_rwlock_t rwlock = FIBER_COMPACT_RWLOCK_INITIALIZER;
+fiber_compact_semaphore_t semaphore = FIBER_COMPACT_SEMAPHORE_INITIALIZER(SEMAPHORE_LIMIT);
+volatile int counter = 0;
+volatile int readers = 0;
+volatile int writers = 0;
+volatile int holders = 0;
+volatile int queued = 0;
+volatile int consumed = 0;
+
+//errno is thread local and a fiber can resume on another thread, so don't let the compiler cache its address
+static int __attribute__((noinline)) current_errno()
+{
+    __asm__ __volatile__("" ::: "memory");
+    return errno;
+}
+
+void* mutex_function(void* param)
+{
+    int i;
+    for(i = 0; i < PER_FIBER_COUNT; ++i) {
+        fiber_compact_mutex_lock(&mutex);
+        ++counter;
+        if(!(i % 10)) {
+            //hold it across a yield now and then so others have to wait
+            fiber_yield();
+        }
+        fiber_compact_mutex_unlock(&mutex);
+    }
+    return NULL;
+}
+
+//even fibers produce and odd fibers consume
+void* cond_function(void* param)
+{
+    const int producer = !((intptr_t)param & 1);
+    int i;
+    for(i = 0; i < PER_FIBER_COUNT; ++i) {
+        fiber_compact_mutex_lock(&mutex);
+        if(producer) {
+            ++queued;
+            fiber_compact_cond_signal(&cond);
+        } else {
+            while(!queued) {
+                fiber_compact_cond_wait(&cond, &mutex);
+            }
+            --queued;
+            ++consumed;
+        }
+        fiber_compact_mutex_unlock(&mutex);
+    }
+    return NULL;
+}
+
+void* rwlock_function(void* param)
+{
+    int i;
+    for(i = 0; i < PER_FIBER_COUNT; ++i) {
+        if(i % 10) {
+            fiber_compact_rwlock_rdlock(&rwlock);
+            __sync_fetch_and_add(&readers, 1);
+            test_assert(!writers);
+            fiber_yield();
+            test_assert(!writers);
+            __sync_fetch_and_sub(&readers, 1);
+            fiber_compact_rwlock_rdunlock(&rwlock);
+        } else {
+            fiber_compact_rwlock_wrlock(&rwlock);
+            test_assert(__sync_add_and_fetch(&writers, 1) == 1);
+            test_assert(!readers);
+            fiber_yield();
+            test_assert(!readers);
+            __sync_fetch_and_sub(&writers, 1);
+            fiber_compact_rwlock_wrunlock(&rwlock);
+        }
+    }
+    return NULL;
+}
+
+void* semaphore_function(void* param)
+{
+    int i;
+    for(i = 0; i < PER_FIBER_COUNT; ++i) {
+        fiber_compact_semaphore_wait(&semaphore);
+        test_assert(__sync_add_and_fetch(&holders, 1) <= SEMAPHORE_LIMIT);
+        fiber_yield();
+        __sync_fetch_and_sub(&holders, 1);
+        fiber_compact_semaphore_post(&semaphore);
+    }
+    return NULL;
+}
+
+static void run_fibers(void* (*fn)(void*))
+{
+    fiber_t* fibers[NUM_FIBERS];
+    intptr_t i;
+    for(i = 0; i < NUM_FIBERS; ++i) {
+        fibers[i] = fiber_create(20000, fn, (void*)i);
+    }
+    for(i = 0; i < NUM_FIBERS; ++i) {
+        fiber_join(fibers[i], NULL);
+    }
+}
+
+int main()
+{
+    fiber_manager_init(NUM_THREADS);
+
+    test_assert(sizeof(fiber_compact_mutex_t) == sizeof(int));
+    test_assert(sizeof(fiber_compact_cond_t) == sizeof(int));
+    test_assert(sizeof(fiber_compact_rwlock_t) <= 8);
+    test_assert(sizeof(fiber_compact_semaphore_t) <= 8);
+
+    run_fibers(&mutex_function);
+    test_assert(counter == NUM_FIBERS * PER_FIBER_COUNT);
+    test_assert(fiber_compact_mutex_trylock(&mutex));
+    test_assert(!fiber_compact_mutex_trylock(&mutex));
+    struct timespec deadline;
+    fiber_deadline_after(&deadline, 0, 10000);
+    test_assert(!fiber_compact_mutex_lock_timed(&mutex, &deadline));
+    test_assert(current_errno() == ETIMEDOUT);
+
+    //the mutex is held again when a timed wait gives up
+    fiber_deadline_after(&deadline, 0, 10000);
+    test_assert(!fiber_compact_cond_wait_timed(&cond, &mutex, &deadline));
+    test_assert(current_errno() == ETIMEDOUT);
+    test_assert(!fiber_compact_mutex_trylock(&mutex));
+    fiber_compact_mutex_unlock(&mutex);
+
+    run_fibers(&cond_function);
+    test_assert(consumed == NUM_FIBERS / 2 * PER_FIBER_COUNT);
+    test_assert(!queued);
+
+    run_fibers(&rwlock_function);
+    test_assert(fiber_compact_rwlock_tryrdlock(&rwlock));
+    test_assert(!fiber_compact_rwlock_trywrlock(&rwlock));
+    fiber_compact_rwlock_rdunlock(&rwlock);
+    test_assert(fiber_compact_rwlock_trywrlock(&rwlock));
+    test_assert(!fiber_compact_rwlock_tryrdlock(&rwlock));
+    fiber_compact_rwlock_wrunlock(&rwlock);
+
+    run_fibers(&semaphore_function);
+    test_assert(fiber_compact_semaphore_getvalue(&semaphore) == SEMAPHORE_LIMIT);
+    while(fiber_compact_semaphore_trywait(&semaphore)) {
+    }
+    fiber_deadline_after(&deadline, 0, 10000);
+    test_assert(!fiber_compact_semaphore_wait_timed(&semaphore, &deadline));
+    test_assert(current_errno() == ETIMEDOUT);
+
+    fiber_manager_print_stats();
+    return 0;
+}
+
@@ -16,7 +16,11 @@
 
 #include "fiber_cond.h"
 #include "fiber_manager.h"
+#include "fiber_event.h"
 #include "test_helper.h"
+#include <stdio.h>
+#include <time.h>
+#include <errno.h>
 
 int volatile counter = 1;
 fiber_mutex_t mutex;
@@ -24,6 +28,8 @@ fiber_cond_t cond;
 #define PER_FIBER_COUNT 1000
 #define NUM_FIBERS 100
 #define NUM_THREADS 2
+#define NUM_HERD 1000
+#define HERD_ROUNDS 20
 
 void* run_function(void* param)
 {
@@ -51,6 +57,163 @@ void* run_single(void* param)
     return NULL;
 }
 
+fiber_cond_t ticket_cond;
+volatile int tickets = 0;
+volatile int timed_got_ticket = 0;
+struct timespec ticket_deadline;
+
+//errno is thread local and a fiber can resume on another thread, so don't let the compiler cache its address
+static int __attribute__((noinline)) current_errno()
+{
+    __asm__ __volatile__("" ::: "memory");
+    return errno;
+}
+
+//the usual timed wait loop: a waiter which times out leaves without checking the predicate again
+void* run_timed_ticket(void* param)
+{
+    fiber_mutex_lock(&mutex);
+    while(!tickets) {
+        if(!fiber_cond_wait_timed(&ticket_cond, &mutex, &ticket_deadline) && current_errno() == ETIMEDOUT) {
+            fiber_mutex_unlock(&mutex);
+            return NULL;
+        }
+    }
+    --tickets;
+    timed_got_ticket = 1;
+    fiber_mutex_unlock(&mutex);
+    return NULL;
+}
+
+void* run_ticket(void* param)
+{
+    fiber_mutex_lock(&mutex);
+    while(!tickets) {
+        fiber_cond_wait(&ticket_cond, &mutex);
+    }
+    --tickets;
+    fiber_mutex_unlock(&mutex);
+    return NULL;
+}
+
+//a timed waiter which is signalled and moved onto the mutex just before its deadline must not lose the signal by
+//timing out while it waits for the mutex, or the untimed waiter queued behind it would sleep forever
+static void run_ticket_test()
+{
+    fiber_cond_init(&ticket_cond);
+    tickets = 0;
+    timed_got_ticket = 0;
+    fiber_deadline_after(&ticket_deadline, 0, 20000);
+    fiber_t* const timed = fiber_create(20000, &run_timed_ticket, NULL);
+    fiber_sleep(0, 5000);
+    fiber_t* const untimed = fiber_create(20000, &run_ticket, NULL);
+    fiber_sleep(0, 5000);
+
+    fiber_mutex_lock(&mutex);
+    tickets = 1;
+    fiber_cond_signal(&ticket_cond);
+    //hold on to the mutex until the deadline has passed, so the timed waiter's timeout fires while it's queued on it
+    while(!fiber_deadline_passed(&ticket_deadline)) {
+        fiber_sleep(0, 5000);
+    }
+    fiber_sleep(0, 20000);
+    fiber_mutex_unlock(&mutex);
+
+    fiber_join(timed, NULL);
+    int i;
+    for(i = 0; i < 100 && tickets; ++i) {
+        fiber_sleep(0, 10000);
+    }
+    //someone used the ticket: the signalled timed waiter, or the untimed one if the timed one gave up first
+    test_assert(!tickets);
+    if(timed_got_ticket) {
+        fiber_mutex_lock(&mutex);
+        tickets = 1;
+        fiber_cond_signal(&ticket_cond);
+        fiber_mutex_unlock(&mutex);
+    }
+    fiber_join(untimed, NULL);
+    test_assert(!tickets);
+    fiber_cond_destroy(&ticket_cond);
+}
+
+fiber_mutex_t herd_mutex;
+fiber_cond_t herd_cond;
+fiber_cond_t herd_done;
+volatile int generation = 0;
+volatile int herd_waiting = 0;
+volatile int herd_woken = 0;
+
+void* run_herd(void* param)
+{
+    int seen = 0;
+    int i;
+    for(i = 0; i < HERD_ROUNDS; ++i) {
+        fiber_mutex_lock(&herd_mutex);
+        ++herd_waiting;
+        if(herd_waiting == NUM_HERD) {
+            fiber_cond_signal(&herd_done);
+        }
+        while(generation == seen) {
+            fiber_cond_wait(&herd_cond, &herd_mutex);
+        }
+        seen = generation;
+        --herd_waiting;
+        ++herd_woken;
+        if(herd_woken == generation * NUM_HERD) {
+            fiber_cond_signal(&herd_done);
+        }
+        fiber_mutex_unlock(&herd_mutex);
+    }
+    return NULL;
+}
+
+//broadcasts to a crowd of waiters which all need the mutex once they're woken
+static void run_herd_test(int mutex_flags, const char* name)
+{
+    fiber_mutex_init_with_flags(&herd_mutex, mutex_flags);
+    fiber_cond_init(&herd_cond);
+    fiber_cond_init(&herd_done);
+    generation = 0;
+    herd_woken = 0;
+
+    fiber_t* fibers[NUM_HERD];
+    int i;
+    for(i = 0; i < NUM_HERD; ++i) {
+        fibers[i] = fiber_create(20000, &run_herd, NULL);
+    }
+
+    struct timespec start;
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    fiber_mutex_lock(&herd_mutex);
+    for(i = 1; i <= HERD_ROUNDS; ++i) {
+        while(herd_waiting < NUM_HERD) {
+            fiber_cond_wait(&herd_done, &herd_mutex);
+        }
+        generation = i;
+        fiber_cond_broadcast(&herd_cond);
+        while(herd_woken < i * NUM_HERD) {
+            fiber_cond_wait(&herd_done, &herd_mutex);
+        }
+    }
+    fiber_mutex_unlock(&herd_mutex);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    for(i = 0; i < NUM_HERD; ++i) {
+        fiber_join(fibers[i], NULL);
+    }
+    test_assert(herd_woken == NUM_HERD * HERD_ROUNDS);
+    test_assert(!herd_waiting);
+
+    const long long usecs = (end.tv_sec - start.tv_sec) * 1000000LL + (end.tv_nsec - start.tv_nsec) / 1000;
+    printf("%s: broadcast to %d waiters took %lld usecs per round\n", name, NUM_HERD, usecs / HERD_ROUNDS);
+
+    fiber_cond_destroy(&herd_done);
+    fiber_cond_destroy(&herd_cond);
+    fiber_mutex_destroy(&herd_mutex);
+}
+
 int main()
 {
     fiber_manager_init(NUM_THREADS);
@@ -79,6 +242,11 @@ int main()
 
     fiber_cond_destroy(&cond);
 
+    run_ticket_test();
+
+    run_herd_test(FIBER_MUTEX_HANDOFF, "handoff");
+    run_herd_test(FIBER_MUTEX_BARGING, "barging");
+
     fiber_manager_print_stats();
     return 0;
 }
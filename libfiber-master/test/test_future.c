@@ -0,0 +1,208 @@
+/*
+ * Copyright (c) 2012-2015, Brian Watling and other contributors
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "fiber_future.h"
+#include "fiber_manager.h"
+#include "fiber_event.h"
+#include "test_helper.h"
+#include <errno.h>
+
+#define NUM_THREADS 4
+#define NUM_GETTERS 100
+#define NUM_PROMISES 50
+#define NUM_STACK_ROUNDS 20000
+
+fiber_promise_t promise;
+fiber_promise_t chained;
+volatile int got = 0;
+volatile int inline_ran = 0;
+volatile int remote_manager = -1;
+
+//errno is thread local and a fiber can resume on another thread, so don't let the compiler cache its address
+static int __attribute__((noinline)) current_errno()
+{
+    __asm__ __volatile__("" ::: "memory");
+    return errno;
+}
+
+void* getter_function(void* param)
+{
+    void* value = NULL;
+    test_assert(fiber_future_get(fiber_promise_get_future(&promise), &value));
+    test_assert(value == (void*)42);
+    __sync_fetch_and_add(&got, 1);
+    return NULL;
+}
+
+void* setter_function(void* param)
+{
+    fiber_yield();
+    test_assert(fiber_promise_set_value((fiber_promise_t*)param, param));
+    return NULL;
+}
+
+void inline_callback(fiber_future_t* future, void* arg)
+{
+    void* value = NULL;
+    test_assert(fiber_future_try_get(future, &value));
+    test_assert(value == (void*)42);
+    __sync_fetch_and_add(&inline_ran, 1);
+}
+
+//a continuation which satisfies another promise, chaining the two
+void chain_callback(fiber_future_t* future, void* arg)
+{
+    void* value = NULL;
+    test_assert(fiber_future_try_get(future, &value));
+    test_assert(fiber_promise_set_value((fiber_promise_t*)arg, (void*)((intptr_t)value + 1)));
+}
+
+void remote_callback(fiber_future_t* future, void* arg)
+{
+    remote_manager = fiber_manager_get()->id;
+    test_assert(fiber_promise_set_value((fiber_promise_t*)arg, NULL));
+}
+
+void* stack_setter_function(void* param)
+{
+    test_assert(fiber_promise_set_value((fiber_promise_t*)param, (void*)42));
+    return NULL;
+}
+
+//the promise lives on the getter's stack, which is reused as soon as the getter has the value. the setter mustn't
+//touch the promise after that, so fill it with a pattern and check nothing writes over it
+static void __attribute__((noinline)) stack_promise_round()
+{
+    fiber_promise_t stack_promise;
+    fiber_promise_init(&stack_promise);
+    fiber_detach(fiber_create(20000, &stack_setter_function, &stack_promise));
+    void* value = NULL;
+    test_assert(fiber_future_get(fiber_promise_get_future(&stack_promise), &value));
+    test_assert(value == (void*)42);
+    volatile unsigned char* const bytes = (volatile unsigned char*)&stack_promise;
+    size_t i;
+    for(i = 0; i < sizeof(stack_promise); ++i) {
+        bytes[i] = 0xa5;
+    }
+    fiber_yield();
+    for(i = 0; i < sizeof(stack_promise); ++i) {
+        test_assert(bytes[i] == 0xa5);
+    }
+}
+
+void* stack_getter_function(void* param)
+{
+    int i;
+    for(i = 0; i < NUM_STACK_ROUNDS; ++i) {
+        stack_promise_round();
+    }
+    return NULL;
+}
+
+int main()
+{
+    fiber_manager_init(NUM_THREADS);
+
+    fiber_promise_init(&promise);
+    fiber_future_t* const future = fiber_promise_get_future(&promise);
+    void* value = NULL;
+    test_assert(!fiber_future_try_get(future, &value));
+    test_assert(current_errno() == EAGAIN);
+    struct timespec deadline;
+    fiber_deadline_after(&deadline, 0, 10000);
+    test_assert(!fiber_future_get_timed(future, &value, &deadline));
+    test_assert(current_errno() == ETIMEDOUT);
+
+    //continuations added before the value is set run inline in the setter, in order
+    fiber_future_continuation_t continuations[3];
+    fiber_promise_init(&chained);
+    fiber_future_then(future, &continuations[0], &inline_callback, NULL, NULL);
+    fiber_future_then(future, &continuations[1], &chain_callback, &chained, NULL);
+
+    fiber_t* getters[NUM_GETTERS];
+    int i;
+    for(i = 0; i < NUM_GETTERS; ++i) {
+        getters[i] = fiber_create(20000, &getter_function, NULL);
+    }
+    fiber_yield();
+    test_assert(fiber_promise_set_value(&promise, (void*)42));
+    test_assert(!fiber_promise_set_value(&promise, (void*)43));
+    test_assert(current_errno() == EINVAL);
+    test_assert(inline_ran == 1);
+    for(i = 0; i < NUM_GETTERS; ++i) {
+        fiber_join(getters[i], NULL);
+    }
+    test_assert(got == NUM_GETTERS);
+    test_assert(fiber_future_try_get(fiber_promise_get_future(&chained), &value));
+    test_assert(value == (void*)43);
+
+    //a continuation added once the future is ready runs right away
+    fiber_future_then(future, &continuations[2], &inline_callback, NULL, NULL);
+    test_assert(inline_ran == 2);
+
+    //a continuation can run on another manager
+    fiber_promise_t remote_done;
+    fiber_promise_init(&remote_done);
+    fiber_future_continuation_t remote;
+    fiber_future_then(future, &remote, &remote_callback, &remote_done, fiber_manager_get_by_id(NUM_THREADS - 1));
+    test_assert(fiber_future_get(fiber_promise_get_future(&remote_done), NULL));
+    test_assert(remote_manager == NUM_THREADS - 1);
+
+    //combinators over promises satisfied by other fibers
+    fiber_promise_t promises[NUM_PROMISES];
+    fiber_future_t* futures[NUM_PROMISES];
+    fiber_future_continuation_t when_continuations[NUM_PROMISES];
+    fiber_future_when_t when_all;
+    fiber_future_when_t when_any;
+    fiber_future_continuation_t any_continuations[NUM_PROMISES];
+    for(i = 0; i < NUM_PROMISES; ++i) {
+        fiber_promise_init(&promises[i]);
+        futures[i] = fiber_promise_get_future(&promises[i]);
+    }
+    fiber_future_t* const all = fiber_future_when_all(&when_all, futures, when_continuations, NUM_PROMISES);
+    fiber_future_t* const any = fiber_future_when_any(&when_any, futures, any_continuations, NUM_PROMISES);
+    test_assert(!fiber_future_is_ready(all));
+    test_assert(!fiber_future_is_ready(any));
+    test_assert(fiber_promise_set_value(&promises[NUM_PROMISES / 2], NULL));
+    test_assert(fiber_future_try_get(any, &value));
+    test_assert(value == futures[NUM_PROMISES / 2]);
+    test_assert(!fiber_future_is_ready(all));
+    for(i = 0; i < NUM_PROMISES; ++i) {
+        if(i != NUM_PROMISES / 2) {
+            fiber_detach(fiber_create(20000, &setter_function, &promises[i]));
+        }
+    }
+    test_assert(fiber_future_get(all, &value));
+    test_assert(value == futures);
+    for(i = 0; i < NUM_PROMISES; ++i) {
+        test_assert(fiber_future_is_ready(futures[i]));
+    }
+
+    fiber_future_when_t empty;
+    test_assert(fiber_future_is_ready(fiber_future_when_all(&empty, NULL, NULL, 0)));
+    test_assert(fiber_future_is_ready(fiber_future_when_any(&empty, NULL, NULL, 0)));
+
+    fiber_t* stack_getters[NUM_THREADS];
+    for(i = 0; i < NUM_THREADS; ++i) {
+        stack_getters[i] = fiber_create(20000, &stack_getter_function, NULL);
+    }
+    for(i = 0; i < NUM_THREADS; ++i) {
+        fiber_join(stack_getters[i], NULL);
+    }
+
+    fiber_manager_print_stats();
+    return 0;
+}
@@ -44,10 +44,13 @@ static inline void fiber_manager_print_stats()
            "\nsignal_spin_count: %" PRIu64
            "\nmulti_signal_spin_count: %" PRIu64
            "\nwake_mpsc_spin_count: %" PRIu64
+           "\nwake_mpsc_token_count: %" PRIu64
            "\nwake_mpmc_spin_count: %" PRIu64
            "\npoll_count: %" PRIu64
            "\nevent_wait_count: %" PRIu64
            "\nlock_contention_count: %" PRIu64
+           "\nbusy_poll_usecs: %" PRIu64
+           "\nblocked_poll_usecs: %" PRIu64
            "\n",
            stats.yield_count,
            stats.steal_count,
@@ -56,10 +59,13 @@ static inline void fiber_manager_print_stats()
            stats.signal_spin_count,
            stats.multi_signal_spin_count,
            stats.wake_mpsc_spin_count,
+           stats.wake_mpsc_token_count,
            stats.wake_mpmc_spin_count,
            stats.poll_count,
            stats.event_wait_count,
-           stats.lock_contention_count);
+           stats.lock_contention_count,
+           stats.busy_poll_usecs,
+           stats.blocked_poll_usecs);
 }
 
 #endif
@@ -0,0 +1,188 @@
+/*
+ * Copyright (c) 2012-2015, Brian Watling and other contributors
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "fiber_lock_profile.h"
+#include "fiber_mutex.h"
+#include "fiber_rwlock.h"
+#include "fiber_semaphore.h"
+#include "fiber_spinlock.h"
+#include "fiber_manager.h"
+#include "test_helper.h"
+#include <errno.h>
+
+#define NUM_THREADS 2
+#define NUM_FIBERS 10
+#define PER_FIBER_COUNT 100
+
+fiber_mutex_t mutex;
+fiber_spinlock_t spinlock;
+fiber_rwlock_t rwlock;
+fiber_semaphore_t semaphore;
+
+void* mutex_function(void* param)
+{
+    int i;
+    for(i = 0; i < PER_FIBER_COUNT; ++i) {
+        fiber_mutex_lock(&mutex);
+        //hold the lock across a yield so the others have to wait for it
+        fiber_yield();
+        fiber_mutex_unlock(&mutex);
+    }
+    return NULL;
+}
+
+void* reader_function(void* param)
+{
+    fiber_rwlock_rdlock(&rwlock);
+    fiber_rwlock_rdunlock(&rwlock);
+    fiber_semaphore_wait(&semaphore);
+    return NULL;
+}
+
+#ifdef FIBER_LOCK_PROFILE
+static uint64_t histogram_total(const uint64_t* histogram)
+{
+    uint64_t total = 0;
+    int i;
+    for(i = 0; i < FIBER_LOCK_PROFILE_BUCKETS; ++i) {
+        total += histogram[i];
+    }
+    return total;
+}
+#endif
+
+static void run_fibers(void* (*fn)(void*))
+{
+    fiber_t* fibers[NUM_FIBERS];
+    int i;
+    for(i = 0; i < NUM_FIBERS; ++i) {
+        fibers[i] = fiber_create(20000, fn, NULL);
+    }
+    for(i = 0; i < NUM_FIBERS; ++i) {
+        fiber_join(fibers[i], NULL);
+    }
+}
+
+int main()
+{
+    fiber_manager_init(NUM_THREADS);
+
+    fiber_mutex_init(&mutex);
+    fiber_spinlock_init(&spinlock);
+    fiber_rwlock_init(&rwlock);
+    fiber_semaphore_init(&semaphore, 0);
+
+    fiber_lock_profile_stats_t stats;
+    memset(&stats, 0, sizeof(stats));
+
+#ifdef FIBER_LOCK_PROFILE
+    test_assert(fiber_lock_profile_start(FIBER_LOCK_PROFILE_BY_CALLER));
+
+    run_fibers(&mutex_function);
+    fiber_lock_profile_lock_stats(&mutex, &stats);
+    test_assert(stats.acquisitions == NUM_FIBERS * PER_FIBER_COUNT);
+    test_assert(stats.contentions > 0);
+    test_assert(stats.max_waiters > 0);
+    test_assert(stats.max_wait_nsecs > 0);
+    test_assert(histogram_total(stats.wait_histogram) == stats.contentions);
+    test_assert(stats.holds == NUM_FIBERS * PER_FIBER_COUNT);
+    test_assert(histogram_total(stats.hold_histogram) == stats.holds);
+
+    //a failed trylock isn't an acquisition
+    fiber_spinlock_lock(&spinlock);
+    test_assert(!fiber_spinlock_trylock(&spinlock));
+    fiber_spinlock_unlock(&spinlock);
+    test_assert(fiber_spinlock_trylock(&spinlock));
+    fiber_spinlock_unlock(&spinlock);
+    memset(&stats, 0, sizeof(stats));
+    fiber_lock_profile_lock_stats(&spinlock, &stats);
+    test_assert(stats.acquisitions == 2);
+    test_assert(stats.contentions == 0);
+    test_assert(stats.holds == 2);
+
+    //readers wait behind a writer, then for the semaphore. permits and shared holds aren't timed
+    fiber_rwlock_wrlock(&rwlock);
+    fiber_t* fibers[NUM_FIBERS];
+    int i;
+    for(i = 0; i < NUM_FIBERS; ++i) {
+        fibers[i] = fiber_create(20000, &reader_function, NULL);
+    }
+    while(rwlock.state.state.waiting_readers < NUM_FIBERS) {
+        fiber_yield();
+    }
+    fiber_rwlock_wrunlock(&rwlock);
+    while(fiber_semaphore_getvalue(&semaphore) > -NUM_FIBERS) {
+        fiber_yield();
+    }
+    fiber_semaphore_post_n(&semaphore, NUM_FIBERS);
+    for(i = 0; i < NUM_FIBERS; ++i) {
+        fiber_join(fibers[i], NULL);
+    }
+    memset(&stats, 0, sizeof(stats));
+    fiber_lock_profile_lock_stats(&rwlock, &stats);
+    test_assert(stats.acquisitions == NUM_FIBERS + 1);
+    test_assert(stats.contentions == NUM_FIBERS);
+    test_assert(stats.max_waiters == NUM_FIBERS - 1);
+    test_assert(stats.holds == 1);
+    memset(&stats, 0, sizeof(stats));
+    fiber_lock_profile_lock_stats(&semaphore, &stats);
+    test_assert(stats.acquisitions == NUM_FIBERS);
+    test_assert(stats.contentions == NUM_FIBERS);
+    test_assert(stats.max_waiters == NUM_FIBERS - 1);
+    test_assert(stats.holds == 0);
+
+    fiber_lock_profile_stop();
+    fiber_mutex_lock(&mutex);
+    fiber_mutex_unlock(&mutex);
+    memset(&stats, 0, sizeof(stats));
+    fiber_lock_profile_lock_stats(&mutex, &stats);
+    test_assert(stats.acquisitions == NUM_FIBERS * PER_FIBER_COUNT);
+
+    fiber_lock_profile_print(stdout);
+    FILE* const dump = tmpfile();
+    test_assert(dump);
+    fiber_lock_profile_dump(dump);
+    rewind(dump);
+    char line[256];
+    test_assert(fgets(line, sizeof(line), dump) && !strcmp(line, "--- mutex:\n"));
+    int samples = 0;
+    while(fgets(line, sizeof(line), dump)) {
+        samples += !!strchr(line, '@');
+    }
+    test_assert(samples >= 3);
+    fclose(dump);
+
+    fiber_lock_profile_reset();
+    memset(&stats, 0, sizeof(stats));
+    fiber_lock_profile_lock_stats(&mutex, &stats);
+    test_assert(stats.acquisitions == 0);
+#else
+    //compiled out: the locks don't record anything and profiling can't be started
+    test_assert(!fiber_lock_profile_start(FIBER_LOCK_PROFILE_BY_CALLER));
+    test_assert(errno == ENOSYS);
+    run_fibers(&mutex_function);
+    fiber_lock_profile_lock_stats(&mutex, &stats);
+    test_assert(stats.acquisitions == 0);
+#endif
+
+    fiber_semaphore_destroy(&semaphore);
+    fiber_rwlock_destroy(&rwlock);
+    fiber_mutex_destroy(&mutex);
+
+    fiber_manager_print_stats();
+    return 0;
+}
+
@@ -0,0 +1,176 @@
+/*
+ * Copyright (c) 2012-2015, Brian Watling and other contributors
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "fiber_multi_channel.h"
+#include "fiber_manager.h"
+#include "fiber_event.h"
+#include "test_helper.h"
+#include <errno.h>
+#include <time.h>
+
+#define NUM_THREADS 4
+#define NUM_SENDERS 4
+#define NUM_RECEIVERS 4
+#define PER_SENDER_COUNT 100000
+
+fiber_bounded_mpmc_channel_t* channel = NULL;
+fiber_multi_channel_t* multi_channel = NULL;
+volatile int results[NUM_SENDERS * PER_SENDER_COUNT] = {};
+
+//errno is thread local and a fiber can resume on another thread, so don't let the compiler cache its address
+static int __attribute__((noinline)) current_errno()
+{
+    __asm__ __volatile__("" ::: "memory");
+    return errno;
+}
+
+int64_t time_diff(const struct timespec* start, const struct timespec* end) {
+    return (end->tv_sec * 1000000000LL + end->tv_nsec) - (start->tv_sec * 1000000000LL + start->tv_nsec);
+}
+
+void* send_function(void* param)
+{
+    const intptr_t base = (intptr_t)param * PER_SENDER_COUNT;
+    intptr_t i;
+    for(i = 1; i <= PER_SENDER_COUNT; ++i) {
+        test_assert(fiber_bounded_mpmc_channel_send(channel, (void*)(base + i)));
+    }
+    return NULL;
+}
+
+void* receive_function(void* param)
+{
+    int i;
+    for(i = 0; i < NUM_SENDERS * PER_SENDER_COUNT / NUM_RECEIVERS; ++i) {
+        const intptr_t n = (intptr_t)fiber_bounded_mpmc_channel_receive(channel);
+        test_assert(n > 0 && n <= NUM_SENDERS * PER_SENDER_COUNT);
+        __sync_fetch_and_add(&results[n - 1], 1);
+    }
+    return NULL;
+}
+
+void* multi_send_function(void* param)
+{
+    const intptr_t base = (intptr_t)param * PER_SENDER_COUNT;
+    intptr_t i;
+    for(i = 1; i <= PER_SENDER_COUNT; ++i) {
+        fiber_multi_channel_send(multi_channel, (void*)(base + i));
+    }
+    return NULL;
+}
+
+void* multi_receive_function(void* param)
+{
+    int i;
+    for(i = 0; i < NUM_SENDERS * PER_SENDER_COUNT / NUM_RECEIVERS; ++i) {
+        const intptr_t n = (intptr_t)fiber_multi_channel_receive(multi_channel);
+        __sync_fetch_and_add(&results[n - 1], 1);
+    }
+    return NULL;
+}
+
+void* cancel_function(void* param)
+{
+    if(fiber_bounded_mpmc_channel_receive(channel)) {
+        return NULL;
+    }
+    return (void*)(intptr_t)current_errno();
+}
+
+//runs the senders and receivers to completion, checks every message arrived once and returns the time taken
+static int64_t run(fiber_run_function_t sender, fiber_run_function_t receiver)
+{
+    int i;
+    for(i = 0; i < NUM_SENDERS * PER_SENDER_COUNT; ++i) {
+        results[i] = 0;
+    }
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    fiber_t* fibers[NUM_SENDERS + NUM_RECEIVERS];
+    for(i = 0; i < NUM_RECEIVERS; ++i) {
+        fibers[i] = fiber_create(20000, receiver, NULL);
+    }
+    for(i = 0; i < NUM_SENDERS; ++i) {
+        fibers[NUM_RECEIVERS + i] = fiber_create(20000, sender, (void*)(intptr_t)i);
+    }
+    for(i = 0; i < NUM_SENDERS + NUM_RECEIVERS; ++i) {
+        fiber_join(fibers[i], NULL);
+    }
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    for(i = 0; i < NUM_SENDERS * PER_SENDER_COUNT; ++i) {
+        test_assert(results[i] == 1);
+    }
+    return time_diff(&start, &end);
+}
+
+int main()
+{
+    fiber_manager_init(NUM_THREADS);
+
+    //a small ring so both senders and receivers park
+    channel = fiber_bounded_mpmc_channel_create(4);
+    test_assert(channel);
+    multi_channel = fiber_multi_channel_create(4, 0);
+    test_assert(multi_channel);
+
+    void* out = NULL;
+    test_assert(!fiber_bounded_mpmc_channel_try_receive(channel, &out));
+    struct timespec deadline;
+    fiber_deadline_after(&deadline, 0, 10000);
+    test_assert(!fiber_bounded_mpmc_channel_receive_timed(channel, &out, &deadline));
+    test_assert(current_errno() == ETIMEDOUT);
+    int i;
+    for(i = 1; i <= 16; ++i) {
+        test_assert(fiber_bounded_mpmc_channel_try_send(channel, (void*)(intptr_t)i));
+    }
+    test_assert(!fiber_bounded_mpmc_channel_try_send(channel, (void*)1));
+    for(i = 1; i <= 16; ++i) {
+        test_assert(fiber_bounded_mpmc_channel_try_receive(channel, &out));
+        test_assert(out == (void*)(intptr_t)i);
+    }
+
+    fiber_t* const canceled = fiber_create(20000, &cancel_function, NULL);
+    fiber_sleep(0, 10000);
+    fiber_cancel(canceled);
+    void* result = NULL;
+    fiber_join(canceled, &result);
+    test_assert((intptr_t)result == ECANCELED);
+    //the canceled receiver didn't take a message with it
+    test_assert(fiber_bounded_mpmc_channel_try_send(channel, (void*)1));
+    test_assert(fiber_bounded_mpmc_channel_try_receive(channel, &out));
+    test_assert(out == (void*)1);
+
+    //with the small ring senders and receivers keep parking
+    test_assert(run(&send_function, &receive_function));
+
+    //the timing runs use the same ring size as test_bounded_mpmc_channel
+    fiber_bounded_mpmc_channel_destroy(channel);
+    fiber_multi_channel_destroy(multi_channel);
+    channel = fiber_bounded_mpmc_channel_create(10);
+    multi_channel = fiber_multi_channel_create(10, 0);
+
+    const int64_t ring_time = run(&send_function, &receive_function);
+    const int64_t multi_time = run(&multi_send_function, &multi_receive_function);
+    printf("%d senders and %d receivers moved %d messages: bounded_mpmc_channel %lf seconds, multi_channel %lf seconds\n",
+           NUM_SENDERS, NUM_RECEIVERS, NUM_SENDERS * PER_SENDER_COUNT, 0.000000001 * ring_time, 0.000000001 * multi_time);
+
+    fiber_bounded_mpmc_channel_destroy(channel);
+    fiber_multi_channel_destroy(multi_channel);
+
+    fiber_manager_print_stats();
+    return 0;
+}
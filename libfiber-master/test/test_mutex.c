@@ -17,12 +17,28 @@
 #include "fiber_mutex.h"
 #include "fiber_manager.h"
 #include "test_helper.h"
+#include <errno.h>
+#include <stdlib.h>
 
 int volatile counter = 0;
+int volatile timed_out = 0;
 fiber_mutex_t mutex;
 #define PER_FIBER_COUNT 100000
 #define NUM_FIBERS 100
 #define NUM_THREADS 4
+#define CONTENDED_COUNT 1000
+#define TIMED_FIBERS 10
+
+//errno is thread local and a fiber can resume on another thread, so don't let the compiler cache its address
+static int __attribute__((noinline)) current_errno()
+{
+    __asm__ __volatile__("" ::: "memory");
+    return errno;
+}
+
+int64_t time_diff(const struct timespec* start, const struct timespec* end) {
+    return (end->tv_sec * 1000000000LL + end->tv_nsec) - (start->tv_sec * 1000000000LL + start->tv_nsec);
+}
 
 void* run_function(void* param)
 {
@@ -35,29 +51,106 @@ void* run_function(void* param)
     return NULL;
 }
 
-int main()
+//holds the lock across a yield so waiters really queue up
+void* contended_function(void* param)
 {
-    fiber_manager_init(NUM_THREADS);
+    int i;
+    for(i = 0; i < CONTENDED_COUNT; ++i) {
+        fiber_mutex_lock(&mutex);
+        const int value = counter;
+        fiber_yield();
+        counter = value + 1;
+        fiber_mutex_unlock(&mutex);
+    }
+    return NULL;
+}
 
-    fiber_mutex_init(&mutex);
+//a few fibers give up on the lock while it's held; the others must still get it
+void* timed_function(void* param)
+{
+    struct timespec deadline;
+    fiber_deadline_after(&deadline, 0, 1000);
+    if(((intptr_t)param & 1) && !fiber_mutex_lock_timed(&mutex, &deadline)) {
+        test_assert(current_errno() == ETIMEDOUT);
+        __sync_fetch_and_add(&timed_out, 1);
+        return NULL;
+    }
+    if(!((intptr_t)param & 1)) {
+        fiber_mutex_lock(&mutex);
+    }
+    ++counter;
+    fiber_mutex_unlock(&mutex);
+    return NULL;
+}
 
+void run_fibers(fiber_run_function_t function, int count)
+{
     fiber_t* fibers[NUM_FIBERS];
     int i;
-    for(i = 0; i < NUM_FIBERS; ++i) {
-        fibers[i] = fiber_create(20000, &run_function, NULL);
+    for(i = 0; i < count; ++i) {
+        fibers[i] = fiber_create(20000, function, (void*)(intptr_t)i);
     }
-
-    for(i = 0; i < NUM_FIBERS; ++i) {
+    for(i = 0; i < count; ++i) {
         fiber_join(fibers[i], NULL);
     }
+}
 
+void test_flags(int flags, const char* name)
+{
+    fiber_mutex_init_with_flags(&mutex, flags);
+
+    counter = 0;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    run_fibers(&run_function, NUM_FIBERS);
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
     test_assert(counter == NUM_FIBERS * PER_FIBER_COUNT);
+
+    counter = 0;
+    struct timespec contended_start;
+    clock_gettime(CLOCK_MONOTONIC, &contended_start);
+    run_fibers(&contended_function, NUM_FIBERS);
+    struct timespec contended_end;
+    clock_gettime(CLOCK_MONOTONIC, &contended_end);
+    test_assert(counter == NUM_FIBERS * CONTENDED_COUNT);
+
+    printf("%s: %lf seconds, %lf seconds holding the lock across yields\n", name,
+           time_diff(&start, &end) / 1000000000.0, time_diff(&contended_start, &contended_end) / 1000000000.0);
+
+    counter = 0;
+    timed_out = 0;
+    fiber_mutex_lock(&mutex);
+    fiber_t* fibers[TIMED_FIBERS];
+    int i;
+    for(i = 0; i < TIMED_FIBERS; ++i) {
+        fibers[i] = fiber_create(20000, &timed_function, (void*)(intptr_t)i);
+    }
+    fiber_sleep(0, 50000);
+    fiber_mutex_unlock(&mutex);
+    for(i = 0; i < TIMED_FIBERS; ++i) {
+        fiber_join(fibers[i], NULL);
+    }
+    //a timeout may be noticed late, after the lock was handed over
+    test_assert(counter + timed_out == TIMED_FIBERS);
+    test_assert(counter >= TIMED_FIBERS / 2);
+
     test_assert(fiber_mutex_trylock(&mutex));
     test_assert(!fiber_mutex_trylock(&mutex));
     fiber_mutex_unlock(&mutex);
     fiber_mutex_destroy(&mutex);
+}
+
+int main(int argc, char* argv[])
+{
+    //the number of threads can be given to compare the policies
+    fiber_manager_init(argc > 1 ? atoi(argv[1]) : NUM_THREADS);
+
+    test_flags(FIBER_MUTEX_HANDOFF, "handoff");
+    test_flags(FIBER_MUTEX_HANDOFF | FIBER_MUTEX_ADAPTIVE, "adaptive handoff");
+    test_flags(FIBER_MUTEX_BARGING, "barging");
+    test_flags(FIBER_MUTEX_BARGING | FIBER_MUTEX_ADAPTIVE, "adaptive barging");
 
     fiber_manager_print_stats();
     return 0;
 }
-
@@ -0,0 +1,127 @@
+/*
+ * Copyright (c) 2012-2015, Brian Watling and other contributors
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "fiber_manager.h"
+#include "fiber_event.h"
+#include "test_helper.h"
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+//one manager does all of the polling, so the batch grows predictably
+#define NUM_THREADS 1
+//enough ready fds that a single poll can't fetch them all
+#define NUM_PAIRS 300
+#define IDLE_USECS 200000
+
+int sockets[NUM_PAIRS][2];
+volatile int delivered = 0;
+volatile uint32_t max_seen_batch = 0;
+
+void* reader_function(void* param)
+{
+    const intptr_t index = (intptr_t)param;
+    char c = 0;
+    test_assert(read(sockets[index][1], &c, 1) == 1);
+    test_assert(c == (char)index);
+    //the poll which woke us has already adapted the batch
+    const uint32_t batch = fiber_manager_get()->poll_batch_size;
+    if(batch > max_seen_batch) {
+        max_seen_batch = batch;
+    }
+    __sync_fetch_and_add(&delivered, 1);
+    return NULL;
+}
+
+//makes every pair readable at once and checks each reader gets its byte
+static void run_burst()
+{
+    fiber_t* readers[NUM_PAIRS];
+    intptr_t i;
+    delivered = 0;
+    max_seen_batch = 0;
+    for(i = 0; i < NUM_PAIRS; ++i) {
+        readers[i] = fiber_create(20000, &reader_function, (void*)i);
+    }
+    //let every reader block in the poller
+    fiber_sleep(0, 20000);
+    for(i = 0; i < NUM_PAIRS; ++i) {
+        const char c = (char)i;
+        test_assert(write(sockets[i][0], &c, 1) == 1);
+    }
+    for(i = 0; i < NUM_PAIRS; ++i) {
+        fiber_join(readers[i], NULL);
+    }
+    test_assert(delivered == NUM_PAIRS);
+}
+
+//the average time an idle manager spends in a blocking poll while this fiber sleeps
+static uint64_t average_block_usecs()
+{
+    fiber_manager_t* const manager = fiber_manager_get();
+    const uint64_t start_polls = manager->poll_count;
+    const uint64_t start_usecs = manager->blocked_poll_usecs;
+    fiber_sleep(0, IDLE_USECS);
+    //every idle pass polls once without blocking and once blocking
+    const uint64_t blocking_polls = (manager->poll_count - start_polls) / 2;
+    test_assert(blocking_polls > 0);
+    return (manager->blocked_poll_usecs - start_usecs) / blocking_polls;
+}
+
+int main()
+{
+    fiber_manager_init(NUM_THREADS);
+
+    int i;
+    for(i = 0; i < NUM_PAIRS; ++i) {
+        test_assert(!socketpair(AF_UNIX, SOCK_STREAM, 0, sockets[i]));
+    }
+
+    //the batch grows past the minimum to drain the burst...
+    run_burst();
+    printf("largest batch with the default cap: %u\n", max_seen_batch);
+    test_assert(max_seen_batch > FIBER_EVENT_MIN_BATCH_SIZE);
+    test_assert(max_seen_batch <= fiber_event_get_max_batch_size());
+    //...and shrinks back once polls come up mostly empty
+    fiber_sleep(0, 50000);
+    test_assert(fiber_manager_get()->poll_batch_size == FIBER_EVENT_MIN_BATCH_SIZE);
+
+    //the cap holds even though every poll is full
+    fiber_event_set_max_batch_size(2 * FIBER_EVENT_MIN_BATCH_SIZE);
+    run_burst();
+    printf("largest batch with a cap of %u: %u\n", fiber_event_get_max_batch_size(), max_seen_batch);
+    test_assert(max_seen_batch == 2 * FIBER_EVENT_MIN_BATCH_SIZE);
+    fiber_event_set_max_batch_size(FIBER_EVENT_DEFAULT_MAX_BATCH_SIZE);
+
+    for(i = 0; i < NUM_PAIRS; ++i) {
+        close(sockets[i][0]);
+        close(sockets[i][1]);
+    }
+
+    //the sleep timer wakes an idle manager every FIBER_TIME_RESOLUTION_MS, so a shorter poll timeout shows up as
+    //shorter blocking polls
+    test_assert(fiber_manager_get_poll_timeout() == FIBER_TIME_RESOLUTION_MS * 1000);
+    const uint64_t default_block = average_block_usecs();
+    fiber_manager_set_poll_timeout(FIBER_TIME_RESOLUTION_MS * 1000 / 5);
+    const uint64_t short_block = average_block_usecs();
+    fiber_manager_set_poll_timeout(FIBER_TIME_RESOLUTION_MS * 1000);
+    printf("average blocking poll: %" PRIu64 " usecs by default, %" PRIu64 " usecs with a %u usec timeout\n",
+           default_block, short_block, FIBER_TIME_RESOLUTION_MS * 1000 / 5);
+    test_assert(2 * short_block < default_block);
+
+    fiber_manager_print_stats();
+    return 0;
+}
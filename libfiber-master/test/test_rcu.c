@@ -0,0 +1,160 @@
+/*
+ * Copyright (c) 2012-2015, Brian Watling and other contributors
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include "fiber_rcu.h"
+#include "fiber_manager.h"
+#include "test_helper.h"
+#include <stddef.h>
+#include <stdlib.h>
+
+#define NUM_THREADS 4
+#define NUM_READERS 20
+#define NUM_UPDATES 2000
+#define NUM_SYNCHRONIZERS 64
+#define PER_SYNCHRONIZER_COUNT 200
+#define LIVE 0x11223344
+#define DEAD 0x55667788
+
+typedef struct table
+{
+    fiber_rcu_head_t rcu;
+    int magic;
+    int version;
+    int check;//always version * 3
+} table_t;
+
+table_t* current = NULL;
+//retired tables are poisoned and kept until the end, so a reader which sees one proves a grace period ended early
+table_t* graveyard[NUM_UPDATES + 1];
+volatile int buried = 0;
+volatile int called = 0;
+volatile int done = 0;
+volatile int reads = 0;
+
+static void bury(table_t* table)
+{
+    table->magic = DEAD;
+    graveyard[__sync_fetch_and_add(&buried, 1)] = table;
+}
+
+static void bury_callback(fiber_rcu_head_t* head)
+{
+    bury((table_t*)((char*)head - offsetof(table_t, rcu)));
+    __sync_fetch_and_add(&called, 1);
+}
+
+void* reader_function(void* param)
+{
+    int last_version = 0;
+    while(!done) {
+        int i;
+        for(i = 0; i < 100; ++i) {
+            fiber_rcu_read_lock();
+            table_t* const table = fiber_rcu_dereference(current);
+            test_assert(table->magic == LIVE);
+            test_assert(table->check == table->version * 3);
+            //readers never go back in time
+            test_assert(table->version >= last_version);
+            last_version = table->version;
+            //linger, so a reader is sometimes descheduled by the OS mid-section
+            int j;
+            for(j = 0; j < 1000; ++j) {
+                test_assert(table->magic == LIVE);
+            }
+            fiber_rcu_read_unlock();
+        }
+        __sync_fetch_and_add(&reads, 1);
+        fiber_yield();
+    }
+    return NULL;
+}
+
+//many fibers waiting for grace periods at once keeps the address-wait buckets busy while managers pass quiescent states
+void* synchronize_function(void* param)
+{
+    int i;
+    for(i = 0; i < PER_SYNCHRONIZER_COUNT; ++i) {
+        fiber_rcu_synchronize();
+        if(i & 1) {
+            fiber_yield();
+        }
+    }
+    return NULL;
+}
+
+int main()
+{
+    fiber_manager_init(NUM_THREADS);
+
+    table_t* table = calloc(1, sizeof(*table));
+    table->magic = LIVE;
+    fiber_rcu_assign_pointer(current, table);
+
+    fiber_t* readers[NUM_READERS];
+    int i;
+    for(i = 0; i < NUM_READERS; ++i) {
+        readers[i] = fiber_create(20000, &reader_function, NULL);
+    }
+
+    for(i = 1; i <= NUM_UPDATES; ++i) {
+        table_t* const old = current;
+        table = calloc(1, sizeof(*table));
+        table->magic = LIVE;
+        table->version = i;
+        table->check = i * 3;
+        fiber_rcu_assign_pointer(current, table);
+        if(i & 1) {
+            fiber_rcu_synchronize();
+            bury(old);
+        } else {
+            fiber_rcu_call(&old->rcu, &bury_callback);
+            fiber_yield();
+        }
+    }
+
+    //the deferred ones go once their manager gets around to them
+    while(called < NUM_UPDATES / 2) {
+        fiber_sleep(0, 1000);
+    }
+    done = 1;
+    for(i = 0; i < NUM_READERS; ++i) {
+        fiber_join(readers[i], NULL);
+    }
+    test_assert(buried == NUM_UPDATES);
+    test_assert(reads > 0);
+    printf("reads %d\n", reads);
+
+    //a grace period with no readers at all ends right away
+    fiber_rcu_synchronize();
+
+    fiber_t* synchronizers[NUM_SYNCHRONIZERS];
+    for(i = 0; i < NUM_SYNCHRONIZERS; ++i) {
+        synchronizers[i] = fiber_create(20000, &synchronize_function, NULL);
+    }
+    for(i = 0; i < NUM_SYNCHRONIZERS; ++i) {
+        fiber_join(synchronizers[i], NULL);
+    }
+
+    for(i = 0; i < buried; ++i) {
+        free(graveyard[i]);
+    }
+    free(current);
+
+    fiber_manager_print_stats();
+    return 0;
+}
+
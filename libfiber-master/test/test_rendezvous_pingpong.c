@@ -0,0 +1,128 @@
+/*
+ * Copyright (c) 2012-2015, Brian Watling and other contributors
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "fiber_channel.h"
+#include "fiber_manager.h"
+#include "test_helper.h"
+
+#define NUM_THREADS 2
+#define ROUND_TRIPS 1000000
+#define NUM_CALLERS 8
+#define PER_CALLER_COUNT 10000
+
+fiber_bounded_channel_t* channel_one = NULL;
+fiber_bounded_channel_t* channel_two = NULL;
+fiber_rendezvous_channel_t rendezvous;
+
+int64_t time_diff(const struct timespec* start, const struct timespec* end) {
+    return (end->tv_sec * 1000000000LL + end->tv_nsec) - (start->tv_sec * 1000000000LL + start->tv_nsec);
+}
+
+void* ping_function(void* param)
+{
+    intptr_t i;
+    for(i = 1; i <= ROUND_TRIPS; ++i) {
+        fiber_bounded_channel_send(channel_one, (void*)i);
+        test_assert(fiber_bounded_channel_receive(channel_two) == (void*)(i + 1));
+    }
+    return NULL;
+}
+
+void* pong_function(void* param)
+{
+    intptr_t i;
+    for(i = 1; i <= ROUND_TRIPS; ++i) {
+        const intptr_t request = (intptr_t)fiber_bounded_channel_receive(channel_one);
+        fiber_bounded_channel_send(channel_two, (void*)(request + 1));
+    }
+    return NULL;
+}
+
+void* call_function(void* param)
+{
+    const intptr_t count = (intptr_t)param;
+    intptr_t i;
+    for(i = 1; i <= count; ++i) {
+        test_assert(fiber_rendezvous_channel_call(&rendezvous, (void*)i) == (void*)(i + 1));
+    }
+    return NULL;
+}
+
+//answers 'count' calls with request + 1
+void* serve_function(void* param)
+{
+    const intptr_t count = (intptr_t)param;
+    intptr_t request = (intptr_t)fiber_rendezvous_channel_receive(&rendezvous);
+    intptr_t i;
+    for(i = 1; i < count; ++i) {
+        request = (intptr_t)fiber_rendezvous_channel_reply_and_receive(&rendezvous, (void*)(request + 1));
+    }
+    fiber_rendezvous_channel_reply(&rendezvous, (void*)(request + 1));
+    return NULL;
+}
+
+int main(int argc, char* argv[])
+{
+    fiber_manager_init(NUM_THREADS);
+
+    fiber_signal_t signal_one;
+    fiber_signal_init(&signal_one);
+    fiber_signal_t signal_two;
+    fiber_signal_init(&signal_two);
+    channel_one = fiber_bounded_channel_create(7, &signal_one);
+    channel_two = fiber_bounded_channel_create(7, &signal_two);
+    test_assert(fiber_rendezvous_channel_init(&rendezvous));
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    fiber_t* fiber = fiber_create(20000, &pong_function, NULL);
+    ping_function(NULL);
+    fiber_join(fiber, NULL);
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    const int64_t bounded_time = time_diff(&start, &end);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    fiber = fiber_create(20000, &serve_function, (void*)(intptr_t)ROUND_TRIPS);
+    call_function((void*)(intptr_t)ROUND_TRIPS);
+    fiber_join(fiber, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    const int64_t rendezvous_time = time_diff(&start, &end);
+
+    printf("%d round trips: bounded_channel %lf seconds, rendezvous_channel %lf seconds\n",
+           ROUND_TRIPS, bounded_time / 1000000000.0, rendezvous_time / 1000000000.0);
+
+    //several callers queue up behind a busy receiver
+    fiber = fiber_create(20000, &serve_function, (void*)(intptr_t)(NUM_CALLERS * PER_CALLER_COUNT));
+    fiber_t* callers[NUM_CALLERS];
+    int i;
+    for(i = 0; i < NUM_CALLERS; ++i) {
+        callers[i] = fiber_create(20000, &call_function, (void*)(intptr_t)PER_CALLER_COUNT);
+    }
+    for(i = 0; i < NUM_CALLERS; ++i) {
+        fiber_join(callers[i], NULL);
+    }
+    fiber_join(fiber, NULL);
+
+    fiber_rendezvous_channel_destroy(&rendezvous);
+    fiber_bounded_channel_destroy(channel_one);
+    fiber_bounded_channel_destroy(channel_two);
+    fiber_signal_destroy(&signal_one);
+    fiber_signal_destroy(&signal_two);
+
+    fiber_manager_print_stats();
+    return 0;
+}
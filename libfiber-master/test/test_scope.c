@@ -0,0 +1,159 @@
+/*
+ * Copyright (c) 2012-2015, Brian Watling and other contributors
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "fiber_manager.h"
+#include "fiber_scope.h"
+#include "fiber_event.h"
+#include "test_helper.h"
+#include <errno.h>
+#include <sys/time.h>
+
+#define NUM_THREADS 2
+#define FAN_OUT 64
+#define ROUNDS 1000
+
+fiber_scope_t scope;
+volatile int counter = 0;
+volatile int canceled = 0;
+
+//errno is thread local and a fiber can resume on another thread, so don't let the compiler cache its address
+static int __attribute__((noinline)) current_errno()
+{
+    __asm__ __volatile__("" ::: "memory");
+    return errno;
+}
+
+long long getusecs(struct timeval* tv)
+{
+    return (long long)tv->tv_sec * 1000000 + tv->tv_usec;
+}
+
+int count_function(void* param)
+{
+    __sync_fetch_and_add(&counter, 1);
+    return FIBER_SUCCESS;
+}
+
+void* count_run_function(void* param)
+{
+    __sync_fetch_and_add(&counter, 1);
+    return NULL;
+}
+
+int spawning_function(void* param)
+{
+    __sync_fetch_and_add(&counter, 1);
+    return fiber_scope_spawn(&scope, 20000, &count_function, NULL);
+}
+
+int sleep_function(void* param)
+{
+    if(!fiber_sleep(10, 0)) {
+        test_assert(current_errno() == ECANCELED);
+        __sync_fetch_and_add(&canceled, 1);
+        return FIBER_ERROR;
+    }
+    return FIBER_SUCCESS;
+}
+
+int fail_function(void* param)
+{
+    return FIBER_ERROR;
+}
+
+int main()
+{
+    fiber_manager_init(NUM_THREADS);
+
+    test_assert(fiber_scope_init(&scope));
+
+    //fan-out and fan-in, including children which spawn more children
+    int i;
+    for(i = 0; i < FAN_OUT; ++i) {
+        test_assert(fiber_scope_spawn(&scope, 20000, (i & 1) ? &spawning_function : &count_function, NULL));
+    }
+    test_assert(fiber_scope_wait(&scope));
+    test_assert(counter == FAN_OUT + FAN_OUT / 2);
+
+    //one failing child cancels its siblings
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(i = 0; i < FAN_OUT - 1; ++i) {
+        test_assert(fiber_scope_spawn(&scope, 20000, &sleep_function, NULL));
+    }
+    test_assert(fiber_scope_spawn(&scope, 20000, &fail_function, NULL));
+    test_assert(!fiber_scope_wait(&scope));
+    test_assert(current_errno() == ECANCELED);
+    test_assert(canceled == FAN_OUT - 1);
+    struct timespec limit = start;
+    limit.tv_sec += 5;
+    test_assert(!fiber_deadline_passed(&limit));
+
+    //a missed deadline cancels the children
+    canceled = 0;
+    for(i = 0; i < FAN_OUT; ++i) {
+        test_assert(fiber_scope_spawn(&scope, 20000, &sleep_function, NULL));
+    }
+    struct timespec deadline;
+    fiber_deadline_after(&deadline, 0, 10000);
+    test_assert(!fiber_scope_wait_timed(&scope, &deadline));
+    test_assert(current_errno() == ETIMEDOUT);
+    test_assert(canceled == FAN_OUT);
+    test_assert(!fiber_deadline_passed(&limit));
+
+    //the scope is usable again after a failure
+    counter = 0;
+    test_assert(fiber_scope_spawn(&scope, 20000, &count_function, NULL));
+    fiber_deadline_after(&deadline, 5, 0);
+    test_assert(fiber_scope_wait_timed(&scope, &deadline));
+    test_assert(counter == 1);
+
+    //compare a scope against joining each fiber
+    struct timeval begin;
+    struct timeval end;
+    counter = 0;
+    gettimeofday(&begin, NULL);
+    int round;
+    for(round = 0; round < ROUNDS; ++round) {
+        for(i = 0; i < FAN_OUT; ++i) {
+            fiber_scope_spawn(&scope, 20000, &count_function, NULL);
+        }
+        fiber_scope_wait(&scope);
+    }
+    gettimeofday(&end, NULL);
+    test_assert(counter == ROUNDS * FAN_OUT);
+    printf("scope: %d rounds of 1-to-%d fan-out in %lld usec\n", ROUNDS, FAN_OUT, getusecs(&end) - getusecs(&begin));
+
+    counter = 0;
+    gettimeofday(&begin, NULL);
+    for(round = 0; round < ROUNDS; ++round) {
+        fiber_t* fibers[FAN_OUT];
+        for(i = 0; i < FAN_OUT; ++i) {
+            fibers[i] = fiber_create(20000, &count_run_function, NULL);
+        }
+        for(i = 0; i < FAN_OUT; ++i) {
+            fiber_join(fibers[i], NULL);
+        }
+    }
+    gettimeofday(&end, NULL);
+    test_assert(counter == ROUNDS * FAN_OUT);
+    printf("join: %d rounds of 1-to-%d fan-out in %lld usec\n", ROUNDS, FAN_OUT, getusecs(&end) - getusecs(&begin));
+
+    fiber_scope_destroy(&scope);
+
+    fiber_manager_print_stats();
+    return 0;
+}
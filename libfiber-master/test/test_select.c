@@ -0,0 +1,256 @@
+/*
+ * Copyright (c) 2012-2015, Brian Watling and other contributors
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "fiber_manager.h"
+#include "fiber_select.h"
+#include "fiber_io.h"
+#include "test_helper.h"
+#include <errno.h>
+#include <unistd.h>
+
+#define NUM_THREADS 2
+#define PER_FIBER_COUNT 100000
+#define NUM_SENDERS 4
+#define PER_SENDER_COUNT 10000
+
+fiber_signal_t signal_one;
+fiber_signal_t signal_two;
+fiber_bounded_channel_t* channel_one = NULL;
+fiber_bounded_channel_t* channel_two = NULL;
+fiber_unbounded_channel_t unbounded_channel;
+int pipe_fds[2];
+
+//errno is thread local and a fiber can resume on another thread, so don't let the compiler cache its address
+static int __attribute__((noinline)) current_errno()
+{
+    __asm__ __volatile__("" ::: "memory");
+    return errno;
+}
+
+void* send_later_function(void* param)
+{
+    fiber_sleep(0, 10000);
+    fiber_bounded_channel_send((fiber_bounded_channel_t*)param, (void*)2);
+    return NULL;
+}
+
+void* receive_later_function(void* param)
+{
+    fiber_sleep(0, 10000);
+    return fiber_bounded_channel_receive((fiber_bounded_channel_t*)param);
+}
+
+void* unbounded_send_later_function(void* param)
+{
+    fiber_sleep(0, 10000);
+    fiber_unbounded_channel_send(&unbounded_channel, (fiber_unbounded_channel_message_t*)param);
+    return NULL;
+}
+
+void* write_later_function(void* param)
+{
+    fiber_sleep(0, 10000);
+    test_assert(write(pipe_fds[1], "x", 1) == 1);
+    return NULL;
+}
+
+void* select_canceled_function(void* param)
+{
+    fiber_select_case_t cases[2];
+    fiber_select_case_receive(&cases[0], channel_one);
+    fiber_select_case_fd(&cases[1], pipe_fds[0], FIBER_POLL_IN);
+    if(fiber_select(cases, 2, NULL) >= 0) {
+        return NULL;
+    }
+    return (void*)(intptr_t)current_errno();
+}
+
+void* producer_function(void* param)
+{
+    fiber_bounded_channel_t* const channel = (fiber_bounded_channel_t*)param;
+    intptr_t i;
+    for(i = 1; i <= PER_FIBER_COUNT; ++i) {
+        fiber_bounded_channel_send(channel, (void*)i);
+    }
+    return NULL;
+}
+
+void* sender_function(void* param)
+{
+    intptr_t i;
+    for(i = 0; i < PER_SENDER_COUNT; ++i) {
+        test_assert(fiber_bounded_channel_send((fiber_bounded_channel_t*)param, (void*)1) >= 0);
+    }
+    return NULL;
+}
+
+void* drain_function(void* param)
+{
+    intptr_t received = 0;
+    while(fiber_bounded_channel_receive(channel_two)) {
+        ++received;
+    }
+    test_assert(current_errno() == EPIPE);
+    return (void*)received;
+}
+
+//races its send case against plain senders, so it's often handed a slot and then completes the receive case instead
+void* select_sender_function(void* param)
+{
+    fiber_select_case_t cases[2];
+    intptr_t sent = 0;
+    int received = 0;
+    while(received < PER_SENDER_COUNT) {
+        fiber_select_case_receive(&cases[0], channel_one);
+        fiber_select_case_send(&cases[1], channel_two, (void*)1);
+        const int index = fiber_select(cases, 2, NULL);
+        test_assert(index == 0 || index == 1);
+        received += !index;
+        sent += index;
+    }
+    return (void*)sent;
+}
+
+int main()
+{
+    fiber_manager_init(NUM_THREADS);
+
+    fiber_signal_init(&signal_one);
+    fiber_signal_init(&signal_two);
+    channel_one = fiber_bounded_channel_create(1, &signal_one);
+    channel_two = fiber_bounded_channel_create(1, &signal_two);
+    test_assert(!pipe(pipe_fds));
+
+    fiber_select_case_t cases[4];
+    void* result = NULL;
+
+    //a message which is already there is taken without blocking; earlier cases win ties
+    fiber_bounded_channel_send(channel_one, (void*)1);
+    fiber_bounded_channel_send(channel_two, (void*)2);
+    fiber_select_case_receive(&cases[0], channel_one);
+    fiber_select_case_receive(&cases[1], channel_two);
+    test_assert(fiber_select(cases, 2, NULL) == 0);
+    test_assert(cases[0].message == (void*)1);
+    test_assert(fiber_select(cases, 2, NULL) == 1);
+    test_assert(cases[1].message == (void*)2);
+
+    //block until the second channel gets a message
+    fiber_t* f = fiber_create(20000, &send_later_function, channel_two);
+    test_assert(fiber_select(cases, 2, NULL) == 1);
+    test_assert(cases[1].message == (void*)2);
+    fiber_join(f, NULL);
+
+    //the deregistered signal still works for a plain receive
+    f = fiber_create(20000, &send_later_function, channel_one);
+    test_assert(fiber_bounded_channel_receive(channel_one) == (void*)2);
+    fiber_join(f, NULL);
+
+    //a send blocks while the channel is full
+    fiber_bounded_channel_send(channel_two, (void*)1);
+    fiber_bounded_channel_send(channel_two, (void*)1);
+    fiber_select_case_receive(&cases[0], channel_one);
+    fiber_select_case_send(&cases[1], channel_two, (void*)3);
+    f = fiber_create(20000, &receive_later_function, channel_two);
+    test_assert(fiber_select(cases, 2, NULL) == 1);
+    fiber_join(f, &result);
+    test_assert(result == (void*)1);
+    test_assert(fiber_bounded_channel_receive(channel_two) == (void*)1);
+    test_assert(fiber_bounded_channel_receive(channel_two) == (void*)3);
+
+    //unbounded channels and fds
+    fiber_unbounded_channel_init(&unbounded_channel, &signal_two);
+    fiber_unbounded_channel_message_t* const message = malloc(sizeof(*message));
+    message->data = (void*)4;
+    fiber_select_case_receive(&cases[0], channel_one);
+    fiber_select_case_unbounded_receive(&cases[1], &unbounded_channel);
+    fiber_select_case_fd(&cases[2], pipe_fds[0], FIBER_POLL_IN);
+    f = fiber_create(20000, &unbounded_send_later_function, message);
+    test_assert(fiber_select(cases, 3, NULL) == 1);
+    test_assert(cases[1].message);
+    free(cases[1].message);
+    fiber_join(f, NULL);
+
+    f = fiber_create(20000, &write_later_function, NULL);
+    test_assert(fiber_select(cases, 3, NULL) == 2);
+    char c;
+    test_assert(read(pipe_fds[0], &c, 1) == 1);
+    fiber_join(f, NULL);
+
+    //a deadline with nothing ready
+    struct timespec deadline;
+    fiber_deadline_after(&deadline, 0, 20000);
+    test_assert(fiber_select(cases, 3, &deadline) == -1);
+    test_assert(current_errno() == ETIMEDOUT);
+    test_assert(fiber_deadline_passed(&deadline));
+
+    //cancel
+    f = fiber_create(20000, &select_canceled_function, NULL);
+    fiber_sleep(0, 10000);
+    test_assert(fiber_cancel(f));
+    fiber_join(f, &result);
+    test_assert((intptr_t)result == ECANCELED);
+    //nothing was left registered on the channel
+    f = fiber_create(20000, &send_later_function, channel_one);
+    test_assert(fiber_bounded_channel_receive(channel_one) == (void*)2);
+    fiber_join(f, NULL);
+
+    //every message is received exactly once while the producers race the deregistration
+    fiber_t* const producer_one = fiber_create(20000, &producer_function, channel_one);
+    fiber_t* const producer_two = fiber_create(20000, &producer_function, channel_two);
+    fiber_select_case_receive(&cases[0], channel_one);
+    fiber_select_case_receive(&cases[1], channel_two);
+    intptr_t sums[2] = {0, 0};
+    int i;
+    for(i = 0; i < 2 * PER_FIBER_COUNT; ++i) {
+        const int index = fiber_select(cases, 2, NULL);
+        test_assert(index == 0 || index == 1);
+        sums[index] += (intptr_t)cases[index].message;
+    }
+    fiber_join(producer_one, NULL);
+    fiber_join(producer_two, NULL);
+    const intptr_t expected = (intptr_t)PER_FIBER_COUNT * (PER_FIBER_COUNT + 1) / 2;
+    test_assert(sums[0] == expected);
+    test_assert(sums[1] == expected);
+
+    //a select which gives back the slot it was handed doesn't strand the senders queued behind it
+    fiber_t* senders[NUM_SENDERS];
+    for(i = 0; i < NUM_SENDERS; ++i) {
+        senders[i] = fiber_create(20000, &sender_function, channel_two);
+    }
+    fiber_t* const drain = fiber_create(20000, &drain_function, NULL);
+    fiber_t* const select_sender = fiber_create(20000, &select_sender_function, NULL);
+    fiber_t* const feeder = fiber_create(20000, &sender_function, channel_one);
+    for(i = 0; i < NUM_SENDERS; ++i) {
+        fiber_join(senders[i], NULL);
+    }
+    fiber_join(select_sender, &result);
+    const intptr_t selected = (intptr_t)result;
+    fiber_join(feeder, NULL);
+    fiber_bounded_channel_close(channel_two);
+    fiber_join(drain, &result);
+    test_assert((intptr_t)result == NUM_SENDERS * PER_SENDER_COUNT + selected);
+
+    fiber_unbounded_channel_destroy(&unbounded_channel);
+    fiber_bounded_channel_destroy(channel_one);
+    fiber_bounded_channel_destroy(channel_two);
+    fiber_signal_destroy(&signal_one);
+    fiber_signal_destroy(&signal_two);
+    close(pipe_fds[0]);
+    close(pipe_fds[1]);
+
+    fiber_manager_print_stats();
+    return 0;
+}
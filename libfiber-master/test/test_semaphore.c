@@ -44,6 +44,29 @@ void* run_function(void* param)
     return NULL;
 }
 
+//takes and gives back several permits at once, mixed in with fibers taking one at a time
+void* run_n_function(void* param)
+{
+    const int id = (intptr_t)param;
+    int i;
+    for(i = 0; i < PER_FIBER_COUNT / 10; ++i) {
+        const int permits = 1 + (id + i) % SEMAPHORE_VALUE;
+        test_assert(fiber_semaphore_wait_n(&semaphore, permits));
+        test_assert(__sync_add_and_fetch(&counter, permits) <= SEMAPHORE_VALUE);
+        fiber_yield();
+        test_assert(__sync_sub_and_fetch(&counter, permits) >= 0);
+        fiber_semaphore_post_n(&semaphore, permits);
+    }
+    return NULL;
+}
+
+void* wait_once_function(void* param)
+{
+    test_assert(fiber_semaphore_wait(&semaphore));
+    __sync_add_and_fetch(&counter, 1);
+    return NULL;
+}
+
 int main()
 {
     fiber_manager_init(NUM_THREADS);
@@ -76,6 +99,31 @@ int main()
         test_assert(fiber_semaphore_post(&semaphore));
         test_assert(fiber_semaphore_getvalue(&semaphore) == i + 1);
     }
+
+    for(i = 0; i < NUM_FIBERS; ++i) {
+        fibers[i] = fiber_create(20000, (i % 2) ? &run_n_function : &run_function, (void*)(intptr_t)i);
+    }
+    for(i = 0; i < NUM_FIBERS; ++i) {
+        fiber_join(fibers[i], NULL);
+    }
+    test_assert(counter == 0);
+    test_assert(fiber_semaphore_getvalue(&semaphore) == SEMAPHORE_VALUE);
+
+    //one post_n() wakes a whole crowd of waiters and keeps the rest of the permits
+    test_assert(fiber_semaphore_wait_n(&semaphore, SEMAPHORE_VALUE));
+    test_assert(!fiber_semaphore_trywait(&semaphore));
+    for(i = 0; i < NUM_FIBERS; ++i) {
+        fibers[i] = fiber_create(20000, &wait_once_function, NULL);
+    }
+    while(fiber_semaphore_getvalue(&semaphore) > -NUM_FIBERS) {
+        fiber_yield();
+    }
+    test_assert(fiber_semaphore_post_n_internal(&semaphore, NUM_FIBERS + SEMAPHORE_VALUE) == NUM_FIBERS);
+    for(i = 0; i < NUM_FIBERS; ++i) {
+        fiber_join(fibers[i], NULL);
+    }
+    test_assert(counter == NUM_FIBERS);
+    test_assert(fiber_semaphore_getvalue(&semaphore) == SEMAPHORE_VALUE);
     fiber_semaphore_destroy(&semaphore);
 
     fiber_manager_print_stats();
@@ -17,12 +17,15 @@
 #include "fiber_spinlock.h"
 #include "fiber_manager.h"
 #include "test_helper.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
 
 int volatile counter = 0;
 fiber_spinlock_t mutex;
 #define PER_FIBER_COUNT 1000000
 #define NUM_FIBERS 100
-#define NUM_THREADS 2
+int NUM_THREADS = 2;
 
 void* run_function(void* param)
 {
@@ -35,12 +38,18 @@ void* run_function(void* param)
     return NULL;
 }
 
-int main()
+int main(int argc, char* argv[])
 {
+    if(argc > 1) {
+        NUM_THREADS = atoi(argv[1]);
+    }
     fiber_manager_init(NUM_THREADS);
 
     fiber_spinlock_init(&mutex);
 
+    struct timespec start;
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
     fiber_t* fibers[NUM_FIBERS];
     int i;
     for(i = 0; i < NUM_FIBERS; ++i) {
@@ -50,6 +59,9 @@ int main()
     for(i = 0; i < NUM_FIBERS; ++i) {
         fiber_join(fibers[i], NULL);
     }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    const double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1000000000.0;
+    printf("%d threads: %.0lf lock/unlock pairs per second\n", NUM_THREADS, NUM_FIBERS * (double)PER_FIBER_COUNT / seconds);
 
     test_assert(counter == NUM_FIBERS * PER_FIBER_COUNT);
     test_assert(fiber_spinlock_trylock(&mutex));
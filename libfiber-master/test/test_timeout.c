@@ -0,0 +1,248 @@
+/*
+ * Copyright (c) 2012-2015, Brian Watling and other contributors
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "fiber_manager.h"
+#include "fiber_mutex.h"
+#include "fiber_cond.h"
+#include "fiber_semaphore.h"
+#include "fiber_channel.h"
+#include "fiber_event.h"
+#include "fiber_io.h"
+#include "test_helper.h"
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <errno.h>
+#include <unistd.h>
+
+#define NUM_THREADS 2
+#define NUM_FIBERS 50
+#define PER_FIBER_COUNT 200
+#define NUM_SPINNERS 8
+#define NUM_TIMED 20
+//a deadline is checked within FIBER_TIME_RESOLUTION_MS plus the time it takes a manager to get around to it. the
+//extra is generous, since these managers share the CPU with each other
+#define MAX_OVERRUN_NSECS ((FIBER_TIME_RESOLUTION_MS + 50) * 1000000LL)
+
+fiber_mutex_t mutex;
+fiber_cond_t cond;
+fiber_semaphore_t semaphore;
+volatile int counter = 0;
+volatile int timed_locks = 0;
+volatile int timed_waits = 0;
+volatile int posts = 0;
+volatile int spinning = 1;
+
+//errno is thread local and a fiber can resume on another thread, so don't let the compiler cache its address
+static int __attribute__((noinline)) current_errno()
+{
+    __asm__ __volatile__("" ::: "memory");
+    return errno;
+}
+
+void* sleep_function(void* param)
+{
+    fiber_sleep(0, (intptr_t)param);
+    return param;
+}
+
+//races short timed locks against plain lock holders; every successful lock must still be exclusive
+void* mutex_function(void* param)
+{
+    int i;
+    for(i = 0; i < PER_FIBER_COUNT; ++i) {
+        struct timespec deadline;
+        fiber_deadline_after(&deadline, 0, i % 50);
+        if(((intptr_t)param & 1) && !fiber_mutex_lock_timed(&mutex, &deadline)) {
+            test_assert(current_errno() == ETIMEDOUT);
+            continue;
+        }
+        if(!((intptr_t)param & 1)) {
+            fiber_mutex_lock(&mutex);
+        } else {
+            ++timed_locks;
+        }
+        ++counter;
+        fiber_mutex_unlock(&mutex);
+    }
+    return NULL;
+}
+
+//races timed waits against posts; no post may be lost to a waiter which gave up
+void* semaphore_function(void* param)
+{
+    int i;
+    for(i = 0; i < PER_FIBER_COUNT; ++i) {
+        if((intptr_t)param & 1) {
+            struct timespec deadline;
+            fiber_deadline_after(&deadline, 0, i % 50);
+            if(fiber_semaphore_wait_timed(&semaphore, &deadline)) {
+                __sync_fetch_and_add(&timed_waits, 1);
+            } else {
+                test_assert(current_errno() == ETIMEDOUT);
+            }
+        } else {
+            fiber_semaphore_post(&semaphore);
+            __sync_fetch_and_add(&posts, 1);
+            fiber_yield();
+        }
+    }
+    return NULL;
+}
+
+//keeps its manager busy, so it never goes idle and polls for events
+void* spin_function(void* param)
+{
+    while(spinning) {
+        fiber_yield();
+    }
+    return NULL;
+}
+
+//returns how far past its deadline a timed wait which nobody satisfies gives up
+void* overrun_function(void* param)
+{
+    int64_t max_overrun = 0;
+    int i;
+    for(i = 0; i < 10; ++i) {
+        struct timespec deadline;
+        fiber_deadline_after(&deadline, 0, 2000);
+        test_assert(!fiber_semaphore_wait_timed(&semaphore, &deadline));
+        test_assert(current_errno() == ETIMEDOUT);
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        const int64_t overrun = (now.tv_sec - deadline.tv_sec) * 1000000000LL + (now.tv_nsec - deadline.tv_nsec);
+        test_assert(overrun >= 0);
+        if(overrun > max_overrun) {
+            max_overrun = overrun;
+        }
+    }
+    return (void*)(intptr_t)max_overrun;
+}
+
+int main()
+{
+    fiber_manager_init(NUM_THREADS);
+
+    struct timespec deadline;
+    fiber_mutex_init(&mutex);
+    fiber_cond_init(&cond);
+    fiber_semaphore_init(&semaphore, 0);
+
+    //each primitive gives up once its deadline passes
+    fiber_mutex_lock(&mutex);
+    fiber_deadline_after(&deadline, 0, 10000);
+    test_assert(!fiber_cond_wait_timed(&cond, &mutex, &deadline));
+    test_assert(current_errno() == ETIMEDOUT);
+    test_assert(fiber_deadline_passed(&deadline));
+    test_assert(!fiber_mutex_trylock(&mutex));//the mutex is held again after the wait
+    fiber_mutex_unlock(&mutex);
+
+    fiber_deadline_after(&deadline, 0, 10000);
+    test_assert(!fiber_semaphore_wait_timed(&semaphore, &deadline));
+    test_assert(current_errno() == ETIMEDOUT);
+    test_assert(!fiber_semaphore_trywait(&semaphore));
+
+    fiber_t* sleeper = fiber_create(20000, &sleep_function, (void*)(intptr_t)100000);
+    void* result = NULL;
+    fiber_deadline_after(&deadline, 0, 10000);
+    test_assert(!fiber_join_timed(sleeper, &result, &deadline));
+    test_assert(current_errno() == ETIMEDOUT);
+    fiber_deadline_after(&deadline, 5, 0);
+    test_assert(fiber_join_timed(sleeper, &result, &deadline));
+    test_assert(result == (void*)(intptr_t)100000);
+
+    fiber_signal_t signal;
+    fiber_signal_init(&signal);
+    fiber_bounded_channel_t* channel = fiber_bounded_channel_create(8, &signal);
+    fiber_deadline_after(&deadline, 0, 10000);
+    test_assert(!fiber_bounded_channel_receive_timed(channel, &result, &deadline));
+    test_assert(current_errno() == ETIMEDOUT);
+    fiber_bounded_channel_send(channel, (void*)1);
+    test_assert(fiber_bounded_channel_receive_timed(channel, &result, &deadline));
+    test_assert(result == (void*)1);
+    fiber_bounded_channel_destroy(channel);
+    fiber_signal_destroy(&signal);
+
+    //SO_RCVTIMEO is honoured even though the socket is non-blocking underneath
+    int sv[2];
+    test_assert(!socketpair(AF_UNIX, SOCK_STREAM, 0, sv));
+    struct timeval tv = {0, 10000};
+    test_assert(!setsockopt(sv[0], SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)));
+    char c;
+    test_assert(read(sv[0], &c, 1) == -1);
+    test_assert(current_errno() == EAGAIN);
+    test_assert(write(sv[1], "x", 1) == 1);
+    test_assert(read(sv[0], &c, 1) == 1 && c == 'x');
+    close(sv[0]);
+    close(sv[1]);
+
+    //timeouts racing wake ups
+    fiber_t* fibers[NUM_FIBERS];
+    intptr_t i;
+    for(i = 0; i < NUM_FIBERS; ++i) {
+        fibers[i] = fiber_create(20000, &mutex_function, (void*)i);
+    }
+    for(i = 0; i < NUM_FIBERS; ++i) {
+        fiber_join(fibers[i], NULL);
+    }
+    test_assert(counter == (NUM_FIBERS / 2) * PER_FIBER_COUNT + timed_locks);
+    test_assert(fiber_mutex_trylock(&mutex));
+    fiber_mutex_unlock(&mutex);
+
+    for(i = 0; i < NUM_FIBERS; ++i) {
+        fibers[i] = fiber_create(20000, &semaphore_function, (void*)i);
+    }
+    for(i = 0; i < NUM_FIBERS; ++i) {
+        fiber_join(fibers[i], NULL);
+    }
+    int remaining = 0;
+    while(fiber_semaphore_trywait(&semaphore)) {
+        ++remaining;
+    }
+    test_assert(posts == timed_waits + remaining);
+
+    //deadlines still expire on time while every manager is too busy to poll for events
+    fiber_t* spinners[NUM_SPINNERS];
+    for(i = 0; i < NUM_SPINNERS; ++i) {
+        spinners[i] = fiber_create(20000, &spin_function, NULL);
+    }
+    fiber_t* timed[NUM_TIMED];
+    for(i = 0; i < NUM_TIMED; ++i) {
+        timed[i] = fiber_create(20000, &overrun_function, NULL);
+    }
+    intptr_t max_overrun = 0;
+    for(i = 0; i < NUM_TIMED; ++i) {
+        void* result = NULL;
+        fiber_join(timed[i], &result);
+        if((intptr_t)result > max_overrun) {
+            max_overrun = (intptr_t)result;
+        }
+    }
+    spinning = 0;
+    for(i = 0; i < NUM_SPINNERS; ++i) {
+        fiber_join(spinners[i], NULL);
+    }
+    printf("max overrun %ldus\n", (long)(max_overrun / 1000));
+    test_assert(max_overrun < MAX_OVERRUN_NSECS);
+
+    fiber_semaphore_destroy(&semaphore);
+    fiber_cond_destroy(&cond);
+    fiber_mutex_destroy(&mutex);
+
+    fiber_manager_print_stats();
+    return 0;
+}
+
@@ -0,0 +1,101 @@
+/*
+ * Copyright (c) 2012-2015, Brian Watling and other contributors
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "fiber_tree_barrier.h"
+#include "fiber_manager.h"
+#include "test_helper.h"
+#include <stdio.h>
+#include <time.h>
+
+#define NUM_FIBERS 1000
+#define NUM_THREADS 4
+#define NUM_ROUNDS 1000
+
+int volatile reached[NUM_FIBERS] = {};
+int volatile winners[NUM_ROUNDS] = {};
+int use_tree = 0;
+
+fiber_barrier_t barrier;
+fiber_tree_barrier_t tree_barrier;
+
+void* run_function(void* param)
+{
+    intptr_t index = (intptr_t)param;
+    int round;
+    int i;
+    for(round = 0; round < NUM_ROUNDS; ++round) {
+        reached[index] = round + 1;
+        const int ret = use_tree ? fiber_tree_barrier_wait(&tree_barrier) : fiber_barrier_wait(&barrier);
+        if(FIBER_BARRIER_SERIAL_FIBER == ret) {
+            __sync_fetch_and_add(&winners[round], 1);
+        }
+        //nobody gets out until everyone is in
+        for(i = 0; i < NUM_FIBERS; i += 37) {
+            test_assert(reached[i] > round);
+        }
+    }
+    return NULL;
+}
+
+static double run_rounds()
+{
+    memset((void*)reached, 0, sizeof(reached));
+    memset((void*)winners, 0, sizeof(winners));
+
+    struct timespec start;
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    fiber_t* fibers[NUM_FIBERS];
+    intptr_t i;
+    for(i = 0; i < NUM_FIBERS; ++i) {
+        //spread the fibers over the managers, as a bulk-synchronous job would be
+        fibers[i] = fiber_create_no_sched(20000, &run_function, (void*)i);
+        fiber_manager_schedule_remote(fiber_manager_get_by_id(i % NUM_THREADS), fibers[i]);
+    }
+    for(i = 0; i < NUM_FIBERS; ++i) {
+        fiber_join(fibers[i], NULL);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    for(i = 0; i < NUM_ROUNDS; ++i) {
+        test_assert(winners[i] == 1);
+    }
+    return ((end.tv_sec - start.tv_sec) * 1000000000.0 + (end.tv_nsec - start.tv_nsec)) / NUM_ROUNDS;
+}
+
+int main()
+{
+    fiber_manager_init(NUM_THREADS);
+
+    fiber_barrier_init(&barrier, NUM_FIBERS);
+    test_assert(fiber_tree_barrier_init(&tree_barrier, NUM_FIBERS));
+
+    const double central = run_rounds();
+    use_tree = 1;
+    const double tree = run_rounds();
+    //the tree barrier should be reusable after all its fibers are gone
+    const double tree_again = run_rounds();
+
+    printf("%d fibers on %d threads: fiber_barrier_t %.0lf ns per round, fiber_tree_barrier_t %.0lf ns per round (%.0lf ns again)\n",
+           NUM_FIBERS, NUM_THREADS, central, tree, tree_again);
+
+    fiber_tree_barrier_destroy(&tree_barrier);
+    fiber_barrier_destroy(&barrier);
+
+    fiber_manager_print_stats();
+    return 0;
+}
+
@@ -21,8 +21,13 @@
 fiber_unbounded_channel_t channel_one;
 fiber_unbounded_channel_t channel_two;
 #define PER_FIBER_COUNT 10000000
+#define ALLOC_COUNT 1000000
 #define NUM_THREADS 2
 
+int64_t time_diff(const struct timespec* start, const struct timespec* end) {
+    return (end->tv_sec * 1000000000LL + end->tv_nsec) - (start->tv_sec * 1000000000LL + start->tv_nsec);
+}
+
 void* ping_function(void* param)
 {
     intptr_t i;
@@ -46,6 +51,59 @@ void* pong_function(void* param)
     return NULL;
 }
 
+//every message is allocated by its sender and freed by its receiver, either with malloc() or from the channel's pool
+void* alloc_ping_function(void* param)
+{
+    const int pooled = (intptr_t)param;
+    intptr_t i;
+    for(i = 1; i <= ALLOC_COUNT; ++i) {
+        if(pooled) {
+            test_assert(fiber_unbounded_channel_send_data(&channel_one, (void*)i) >= 0);
+            test_assert(fiber_unbounded_channel_receive_data(&channel_two) == (void*)i);
+        } else {
+            fiber_unbounded_channel_message_t* node = malloc(sizeof(*node));
+            node->data = (void*)i;
+            fiber_unbounded_channel_send(&channel_one, node);
+            node = fiber_unbounded_channel_receive(&channel_two);
+            test_assert(node->data == (void*)i);
+            free(node);
+        }
+    }
+    return NULL;
+}
+
+void* alloc_pong_function(void* param)
+{
+    const int pooled = (intptr_t)param;
+    intptr_t i;
+    for(i = 1; i <= ALLOC_COUNT; ++i) {
+        if(pooled) {
+            void* const data = fiber_unbounded_channel_receive_data(&channel_one);
+            test_assert(fiber_unbounded_channel_send_data(&channel_two, data) >= 0);
+        } else {
+            fiber_unbounded_channel_message_t* node = fiber_unbounded_channel_receive(&channel_one);
+            void* const data = node->data;
+            free(node);
+            node = malloc(sizeof(*node));
+            node->data = data;
+            fiber_unbounded_channel_send(&channel_two, node);
+        }
+    }
+    return NULL;
+}
+
+int64_t time_alloc_pingpong(int pooled)
+{
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    fiber_t* const ping_fiber = fiber_create(20000, &alloc_ping_function, (void*)(intptr_t)pooled);
+    alloc_pong_function((void*)(intptr_t)pooled);
+    fiber_join(ping_fiber, NULL);
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return time_diff(&start, &end);
+}
+
 int main(int argc, char* argv[])
 {
     fiber_manager_init(NUM_THREADS);
@@ -66,6 +124,11 @@ int main(int argc, char* argv[])
 
     fiber_join(ping_fiber, NULL);
 
+    const int64_t malloc_time = time_alloc_pingpong(0);
+    const int64_t pooled_time = time_alloc_pingpong(1);
+    printf("%d round trips allocating every message: malloc %lf seconds, pooled %lf seconds\n",
+           ALLOC_COUNT, malloc_time / 1000000000.0, pooled_time / 1000000000.0);
+
     fiber_unbounded_channel_destroy(&channel_one);
     fiber_unbounded_channel_destroy(&channel_two);
 
@@ -0,0 +1,125 @@
+/*
+ * Copyright (c) 2012-2015, Brian Watling and other contributors
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include "fiber_address.h"
+#include "fiber_manager.h"
+#include "fiber_event.h"
+#include "test_helper.h"
+#include <errno.h>
+
+#define NUM_THREADS 2
+#define NUM_FIBERS 100
+//more than there are buckets, so some of these share a wait queue
+#define NUM_ADDRESSES (2 * FIBER_ADDRESS_BUCKETS)
+
+volatile int value = 0;
+volatile int woken = 0;
+volatile int addresses[NUM_ADDRESSES];
+volatile int address_woken[NUM_ADDRESSES];
+
+//errno is thread local and a fiber can resume on another thread, so don't let the compiler cache its address
+static int __attribute__((noinline)) current_errno()
+{
+    __asm__ __volatile__("" ::: "memory");
+    return errno;
+}
+
+void* wait_function(void* param)
+{
+    while(!value) {
+        fiber_wait_address(&value, 0, NULL);
+    }
+    __sync_fetch_and_add(&woken, 1);
+    return NULL;
+}
+
+void* address_function(void* param)
+{
+    const intptr_t index = (intptr_t)param;
+    while(!addresses[index]) {
+        fiber_wait_address(&addresses[index], 0, NULL);
+    }
+    __sync_fetch_and_add(&address_woken[index], 1);
+    return NULL;
+}
+
+int main()
+{
+    fiber_manager_init(NUM_THREADS);
+
+    //the value doesn't match, so there's no wait
+    test_assert(!fiber_wait_address(&value, 1, NULL));
+    test_assert(current_errno() == EAGAIN);
+
+    struct timespec deadline;
+    fiber_deadline_after(&deadline, 0, 10000);
+    test_assert(!fiber_wait_address(&value, 0, &deadline));
+    test_assert(current_errno() == ETIMEDOUT);
+    test_assert(fiber_deadline_passed(&deadline));
+
+    test_assert(fiber_wake_address(&value, 1) == 0);
+
+    //waiters are woken no more than 'count' at a time
+    fiber_t* fibers[NUM_FIBERS];
+    intptr_t i;
+    for(i = 0; i < NUM_FIBERS; ++i) {
+        fibers[i] = fiber_create(20000, &wait_function, NULL);
+    }
+    fiber_sleep(0, 10000);
+    test_assert(fiber_wake_address(&value, 1) == 1);
+    fiber_sleep(0, 10000);
+    //the woken fiber found the value unchanged and waited again
+    test_assert(woken == 0);
+    value = 1;
+    int total = 0;
+    while(total < NUM_FIBERS) {
+        total += fiber_wake_address(&value, 10);
+        fiber_yield();
+    }
+    for(i = 0; i < NUM_FIBERS; ++i) {
+        fiber_join(fibers[i], NULL);
+    }
+    test_assert(woken == NUM_FIBERS);
+    test_assert(fiber_wake_address(&value, 1) == 0);
+
+    //a wake only wakes waiters on its own address, even when they share a queue with others
+    fiber_t* address_fibers[NUM_ADDRESSES];
+    for(i = 0; i < NUM_ADDRESSES; ++i) {
+        address_fibers[i] = fiber_create(20000, &address_function, (void*)i);
+    }
+    fiber_sleep(0, 10000);
+    for(i = 0; i < NUM_ADDRESSES; i += 2) {
+        addresses[i] = 1;
+        test_assert(fiber_wake_address(&addresses[i], NUM_ADDRESSES) == 1);
+    }
+    for(i = 0; i < NUM_ADDRESSES; i += 2) {
+        fiber_join(address_fibers[i], NULL);
+    }
+    for(i = 0; i < NUM_ADDRESSES; ++i) {
+        test_assert(address_woken[i] == !(i & 1));
+    }
+    for(i = 1; i < NUM_ADDRESSES; i += 2) {
+        addresses[i] = 1;
+        fiber_wake_address(&addresses[i], NUM_ADDRESSES);
+        fiber_join(address_fibers[i], NULL);
+        test_assert(address_woken[i] == 1);
+    }
+
+    fiber_manager_print_stats();
+    return 0;
+}
+
@@ -22,12 +22,13 @@
 #define PER_FIBER_COUNT 10000
 
 mpsc_fifo_t fifo;
+volatile int wake_tokens = 0;
 
 void* run_function(void* param)
 {
     int i;
     for(i = 0; i < PER_FIBER_COUNT; ++i) {
-        fiber_manager_wait_in_mpsc_queue(fiber_manager_get(), &fifo);
+        fiber_manager_wait_in_mpsc_queue_with_tokens(fiber_manager_get(), &fifo, &wake_tokens, NULL, 0, NULL);
     }
     return NULL;
 }
@@ -46,13 +47,15 @@ int main()
     fiber_yield();
 
     for(i = 0; i < PER_FIBER_COUNT; ++i) {
-        fiber_manager_wake_from_mpsc_queue(fiber_manager_get(), &fifo, NUM_FIBERS);
+        fiber_manager_wake_from_mpsc_queue_with_tokens(fiber_manager_get(), &fifo, &wake_tokens, NUM_FIBERS);
     }
 
     for(i = 0; i < NUM_FIBERS; ++i) {
         fiber_join(fibers[i], NULL);
     }
 
+    test_assert(wake_tokens == 0);
+    fiber_manager_wake_from_mpsc_queue(fiber_manager_get(), &fifo, 0);
     mpsc_fifo_destroy(&fifo);
 
     fiber_manager_print_stats();
@@ -0,0 +1,118 @@
+/*
+ * Copyright (c) 2012-2015, Brian Watling and other contributors
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "fiber_waitgroup.h"
+#include "fiber_manager.h"
+#include "test_helper.h"
+#include <stdio.h>
+#include <time.h>
+
+#define NUM_THREADS 4
+#define NUM_WORKERS 1000
+#define NUM_WAITERS 10
+#define NUM_ROUNDS 10
+
+fiber_waitgroup_t work;
+fiber_waitgroup_t waiters;
+volatile int finished = 0;
+volatile int checked = 0;
+
+void* worker_function(void* param)
+{
+    fiber_yield();
+    __sync_fetch_and_add(&finished, 1);
+    fiber_waitgroup_done(&work);
+    return NULL;
+}
+
+void* waiter_function(void* param)
+{
+    const intptr_t round = (intptr_t)param;
+    fiber_waitgroup_wait(&work);
+    test_assert(finished == round * NUM_WORKERS);
+    __sync_fetch_and_add(&checked, 1);
+    fiber_waitgroup_done(&waiters);
+    return NULL;
+}
+
+static long long usecs_since(const struct timespec* start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000000LL + (now.tv_nsec - start->tv_nsec) / 1000;
+}
+
+int main()
+{
+    fiber_manager_init(NUM_THREADS);
+
+    fiber_waitgroup_init(&work, 0);
+    fiber_waitgroup_init(&waiters, 0);
+
+    //nothing outstanding
+    fiber_waitgroup_wait(&work);
+    fiber_waitgroup_add(&work, 2);
+    fiber_waitgroup_add(&work, -2);
+    fiber_waitgroup_wait(&work);
+
+    //several fibers wait on each round, and the group is reused round after round
+    intptr_t round;
+    int i;
+    for(round = 1; round <= NUM_ROUNDS; ++round) {
+        fiber_waitgroup_add(&work, NUM_WORKERS);
+        fiber_waitgroup_add(&waiters, NUM_WAITERS);
+        for(i = 0; i < NUM_WAITERS; ++i) {
+            fiber_detach(fiber_create(20000, &waiter_function, (void*)round));
+        }
+        for(i = 0; i < NUM_WORKERS; ++i) {
+            fiber_detach(fiber_create(20000, &worker_function, NULL));
+        }
+        fiber_waitgroup_wait(&work);
+        test_assert(finished == round * NUM_WORKERS);
+        test_assert(!fiber_waitgroup_getvalue(&work));
+        //every waiter must be gone before the next round starts
+        fiber_waitgroup_wait(&waiters);
+        test_assert(checked == round * NUM_WAITERS);
+    }
+
+    //fan-in with a wait group versus joining each fiber
+    fiber_t* fibers[NUM_WORKERS];
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    fiber_waitgroup_add(&work, NUM_WORKERS);
+    for(i = 0; i < NUM_WORKERS; ++i) {
+        fiber_detach(fiber_create(20000, &worker_function, NULL));
+    }
+    fiber_waitgroup_wait(&work);
+    printf("waitgroup: %lld usecs for %d fibers\n", usecs_since(&start), NUM_WORKERS);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    fiber_waitgroup_add(&work, NUM_WORKERS);
+    for(i = 0; i < NUM_WORKERS; ++i) {
+        fibers[i] = fiber_create(20000, &worker_function, NULL);
+    }
+    for(i = 0; i < NUM_WORKERS; ++i) {
+        fiber_join(fibers[i], NULL);
+    }
+    printf("join: %lld usecs for %d fibers\n", usecs_since(&start), NUM_WORKERS);
+    test_assert(finished == (NUM_ROUNDS + 2) * NUM_WORKERS);
+
+    fiber_waitgroup_destroy(&waiters);
+    fiber_waitgroup_destroy(&work);
+
+    fiber_manager_print_stats();
+    return 0;
+}
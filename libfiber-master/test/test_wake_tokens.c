@@ -0,0 +1,74 @@
+/*
+ * Copyright (c) 2012-2015, Brian Watling and other contributors
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "fiber_manager.h"
+#include "test_helper.h"
+
+#define NUM_THREADS 2
+
+mpsc_fifo_t waiters;
+volatile int wake_tokens = 0;
+volatile int woken = 0;
+
+void* wait_function(void* param)
+{
+    test_assert(fiber_manager_wait_in_mpsc_queue_with_tokens(fiber_manager_get(), &waiters, &wake_tokens, NULL, 0, NULL));
+    __sync_fetch_and_add(&woken, 1);
+    return NULL;
+}
+
+int main()
+{
+    fiber_manager_init(NUM_THREADS);
+
+    test_assert(mpsc_fifo_init(&waiters));
+
+    //nobody is queued yet, so the waker leaves tokens which the waiters take instead of blocking
+    test_assert(fiber_manager_wake_from_mpsc_queue_with_tokens(fiber_manager_get(), &waiters, &wake_tokens, 2) == 2);
+    test_assert(wake_tokens == 2);
+    test_assert(fiber_manager_wait_in_mpsc_queue_with_tokens(fiber_manager_get(), &waiters, &wake_tokens, NULL, 0, NULL));
+    test_assert(fiber_manager_wait_in_mpsc_queue_with_tokens(fiber_manager_get(), &waiters, &wake_tokens, NULL, 1, NULL));
+    test_assert(wake_tokens == 0);
+    void* entry = NULL;
+    test_assert(!mpsc_fifo_peek(&waiters, &entry));
+
+    //a parked waiter is woken without leaving a token
+    fiber_t* const waiter = fiber_create(20000, &wait_function, NULL);
+    fiber_yield();
+    test_assert(fiber_manager_wake_from_mpsc_queue_with_tokens(fiber_manager_get(), &waiters, &wake_tokens, 1) == 1);
+    fiber_join(waiter, NULL);
+    test_assert(woken == 1);
+    test_assert(wake_tokens == 0);
+
+    //racing waiters and wakers leave no tokens behind
+    fiber_t* waiters_fibers[10];
+    int i;
+    for(i = 0; i < 10; ++i) {
+        waiters_fibers[i] = fiber_create(20000, &wait_function, NULL);
+    }
+    test_assert(fiber_manager_wake_from_mpsc_queue_with_tokens(fiber_manager_get(), &waiters, &wake_tokens, 10) == 10);
+    for(i = 0; i < 10; ++i) {
+        fiber_join(waiters_fibers[i], NULL);
+    }
+    test_assert(woken == 11);
+    test_assert(wake_tokens == 0);
+
+    fiber_manager_wake_from_mpsc_queue(fiber_manager_get(), &waiters, 0);
+    mpsc_fifo_destroy(&waiters);
+
+    fiber_manager_print_stats();
+    return 0;
+}